@@ -0,0 +1,59 @@
+#version 450 core
+layout(location = 0) in vec3 normal;
+layout(location = 1) in vec3 fragPos;
+layout(location = 2) in vec3 viewPos;
+
+// Must match CSG_ABUFFER_END in csg-pipeline.h.
+#define END 0x3FFFFFFFu
+#define FRONT_FACING 0x40000000u
+#define SUBSTRACTIVE 0x80000000u
+
+struct Node {
+  float depth;
+  uint color;
+  uint link;
+};
+
+layout(set = 1, binding = 0, r32ui) uniform coherent uimage2D heads;
+
+layout(set = 1, binding = 1) writeonly buffer Nodes {
+  Node nodes[];
+};
+
+layout(set = 1, binding = 2) buffer Counter {
+  uint fragmentCount;
+  uint overflowed;
+};
+
+layout(push_constant) uniform PushConstants {
+  layout(offset = 68) uint operand;
+};
+
+void main(void)
+{
+  // Every surface is kept, the resolve pass decides which one is visible.
+  uint index = atomicAdd(fragmentCount, 1u);
+  if (index >= uint(nodes.length()))
+  {
+    overflowed = 1u;
+    return;
+  }
+
+  vec3 lightPos   = vec3(-10.0, 20.0, -4.0);
+  vec3 lightColor = vec3(1.0, 1.0, 1.0);
+  vec3 albedo     = vec3(0.9, 0.1, 0.1);
+
+  // Back faces are only visible as the walls of a carved hole, lit from inside.
+  vec3 surfaceNormal = gl_FrontFacing ? normal : -normal;
+  vec3 lightDir      = normalize(lightPos - fragPos);
+
+  vec3 ambient = vec3(0.1, 0.1, 0.1) * albedo;
+
+  float diff = max(dot(surfaceNormal, lightDir), 0.0);
+  vec3 diffuse = diff * lightColor * albedo;
+
+  uint next = imageAtomicExchange(heads, ivec2(gl_FragCoord.xy), index);
+  uint flags = (gl_FrontFacing ? FRONT_FACING : 0u) | (operand != 0u ? SUBSTRACTIVE : 0u);
+
+  nodes[index] = Node(gl_FragCoord.z, packUnorm4x8(vec4(ambient + diffuse, 1.0)), next | flags);
+}
@@ -0,0 +1,17 @@
+#version 450 core
+layout(set = 1, binding = 3, rgba8) uniform readonly image2D resolvedColor;
+layout(set = 1, binding = 4, r32f) uniform readonly image2D resolvedDepth;
+
+layout(location = 0) out vec4 fragColor;
+
+void main(void)
+{
+  // Pixels left transparent by the resolve pass hold no surface.
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  vec4 color = imageLoad(resolvedColor, pixel);
+  if (color.a == 0.0)
+    discard;
+
+  fragColor = color;
+  gl_FragDepth = imageLoad(resolvedDepth, pixel).r;
+}
@@ -9,8 +9,7 @@ layout(location = 0) out vec4 fragColor;
 
 void main(void)
 {
-  vec2 uv = gl_FragCoord.xy / vec2(800.0, 600.0);
-  float masked = texture(mask, uv).r;
+  float masked = texelFetch(mask, ivec2(gl_FragCoord.xy), 0).r;
 
   if (masked == 1.0)
     discard;
@@ -0,0 +1,9 @@
+#version 450 core
+
+void main(void)
+{
+  // One triangle on the far plane covering the whole render area, the fragment shader writes
+  // the depth where the stencil test passes.
+  vec2 position = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4(position * 2.0 - 1.0, 1.0, 1.0);
+}
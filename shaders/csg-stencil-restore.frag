@@ -0,0 +1,8 @@
+#version 450 core
+layout(set = 1, binding = 3) uniform sampler2D savedDepth;
+
+void main(void)
+{
+  // The depth the scene had before the pair, so carved areas let the pairs behind show.
+  gl_FragDepth = texelFetch(savedDepth, ivec2(gl_FragCoord.xy), 0).r;
+}
@@ -0,0 +1,23 @@
+#version 450 core
+layout(location = 0) in vec3 normal;
+layout(location = 1) in vec3 fragPos;
+layout(location = 2) in vec3 viewPos;
+
+layout(location = 0) out vec4 fragColor;
+
+void main(void)
+{
+  // The stencil test already kept the visible surfaces, nothing is sampled.
+  vec3 lightPos   = vec3(-10.0, 20.0, -4.0);
+  vec3 lightColor = vec3(1.0, 1.0, 1.0);
+  vec3 albedo     = vec3(0.9, 0.1, 0.1);
+
+  vec3 lightDir   = normalize(lightPos - fragPos);
+
+  vec3 ambient = vec3(0.1, 0.1, 0.1) * albedo;
+
+  float diff = max(dot(normal, lightDir), 0.0);
+  vec3 diffuse = diff * lightColor * albedo;
+
+  fragColor = vec4(ambient + diffuse, 1.0);
+}
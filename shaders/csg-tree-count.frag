@@ -0,0 +1,12 @@
+#version 450 core
+layout(push_constant) uniform PushConstants {
+  layout(offset = 64) uvec2 operandBit;
+};
+
+layout(location = 0) out uvec2 fragMask;
+
+void main(void)
+{
+  // XORed into the mask: an odd count of surfaces up to the layer means it lies inside.
+  fragMask = operandBit;
+}
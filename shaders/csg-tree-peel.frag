@@ -0,0 +1,35 @@
+#version 450 core
+layout(location = 0) in vec3 normal;
+layout(location = 1) in vec3 fragPos;
+layout(location = 2) in vec3 viewPos;
+
+layout(set = 1, binding = 0) uniform sampler2D previousLayer;
+
+layout(push_constant) uniform PushConstants {
+  layout(offset = 64) uint firstLayer;
+};
+
+layout(location = 0) out vec4 fragColor;
+
+void main(void)
+{
+  // Keep only the surfaces behind the layer peeled before.
+  if (firstLayer == 0 && gl_FragCoord.z <= texelFetch(previousLayer, ivec2(gl_FragCoord.xy), 0).r)
+    discard;
+
+  // A back face shows up where an operand was carved, lit from the inside.
+  vec3 surfaceNormal = normalize(gl_FrontFacing ? normal : -normal);
+
+  vec3 lightPos   = vec3(-10.0, 20.0, -4.0);
+  vec3 lightColor = vec3(1.0, 1.0, 1.0);
+  vec3 albedo     = vec3(0.9, 0.1, 0.1);
+
+  vec3 lightDir   = normalize(lightPos - fragPos);
+
+  vec3 ambient = vec3(0.1, 0.1, 0.1) * albedo;
+
+  float diff = max(dot(surfaceNormal, lightDir), 0.0);
+  vec3 diffuse = diff * lightColor * albedo;
+
+  fragColor = vec4(ambient + diffuse, 1.0);
+}
@@ -0,0 +1,74 @@
+#version 450 core
+#define MAX_OPERANDS 64
+
+#define OP_OPERAND 0u
+#define OP_UNION 1u
+#define OP_SUBTRACT 2u
+#define OP_INTERSECT 3u
+
+layout(set = 0, binding = 1) readonly buffer Programs {
+  uint programs[];
+};
+
+layout(set = 1, binding = 0) uniform usampler2D mask;
+layout(set = 1, binding = 1) uniform sampler2D layerDepth;
+layout(set = 1, binding = 2) uniform sampler2D layerColor;
+
+layout(push_constant) uniform PushConstants {
+  uint programOffset;
+  uint programLength;
+};
+
+layout(location = 0) out vec4 fragColor;
+
+bool isInside(uvec2 inside, uint operand)
+{
+  return ((operand < 32 ? inside.x >> operand : inside.y >> (operand - 32)) & 1u) != 0;
+}
+
+void main(void)
+{
+  ivec2 texel = ivec2(gl_FragCoord.xy);
+  float depth = texelFetch(layerDepth, texel, 0).r;
+
+  // No surface left on this layer.
+  if (depth == 1.0)
+    discard;
+
+  uvec2 inside = texelFetch(mask, texel, 0).rg;
+
+  // Postfix program, every word holds the operation in its high half and the operand index
+  // in its low half.
+  bool stack[MAX_OPERANDS];
+  int top = 0;
+
+  for (uint i = 0; i < programLength; i++)
+  {
+    uint word = programs[programOffset + i];
+    uint operation = word >> 16;
+
+    if (operation == OP_OPERAND)
+    {
+      stack[top++] = isInside(inside, word & 0xFFFFu);
+      continue;
+    }
+
+    bool right = stack[--top];
+    bool left = stack[top - 1];
+
+    if (operation == OP_UNION)
+      stack[top - 1] = left || right;
+    else if (operation == OP_SUBTRACT)
+      stack[top - 1] = left && !right;
+    else
+      stack[top - 1] = left && right;
+  }
+
+  // The visible surface is the first layer past which the ray is inside the tree, the depth
+  // test rejects the layers behind it.
+  if (!stack[0])
+    discard;
+
+  gl_FragDepth = depth;
+  fragColor = texelFetch(layerColor, texel, 0);
+}
@@ -0,0 +1,8 @@
+#version 450 core
+
+void main(void)
+{
+  // One triangle covering the whole render area.
+  vec2 position = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4(position * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -16,10 +16,11 @@ float linearDepth(float z, float near, float far) {
 
 void main(void)
 {
-  vec2 uv = gl_FragCoord.xy / vec2(800.0, 600.0);
-  float rayEnterDepth = texture(rayEnter, uv).r;
-  float rayLeaveDepth = texture(rayLeave, uv).r;
-  float frontDepthValue = texture(frontDepth, uv).r;
+  // The targets match the render area, so the fragment reads its own texel at any resolution.
+  ivec2 texel = ivec2(gl_FragCoord.xy);
+  float rayEnterDepth = texelFetch(rayEnter, texel, 0).r;
+  float rayLeaveDepth = texelFetch(rayLeave, texel, 0).r;
+  float frontDepthValue = texelFetch(frontDepth, texel, 0).r;
 
   if (rayLeaveDepth < 1.0 && rayEnterDepth == 1.0)
     rayEnterDepth = 0.0;
@@ -17,6 +17,9 @@ layout (set = 0, binding = 0) uniform ubo {
   mat4 projection;
 };
 
+// The stencil passes test the color passes against the exact depth they stored.
+invariant gl_Position;
+
 void main(void)
 {
   vec4 worldPos = model * vec4(vertexPosition, 1.0);
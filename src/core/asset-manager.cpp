@@ -1,136 +1,423 @@
 #include "core/asset-manager.h"
 
 #include <cstring>
+#include <iostream>
+#include <iterator>
 #include <stdexcept>
 
 #include <stb/stb_image.h>
 
+#include "core/deletion-queue.h"
 #include "core/engine.h"
+#include "core/staging-buffer.h"
+#include "core/trace-recorder.h"
+#include "misc/thread-pool.h"
 
 namespace core
 {
+  void AssetManager::init(VkDeviceSize memory_budget)
+  {
+    memory_budget_ = memory_budget != 0 ? memory_budget : ASSET_MEMORY_BUDGET;
+
+    // Magenta and black checkerboard, the usual "texture not there yet" look.
+    const unsigned char pixels[] = {
+      255, 0, 255, 255, 0, 0, 0, 255, 0, 0, 0, 255, 255, 0, 255, 255,
+    };
+
+    placeholder_ = create_image(pixels, 2, 2);
+  }
+
+  void AssetManager::free()
+  {
+    {
+      std::unique_lock lock(mutex_);
+      decoding_condition_.wait(lock, [this]() { return decoding_count_ == 0; });
+
+      for (auto& decoded_image : decoded_images_)
+        stbi_image_free(decoded_image.pixels);
+
+      decoded_images_.clear();
+    }
+
+    // Let pending uploads finish and their callbacks run while the requests still exist.
+    auto& transfer_queue = TransferQueue::get_singleton();
+    transfer_queue.wait(transfer_queue.submit());
+    transfer_queue.poll();
+
+    while (!images_.empty())
+      destroy_image(images_.begin()->first);
+
+    free_image(placeholder_);
+    placeholder_ = nullptr;
+
+    requests_.clear();
+    handles_.clear();
+    stats_ = {};
+  }
+
   ImageData* AssetManager::load_image(const std::string& path, const std::string& name)
   {
+    ImageHandle handle;
+    if (acquire(path, name, handle) && requests_[handle].image)
+      return requests_[handle].image;
+
+    // Either not loaded at all or still being decoded, in which case the decoded copy is
+    // dropped by update() since the request is ready by then.
+    ImageData* image_data;
+    try
+    {
+      auto container = open_container(path);
+      if (container)
+        image_data = create_image(*container);
+      else
+      {
+        int width, height, channels;
+        stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        if (!pixels)
+          throw std::runtime_error("failed to load image");
+
+        try
+        {
+          image_data = create_image(pixels, width, height);
+        }
+        catch (...)
+        {
+          stbi_image_free(pixels);
+          throw;
+        }
+
+        stbi_image_free(pixels);
+      }
+    }
+    catch (...)
+    {
+      // Left loading, later loads of the name would count a hit and resolve to the
+      // placeholder forever.
+      auto& request = requests_[handle];
+      request.status = ImageStatus::failed;
+      request.reference_count--;
+      throw;
+    }
+
+    requests_[handle].status = ImageStatus::ready;
+    insert_image(handle, image_data);
+
+    return image_data;
+  }
+
+  ImageHandle AssetManager::load_image_async(const std::string& path, const std::string& name)
+  {
+    ImageHandle handle;
+    if (!acquire(path, name, handle))
+      decode(handle);
+
+    return handle;
+  }
+
+  void AssetManager::release_image(const std::string& name)
+  {
+    auto it = handles_.find(name);
+    if (it == handles_.end() || requests_[it->second].reference_count == 0)
+      throw std::invalid_argument("releasing an image that is not referenced: " + name);
+
+    auto& request = requests_[it->second];
+    request.reference_count--;
+    // It may have been sampled by the frame being recorded.
+    request.last_used_frame = Engine::get_singleton().get_frame_number();
+  }
+
+  ImageData* AssetManager::find_image(const std::string& name)
+  {
+    auto handle_it = handles_.find(name);
+    if (handle_it != handles_.end())
+      requests_[handle_it->second].last_used_frame = Engine::get_singleton().get_frame_number();
+
+    auto it = images_.find(name);
+    return it != images_.end() ? it->second : nullptr;
+  }
+
+  void AssetManager::destroy_image(const std::string& name)
+  {
+    auto handle_it = handles_.find(name);
+    if (handle_it != handles_.end())
+    {
+      requests_[handle_it->second].status = ImageStatus::unloaded;
+      requests_[handle_it->second].image = nullptr;
+    }
+
     auto it = images_.find(name);
     if (it != images_.end())
-      return it->second;
+    {
+      stats_.resident_bytes -= it->second->allocation.size;
+      free_image(it->second);
+      images_.erase(it);
+    }
+  }
 
-    int width, height, channels;
-    stbi_uc* pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
-    if (!pixels)
-      throw std::runtime_error("failed to load image");
+  void AssetManager::update()
+  {
+    TraceScope scope("asset update");
+    std::vector<DecodedImage> decoded_images;
 
-    VkDeviceSize image_size = width * height * 4;
-    auto image_data = new ImageData();
+    {
+      std::lock_guard lock(mutex_);
+      decoded_images.swap(decoded_images_);
+    }
 
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_memory;
+    auto& transfer_queue = TransferQueue::get_singleton();
+    VkDeviceSize uploaded_size = 0;
+    size_t i = 0;
 
-    auto& engine = Engine::get_singleton();
-    auto device = engine.get_device();
+    // Keep each frame's share of the staging ring bounded so that the render thread never
+    // stalls on it, whatever is left waits for the next frame.
+    for (; i < decoded_images.size() && uploaded_size < ASSET_UPLOAD_BUDGET; i++)
+    {
+      auto& decoded_image = decoded_images[i];
+      auto& request = requests_[decoded_image.handle];
+
+      if (!decoded_image.pixels && !decoded_image.container)
+      {
+        std::clog << "failed to load image " << request.path << '\n';
+        request.status = ImageStatus::failed;
+        continue;
+      }
+
+      if (request.status == ImageStatus::loading)
+      {
+        ImageData* image_data;
+        if (decoded_image.container)
+        {
+          image_data = create_image(*decoded_image.container);
+          uploaded_size += decoded_image.container->get_size();
+        }
+        else
+        {
+          image_data = create_image(decoded_image.pixels, decoded_image.width,
+                                    decoded_image.height);
+          uploaded_size += decoded_image.width * decoded_image.height * 4;
+        }
+
+        insert_image(decoded_image.handle, image_data);
+
+        auto handle = decoded_image.handle;
+        transfer_queue.on_complete(image_data->ticket, [this, handle, image_data]() {
+          auto& request = requests_[handle];
+          if (request.status == ImageStatus::loading && request.image == image_data)
+            request.status = ImageStatus::ready;
+        });
+      }
+
+      stbi_image_free(decoded_image.pixels);
+    }
 
-    // TODO: Create a create_buffer method someday
-    const VkBufferCreateInfo create_info = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .size = image_size,
-      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-      .queueFamilyIndexCount = 0,
-      .pQueueFamilyIndices = nullptr,
-    };
+    if (i < decoded_images.size())
+    {
+      std::lock_guard lock(mutex_);
+      decoded_images_.insert(decoded_images_.begin(),
+                             std::make_move_iterator(decoded_images.begin() + i),
+                             std::make_move_iterator(decoded_images.end()));
+    }
 
-    VkResult result = vkCreateBuffer(device, &create_info, nullptr, &staging_buffer);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create buffer");
+    evict();
+  }
 
-    VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(device, staging_buffer, &memory_requirements);
+  ImageData* AssetManager::get_image(ImageHandle handle)
+  {
+    auto& request = requests_[handle];
+    request.last_used_frame = Engine::get_singleton().get_frame_number();
 
-    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    const VkMemoryAllocateInfo buffer_allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = engine.find_memory_type(memory_requirements.memoryTypeBits, flags),
-    };
+    return request.status == ImageStatus::ready ? request.image : placeholder_;
+  }
 
-    result = vkAllocateMemory(device, &buffer_allocate_info, nullptr, &staging_memory);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
+  ImageStatus AssetManager::get_status(ImageHandle handle) const
+  {
+    return requests_[handle].status;
+  }
 
-    result = vkBindBufferMemory(device, staging_buffer, staging_memory, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to bind buffer memory");
+  ImageData* AssetManager::get_placeholder() const { return placeholder_; }
 
-    void* data;
-    result = vkMapMemory(device, staging_memory, 0, image_size, 0, &data);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to map buffer memory");
+  AssetStats AssetManager::get_stats() const
+  {
+    auto stats = stats_;
+    stats.budget_bytes = memory_budget_;
+    return stats;
+  }
+
+  bool AssetManager::acquire(const std::string& path, const std::string& name,
+                             ImageHandle& handle)
+  {
+    auto it = handles_.find(name);
+    if (it != handles_.end())
+      handle = it->second;
+    else
+    {
+      handle = requests_.size();
+      requests_.push_back({
+          .path = path,
+          .name = name,
+          .status = ImageStatus::unloaded,
+          .image = nullptr,
+          .reference_count = 0,
+          .last_used_frame = 0,
+      });
+      handles_.insert({ name, handle });
+    }
+
+    auto& request = requests_[handle];
+    request.reference_count++;
+    request.last_used_frame = Engine::get_singleton().get_frame_number();
 
-    std::memcpy(data, pixels, image_size);
-    vkUnmapMemory(device, staging_memory);
+    if (request.status == ImageStatus::loading || request.status == ImageStatus::ready)
+    {
+      stats_.hits++;
+      return true;
+    }
+
+    stats_.misses++;
+    request.path = path;
+    request.status = ImageStatus::loading;
+    request.image = nullptr;
+
+    return false;
+  }
+
+  void AssetManager::insert_image(ImageHandle handle, ImageData* image_data)
+  {
+    auto& request = requests_[handle];
+    request.image = image_data;
+
+    images_.insert({ request.name, image_data });
+    stats_.resident_bytes += image_data->allocation.size;
+  }
+
+  void AssetManager::evict()
+  {
+    // Images the frames in flight may sample are skipped, their memory would only come back
+    // through the deletion queue once those frames retire anyway.
+    auto& engine = Engine::get_singleton();
+    uint64_t frame_number = engine.get_frame_number();
+
+    while (stats_.resident_bytes > memory_budget_)
+    {
+      ImageRequest* victim = nullptr;
+      for (auto& request : requests_)
+      {
+        bool evictable = request.status == ImageStatus::ready && request.reference_count == 0
+            && request.last_used_frame + engine.get_frames_in_flight() <= frame_number;
+
+        if (evictable && (!victim || request.last_used_frame < victim->last_used_frame))
+          victim = &request;
+      }
+
+      // Everything left is referenced or possibly still sampled by a frame in flight.
+      if (!victim)
+        break;
+
+      destroy_image(victim->name);
+      stats_.evictions++;
+    }
+  }
+
+  ImageData* AssetManager::create_image(const unsigned char* pixels, uint32_t width,
+                                        uint32_t height)
+  {
+    VkDeviceSize image_size = width * height * 4;
+    auto image_data = new ImageData();
+
+    auto& engine = Engine::get_singleton();
 
-    images_.insert({ name, image_data });
-    stbi_image_free(pixels);
+    auto staging_region = StagingBuffer::get_singleton().allocate(image_size);
+    std::memcpy(staging_region.data, pixels, image_size);
 
     const VkExtent3D image_extent = {
-      .width = static_cast<uint32_t>(width),
-      .height = static_cast<uint32_t>(height),
-      .depth = 4,
+      .width = width,
+      .height = height,
+      .depth = 1,
     };
 
+    uint32_t mip_levels = engine.get_mip_levels(VK_FORMAT_R8G8B8A8_SRGB, image_extent);
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (mip_levels > 1)
+      usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
     const VkImageCreateInfo image_create_info = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
       .imageType = VK_IMAGE_TYPE_2D,
-      .format = engine.get_surface_format().format,
+      .format = VK_FORMAT_R8G8B8A8_SRGB,
       .extent = image_extent,
-      .mipLevels = 1,
+      .mipLevels = mip_levels,
       .arrayLayers = 1,
       .samples = VK_SAMPLE_COUNT_1_BIT,
       .tiling = VK_IMAGE_TILING_OPTIMAL,
-      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .usage = usage,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
       .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    result = vkCreateImage(device, &image_create_info, nullptr, &image_data->image);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create image");
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image_data->image,
+                        image_data->allocation);
+
+    const VkOffset3D offset = {
+      .x = 0,
+      .y = 0,
+      .z = 0,
+    };
 
-    vkGetImageMemoryRequirements(device, image_data->image, &memory_requirements);
+    image_data->ticket =
+        engine.transfer_image(image_data->image, offset, image_extent, 1, staging_region.buffer,
+                              staging_region.offset, mip_levels);
 
-    auto flag = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-    const VkMemoryAllocateInfo image_allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    create_view_and_sampler(image_data, VK_FORMAT_R8G8B8A8_SRGB, mip_levels);
+
+    return image_data;
+  }
+
+  ImageData* AssetManager::create_image(const TextureContainer& container)
+  {
+    auto image_data = new ImageData();
+    auto& engine = Engine::get_singleton();
+
+    // The blocks are copied as is, along with whatever mip chain the container holds.
+    auto staging_region = StagingBuffer::get_singleton().allocate(container.get_size());
+    auto regions = container.copy_regions(staging_region.data, staging_region.offset);
+
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
       .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = engine.find_memory_type(memory_requirements.memoryTypeBits, flag),
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = container.get_format(),
+      .extent = container.get_extent(),
+      .mipLevels = container.get_level_count(),
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    result = vkAllocateMemory(device, &image_allocate_info, nullptr, &image_data->memory);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image_data->image,
+                        image_data->allocation);
 
-    result = vkBindImageMemory(device, image_data->image, image_data->memory, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to bind buffer memory");
+    image_data->ticket = engine.transfer_image_levels(image_data->image, staging_region.buffer,
+                                                      regions, 1, container.get_level_count());
 
-    const VkOffset3D offset = {
-      .x = 0,
-      .y = 0,
-      .z = 0,
-    };
+    create_view_and_sampler(image_data, container.get_format(), container.get_level_count());
 
-    engine.transfer_image(image_data->image, offset, image_extent, 1, staging_buffer);
+    return image_data;
+  }
 
-    vkDestroyBuffer(device, staging_buffer, nullptr);
-    vkFreeMemory(device, staging_memory, nullptr);
+  void AssetManager::create_view_and_sampler(ImageData* image_data, VkFormat format,
+                                             uint32_t mip_levels)
+  {
+    auto device = Engine::get_singleton().get_device();
 
     const VkComponentMapping components = {
       .r = VK_COMPONENT_SWIZZLE_R,
@@ -142,7 +429,7 @@ namespace core
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
-      .levelCount = 1,
+      .levelCount = mip_levels,
       .baseArrayLayer = 0,
       .layerCount = 1,
     };
@@ -153,12 +440,13 @@ namespace core
       .flags = 0,
       .image = image_data->image,
       .viewType = VK_IMAGE_VIEW_TYPE_2D,
-      .format = VK_FORMAT_R8G8B8A8_SRGB,
+      .format = format,
       .components = components,
       .subresourceRange = subresource_range,
     };
 
-    result = vkCreateImageView(device, &image_view_create_info, nullptr, &image_data->image_view);
+    VkResult result =
+        vkCreateImageView(device, &image_view_create_info, nullptr, &image_data->image_view);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create image view");
 
@@ -178,7 +466,7 @@ namespace core
       .compareEnable = VK_FALSE,
       .compareOp = VK_COMPARE_OP_ALWAYS,
       .minLod = 0.0f,
-      .maxLod = 0.0f,
+      .maxLod = static_cast<float>(mip_levels),
       .borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
       .unnormalizedCoordinates = VK_FALSE,
     };
@@ -186,39 +474,74 @@ namespace core
     result = vkCreateSampler(device, &sampler_create_info, nullptr, &image_data->sampler);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create sampler");
-
-    return image_data;
   }
 
-  ImageData* AssetManager::find_image(const std::string& name)
+  void AssetManager::free_image(ImageData* image_data)
   {
-    auto it = images_.find(name);
-    return it != images_.end() ? it->second : nullptr;
+    auto& deletion_queue = DeletionQueue::get_singleton();
+    auto device = Engine::get_singleton().get_device();
+
+    // Queued behind the upload, which may still be in flight when an image is dropped right
+    // after being requested, and behind the frames that may sample it.
+    deletion_queue.push([device, sampler = image_data->sampler,
+                         image_view = image_data->image_view]() {
+      vkDestroySampler(device, sampler, nullptr);
+      vkDestroyImageView(device, image_view, nullptr);
+    });
+    deletion_queue.destroy_image(image_data->image, image_data->allocation);
+
+    delete image_data;
   }
 
-  void AssetManager::destroy_image(const std::string& name)
+  void AssetManager::decode(ImageHandle handle)
   {
-    auto& engine = Engine::get_singleton();
-    auto device = engine.get_device();
-    auto it = images_.find(name);
-
-    if (it != images_.end())
     {
-      auto image_data = it->second;
-
-      vkDestroySampler(device, image_data->sampler, nullptr);
-      vkDestroyImageView(device, image_data->image_view, nullptr);
-      vkDestroyImage(device, image_data->image, nullptr);
-      vkFreeMemory(device, image_data->memory, nullptr);
-
-      delete image_data;
-      images_.erase(name);
+      std::lock_guard lock(mutex_);
+      decoding_count_++;
     }
+
+    misc::ThreadPool::get_singleton().submit([this, handle, path = requests_[handle].path]() {
+      TraceScope scope("decode image");
+
+      // A compressed container only needs to be mapped, decoding is skipped altogether.
+      auto container = open_container(path);
+
+      int width = 0;
+      int height = 0;
+      int channels;
+      stbi_uc* pixels = nullptr;
+      if (!container)
+        pixels = stbi_load(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+
+      std::lock_guard lock(mutex_);
+      decoded_images_.push_back({
+          .handle = handle,
+          .pixels = pixels,
+          .width = static_cast<uint32_t>(width),
+          .height = static_cast<uint32_t>(height),
+          .container = std::move(container),
+      });
+
+      decoding_count_--;
+      decoding_condition_.notify_all();
+    });
   }
 
-  void AssetManager::free()
+  std::unique_ptr<TextureContainer> AssetManager::open_container(const std::string& path) const
   {
-    for (auto it = images_.begin(); it != images_.end(); it++)
-      destroy_image(it->first);
+    // A broken container falls back to the source image, decoded by stb.
+    auto container = std::make_unique<TextureContainer>(path);
+    try
+    {
+      if (!container->load())
+        container.reset();
+    }
+    catch (const std::runtime_error& e)
+    {
+      std::clog << e.what() << '\n';
+      container.reset();
+    }
+
+    return container;
   }
 } // namespace core
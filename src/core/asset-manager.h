@@ -1,20 +1,51 @@
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include <vulkan/vulkan.h>
 
+#include "core/memory-allocator.h"
+#include "core/texture-container.h"
+#include "core/transfer-queue.h"
 #include "misc/singleton.h"
 
+#define ASSET_UPLOAD_BUDGET (16 * 1024 * 1024)
+#define ASSET_MEMORY_BUDGET (256 * 1024 * 1024)
+
 namespace core
 {
   struct ImageData
   {
     VkImage image;
-    VkDeviceMemory memory;
+    Allocation allocation;
     VkImageView image_view;
     VkSampler sampler;
+    TransferTicket ticket;
+  };
+
+  using ImageHandle = uint32_t;
+
+  struct AssetStats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    VkDeviceSize resident_bytes;
+    VkDeviceSize budget_bytes;
+  };
+
+  enum class ImageStatus
+  {
+    loading,
+    ready,
+    failed,
+    unloaded,
   };
 
   class AssetManager : public misc::Singleton<AssetManager>
@@ -26,13 +57,79 @@ namespace core
     AssetManager() = default;
 
   public:
+    /// memory_budget is the device memory unreferenced images are kept cached within, 0 uses
+    /// ASSET_MEMORY_BUDGET.
+    void init(VkDeviceSize memory_budget = 0);
+    void free();
+
+    /// Both loads take a reference on the image, dropped again with release_image().
     ImageData* load_image(const std::string& path, const std::string& name);
+    /// Decode on the thread pool and upload from update(), the handle resolves to a
+    /// placeholder until the image is on the GPU.
+    ImageHandle load_image_async(const std::string& path, const std::string& name);
+    /// Unreferenced images stay cached until the budget forces them out.
+    void release_image(const std::string& name);
     ImageData* find_image(const std::string& name);
+    /// Free an image right away, whether it is referenced or not.
     void destroy_image(const std::string& name);
 
-    void free();
+    /// Upload decoded images, within ASSET_UPLOAD_BUDGET bytes per call, and evict least
+    /// recently used images over the memory budget. Called every frame.
+    void update();
+
+    ImageData* get_image(ImageHandle handle);
+    ImageStatus get_status(ImageHandle handle) const;
+    ImageData* get_placeholder() const;
+    AssetStats get_stats() const;
 
   private:
+    struct ImageRequest
+    {
+      std::string path;
+      std::string name;
+      ImageStatus status;
+      ImageData* image;
+      uint32_t reference_count;
+      /// Engine frame number of the last frame that may have sampled the image.
+      uint64_t last_used_frame;
+    };
+
+    struct DecodedImage
+    {
+      ImageHandle handle;
+      unsigned char* pixels;
+      uint32_t width;
+      uint32_t height;
+      /// Set instead of pixels when a compressed container was found.
+      std::unique_ptr<TextureContainer> container;
+    };
+
+    ImageData* create_image(const unsigned char* pixels, uint32_t width, uint32_t height);
+    ImageData* create_image(const TextureContainer& container);
+    void create_view_and_sampler(ImageData* image_data, VkFormat format, uint32_t mip_levels);
+    /// Find or register the request for name and take a reference, true if the image is
+    /// already loaded or on its way.
+    bool acquire(const std::string& path, const std::string& name, ImageHandle& handle);
+    void insert_image(ImageHandle handle, ImageData* image_data);
+    void evict();
+    void free_image(ImageData* image_data);
+    void decode(ImageHandle handle);
+    /// The compressed container next to path, null when there is none or it is broken. Shared
+    /// by both loads so that they fall back to stb alike.
+    std::unique_ptr<TextureContainer> open_container(const std::string& path) const;
+
     std::unordered_map<std::string, ImageData*> images_;
+    ImageData* placeholder_ = nullptr;
+
+    std::vector<ImageRequest> requests_;
+    std::unordered_map<std::string, ImageHandle> handles_;
+    VkDeviceSize memory_budget_ = ASSET_MEMORY_BUDGET;
+    AssetStats stats_ = {};
+
+    /// Shared with the decoding workers.
+    std::vector<DecodedImage> decoded_images_;
+    uint32_t decoding_count_ = 0;
+    std::mutex mutex_;
+    std::condition_variable decoding_condition_;
   };
 } // namespace core
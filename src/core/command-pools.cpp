@@ -0,0 +1,138 @@
+#include "core/command-pools.h"
+
+#include <stdexcept>
+
+#include "core/engine.h"
+#include "misc/thread-pool.h"
+
+namespace core
+{
+  void CommandPools::init()
+  {
+    auto& engine = Engine::get_singleton();
+    auto thread_count = misc::ThreadPool::get_singleton().get_thread_count() + 1;
+
+    const VkCommandPoolCreateInfo command_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = engine.get_graphics_queue_family(),
+    };
+
+    frames_.resize(MAX_FRAMES_IN_FLIGHT);
+    for (auto& frame : frames_)
+    {
+      frame.resize(thread_count);
+      for (auto& thread_commands : frame)
+      {
+        thread_commands.used_count = 0;
+
+        VkResult result = vkCreateCommandPool(engine.get_device(), &command_pool_create_info,
+                                              nullptr, &thread_commands.command_pool);
+        if (result != VK_SUCCESS)
+          throw std::runtime_error("failed to create command pool");
+      }
+    }
+  }
+
+  void CommandPools::free()
+  {
+    auto device = Engine::get_singleton().get_device();
+
+    // Destroying a pool frees its command buffers.
+    for (auto& frame : frames_)
+      for (auto& thread_commands : frame)
+        vkDestroyCommandPool(device, thread_commands.command_pool, nullptr);
+
+    frames_.clear();
+  }
+
+  void CommandPools::reset()
+  {
+    auto& engine = Engine::get_singleton();
+
+    for (auto& thread_commands : frames_[engine.get_current_frame()])
+    {
+      if (thread_commands.used_count == 0)
+        continue;
+
+      VkResult result = vkResetCommandPool(engine.get_device(), thread_commands.command_pool, 0);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to reset command pool");
+
+      thread_commands.used_count = 0;
+    }
+  }
+
+  VkCommandBuffer CommandPools::begin(const VkCommandBufferInheritanceRenderingInfo& rendering_info)
+  {
+    auto& engine = Engine::get_singleton();
+    auto& thread_commands =
+        frames_[engine.get_current_frame()][misc::ThreadPool::get_thread_index()];
+
+    // Command buffers stay allocated across resets, a pool only grows to the largest frame.
+    if (thread_commands.used_count == thread_commands.command_buffers.size())
+    {
+      const VkCommandBufferAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext = nullptr,
+        .commandPool = thread_commands.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+        .commandBufferCount = 1,
+      };
+
+      VkCommandBuffer command_buffer;
+      VkResult result = vkAllocateCommandBuffers(engine.get_device(), &allocate_info,
+                                                 &command_buffer);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate command buffers");
+
+      thread_commands.command_buffers.push_back(command_buffer);
+    }
+
+    auto command_buffer = thread_commands.command_buffers[thread_commands.used_count++];
+
+    const VkCommandBufferInheritanceInfo inheritance_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+      .pNext = &rendering_info,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .framebuffer = VK_NULL_HANDLE,
+      .occlusionQueryEnable = VK_FALSE,
+      .queryFlags = 0,
+      .pipelineStatistics = 0,
+    };
+
+    const VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+          | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+      .pInheritanceInfo = &inheritance_info,
+    };
+
+    VkResult result = vkBeginCommandBuffer(command_buffer, &begin_info);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to begin command buffer recording");
+
+    return command_buffer;
+  }
+
+  void CommandPools::end(VkCommandBuffer command_buffer) const
+  {
+    VkResult result = vkEndCommandBuffer(command_buffer);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to end command buffer");
+  }
+
+  uint32_t CommandPools::get_recorded_count() const
+  {
+    auto& frame = frames_[Engine::get_singleton().get_current_frame()];
+
+    uint32_t count = 0;
+    for (const auto& thread_commands : frame)
+      count += thread_commands.used_count;
+
+    return count;
+  }
+} // namespace core
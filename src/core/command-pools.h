@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "misc/singleton.h"
+
+namespace core
+{
+  /// Secondary command buffers for the passes, recorded on the thread pool. Every frame in
+  /// flight has one command pool per thread, so recording never takes a lock and a whole frame
+  /// is recycled with a single pool reset.
+  class CommandPools : public misc::Singleton<CommandPools>
+  {
+    // Give Singleton<CommandPools> access to CommandPools’s private constructor
+    friend class Singleton<CommandPools>;
+
+  private:
+    /// Construct a CommandPools.
+    CommandPools() = default;
+
+  public:
+    void init();
+    void free();
+
+    /// Recycle the command buffers of the current frame. Called every frame after the in flight
+    /// fence wait.
+    void reset();
+    /// Begin a secondary command buffer on the calling thread's pool, to be executed inside a
+    /// dynamic rendering pass with the given attachment formats.
+    VkCommandBuffer begin(const VkCommandBufferInheritanceRenderingInfo& rendering_info);
+    void end(VkCommandBuffer command_buffer) const;
+
+    /// Secondary command buffers recorded for the current frame so far.
+    uint32_t get_recorded_count() const;
+
+  private:
+    struct ThreadCommands
+    {
+      VkCommandPool command_pool;
+      std::vector<VkCommandBuffer> command_buffers;
+      uint32_t used_count;
+    };
+
+    /// Indexed by frame in flight, then by ThreadPool::get_thread_index().
+    std::vector<std::vector<ThreadCommands>> frames_;
+  };
+} // namespace core
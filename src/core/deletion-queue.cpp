@@ -0,0 +1,57 @@
+#include "core/deletion-queue.h"
+
+#include "core/engine.h"
+
+namespace core
+{
+  void DeletionQueue::free()
+  {
+    while (!deletions_.empty())
+    {
+      auto deleter = std::move(deletions_.front().deleter);
+      deletions_.pop_front();
+      deleter();
+    }
+  }
+
+  void DeletionQueue::push(std::function<void()> deleter)
+  {
+    // The frame being recorded may use the resource, and so may uploads not submitted yet.
+    deletions_.push_back({
+        .frame_number = Engine::get_singleton().get_frame_number(),
+        .ticket = TransferQueue::get_singleton().get_last_ticket(),
+        .deleter = std::move(deleter),
+    });
+  }
+
+  void DeletionQueue::destroy_buffer(VkBuffer buffer, const Allocation& allocation)
+  {
+    push([buffer, allocation]() { Engine::get_singleton().destroy_buffer(buffer, allocation); });
+  }
+
+  void DeletionQueue::destroy_image(VkImage image, const Allocation& allocation)
+  {
+    push([image, allocation]() { Engine::get_singleton().destroy_image(image, allocation); });
+  }
+
+  void DeletionQueue::flush()
+  {
+    auto& engine = Engine::get_singleton();
+    auto& transfer_queue = TransferQueue::get_singleton();
+    uint64_t frame_number = engine.get_frame_number();
+
+    // Both keys only grow along the queue, so the retired deletions are all at the front.
+    while (!deletions_.empty())
+    {
+      const auto& deletion = deletions_.front();
+      if (deletion.frame_number + engine.get_frames_in_flight() > frame_number
+          || !transfer_queue.is_complete(deletion.ticket))
+        break;
+
+      // Pop first, a deleter may queue further deletions.
+      auto deleter = std::move(deletions_.front().deleter);
+      deletions_.pop_front();
+      deleter();
+    }
+  }
+} // namespace core
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+#include <vulkan/vulkan.h>
+
+#include "core/memory-allocator.h"
+#include "core/transfer-queue.h"
+#include "misc/singleton.h"
+
+namespace core
+{
+  /// Destroys resources once the GPU is done with them instead of idling the device: a
+  /// deletion runs when every frame and transfer recorded before it has completed.
+  class DeletionQueue : public misc::Singleton<DeletionQueue>
+  {
+    // Give Singleton<DeletionQueue> access to DeletionQueue’s private constructor
+    friend class Singleton<DeletionQueue>;
+
+  private:
+    /// Construct a DeletionQueue.
+    DeletionQueue() = default;
+
+  public:
+    /// Run every pending deletion, the device must be idle.
+    void free();
+
+    void push(std::function<void()> deleter);
+    void destroy_buffer(VkBuffer buffer, const Allocation& allocation);
+    void destroy_image(VkImage image, const Allocation& allocation);
+    /// Run the deletions whose frame retired. Called every frame after the in flight fence
+    /// wait.
+    void flush();
+
+    size_t get_pending_count() const;
+
+  private:
+    struct Deletion
+    {
+      uint64_t frame_number;
+      TransferTicket ticket;
+      std::function<void()> deleter;
+    };
+
+    std::deque<Deletion> deletions_;
+  };
+} // namespace core
+
+#include "core/deletion-queue.hxx"
@@ -0,0 +1,6 @@
+#include "core/deletion-queue.h"
+
+namespace core
+{
+  inline size_t DeletionQueue::get_pending_count() const { return deletions_.size(); }
+} // namespace core
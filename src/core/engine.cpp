@@ -1,6 +1,11 @@
 #include "engine.h"
 
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <chrono>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <set>
 
@@ -8,43 +13,78 @@
 #include <imgui_impl_vulkan.h>
 
 #include "core/asset-manager.h"
+#include "core/command-pools.h"
+#include "core/deletion-queue.h"
+#include "core/frame-pacer.h"
+#include "core/profiler.h"
+#include "core/staging-buffer.h"
+#include "core/trace-recorder.h"
 #include "gfx/csg-pipeline.h"
+#include "gfx/csg-tree-pipeline.h"
 #include "gfx/skybox-pipeline.h"
+#include "misc/thread-pool.h"
 #include "render/renderer.h"
 
 namespace core
 {
   void Engine::init(int argc, char* argv[])
   {
-    create_window();
+    parse_arguments(argc, argv);
+    TraceRecorder::get_singleton().init(trace_path_);
+    misc::ThreadPool::get_singleton().init(thread_count_);
+    FramePacer::get_singleton().init(frame_rate_limit_);
+
+    if (!headless_)
+      create_window();
     create_instance();
-    create_surface();
+    if (!headless_)
+      create_surface();
     create_device();
-    create_swapchain();
-    create_swapchain_resources();
-    create_command_pools();
-    allocate_command_buffers();
-    create_fences();
-    create_semaphores();
+
+    MemoryAllocator::get_singleton().init();
+
+    if (headless_)
+      create_offscreen_images();
+    else
+    {
+      create_swapchain();
+      create_swapchain_resources();
+    }
+    create_frame_contexts();
+    CommandPools::get_singleton().init();
+    Profiler::get_singleton().init(profile_path_);
+
+    TransferQueue::get_singleton().init();
+    StagingBuffer::get_singleton().init();
+    AssetManager::get_singleton().init(texture_budget_);
 
     init_imgui();
 
     auto& csg_pipeline = gfx::CSGPipeline::get_singleton();
+    auto& csg_tree_pipeline = gfx::CSGTreePipeline::get_singleton();
     auto& skybox_pipeline = gfx::SkyboxPipeline::get_singleton();
     auto& renderer = render::Renderer::get_singleton();
 
     csg_pipeline.init();
+    csg_tree_pipeline.init();
     skybox_pipeline.init();
     renderer.init();
   }
 
   void Engine::loop()
   {
+    auto& frame_pacer = FramePacer::get_singleton();
+
     bool running = true;
-    while (running)
+    for (uint32_t i = 0; running && (frame_limit_ == 0 || i < frame_limit_); i++)
     {
+      // Input is polled as late as possible: after the limiter slept and once the frame
+      // context is free, so that nothing but recording stands between input and present.
+      frame_pacer.wait();
+      wait_for_frame();
+
       SDL_Event event;
-      while (SDL_PollEvent(&event))
+      while (!headless_ && SDL_PollEvent(&event))
       {
         if (event.type == SDL_EVENT_QUIT)
           running = false;
@@ -54,60 +94,201 @@ namespace core
         ImGui_ImplSDL3_ProcessEvent(&event);
       }
 
+      frame_pacer.mark_input();
       render();
     }
   }
 
+  double Engine::benchmark(uint32_t frame_count)
+  {
+    // The first frame pays for pending uploads and pipeline warm-up, keep it out of the timing.
+    render();
+    vkDeviceWaitIdle(device_);
+
+    auto& frame_pacer = FramePacer::get_singleton();
+    frame_pacer.reset();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < frame_count; i++)
+    {
+      SDL_Event event;
+      while (!headless_ && SDL_PollEvent(&event))
+        ImGui_ImplSDL3_ProcessEvent(&event);
+
+      frame_pacer.mark_input();
+      render();
+    }
+
+    vkDeviceWaitIdle(device_);
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / frame_count;
+  }
+
   void Engine::quit()
   {
     auto& asset_manager = AssetManager::get_singleton();
     auto& csg_pipeline = gfx::CSGPipeline::get_singleton();
+    auto& csg_tree_pipeline = gfx::CSGTreePipeline::get_singleton();
     auto& skybox_pipeline = gfx::SkyboxPipeline::get_singleton();
     auto& renderer = render::Renderer::get_singleton();
 
     vkDeviceWaitIdle(device_);
 
+    if (!capture_path_.empty())
+      save_frame(capture_path_);
+
+    auto memory_stats = MemoryAllocator::get_singleton().get_stats();
+    std::clog << "device memory: " << memory_stats.used_bytes << " bytes used, "
+              << memory_stats.wasted_bytes << " wasted, " << memory_stats.reserved_bytes
+              << " reserved in " << memory_stats.block_count << " blocks and "
+              << memory_stats.dedicated_count << " dedicated allocations\n";
+
+    auto asset_stats = asset_manager.get_stats();
+    std::clog << "texture cache: " << asset_stats.hits << " hits, " << asset_stats.misses
+              << " misses, " << asset_stats.evictions << " evictions, "
+              << asset_stats.resident_bytes << " of " << asset_stats.budget_bytes
+              << " bytes resident\n";
+
+    auto pacing_stats = FramePacer::get_singleton().get_stats();
+    std::clog << "frame pacing: " << pacing_stats.frame_count << " frames, interval "
+              << pacing_stats.average_interval << " ms (p99 " << pacing_stats.p99_interval
+              << ", max " << pacing_stats.max_interval << ", jitter " << pacing_stats.jitter
+              << "), input to queue present " << pacing_stats.average_latency << " ms (p99 "
+              << pacing_stats.p99_latency << ")\n";
+
     asset_manager.free();
+    TransferQueue::get_singleton().free();
+    StagingBuffer::get_singleton().free();
     skybox_pipeline.free();
     csg_pipeline.free();
+    csg_tree_pipeline.free();
     renderer.free();
+    DeletionQueue::get_singleton().free();
 
     ImGui_ImplVulkan_Shutdown();
-    ImGui_ImplSDL3_Shutdown();
+    if (!headless_)
+      ImGui_ImplSDL3_Shutdown();
     ImGui::DestroyContext(context_);
     vkDestroyDescriptorPool(device_, imgui_descriptor_pool_, nullptr);
 
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    for (auto& frame : frames_)
     {
-      vkDestroySemaphore(device_, image_available_semaphores_[i], nullptr);
-      vkDestroySemaphore(device_, render_finished_semaphores_[i], nullptr);
-      vkDestroyFence(device_, in_flight_fences_[i], nullptr);
+      vkDestroySemaphore(device_, frame.image_available_semaphore, nullptr);
+      vkDestroyFence(device_, frame.in_flight_fence, nullptr);
+      vkDestroyCommandPool(device_, frame.command_pool, nullptr);
     }
 
-    vkDestroyFence(device_, transfer_fence_, nullptr);
-
-    vkFreeCommandBuffers(device_, transfer_command_pool_, 1, &transfer_command_buffer_);
-    vkFreeCommandBuffers(device_, graphics_command_pool_, graphics_command_buffers_.size(),
-                         graphics_command_buffers_.data());
+    // The profiler still adds the GPU ranges of the last frames to the trace.
+    Profiler::get_singleton().free();
+    TraceRecorder::get_singleton().free();
+    CommandPools::get_singleton().free();
+    destroy_swapchain_resources();
 
-    vkDestroyCommandPool(device_, transfer_command_pool_, nullptr);
-    vkDestroyCommandPool(device_, graphics_command_pool_, nullptr);
-
-    for (size_t i = 0; i < swapchain_image_views_.size(); i++)
-      vkDestroyImageView(device_, swapchain_image_views_[i], nullptr);
+    if (headless_)
+    {
+      for (size_t i = 0; i < swapchain_images_.size(); i++)
+        destroy_image(swapchain_images_[i], offscreen_allocations_[i]);
+    }
+    else
+      vkDestroySwapchainKHR(device_, swapchain_, nullptr);
 
-    vkDestroySwapchainKHR(device_, swapchain_, nullptr);
+    MemoryAllocator::get_singleton().free();
     vkDestroyDevice(device_, nullptr);
-    vkDestroySurfaceKHR(instance_, surface_, nullptr);
+    if (!headless_)
+      vkDestroySurfaceKHR(instance_, surface_, nullptr);
     vkDestroyInstance(instance_, nullptr);
 
-    SDL_DestroyWindow(window_);
-    SDL_Quit();
+    if (!headless_)
+    {
+      SDL_DestroyWindow(window_);
+      SDL_Quit();
+    }
+
+    misc::ThreadPool::get_singleton().free();
+  }
+
+  void Engine::parse_arguments(int argc, char* argv[])
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      std::string argument = argv[i];
+
+      if (argument == "--benchmark")
+      {
+        benchmark_frames_ = DEFAULT_BENCHMARK_FRAMES;
+        if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+          benchmark_frames_ = std::stoul(argv[++i]);
+
+        if (benchmark_frames_ == 0)
+          throw std::invalid_argument("--benchmark expects a positive frame count");
+      }
+      else if (argument == "--threads" && i + 1 < argc)
+        thread_count_ = std::stoul(argv[++i]);
+      else if (argument == "--no-mipmaps")
+        mipmapping_ = false;
+      else if (argument == "--texture-budget" && i + 1 < argc)
+        texture_budget_ = std::stoull(argv[++i]) * 1024 * 1024;
+      else if (argument == "--frames-in-flight" && i + 1 < argc)
+        set_frames_in_flight(std::stoul(argv[++i]));
+      else if (argument == "--present-mode" && i + 1 < argc)
+      {
+        std::string name = argv[++i];
+
+        present_mode_requested_ = false;
+        for (auto present_mode : { VK_PRESENT_MODE_FIFO_KHR, VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+                                   VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR })
+        {
+          if (name == get_present_mode_name(present_mode))
+          {
+            present_mode_ = present_mode;
+            present_mode_requested_ = true;
+          }
+        }
+
+        if (!present_mode_requested_)
+          throw std::invalid_argument("unknown present mode " + name);
+      }
+      else if (argument == "--swapchain-images" && i + 1 < argc)
+        swapchain_image_count_ = std::stoul(argv[++i]);
+      else if (argument == "--fps-limit" && i + 1 < argc)
+        frame_rate_limit_ = std::stod(argv[++i]);
+      else if (argument == "--frames" && i + 1 < argc)
+      {
+        frame_limit_ = std::stoul(argv[++i]);
+        if (frame_limit_ == 0)
+          throw std::invalid_argument("--frames expects a positive frame count");
+      }
+      else if (argument == "--headless")
+        headless_ = true;
+      else if (argument == "--capture" && i + 1 < argc)
+        capture_path_ = argv[++i];
+      else if (argument == "--profile" && i + 1 < argc)
+        profile_path_ = argv[++i];
+      else if (argument == "--trace" && i + 1 < argc)
+        trace_path_ = argv[++i];
+      else if (argument == "--render-scale" && i + 1 < argc)
+      {
+        render_scale_ = std::stof(argv[++i]);
+        if (render_scale_ <= 0.0f || render_scale_ > 2.0f)
+          throw std::invalid_argument("--render-scale expects a scale between 0 and 2");
+      }
+      else
+        throw std::invalid_argument("unknown option " + argument);
+    }
+
+    if (!capture_path_.empty() && !headless_)
+      throw std::invalid_argument("--capture requires --headless");
+
+    // Nothing can close a headless run, it renders a single frame unless told otherwise.
+    if (headless_ && frame_limit_ == 0)
+      frame_limit_ = 1;
   }
 
   void Engine::create_buffer(const VkBufferCreateInfo& create_info,
                              VkMemoryPropertyFlags properties, VkBuffer& buffer,
-                             VkDeviceMemory& memory) const
+                             Allocation& allocation, MemoryLifetime lifetime) const
   {
     VkResult result = vkCreateBuffer(device_, &create_info, nullptr, &buffer);
     if (result != VK_SUCCESS)
@@ -116,25 +297,17 @@ namespace core
     VkMemoryRequirements memory_requirements;
     vkGetBufferMemoryRequirements(device_, buffer, &memory_requirements);
 
-    const VkMemoryAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits, properties),
-    };
+    auto& memory_allocator = MemoryAllocator::get_singleton();
+    allocation = memory_allocator.allocate(memory_requirements, properties, false, lifetime);
 
-    result = vkAllocateMemory(device_, &allocate_info, nullptr, &memory);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
-
-    result = vkBindBufferMemory(device_, buffer, memory, 0);
+    result = vkBindBufferMemory(device_, buffer, allocation.memory, allocation.offset);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to bind buffer memory");
   }
 
   void Engine::create_image(const VkImageCreateInfo& image_create_info,
                             VkMemoryPropertyFlags properties, VkImage& image,
-                            VkDeviceMemory& memory)
+                            Allocation& allocation, MemoryLifetime lifetime) const
   {
     VkResult result = vkCreateImage(device_, &image_create_info, nullptr, &image);
     if (result != VK_SUCCESS)
@@ -143,22 +316,28 @@ namespace core
     VkMemoryRequirements memory_requirements;
     vkGetImageMemoryRequirements(device_, image, &memory_requirements);
 
-    const VkMemoryAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits, properties),
-    };
-
-    result = vkAllocateMemory(device_, &allocate_info, nullptr, &memory);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
+    bool optimal_image = image_create_info.tiling == VK_IMAGE_TILING_OPTIMAL;
+    auto& memory_allocator = MemoryAllocator::get_singleton();
+    allocation = memory_allocator.allocate(memory_requirements, properties, optimal_image,
+                                           lifetime);
 
-    result = vkBindImageMemory(device_, image, memory, 0);
+    result = vkBindImageMemory(device_, image, allocation.memory, allocation.offset);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to bind image memory");
   }
 
+  void Engine::destroy_buffer(VkBuffer buffer, const Allocation& allocation) const
+  {
+    vkDestroyBuffer(device_, buffer, nullptr);
+    MemoryAllocator::get_singleton().deallocate(allocation);
+  }
+
+  void Engine::destroy_image(VkImage image, const Allocation& allocation)
+  {
+    vkDestroyImage(device_, image, nullptr);
+    MemoryAllocator::get_singleton().deallocate(allocation);
+  }
+
   uint32_t Engine::find_memory_type(uint32_t required_memory_type,
                                     VkMemoryPropertyFlags flags) const
   {
@@ -177,31 +356,28 @@ namespace core
     throw std::runtime_error("no suitable memory type found");
   }
 
-  void Engine::transfer_image(VkImage image, VkOffset3D offset, VkExtent3D extent,
-                              uint32_t layer_count, VkBuffer buffer) const
+  uint32_t Engine::get_mip_levels(VkFormat format, VkExtent3D extent) const
   {
-    VkResult result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for fence");
+    if (!mipmapping_)
+      return 1;
 
-    result = vkResetFences(device_, 1, &transfer_fence_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset fence");
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(physical_device_, format, &format_properties);
 
-    result = vkResetCommandBuffer(transfer_command_buffer_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset command buffer");
+    const VkFormatFeatureFlags required_features = VK_FORMAT_FEATURE_BLIT_SRC_BIT
+        | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ((format_properties.optimalTilingFeatures & required_features) != required_features)
+      return 1;
 
-    const VkCommandBufferBeginInfo command_buffer_begin_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .pInheritanceInfo = nullptr,
-    };
+    return std::bit_width(std::max(extent.width, extent.height));
+  }
 
-    result = vkBeginCommandBuffer(transfer_command_buffer_, &command_buffer_begin_info);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to begin command buffer");
+  TransferTicket Engine::transfer_image(VkImage image, VkOffset3D offset, VkExtent3D extent,
+                                        uint32_t layer_count, VkBuffer buffer,
+                                        VkDeviceSize buffer_offset, uint32_t mip_levels)
+  {
+    auto& transfer_queue = TransferQueue::get_singleton();
+    auto command_buffer = transfer_queue.get_command_buffer();
 
     const VkImageSubresourceLayers image_subresource_layers = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -211,7 +387,7 @@ namespace core
     };
 
     const VkBufferImageCopy region = {
-      .bufferOffset = 0,
+      .bufferOffset = buffer_offset,
       .bufferRowLength = 0,
       .bufferImageHeight = 0,
       .imageSubresource = image_subresource_layers,
@@ -219,66 +395,67 @@ namespace core
       .imageExtent = extent,
     };
 
-    transition_transfer_image_layout(image, surface_format_.format, layer_count,
+    transition_transfer_image_layout(command_buffer, image, surface_format_.format, layer_count,
                                      VK_IMAGE_LAYOUT_UNDEFINED,
                                      VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    vkCmdCopyBufferToImage(transfer_command_buffer_, buffer, image,
-                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    transition_transfer_image_layout(image, surface_format_.format, layer_count,
-                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                                     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    vkCmdCopyBufferToImage(command_buffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                           &region);
 
-    vkEndCommandBuffer(transfer_command_buffer_);
+    // Uploads are recorded on the graphics family, so the chain is blitted in the same submission
+    // and every level is readable once the ticket is reached.
+    if (mip_levels > 1)
+      record_mipmaps(command_buffer, image, extent, layer_count, mip_levels);
+    else
+      transition_transfer_image_layout(command_buffer, image, surface_format_.format, layer_count,
+                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
-    const VkSubmitInfo submit_info = {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .pNext = nullptr,
-      .waitSemaphoreCount = 0,
-      .pWaitSemaphores = nullptr,
-      .pWaitDstStageMask = nullptr,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &transfer_command_buffer_,
-      .signalSemaphoreCount = 0,
-      .pSignalSemaphores = nullptr,
-    };
+    return transfer_queue.get_recording_ticket();
+  }
 
-    VkQueue transfer_queue;
-    vkGetDeviceQueue(device_, transfer_queue_family_, 0, &transfer_queue);
+  TransferTicket Engine::transfer_image_levels(VkImage image, VkBuffer buffer,
+                                               std::span<const VkBufferImageCopy> regions,
+                                               uint32_t layer_count, uint32_t mip_levels) const
+  {
+    auto& transfer_queue = TransferQueue::get_singleton();
+    auto command_buffer = transfer_queue.get_command_buffer();
 
-    result = vkQueueSubmit(transfer_queue, 1, &submit_info, transfer_fence_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to submit to queue");
+    transition_transfer_image_layout(command_buffer, image, surface_format_.format, layer_count,
+                                     VK_IMAGE_LAYOUT_UNDEFINED,
+                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mip_levels);
+    vkCmdCopyBufferToImage(command_buffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           regions.size(), regions.data());
+    transition_transfer_image_layout(command_buffer, image, surface_format_.format, layer_count,
+                                     VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                     VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mip_levels);
 
-    result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for transfer completion");
+    return transfer_queue.get_recording_ticket();
   }
 
-  void Engine::transition_image_layout(VkImage image, VkFormat format, uint32_t layer_count,
-                                       TransitionLayout transition_layout) const
+  TransferTicket Engine::copy_buffer(VkBuffer src_buffer, VkDeviceSize src_offset,
+                                     VkBuffer dst_buffer, VkDeviceSize dst_offset,
+                                     VkDeviceSize size) const
   {
-    VkResult result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for fence");
+    auto& transfer_queue = TransferQueue::get_singleton();
+    auto command_buffer = transfer_queue.get_command_buffer();
 
-    result = vkResetFences(device_, 1, &transfer_fence_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset fence");
+    const VkBufferCopy region = {
+      .srcOffset = src_offset,
+      .dstOffset = dst_offset,
+      .size = size,
+    };
 
-    result = vkResetCommandBuffer(transfer_command_buffer_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset command buffer");
+    vkCmdCopyBuffer(command_buffer, src_buffer, dst_buffer, 1, &region);
 
-    const VkCommandBufferBeginInfo command_buffer_begin_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .pInheritanceInfo = nullptr,
-    };
+    return transfer_queue.get_recording_ticket();
+  }
 
-    result = vkBeginCommandBuffer(transfer_command_buffer_, &command_buffer_begin_info);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to begin command buffer");
+  TransferTicket Engine::transition_image_layout(VkImage image, VkFormat format,
+                                                 uint32_t layer_count,
+                                                 TransitionLayout transition_layout) const
+  {
+    auto& transfer_queue = TransferQueue::get_singleton();
+    auto command_buffer = transfer_queue.get_command_buffer();
 
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = transition_layout.aspect_mask,
@@ -301,60 +478,16 @@ namespace core
       .subresourceRange = subresource_range,
     };
 
-    vkCmdPipelineBarrier(transfer_command_buffer_, transition_layout.src_stage,
-                         transition_layout.dst_stage, 0, 0, nullptr, 0, nullptr, 1,
-                         &image_memory_barrier);
-
-    vkEndCommandBuffer(transfer_command_buffer_);
-
-    const VkSubmitInfo submit_info = {
-      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .pNext = nullptr,
-      .waitSemaphoreCount = 0,
-      .pWaitSemaphores = nullptr,
-      .pWaitDstStageMask = nullptr,
-      .commandBufferCount = 1,
-      .pCommandBuffers = &transfer_command_buffer_,
-      .signalSemaphoreCount = 0,
-      .pSignalSemaphores = nullptr,
-    };
-
-    VkQueue transfer_queue;
-    vkGetDeviceQueue(device_, transfer_queue_family_, 0, &transfer_queue);
+    vkCmdPipelineBarrier(command_buffer, transition_layout.src_stage, transition_layout.dst_stage,
+                         0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier);
 
-    result = vkQueueSubmit(transfer_queue, 1, &submit_info, transfer_fence_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to submit to queue");
-
-    result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for transfer completion");
+    return transfer_queue.get_recording_ticket();
   }
 
-  void Engine::clear_depth_image(VkImage depth_image, uint32_t layer_count) const
+  TransferTicket Engine::clear_depth_image(VkImage depth_image, uint32_t layer_count) const
   {
-    VkResult result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for fence");
-
-    result = vkResetFences(device_, 1, &transfer_fence_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset fence");
-
-    result = vkResetCommandBuffer(transfer_command_buffer_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset command buffer");
-
-    const VkCommandBufferBeginInfo command_buffer_begin_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .pInheritanceInfo = nullptr,
-    };
-
-    result = vkBeginCommandBuffer(transfer_command_buffer_, &command_buffer_begin_info);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to begin command buffer");
+    auto& transfer_queue = TransferQueue::get_singleton();
+    auto command_buffer = transfer_queue.get_command_buffer();
 
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
@@ -377,15 +510,14 @@ namespace core
       .subresourceRange = subresource_range,
     };
 
-    vkCmdPipelineBarrier(transfer_command_buffer_, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
                          VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1,
                          &image_memory_barrier);
 
     VkClearDepthStencilValue clear_value = { 1.0f, 0 };
 
-    vkCmdClearDepthStencilImage(transfer_command_buffer_, depth_image,
-                                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clear_value, 1,
-                                &subresource_range);
+    vkCmdClearDepthStencilImage(command_buffer, depth_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                                &clear_value, 1, &subresource_range);
 
     const VkImageMemoryBarrier back_image_memory_barrier = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
@@ -400,11 +532,86 @@ namespace core
       .subresourceRange = subresource_range,
     };
 
-    vkCmdPipelineBarrier(transfer_command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
                          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1,
                          &back_image_memory_barrier);
 
-    vkEndCommandBuffer(transfer_command_buffer_);
+    return transfer_queue.get_recording_ticket();
+  }
+
+  std::vector<uint8_t> Engine::read_frame()
+  {
+    if (!headless_)
+      throw std::runtime_error("frames can only be read back in headless mode");
+
+    if (frame_number_ == 0)
+      throw std::runtime_error("no frame to read back");
+
+    if (vkDeviceWaitIdle(device_) != VK_SUCCESS)
+      throw std::runtime_error("failed to wait idle for device");
+
+    VkDeviceSize size = swapchain_extent_.width * swapchain_extent_.height * 4;
+
+    const VkBufferCreateInfo buffer_create_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .size = size,
+      .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+    };
+
+    VkBuffer buffer;
+    Allocation allocation;
+    create_buffer(buffer_create_info,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  buffer, allocation, MemoryLifetime::transient);
+
+    // The device is idle, any frame context's pool can lend a command buffer.
+    auto command_pool = frames_[current_frame_].command_pool;
+
+    const VkCommandBufferAllocateInfo allocate_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .commandPool = command_pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1,
+    };
+
+    VkCommandBuffer command_buffer;
+    VkResult result = vkAllocateCommandBuffers(device_, &allocate_info, &command_buffer);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate command buffers");
+
+    const VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+      .pInheritanceInfo = nullptr,
+    };
+
+    result = vkBeginCommandBuffer(command_buffer, &begin_info);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to begin command buffer recording");
+
+    const VkBufferImageCopy region = {
+      .bufferOffset = 0,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+      .imageOffset = { 0, 0, 0 },
+      .imageExtent = { swapchain_extent_.width, swapchain_extent_.height, 1 },
+    };
+
+    // Frames leave their image in TRANSFER_SRC.
+    vkCmdCopyImageToBuffer(command_buffer, swapchain_images_[last_image_index_],
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1, &region);
+
+    result = vkEndCommandBuffer(command_buffer);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to end command buffer");
 
     const VkSubmitInfo submit_info = {
       .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
@@ -413,21 +620,48 @@ namespace core
       .pWaitSemaphores = nullptr,
       .pWaitDstStageMask = nullptr,
       .commandBufferCount = 1,
-      .pCommandBuffers = &transfer_command_buffer_,
+      .pCommandBuffers = &command_buffer,
       .signalSemaphoreCount = 0,
       .pSignalSemaphores = nullptr,
     };
 
-    VkQueue transfer_queue;
-    vkGetDeviceQueue(device_, transfer_queue_family_, 0, &transfer_queue);
+    VkQueue graphics_queue;
+    vkGetDeviceQueue(device_, graphics_queue_family_, 0, &graphics_queue);
 
-    result = vkQueueSubmit(transfer_queue, 1, &submit_info, transfer_fence_);
+    result = vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
     if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to submit to queue");
+      throw std::runtime_error("failed to submit");
 
-    result = vkWaitForFences(device_, 1, &transfer_fence_, VK_TRUE, UINT64_MAX);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to wait for transfer completion");
+    if (vkQueueWaitIdle(graphics_queue) != VK_SUCCESS)
+      throw std::runtime_error("failed to wait idle for queue");
+
+    auto data = static_cast<const uint8_t*>(allocation.data);
+    std::vector<uint8_t> pixels(data, data + size);
+
+    vkFreeCommandBuffers(device_, command_pool, 1, &command_buffer);
+    destroy_buffer(buffer, allocation);
+
+    return pixels;
+  }
+
+  void Engine::save_frame(const std::string& path)
+  {
+    auto pixels = read_frame();
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+      throw std::runtime_error("failed to open " + path);
+
+    file << "P6\n" << swapchain_extent_.width << " " << swapchain_extent_.height << "\n255\n";
+
+    // PPM has no alpha channel.
+    for (size_t i = 0; i < pixels.size(); i += 4)
+      file.write(reinterpret_cast<const char*>(&pixels[i]), 3);
+
+    if (!file)
+      throw std::runtime_error("failed to write " + path);
+
+    std::clog << "frame saved to " << path << "\n";
   }
 
   void Engine::create_window()
@@ -444,12 +678,26 @@ namespace core
 
   void Engine::create_instance()
   {
-    // Query Vulkan extensions required by SDL
+    // Query Vulkan extensions required by SDL, none are needed without a surface.
     uint32_t extensionCount = 0;
-    auto extensionNames = SDL_Vulkan_GetInstanceExtensions(&extensionCount);
+    const char* const* extensionNames = nullptr;
+    if (!headless_)
+      extensionNames = SDL_Vulkan_GetInstanceExtensions(&extensionCount);
 
     const char* validation_layers[] = { "VK_LAYER_KHRONOS_validation" };
 
+    // Build machines without the Vulkan SDK only have the loader and a driver, run without
+    // validation there instead of failing.
+    uint32_t layer_count = 0;
+    vkEnumerateInstanceLayerProperties(&layer_count, nullptr);
+
+    std::vector<VkLayerProperties> layers(layer_count);
+    vkEnumerateInstanceLayerProperties(&layer_count, layers.data());
+
+    bool validation = std::any_of(layers.begin(), layers.end(), [&](const auto& layer) {
+      return strcmp(layer.layerName, validation_layers[0]) == 0;
+    });
+
     const VkApplicationInfo appInfo = {
       .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
       .pNext = nullptr,
@@ -465,7 +713,7 @@ namespace core
       .pNext = nullptr,
       .flags = 0,
       .pApplicationInfo = &appInfo,
-      .enabledLayerCount = 1,
+      .enabledLayerCount = validation ? 1u : 0u,
       .ppEnabledLayerNames = validation_layers,
       .enabledExtensionCount = extensionCount,
       .ppEnabledExtensionNames = extensionNames,
@@ -510,6 +758,8 @@ namespace core
     enabled_features_ = {};
     enabled_features_.independentBlend = VK_TRUE;
     enabled_features_.multiDrawIndirect = supported_features.multiDrawIndirect;
+    enabled_features_.logicOp = supported_features.logicOp;
+    enabled_features_.fragmentStoresAndAtomics = supported_features.fragmentStoresAndAtomics;
     enabled_features_.geometryShader = VK_TRUE;
     enabled_features_.tessellationShader = VK_TRUE;
 
@@ -537,9 +787,15 @@ namespace core
       queue_create_infos.push_back(queue_create_info);
     }
 
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+      .pNext = nullptr,
+      .timelineSemaphore = VK_TRUE,
+    };
+
     VkPhysicalDeviceDynamicRenderingFeatures dynamic_rendering_features = {
       .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DYNAMIC_RENDERING_FEATURES,
-      .pNext = nullptr,
+      .pNext = &timeline_semaphore_features,
       .dynamicRendering = VK_TRUE,
     };
 
@@ -557,7 +813,8 @@ namespace core
       .pQueueCreateInfos = queue_create_infos.data(),
       .enabledLayerCount = 0,
       .ppEnabledLayerNames = nullptr,
-      .enabledExtensionCount = sizeof(required_extensions) / sizeof(required_extensions[0]),
+      // Offscreen images need no swapchain.
+      .enabledExtensionCount = headless_ ? 0u : 1u,
       .ppEnabledExtensionNames = required_extensions,
       .pEnabledFeatures = nullptr,
     };
@@ -611,23 +868,46 @@ namespace core
       }
     }
 
+    VkPresentModeKHR present_mode = choose_present_mode();
+
+    // By default, one image more than the surface minimum lets MAILBOX always have a free image
+    // to render to, at the cost of one more frame of latency with FIFO.
+    uint32_t image_count = capabilities.minImageCount + 1;
+    if (swapchain_image_count_ != 0)
+      image_count = std::max(capabilities.minImageCount, swapchain_image_count_);
+    if (capabilities.maxImageCount != 0)
+      image_count = std::min(image_count, capabilities.maxImageCount);
+
+    std::clog << "swapchain: " << get_present_mode_name(present_mode) << ", " << image_count
+              << " images\n";
+
+    // The scene is blitted to the swapchain when it is rendered at another scale.
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+      usage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    else if (render_scale_ != 1.0f)
+    {
+      std::clog << "swapchain images cannot be blitted to, rendering at native scale\n";
+      render_scale_ = 1.0f;
+    }
+
     const VkSwapchainCreateInfoKHR create_info = {
       .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
       .pNext = nullptr,
       .flags = 0,
       .surface = surface_,
-      .minImageCount = capabilities.minImageCount,
+      .minImageCount = image_count,
       .imageFormat = surface_format_.format,
       .imageColorSpace = surface_format_.colorSpace,
       .imageExtent = swapchain_extent_,
       .imageArrayLayers = 1,
-      .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+      .imageUsage = usage,
       .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
       .preTransform = capabilities.currentTransform,
       .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
-      .presentMode = VK_PRESENT_MODE_FIFO_KHR,
+      .presentMode = present_mode,
       .clipped = VK_TRUE,
       .oldSwapchain = swapchain_,
     };
@@ -637,6 +917,63 @@ namespace core
       throw std::runtime_error("failed to create swapchain");
   }
 
+  VkPresentModeKHR Engine::choose_present_mode() const
+  {
+    uint32_t present_mode_count = 0;
+    VkResult result = vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device_, surface_,
+                                                                &present_mode_count, nullptr);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to retrieve physical device surface present modes");
+
+    std::vector<VkPresentModeKHR> present_modes(present_mode_count);
+    result = vkGetPhysicalDeviceSurfacePresentModesKHR(physical_device_, surface_,
+                                                       &present_mode_count, present_modes.data());
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to retrieve physical device surface present modes");
+
+    auto supported = [&](VkPresentModeKHR present_mode) {
+      return std::find(present_modes.begin(), present_modes.end(), present_mode)
+          != present_modes.end();
+    };
+
+    // FIFO is the only mode every surface supports.
+    if (present_mode_requested_)
+    {
+      if (supported(present_mode_))
+        return present_mode_;
+
+      std::clog << get_present_mode_name(present_mode_)
+                << " present mode is not supported, using fifo\n";
+      return VK_PRESENT_MODE_FIFO_KHR;
+    }
+
+    // Benchmarks measure the renderer, not the display refresh rate.
+    if (benchmark_frames_ != 0)
+    {
+      if (supported(VK_PRESENT_MODE_IMMEDIATE_KHR))
+        return VK_PRESENT_MODE_IMMEDIATE_KHR;
+      if (supported(VK_PRESENT_MODE_MAILBOX_KHR))
+        return VK_PRESENT_MODE_MAILBOX_KHR;
+    }
+
+    return VK_PRESENT_MODE_FIFO_KHR;
+  }
+
+  const char* Engine::get_present_mode_name(VkPresentModeKHR present_mode) const
+  {
+    switch (present_mode)
+    {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR:
+      return "immediate";
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+      return "mailbox";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+      return "fifo-relaxed";
+    default:
+      return "fifo";
+    }
+  }
+
   void Engine::create_swapchain_resources()
   {
     uint32_t image_count = 0;
@@ -654,108 +991,128 @@ namespace core
 
     for (uint32_t i = 0; i < image_count; i++)
       create_image_view(i);
-  }
-
-  void Engine::create_command_pools()
-  {
-    const VkCommandPoolCreateInfo graphics_command_pool_create_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-      .queueFamilyIndex = graphics_queue_family_,
-    };
 
-    VkResult result = vkCreateCommandPool(device_, &graphics_command_pool_create_info, nullptr,
-                                          &graphics_command_pool_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create graphics command pool");
-
-    const VkCommandPoolCreateInfo transfer_command_pool_create_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    const VkSemaphoreCreateInfo semaphore_create_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
       .pNext = nullptr,
-      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-      .queueFamilyIndex = transfer_queue_family_,
+      .flags = 0,
     };
 
-    result = vkCreateCommandPool(device_, &transfer_command_pool_create_info, nullptr,
-                                 &transfer_command_pool_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create graphics command pool");
+    render_finished_semaphores_.resize(image_count);
+    for (auto& semaphore : render_finished_semaphores_)
+    {
+      result = vkCreateSemaphore(device_, &semaphore_create_info, nullptr, &semaphore);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to create semaphore");
+    }
   }
 
-  void Engine::allocate_command_buffers()
+  void Engine::destroy_swapchain_resources()
   {
-    uint32_t image_count = 0;
-    VkResult result = vkGetSwapchainImagesKHR(device_, swapchain_, &image_count, nullptr);
+    for (auto semaphore : render_finished_semaphores_)
+      vkDestroySemaphore(device_, semaphore, nullptr);
 
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to retrieve swpachain image count");
+    for (auto image_view : swapchain_image_views_)
+      vkDestroyImageView(device_, image_view, nullptr);
 
-    const VkCommandBufferAllocateInfo graphics_allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .commandPool = graphics_command_pool_,
-      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-      .commandBufferCount = image_count,
-    };
+    render_finished_semaphores_.clear();
+    swapchain_image_views_.clear();
+  }
 
-    graphics_command_buffers_.resize(image_count);
-    result = vkAllocateCommandBuffers(device_, &graphics_allocate_info,
-                                      graphics_command_buffers_.data());
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate command buffers");
+  void Engine::create_offscreen_images()
+  {
+    swapchain_extent_ = { HEADLESS_WIDTH, HEADLESS_HEIGHT };
+    surface_format_ = { VK_FORMAT_R8G8B8A8_UNORM, VK_COLORSPACE_SRGB_NONLINEAR_KHR };
+    min_image_count_ = MAX_FRAMES_IN_FLIGHT;
 
-    const VkCommandBufferAllocateInfo transfer_allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
       .pNext = nullptr,
-      .commandPool = transfer_command_pool_,
-      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-      .commandBufferCount = 1,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = surface_format_.format,
+      .extent = { swapchain_extent_.width, swapchain_extent_.height, 1 },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+          | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    result = vkAllocateCommandBuffers(device_, &transfer_allocate_info, &transfer_command_buffer_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate command buffers");
+    // A frame renders to the image of its frame context, so none is overwritten while a frame
+    // still in flight uses it.
+    swapchain_images_.resize(MAX_FRAMES_IN_FLIGHT);
+    swapchain_image_views_.resize(MAX_FRAMES_IN_FLIGHT);
+    offscreen_allocations_.resize(MAX_FRAMES_IN_FLIGHT);
+    for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, swapchain_images_[i],
+                   offscreen_allocations_[i]);
+      create_image_view(i);
+    }
+
+    std::clog << "headless: " << swapchain_extent_.width << "x" << swapchain_extent_.height
+              << " offscreen images\n";
   }
 
-  void Engine::create_fences()
+  void Engine::create_frame_contexts()
   {
-    const VkFenceCreateInfo create_info = {
+    const VkCommandPoolCreateInfo command_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+      .queueFamilyIndex = graphics_queue_family_,
+    };
+
+    const VkFenceCreateInfo fence_create_info = {
       .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
       .pNext = nullptr,
       .flags = VK_FENCE_CREATE_SIGNALED_BIT,
     };
 
-    in_flight_fences_.resize(MAX_FRAMES_IN_FLIGHT);
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-      if (vkCreateFence(device_, &create_info, nullptr, &in_flight_fences_[i]) != VK_SUCCESS)
-        throw std::runtime_error("failed to create fence");
-
-    if (vkCreateFence(device_, &create_info, nullptr, &transfer_fence_) != VK_SUCCESS)
-      throw std::runtime_error("failed to create fence");
-  }
-
-  void Engine::create_semaphores()
-  {
-    const VkSemaphoreCreateInfo create_info = {
+    const VkSemaphoreCreateInfo semaphore_create_info = {
       .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
     };
 
-    image_available_semaphores_.resize(MAX_FRAMES_IN_FLIGHT);
-    render_finished_semaphores_.resize(MAX_FRAMES_IN_FLIGHT);
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    // Contexts exist for the largest depth, so that it can change without reallocating.
+    frames_.resize(MAX_FRAMES_IN_FLIGHT);
+    for (auto& frame : frames_)
     {
       VkResult result =
-          vkCreateSemaphore(device_, &create_info, nullptr, &image_available_semaphores_[i]);
+          vkCreateCommandPool(device_, &command_pool_create_info, nullptr, &frame.command_pool);
       if (result != VK_SUCCESS)
-        throw std::runtime_error("failed to create semaphore");
+        throw std::runtime_error("failed to create graphics command pool");
+
+      const VkCommandBufferAllocateInfo allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .pNext = nullptr,
+        .commandPool = frame.command_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+      };
 
-      result = vkCreateSemaphore(device_, &create_info, nullptr, &render_finished_semaphores_[i]);
+      result = vkAllocateCommandBuffers(device_, &allocate_info, &frame.command_buffer);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to allocate command buffers");
+
+      result = vkCreateFence(device_, &fence_create_info, nullptr, &frame.in_flight_fence);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to create fence");
+
+      result = vkCreateSemaphore(device_, &semaphore_create_info, nullptr,
+                                 &frame.image_available_semaphore);
       if (result != VK_SUCCESS)
         throw std::runtime_error("failed to create semaphore");
     }
+
+    frames_in_flight_ = requested_frames_in_flight_;
   }
 
   void Engine::init_imgui()
@@ -767,17 +1124,20 @@ namespace core
     io.IniFilename = nullptr;
     io.LogFilename = nullptr;
 
-    if (!ImGui_ImplSDL3_InitForVulkan(window_))
+    if (headless_)
+    {
+      // Without a platform backend nothing updates these, a fixed time step also keeps
+      // headless runs reproducible.
+      io.DisplaySize = ImVec2(swapchain_extent_.width, swapchain_extent_.height);
+      io.DeltaTime = 1.0f / 60.0f;
+    }
+    else if (!ImGui_ImplSDL3_InitForVulkan(window_))
       throw std::runtime_error("failed to init imgui");
 
     VkQueue graphics_queue;
     vkGetDeviceQueue(device_, graphics_queue_family_, 0, &graphics_queue);
 
-    uint32_t image_count = 0;
-    VkResult result = vkGetSwapchainImagesKHR(device_, swapchain_, &image_count, nullptr);
-
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to retrieve swpachain image count");
+    uint32_t image_count = swapchain_images_.size();
 
     const VkDescriptorPoolSize pool_sizes[] = {
       { VK_DESCRIPTOR_TYPE_SAMPLER, 1000 },
@@ -802,8 +1162,8 @@ namespace core
       .pPoolSizes = pool_sizes,
     };
 
-    result = vkCreateDescriptorPool(device_, &descriptor_pool_create_info, nullptr,
-                                    &imgui_descriptor_pool_);
+    VkResult result = vkCreateDescriptorPool(device_, &descriptor_pool_create_info, nullptr,
+                                             &imgui_descriptor_pool_);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create descriptor pool");
 
@@ -826,7 +1186,8 @@ namespace core
       .DescriptorPool = imgui_descriptor_pool_,
       .RenderPass = VK_NULL_HANDLE,
       .MinImageCount = min_image_count_,
-      .ImageCount = image_count,
+      // Its vertex buffers rotate with ImageCount, every frame in flight needs its own.
+      .ImageCount = std::max<uint32_t>(image_count, MAX_FRAMES_IN_FLIGHT),
       .MSAASamples = VK_SAMPLE_COUNT_1_BIT,
       .PipelineCache = VK_NULL_HANDLE,
       .Subpass = 0,
@@ -884,15 +1245,18 @@ namespace core
 
     bool graphics_family_found = false;
     bool present_family_found = false;
-    bool transfer_family_found = false;
 
     for (uint32_t idx = 0; idx < family_count; idx++)
     {
-      VkBool32 supported;
-      VkResult result = vkGetPhysicalDeviceSurfaceSupportKHR(device, idx, surface_, &supported);
+      // Headless frames never leave the graphics queue.
+      VkBool32 supported = family_properties[idx].queueFlags & VK_QUEUE_GRAPHICS_BIT;
+      if (!headless_)
+      {
+        VkResult result = vkGetPhysicalDeviceSurfaceSupportKHR(device, idx, surface_, &supported);
 
-      if (result != VK_SUCCESS)
-        throw std::runtime_error("failed to retrieve KHR surface support");
+        if (result != VK_SUCCESS)
+          throw std::runtime_error("failed to retrieve KHR surface support");
+      }
 
       if (supported)
       {
@@ -906,21 +1270,24 @@ namespace core
         graphics_family_found = true;
       }
 
-      if (family_properties[idx].queueFlags & VK_QUEUE_TRANSFER_BIT)
-      {
-        transfer_queue_family_ = idx;
-        transfer_family_found = true;
-      }
-
-      if (graphics_family_found && present_family_found && transfer_family_found)
+      if (graphics_family_found && present_family_found)
         break;
     }
 
+    // Uploads go through the graphics family on purpose. Their barriers use graphics stages
+    // (layout transitions for depth attachments, mip blits) and resources are exclusive with no
+    // ownership transfers, which only holds when both queues share a family. Graphics families
+    // always support transfers, even when they do not advertise VK_QUEUE_TRANSFER_BIT.
+    transfer_queue_family_ = graphics_queue_family_;
+
     return !graphics_family_found || !present_family_found;
   }
 
   bool Engine::required_extensions_not_supported(VkPhysicalDevice device)
   {
+    if (headless_)
+      return false;
+
     uint32_t extension_count;
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count, nullptr);
 
@@ -938,6 +1305,9 @@ namespace core
 
   bool Engine::swapchain_not_spported(VkPhysicalDevice device)
   {
+    if (headless_)
+      return false;
+
     uint32_t format_count;
     uint32_t present_mode_count;
     VkResult result =
@@ -1016,18 +1386,59 @@ namespace core
     if (vkDeviceWaitIdle(device_) != VK_SUCCESS)
       throw std::runtime_error("failed to wait idle for device");
 
-    for (size_t i = 0; i < swapchain_image_views_.size(); i++)
-      vkDestroyImageView(device_, swapchain_image_views_[i], nullptr);
-
+    destroy_swapchain_resources();
     vkDestroySwapchainKHR(device_, swapchain_, nullptr);
 
     create_swapchain();
     create_swapchain_resources();
+
+    // The scene targets follow the new extent.
+    render::Renderer::get_singleton().resize();
+  }
+
+  VkExtent2D Engine::get_render_extent() const
+  {
+    return {
+      std::max(static_cast<uint32_t>(swapchain_extent_.width * render_scale_), 1u),
+      std::max(static_cast<uint32_t>(swapchain_extent_.height * render_scale_), 1u),
+    };
   }
 
-  void Engine::transition_transfer_image_layout(VkImage image, VkFormat format,
-                                                uint32_t layer_count, VkImageLayout old_layout,
-                                                VkImageLayout new_layout) const
+  void Engine::set_frames_in_flight(uint32_t frame_count)
+  {
+    if (frame_count == 0 || frame_count > MAX_FRAMES_IN_FLIGHT)
+      throw std::invalid_argument("frames in flight must be between 1 and "
+                                  + std::to_string(MAX_FRAMES_IN_FLIGHT));
+
+    requested_frames_in_flight_ = frame_count;
+  }
+
+  void Engine::apply_frames_in_flight()
+  {
+    // Frames must keep reusing the context of the frame frames_in_flight_ before them, which
+    // only holds again once every context retired.
+    std::vector<VkFence> fences;
+    for (const auto& frame : frames_)
+      fences.push_back(frame.in_flight_fence);
+
+    VkResult result = vkWaitForFences(device_, fences.size(), fences.data(), VK_TRUE, UINT64_MAX);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to wait for fences");
+
+    // Contexts are about to be reused out of order, collect what they measured first.
+    Profiler::get_singleton().flush();
+
+    frames_in_flight_ = requested_frames_in_flight_;
+    current_frame_ = 0;
+
+    std::clog << frames_in_flight_ << " frames in flight\n";
+  }
+
+  void Engine::transition_transfer_image_layout(VkCommandBuffer command_buffer, VkImage image,
+                                                VkFormat format, uint32_t layer_count,
+                                                VkImageLayout old_layout,
+                                                VkImageLayout new_layout,
+                                                uint32_t level_count) const
   {
     VkAccessFlags src_access;
     VkAccessFlags dst_access;
@@ -1058,7 +1469,7 @@ namespace core
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
-      .levelCount = 1,
+      .levelCount = level_count,
       .baseArrayLayer = 0,
       .layerCount = layer_count,
     };
@@ -1076,52 +1487,165 @@ namespace core
       .subresourceRange = subresource_range,
     };
 
-    vkCmdPipelineBarrier(transfer_command_buffer_, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr,
-                         1, &image_memory_barrier);
+    vkCmdPipelineBarrier(command_buffer, src_stage, dst_stage, 0, 0, nullptr, 0, nullptr, 1,
+                         &image_memory_barrier);
   }
 
-  void Engine::render()
+  void Engine::record_mipmaps(VkCommandBuffer command_buffer, VkImage image, VkExtent3D extent,
+                              uint32_t layer_count, uint32_t mip_levels) const
   {
-    uint32_t image_index;
-    VkResult result =
-        vkWaitForFences(device_, 1, &in_flight_fences_[current_frame_], VK_TRUE, UINT64_MAX);
+    // The first level was just copied and is still in TRANSFER_DST.
+    VkImageMemoryBarrier barriers[2];
+    for (auto& barrier : barriers)
+      barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .pNext = nullptr,
+        .srcAccessMask = 0,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = {
+          .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+          .baseMipLevel = 0,
+          .levelCount = 1,
+          .baseArrayLayer = 0,
+          .layerCount = layer_count,
+        },
+      };
+
+    int32_t width = extent.width;
+    int32_t height = extent.height;
+
+    for (uint32_t level = 1; level < mip_levels; level++)
+    {
+      // The previous level becomes the blit source, this one the destination.
+      barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+      barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+      barriers[0].subresourceRange.baseMipLevel = level - 1;
+
+      barriers[1].srcAccessMask = 0;
+      barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+      barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+      barriers[1].subresourceRange.baseMipLevel = level;
+
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2,
+                           barriers);
+
+      int32_t next_width = std::max(width / 2, 1);
+      int32_t next_height = std::max(height / 2, 1);
+
+      const VkImageBlit blit = {
+        .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, layer_count },
+        .srcOffsets = { { 0, 0, 0 }, { width, height, 1 } },
+        .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, layer_count },
+        .dstOffsets = { { 0, 0, 0 }, { next_width, next_height, 1 } },
+      };
+
+      vkCmdBlitImage(command_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                     image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit,
+                     VK_FILTER_LINEAR);
+
+      width = next_width;
+      height = next_height;
+    }
+
+    // Every level but the last one ends up as a blit source.
+    barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[0].subresourceRange.baseMipLevel = 0;
+    barriers[0].subresourceRange.levelCount = mip_levels - 1;
+
+    barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[1].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barriers[1].subresourceRange.baseMipLevel = mip_levels - 1;
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 2,
+                         barriers);
+  }
+
+  void Engine::wait_for_frame()
+  {
+    if (requested_frames_in_flight_ != frames_in_flight_)
+      apply_frames_in_flight();
+
+    CpuScope scope("wait for frame");
+    VkResult result = vkWaitForFences(device_, 1, &frames_[current_frame_].in_flight_fence,
+                                      VK_TRUE, UINT64_MAX);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to wait for fences");
+  }
 
-    result = vkAcquireNextImageKHR(device_, swapchain_, UINT64_MAX,
-                                   image_available_semaphores_[current_frame_], VK_NULL_HANDLE,
-                                   &image_index);
-    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+  void Engine::render()
+  {
+    // Returns right away when the loop already waited before polling input.
+    wait_for_frame();
+
+    auto& frame = frames_[current_frame_];
+
+    // Offscreen images belong to the frame contexts, there is nothing to acquire.
+    uint32_t image_index = current_frame_;
+    VkResult result;
+
+    auto& transfer_queue = TransferQueue::get_singleton();
+    transfer_queue.poll();
+    StagingBuffer::get_singleton().reclaim();
+    DeletionQueue::get_singleton().flush();
+    CommandPools::get_singleton().reset();
+    AssetManager::get_singleton().update();
+
+    if (!headless_)
     {
-      replace_swapchain();
-      return;
+      TraceScope scope("acquire");
+      result = vkAcquireNextImageKHR(device_, swapchain_, UINT64_MAX,
+                                     frame.image_available_semaphore, VK_NULL_HANDLE,
+                                     &image_index);
+      if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+      {
+        replace_swapchain();
+        return;
+      }
+      else if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to acquire next image");
     }
-    else if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to acquire next image");
 
-    result = vkResetFences(device_, 1, &in_flight_fences_[current_frame_]);
+    result = vkResetFences(device_, 1, &frame.in_flight_fence);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to reset fences");
 
     auto& renderer = render::Renderer::get_singleton();
     auto image_view = swapchain_image_views_[image_index];
-    auto command_buffer = graphics_command_buffers_[image_index];
+    auto command_buffer = frame.command_buffer;
 
     const VkCommandBufferBeginInfo command_buffer_begin_info = {
       .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
       .pNext = nullptr,
-      .flags = 0,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
       .pInheritanceInfo = nullptr,
     };
 
-    result = vkResetCommandBuffer(command_buffer, 0);
+    result = vkResetCommandPool(device_, frame.command_pool, 0);
     if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to reset command buffer");
+      throw std::runtime_error("failed to reset command pool");
 
     result = vkBeginCommandBuffer(command_buffer, &command_buffer_begin_info);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to begin command buffer recording");
 
+    auto& profiler = Profiler::get_singleton();
+    profiler.begin_frame(command_buffer);
+
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
@@ -1148,11 +1672,16 @@ namespace core
                          1, &image_memory_barrier1);
 
     ImGui_ImplVulkan_NewFrame();
-    ImGui_ImplSDL3_NewFrame();
+    if (!headless_)
+      ImGui_ImplSDL3_NewFrame();
     ImGui::NewFrame();
 
-    renderer.draw(image_view, command_buffer);
+    {
+      CpuScope scope("draw");
+      renderer.draw(swapchain_images_[image_index], image_view, command_buffer);
+    }
 
+    profiler.draw_overlay();
     ImGui::Render();
 
     const VkRenderingAttachmentInfo color_attachment = {
@@ -1179,17 +1708,21 @@ namespace core
       .pStencilAttachment = nullptr
     };
 
+    uint32_t imgui_query = profiler.begin_gpu(command_buffer, "imgui");
     vkCmdBeginRendering(command_buffer, &rendering_info);
     ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), command_buffer);
     vkCmdEndRendering(command_buffer);
+    profiler.end_gpu(command_buffer, imgui_query);
 
+    // Offscreen images are left ready to be read back.
     const VkImageMemoryBarrier image_memory_barrier2 = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
       .pNext = nullptr,
       .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-      .dstAccessMask = 0,
+      .dstAccessMask = headless_ ? VK_ACCESS_TRANSFER_READ_BIT : VK_ACCESS_NONE,
       .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-      .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+      .newLayout = headless_ ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                             : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
       .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
       .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
       .image = swapchain_images_[image_index],
@@ -1197,39 +1730,80 @@ namespace core
     };
 
     vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                         &image_memory_barrier2);
+                         headless_ ? VK_PIPELINE_STAGE_TRANSFER_BIT
+                                   : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                         0, 0, nullptr, 0, nullptr, 1, &image_memory_barrier2);
 
+    profiler.end_frame(command_buffer);
     vkEndCommandBuffer(command_buffer);
 
+    // Everything recorded for upload this frame goes out in one batch the frame waits on.
+    transfer_queue.submit();
+    TransferTicket transfer_ticket = transfer_queue.consume_graphics_wait();
+
+    // Headless frames skip the image available semaphore, the first entry.
+    uint32_t first_wait = headless_ ? 1 : 0;
+    uint32_t wait_semaphore_count = (transfer_ticket ? 2 : 1) - first_wait;
+
+    const VkSemaphore wait_semaphores[] = {
+      frame.image_available_semaphore,
+      transfer_queue.get_timeline_semaphore(),
+    };
+
+    const uint64_t wait_values[] = { 0, transfer_ticket };
+
     const VkPipelineStageFlags wait_stages[] = {
       VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+    };
+
+    const VkTimelineSemaphoreSubmitInfo timeline_submit_info = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .pNext = nullptr,
+      .waitSemaphoreValueCount = wait_semaphore_count,
+      .pWaitSemaphoreValues = wait_values + first_wait,
+      .signalSemaphoreValueCount = 0,
+      .pSignalSemaphoreValues = nullptr,
     };
 
     const VkSubmitInfo submit_info = {
       .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-      .pNext = nullptr,
-      .waitSemaphoreCount = 1,
-      .pWaitSemaphores = &image_available_semaphores_[current_frame_],
-      .pWaitDstStageMask = wait_stages,
+      .pNext = &timeline_submit_info,
+      .waitSemaphoreCount = wait_semaphore_count,
+      .pWaitSemaphores = wait_semaphores + first_wait,
+      .pWaitDstStageMask = wait_stages + first_wait,
       .commandBufferCount = 1,
-      .pCommandBuffers = &graphics_command_buffers_[image_index],
-      .signalSemaphoreCount = 1,
-      .pSignalSemaphores = &render_finished_semaphores_[current_frame_],
+      .pCommandBuffers = &command_buffer,
+      .signalSemaphoreCount = headless_ ? 0u : 1u,
+      .pSignalSemaphores = headless_ ? nullptr : &render_finished_semaphores_[image_index],
     };
 
     VkQueue graphics_queue;
     vkGetDeviceQueue(device_, graphics_queue_family_, 0, &graphics_queue);
 
-    result = vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences_[current_frame_]);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to submit");
+    {
+      TraceScope scope("submit");
+      result = vkQueueSubmit(graphics_queue, 1, &submit_info, frame.in_flight_fence);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to submit");
+    }
+
+    last_image_index_ = image_index;
+    current_frame_ = (current_frame_ + 1) % frames_in_flight_;
+    frame_number_++;
+
+    auto& frame_pacer = FramePacer::get_singleton();
+    if (headless_)
+    {
+      frame_pacer.mark_present();
+      return;
+    }
 
     const VkPresentInfoKHR present_info = {
       .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
       .pNext = nullptr,
       .waitSemaphoreCount = 1,
-      .pWaitSemaphores = &render_finished_semaphores_[current_frame_],
+      .pWaitSemaphores = &render_finished_semaphores_[image_index],
       .swapchainCount = 1,
       .pSwapchains = &swapchain_,
       .pImageIndices = &image_index,
@@ -1239,12 +1813,15 @@ namespace core
     VkQueue present_queue;
     vkGetDeviceQueue(device_, present_queue_family_, 0, &present_queue);
 
-    result = vkQueuePresentKHR(present_queue, &present_info);
+    {
+      TraceScope scope("present");
+      result = vkQueuePresentKHR(present_queue, &present_info);
+    }
+    frame_pacer.mark_present();
+
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
       replace_swapchain();
     else if (result != VK_SUCCESS)
       throw std::runtime_error("failed to present");
-
-    current_frame_ = (current_frame_ + 1) % MAX_FRAMES_IN_FLIGHT;
   }
 } // namespace core
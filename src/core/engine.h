@@ -1,5 +1,6 @@
 #pragma once
 
+#include <span>
 #include <string>
 #include <vector>
 
@@ -8,9 +9,15 @@
 #include <imgui_impl_sdl3.h>
 #include <vulkan/vulkan.h>
 
+#include "core/memory-allocator.h"
+#include "core/transfer-queue.h"
 #include "misc/singleton.h"
 
-#define MAX_FRAMES_IN_FLIGHT 3
+#define MAX_FRAMES_IN_FLIGHT 4
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define DEFAULT_BENCHMARK_FRAMES 1000
+#define HEADLESS_WIDTH 800
+#define HEADLESS_HEIGHT 600
 
 namespace core
 {
@@ -38,35 +45,88 @@ namespace core
     void init(int argc, char* argv[]);
     void loop();
     void quit();
+    /// Render frame_count frames as fast as possible and return the average frame time in ms.
+    double benchmark(uint32_t frame_count);
 
     void create_buffer(const VkBufferCreateInfo& create_info, VkMemoryPropertyFlags properties,
-                       VkBuffer& buffer, VkDeviceMemory& memory) const;
+                       VkBuffer& buffer, Allocation& allocation,
+                       MemoryLifetime lifetime = MemoryLifetime::persistent) const;
     void create_image(const VkImageCreateInfo& image_create_info, VkMemoryPropertyFlags properties,
-                      VkImage& image, VkDeviceMemory& memory);
+                      VkImage& image, Allocation& allocation,
+                      MemoryLifetime lifetime = MemoryLifetime::persistent) const;
+    void destroy_buffer(VkBuffer buffer, const Allocation& allocation) const;
+    void destroy_image(VkImage image, const Allocation& allocation);
     uint32_t find_memory_type(uint32_t required_memory_type, VkMemoryPropertyFlags flags) const;
-    void transfer_image(VkImage image, VkOffset3D offset, VkExtent3D extent, uint32_t layer_count,
-                        VkBuffer buffer) const;
-    void transition_image_layout(VkImage image, VkFormat format, uint32_t layer_count,
-                                 TransitionLayout transition_layout) const;
-    void clear_depth_image(VkImage depth_image, uint32_t layer_count) const;
+    /// Full mip chain length for an image, or 1 when mipmaps are disabled or the format cannot
+    /// be blitted with linear filtering.
+    uint32_t get_mip_levels(VkFormat format, VkExtent3D extent) const;
+    /// Upload the first mip level. With several levels, the rest is blitted in the same
+    /// submission, every level is sampleable once the ticket is reached.
+    TransferTicket transfer_image(VkImage image, VkOffset3D offset, VkExtent3D extent,
+                                  uint32_t layer_count, VkBuffer buffer, VkDeviceSize buffer_offset,
+                                  uint32_t mip_levels = 1);
+    /// Upload precomputed mip levels, one region per level and layer.
+    TransferTicket transfer_image_levels(VkImage image, VkBuffer buffer,
+                                         std::span<const VkBufferImageCopy> regions,
+                                         uint32_t layer_count, uint32_t mip_levels) const;
+    TransferTicket copy_buffer(VkBuffer src_buffer, VkDeviceSize src_offset, VkBuffer dst_buffer,
+                               VkDeviceSize dst_offset, VkDeviceSize size) const;
+    TransferTicket transition_image_layout(VkImage image, VkFormat format, uint32_t layer_count,
+                                           TransitionLayout transition_layout) const;
+    TransferTicket clear_depth_image(VkImage depth_image, uint32_t layer_count) const;
+
+    /// Copy the last rendered frame back to the host, tightly packed RGBA rows. Only offscreen
+    /// images can be read back, so this requires headless mode.
+    std::vector<uint8_t> read_frame();
+    /// Write the last rendered frame as a binary PPM image.
+    void save_frame(const std::string& path);
 
     SDL_Window* get_window() const;
+    VkPhysicalDevice get_physical_device() const;
     VkDevice get_device() const;
     VkExtent2D get_swapchain_extent() const;
+    /// Extent of the scene passes, the swapchain extent scaled by the render scale.
+    VkExtent2D get_render_extent() const;
+    float get_render_scale() const;
     VkSurfaceFormatKHR get_surface_format() const;
+    /// Index of the frame context being recorded, below get_frames_in_flight().
     uint32_t get_current_frame() const;
+    uint32_t get_frames_in_flight() const;
+    /// Fewer frames in flight lower the input latency, more let the CPU run further ahead of
+    /// the GPU. Takes effect at the start of the next frame, between 1 and MAX_FRAMES_IN_FLIGHT.
+    void set_frames_in_flight(uint32_t frame_count);
+    /// Number of frames submitted so far.
+    uint64_t get_frame_number() const;
+    uint32_t get_graphics_queue_family() const;
+    const VkPhysicalDeviceFeatures& get_enabled_features() const;
+    /// The graphics family, uploads share its queue to avoid ownership transfers.
+    uint32_t get_transfer_queue_family() const;
+    uint32_t get_benchmark_frames() const;
+    bool is_mipmapping() const;
+    bool is_headless() const;
 
   private:
+    /// What a frame owns while it is in flight, reused once its fence signaled.
+    struct FrameContext
+    {
+      VkCommandPool command_pool;
+      VkCommandBuffer command_buffer;
+      VkFence in_flight_fence;
+      VkSemaphore image_available_semaphore;
+    };
+
+    void parse_arguments(int argc, char* argv[]);
     void create_window();
     void create_instance();
     void create_surface();
     void create_device();
     void create_swapchain();
     void create_swapchain_resources();
-    void create_command_pools();
-    void allocate_command_buffers();
-    void create_fences();
-    void create_semaphores();
+    void create_frame_contexts();
+    /// Stand-ins for the swapchain images when there is no window to present to.
+    void create_offscreen_images();
+    VkPresentModeKHR choose_present_mode() const;
+    const char* get_present_mode_name(VkPresentModeKHR present_mode) const;
     void init_imgui();
 
     void choose_physical_device(std::vector<VkPhysicalDevice> physical_devices);
@@ -77,12 +137,21 @@ namespace core
     int calculate_device_properties_score(VkPhysicalDeviceProperties properties);
     void create_image_view(size_t index);
     void replace_swapchain();
-    void transition_transfer_image_layout(VkImage image, VkFormat format, uint32_t layer_count,
-                                          VkImageLayout old_layout, VkImageLayout new_layout) const;
+    void destroy_swapchain_resources();
+    /// Wait for every frame in flight before switching to the requested frame count.
+    void apply_frames_in_flight();
+    void transition_transfer_image_layout(VkCommandBuffer command_buffer, VkImage image,
+                                          VkFormat format, uint32_t layer_count,
+                                          VkImageLayout old_layout, VkImageLayout new_layout,
+                                          uint32_t level_count = 1) const;
+    void record_mipmaps(VkCommandBuffer command_buffer, VkImage image, VkExtent3D extent,
+                        uint32_t layer_count, uint32_t mip_levels) const;
 
+    /// Wait until the context of the next frame can be reused.
+    void wait_for_frame();
     void render();
 
-    SDL_Window* window_;
+    SDL_Window* window_ = nullptr;
     ImGuiContext* context_;
     VkInstance instance_ = VK_NULL_HANDLE;
     VkSurfaceKHR surface_ = VK_NULL_HANDLE;
@@ -98,16 +167,42 @@ namespace core
     VkSwapchainKHR swapchain_ = VK_NULL_HANDLE;
     std::vector<VkImage> swapchain_images_;
     std::vector<VkImageView> swapchain_image_views_;
-    VkCommandPool graphics_command_pool_ = VK_NULL_HANDLE;
-    VkCommandPool transfer_command_pool_ = VK_NULL_HANDLE;
-    std::vector<VkCommandBuffer> graphics_command_buffers_;
-    VkCommandBuffer transfer_command_buffer_;
-    std::vector<VkFence> in_flight_fences_;
-    VkFence transfer_fence_ = VK_NULL_HANDLE;
-    std::vector<VkSemaphore> image_available_semaphores_;
+    /// Backing memory of the swapchain images in headless mode, one image per frame in flight.
+    std::vector<Allocation> offscreen_allocations_;
+    /// Image the last submitted frame rendered to.
+    uint32_t last_image_index_ = 0;
+    /// One per swapchain image, presentation may still wait on it after the frame retired.
     std::vector<VkSemaphore> render_finished_semaphores_;
+    std::vector<FrameContext> frames_;
     VkDescriptorPool imgui_descriptor_pool_ = VK_NULL_HANDLE;
     uint32_t current_frame_ = 0;
+    uint32_t frames_in_flight_ = DEFAULT_FRAMES_IN_FLIGHT;
+    uint32_t requested_frames_in_flight_ = DEFAULT_FRAMES_IN_FLIGHT;
+    uint64_t frame_number_ = 0;
+    uint32_t benchmark_frames_ = 0;
+    /// Worker threads besides the main one, 0 uses every hardware thread.
+    uint32_t thread_count_ = 0;
+    bool mipmapping_ = true;
+    /// Texture cache budget in bytes, 0 uses ASSET_MEMORY_BUDGET.
+    VkDeviceSize texture_budget_ = 0;
+    VkPresentModeKHR present_mode_ = VK_PRESENT_MODE_FIFO_KHR;
+    bool present_mode_requested_ = false;
+    /// Swapchain images to ask for, 0 uses one more than the surface minimum.
+    uint32_t swapchain_image_count_ = 0;
+    /// Frames per second cap, 0 leaves the frame rate unlimited.
+    double frame_rate_limit_ = 0.0;
+    /// Frames to render before quitting on its own, 0 runs until the window is closed.
+    uint32_t frame_limit_ = 0;
+    /// Render offscreen, without a window, surface or swapchain.
+    bool headless_ = false;
+    /// Scene passes run at this fraction of the swapchain extent and are blitted to it.
+    float render_scale_ = 1.0f;
+    /// Where to save the last frame on exit, empty to skip the capture.
+    std::string capture_path_;
+    /// Where to export the per frame profile on exit, empty to skip the export.
+    std::string profile_path_;
+    /// Record a trace from the start and save it there on exit, empty to only record on demand.
+    std::string trace_path_;
   };
 } // namespace core
 
@@ -3,8 +3,21 @@
 namespace core
 {
   inline SDL_Window* Engine::get_window() const { return window_; }
+  inline VkPhysicalDevice Engine::get_physical_device() const { return physical_device_; }
   inline VkDevice Engine::get_device() const { return device_; }
   inline VkExtent2D Engine::get_swapchain_extent() const { return swapchain_extent_; }
+  inline float Engine::get_render_scale() const { return render_scale_; }
   inline VkSurfaceFormatKHR Engine::get_surface_format() const { return surface_format_; }
   inline uint32_t Engine::get_current_frame() const { return current_frame_; }
+  inline uint32_t Engine::get_frames_in_flight() const { return frames_in_flight_; }
+  inline uint64_t Engine::get_frame_number() const { return frame_number_; }
+  inline uint32_t Engine::get_graphics_queue_family() const { return graphics_queue_family_; }
+  inline const VkPhysicalDeviceFeatures& Engine::get_enabled_features() const
+  {
+    return enabled_features_;
+  }
+  inline uint32_t Engine::get_transfer_queue_family() const { return transfer_queue_family_; }
+  inline uint32_t Engine::get_benchmark_frames() const { return benchmark_frames_; }
+  inline bool Engine::is_mipmapping() const { return mipmapping_; }
+  inline bool Engine::is_headless() const { return headless_; }
 } // namespace core
@@ -0,0 +1,113 @@
+#include "core/frame-pacer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+namespace core
+{
+  void FramePacer::init(double frame_rate)
+  {
+    frame_rate_ = frame_rate;
+    frame_interval_ = clock::duration::zero();
+    if (frame_rate > 0.0)
+    {
+      std::chrono::duration<double> interval(1.0 / frame_rate);
+      frame_interval_ = std::chrono::duration_cast<clock::duration>(interval);
+    }
+
+    next_frame_ = clock::now();
+    reset();
+  }
+
+  void FramePacer::wait()
+  {
+    if (frame_interval_ == clock::duration::zero())
+      return;
+
+    auto now = clock::now();
+    if (now < next_frame_)
+      std::this_thread::sleep_until(next_frame_);
+
+    // A frame that ran late pushes the schedule back instead of letting the next ones catch up
+    // in a burst.
+    next_frame_ = std::max(next_frame_, now) + frame_interval_;
+  }
+
+  void FramePacer::mark_input() { input_time_ = clock::now(); }
+
+  void FramePacer::mark_present()
+  {
+    using milliseconds = std::chrono::duration<double, std::milli>;
+
+    auto now = clock::now();
+
+    if (frame_count_ != 0)
+      record(intervals_, milliseconds(now - last_present_).count());
+    record(latencies_, milliseconds(now - input_time_).count());
+
+    last_present_ = now;
+    frame_count_++;
+  }
+
+  void FramePacer::reset()
+  {
+    frame_count_ = 0;
+    intervals_.clear();
+    latencies_.clear();
+  }
+
+  PacingStats FramePacer::get_stats() const
+  {
+    PacingStats stats = {
+      .frame_count = frame_count_,
+      .average_interval = 0.0,
+      .p99_interval = 0.0,
+      .max_interval = 0.0,
+      .jitter = 0.0,
+      .average_latency = 0.0,
+      .p99_latency = 0.0,
+    };
+
+    if (!intervals_.empty())
+    {
+      stats.average_interval =
+          std::accumulate(intervals_.begin(), intervals_.end(), 0.0) / intervals_.size();
+      stats.p99_interval = get_percentile(intervals_, 0.99);
+      stats.max_interval = *std::max_element(intervals_.begin(), intervals_.end());
+
+      double variance = 0.0;
+      for (auto interval : intervals_)
+        variance += (interval - stats.average_interval) * (interval - stats.average_interval);
+      stats.jitter = std::sqrt(variance / intervals_.size());
+    }
+
+    if (!latencies_.empty())
+    {
+      stats.average_latency =
+          std::accumulate(latencies_.begin(), latencies_.end(), 0.0) / latencies_.size();
+      stats.p99_latency = get_percentile(latencies_, 0.99);
+    }
+
+    return stats;
+  }
+
+  void FramePacer::record(std::deque<double>& samples, double sample)
+  {
+    if (samples.size() == PACING_SAMPLE_COUNT)
+      samples.pop_front();
+
+    samples.push_back(sample);
+  }
+
+  double FramePacer::get_percentile(const std::deque<double>& samples, double percentile) const
+  {
+    std::vector<double> sorted(samples.begin(), samples.end());
+    auto nth = sorted.begin() + static_cast<size_t>(percentile * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), nth, sorted.end());
+
+    return *nth;
+  }
+} // namespace core
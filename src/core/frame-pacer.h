@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+#include "misc/singleton.h"
+
+#define PACING_SAMPLE_COUNT 10000
+
+namespace core
+{
+  /// Frame time and latency distribution over the recent frames, in milliseconds.
+  struct PacingStats
+  {
+    uint64_t frame_count;
+    double average_interval;
+    double p99_interval;
+    double max_interval;
+    /// Standard deviation of the frame interval, how uneven the frames are delivered.
+    double jitter;
+    /// Input to queue present, the wait for scanout is not included.
+    double average_latency;
+    double p99_latency;
+  };
+
+  /// Caps the frame rate and measures the pacing actually achieved. Latency runs from the
+  /// moment input is polled for a frame to the moment vkQueuePresentKHR returns for it, which
+  /// is before the image reaches the display.
+  class FramePacer : public misc::Singleton<FramePacer>
+  {
+    // Give Singleton<FramePacer> access to FramePacer’s private constructor
+    friend class Singleton<FramePacer>;
+
+  private:
+    /// Construct a FramePacer.
+    FramePacer() = default;
+
+  public:
+    /// Limit to frame_rate frames per second, 0 leaves the frame rate unlimited.
+    void init(double frame_rate);
+
+    /// Sleep until the next frame is due. Sleeping before input is polled, rather than after
+    /// the frame was rendered, keeps the input fresh.
+    void wait();
+    void mark_input();
+    void mark_present();
+    void reset();
+
+    PacingStats get_stats() const;
+    double get_frame_rate() const;
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    void record(std::deque<double>& samples, double sample);
+    double get_percentile(const std::deque<double>& samples, double percentile) const;
+
+    double frame_rate_ = 0.0;
+    clock::duration frame_interval_ = clock::duration::zero();
+    clock::time_point next_frame_;
+    clock::time_point input_time_;
+    clock::time_point last_present_;
+    uint64_t frame_count_ = 0;
+    /// The last PACING_SAMPLE_COUNT samples of each.
+    std::deque<double> intervals_;
+    std::deque<double> latencies_;
+  };
+} // namespace core
+
+#include "core/frame-pacer.hxx"
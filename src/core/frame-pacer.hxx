@@ -0,0 +1,6 @@
+#include "core/frame-pacer.h"
+
+namespace core
+{
+  inline double FramePacer::get_frame_rate() const { return frame_rate_; }
+} // namespace core
@@ -0,0 +1,326 @@
+#include "core/memory-allocator.h"
+
+#include <algorithm>
+#include <bit>
+#include <iostream>
+#include <stdexcept>
+
+#include "core/engine.h"
+
+namespace core
+{
+  void MemoryAllocator::init()
+  {
+    auto& engine = Engine::get_singleton();
+    device_ = engine.get_device();
+
+    vkGetPhysicalDeviceMemoryProperties(engine.get_physical_device(), &memory_properties_);
+
+    // Small heaps (e.g. the BAR window) get blocks they can hold several of.
+    block_size_ = MEMORY_BLOCK_SIZE;
+    for (uint32_t i = 0; i < memory_properties_.memoryHeapCount; i++)
+    {
+      VkDeviceSize heap_block_size = std::bit_floor(memory_properties_.memoryHeaps[i].size / 8);
+      block_size_ = std::max<VkDeviceSize>(std::min(block_size_, heap_block_size), 1024 * 1024);
+    }
+
+    max_order_ = std::countr_zero(block_size_ / MEMORY_MIN_ALLOCATION_SIZE);
+  }
+
+  void MemoryAllocator::free()
+  {
+    std::lock_guard lock(mutex_);
+
+    if (stats_.allocation_count != 0)
+      std::clog << "memory allocator: " << stats_.allocation_count
+                << " allocations still alive at shutdown\n";
+
+    for (auto& pool : pools_)
+    {
+      for (auto& block : pool.buddy_blocks)
+        if (block.memory != VK_NULL_HANDLE)
+          free_memory(block.memory, block_size_);
+
+      for (auto& block : pool.linear_blocks)
+        if (block.memory != VK_NULL_HANDLE)
+          free_memory(block.memory, block.size);
+
+      pool.buddy_blocks.clear();
+      pool.linear_blocks.clear();
+    }
+
+    stats_ = {};
+  }
+
+  Allocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements,
+                                       VkMemoryPropertyFlags properties, bool optimal_image,
+                                       MemoryLifetime lifetime)
+  {
+    auto& engine = Engine::get_singleton();
+    uint32_t memory_type = engine.find_memory_type(requirements.memoryTypeBits, properties);
+
+    std::lock_guard lock(mutex_);
+
+    Allocation allocation;
+    allocation.size = requirements.size;
+    allocation.lifetime = lifetime;
+    // Buffers and optimal images never share a block, which keeps bufferImageGranularity out
+    // of the picture.
+    allocation.pool = memory_type * 2 + (optimal_image ? 1 : 0);
+
+    auto& pool = pools_[allocation.pool];
+    VkDeviceSize reserved_size =
+        std::bit_ceil(std::max<VkDeviceSize>({ requirements.size, requirements.alignment,
+                                               MEMORY_MIN_ALLOCATION_SIZE }));
+
+    if (reserved_size > block_size_ / 2)
+    {
+      char* data;
+      allocation.memory = allocate_memory(memory_type, requirements.size, data);
+      allocation.data = data;
+      allocation.reserved_size = requirements.size;
+      allocation.dedicated = true;
+
+      stats_.dedicated_count++;
+    }
+    else if (lifetime == MemoryLifetime::transient)
+    {
+      uint32_t index = 0;
+      VkDeviceSize offset = 0;
+
+      for (; index < pool.linear_blocks.size(); index++)
+      {
+        auto& block = pool.linear_blocks[index];
+        offset = (block.head + requirements.alignment - 1) / requirements.alignment
+            * requirements.alignment;
+
+        if (block.memory != VK_NULL_HANDLE && offset + requirements.size <= block.size)
+          break;
+      }
+
+      if (index == pool.linear_blocks.size())
+      {
+        auto it = std::find_if(pool.linear_blocks.begin(), pool.linear_blocks.end(),
+                               [](const auto& b) { return b.memory == VK_NULL_HANDLE; });
+        index = std::distance(pool.linear_blocks.begin(), it);
+        if (it == pool.linear_blocks.end())
+          pool.linear_blocks.emplace_back();
+
+        auto& block = pool.linear_blocks[index];
+        block.size = block_size_;
+        block.memory = allocate_memory(memory_type, block.size, block.data);
+        offset = 0;
+
+        stats_.block_count++;
+      }
+
+      auto& block = pool.linear_blocks[index];
+      allocation.memory = block.memory;
+      allocation.offset = offset;
+      allocation.data = block.data ? block.data + offset : nullptr;
+      allocation.reserved_size = offset + requirements.size - block.head;
+      allocation.block = index;
+
+      block.head = offset + requirements.size;
+      block.allocation_count++;
+    }
+    else
+    {
+      uint32_t order = get_order(reserved_size);
+      uint32_t index = 0;
+      VkDeviceSize offset = 0;
+
+      for (; index < pool.buddy_blocks.size(); index++)
+      {
+        auto& block = pool.buddy_blocks[index];
+        if (block.memory != VK_NULL_HANDLE && allocate_buddy(block, order, offset))
+          break;
+      }
+
+      if (index == pool.buddy_blocks.size())
+      {
+        // Reuse the slot of a released block so that block indices stay stable.
+        auto it = std::find_if(pool.buddy_blocks.begin(), pool.buddy_blocks.end(),
+                               [](const auto& b) { return b.memory == VK_NULL_HANDLE; });
+        index = std::distance(pool.buddy_blocks.begin(), it);
+        if (it == pool.buddy_blocks.end())
+          pool.buddy_blocks.emplace_back();
+
+        auto& block = pool.buddy_blocks[index];
+        block.memory = allocate_memory(memory_type, block_size_, block.data);
+        block.free_lists.assign(max_order_ + 1, {});
+        block.free_lists[max_order_].insert(0);
+        allocate_buddy(block, order, offset);
+
+        stats_.block_count++;
+      }
+
+      auto& block = pool.buddy_blocks[index];
+      allocation.memory = block.memory;
+      allocation.offset = offset;
+      allocation.data = block.data ? block.data + offset : nullptr;
+      allocation.reserved_size = reserved_size;
+      allocation.block = index;
+    }
+
+    stats_.used_bytes += allocation.size;
+    stats_.wasted_bytes += allocation.reserved_size - allocation.size;
+    stats_.allocation_count++;
+
+    return allocation;
+  }
+
+  void MemoryAllocator::deallocate(const Allocation& allocation)
+  {
+    if (allocation.memory == VK_NULL_HANDLE)
+      return;
+
+    std::lock_guard lock(mutex_);
+    auto& pool = pools_[allocation.pool];
+
+    if (allocation.dedicated)
+    {
+      free_memory(allocation.memory, allocation.size);
+      stats_.dedicated_count--;
+    }
+    else if (allocation.lifetime == MemoryLifetime::transient)
+    {
+      auto& block = pool.linear_blocks[allocation.block];
+
+      // Transient memory is only recycled once everything in the block is gone.
+      if (--block.allocation_count == 0)
+      {
+        block.head = 0;
+
+        auto live_blocks = std::count_if(pool.linear_blocks.begin(), pool.linear_blocks.end(),
+                                         [](const auto& b) { return b.memory != VK_NULL_HANDLE; });
+        if (live_blocks > 1)
+        {
+          free_memory(block.memory, block.size);
+          block = LinearBlock();
+          stats_.block_count--;
+        }
+      }
+    }
+    else
+    {
+      auto& block = pool.buddy_blocks[allocation.block];
+      free_buddy(block, allocation.offset);
+
+      bool empty = block.free_lists[max_order_].size() == 1;
+      auto live_blocks = std::count_if(pool.buddy_blocks.begin(), pool.buddy_blocks.end(),
+                                       [](const auto& b) { return b.memory != VK_NULL_HANDLE; });
+
+      // Keep one empty block around so that a single resource being recreated does not hit
+      // vkAllocateMemory every time.
+      if (empty && live_blocks > 1)
+      {
+        free_memory(block.memory, block_size_);
+        block = BuddyBlock();
+        stats_.block_count--;
+      }
+    }
+
+    stats_.used_bytes -= allocation.size;
+    stats_.wasted_bytes -= allocation.reserved_size - allocation.size;
+    stats_.allocation_count--;
+  }
+
+  bool MemoryAllocator::allocate_buddy(BuddyBlock& block, uint32_t order, VkDeviceSize& offset)
+  {
+    uint32_t current = order;
+    while (current <= max_order_ && block.free_lists[current].empty())
+      current++;
+
+    if (current > max_order_)
+      return false;
+
+    offset = *block.free_lists[current].begin();
+    block.free_lists[current].erase(block.free_lists[current].begin());
+
+    // Split down to the requested order, returning the upper halves to the free lists.
+    while (current > order)
+    {
+      current--;
+      block.free_lists[current].insert(offset + get_order_size(current));
+    }
+
+    block.orders[offset] = order;
+    return true;
+  }
+
+  void MemoryAllocator::free_buddy(BuddyBlock& block, VkDeviceSize offset)
+  {
+    auto it = block.orders.find(offset);
+    if (it == block.orders.end())
+      throw std::invalid_argument("freeing memory that was not allocated");
+
+    uint32_t order = it->second;
+    block.orders.erase(it);
+
+    // Merge with the buddy as long as it is free as well.
+    while (order < max_order_)
+    {
+      VkDeviceSize buddy = offset ^ get_order_size(order);
+      auto buddy_it = block.free_lists[order].find(buddy);
+      if (buddy_it == block.free_lists[order].end())
+        break;
+
+      block.free_lists[order].erase(buddy_it);
+      offset = std::min(offset, buddy);
+      order++;
+    }
+
+    block.free_lists[order].insert(offset);
+  }
+
+  VkDeviceMemory MemoryAllocator::allocate_memory(uint32_t memory_type, VkDeviceSize size,
+                                                  char*& data)
+  {
+    const VkMemoryAllocateInfo allocate_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .allocationSize = size,
+      .memoryTypeIndex = memory_type,
+    };
+
+    VkDeviceMemory memory;
+    VkResult result = vkAllocateMemory(device_, &allocate_info, nullptr, &memory);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate device memory");
+
+    data = nullptr;
+    auto flags = memory_properties_.memoryTypes[memory_type].propertyFlags;
+
+    // Host visible blocks stay mapped, sub-allocations only offset into them.
+    if (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+      void* mapped;
+      result = vkMapMemory(device_, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to map device memory");
+
+      data = static_cast<char*>(mapped);
+    }
+
+    stats_.reserved_bytes += size;
+    return memory;
+  }
+
+  void MemoryAllocator::free_memory(VkDeviceMemory memory, VkDeviceSize size)
+  {
+    // Freeing implicitly unmaps host visible blocks.
+    vkFreeMemory(device_, memory, nullptr);
+    stats_.reserved_bytes -= size;
+  }
+
+  uint32_t MemoryAllocator::get_order(VkDeviceSize size) const
+  {
+    return std::countr_zero(size / MEMORY_MIN_ALLOCATION_SIZE);
+  }
+
+  VkDeviceSize MemoryAllocator::get_order_size(uint32_t order) const
+  {
+    return static_cast<VkDeviceSize>(MEMORY_MIN_ALLOCATION_SIZE) << order;
+  }
+} // namespace core
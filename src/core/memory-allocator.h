@@ -0,0 +1,111 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "misc/singleton.h"
+
+#define MEMORY_BLOCK_SIZE (64 * 1024 * 1024)
+#define MEMORY_MIN_ALLOCATION_SIZE 256
+
+namespace core
+{
+  enum class MemoryLifetime
+  {
+    persistent,
+    transient,
+  };
+
+  struct Allocation
+  {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    /// Host pointer to the allocation, null unless the memory is host visible.
+    void* data = nullptr;
+
+    VkDeviceSize reserved_size = 0;
+    uint32_t pool = 0;
+    uint32_t block = 0;
+    MemoryLifetime lifetime = MemoryLifetime::persistent;
+    bool dedicated = false;
+  };
+
+  struct MemoryStats
+  {
+    VkDeviceSize reserved_bytes;
+    VkDeviceSize used_bytes;
+    VkDeviceSize wasted_bytes;
+    uint32_t block_count;
+    uint32_t dedicated_count;
+    uint32_t allocation_count;
+  };
+
+  class MemoryAllocator : public misc::Singleton<MemoryAllocator>
+  {
+    // Give Singleton<MemoryAllocator> access to MemoryAllocator’s private constructor
+    friend class Singleton<MemoryAllocator>;
+
+  private:
+    /// Construct a MemoryAllocator.
+    MemoryAllocator() = default;
+
+  public:
+    void init();
+    void free();
+
+    /// Sub-allocate memory, persistent requests from buddy blocks and transient ones linearly.
+    Allocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties,
+                        bool optimal_image, MemoryLifetime lifetime);
+    void deallocate(const Allocation& allocation);
+
+    MemoryStats get_stats() const;
+
+  private:
+    struct BuddyBlock
+    {
+      VkDeviceMemory memory = VK_NULL_HANDLE;
+      char* data = nullptr;
+      std::vector<std::set<VkDeviceSize>> free_lists;
+      std::unordered_map<VkDeviceSize, uint32_t> orders;
+    };
+
+    struct LinearBlock
+    {
+      VkDeviceMemory memory = VK_NULL_HANDLE;
+      char* data = nullptr;
+      VkDeviceSize size = 0;
+      VkDeviceSize head = 0;
+      uint32_t allocation_count = 0;
+    };
+
+    struct Pool
+    {
+      std::vector<BuddyBlock> buddy_blocks;
+      std::vector<LinearBlock> linear_blocks;
+    };
+
+    bool allocate_buddy(BuddyBlock& block, uint32_t order, VkDeviceSize& offset);
+    void free_buddy(BuddyBlock& block, VkDeviceSize offset);
+    VkDeviceMemory allocate_memory(uint32_t memory_type, VkDeviceSize size, char*& data);
+    void free_memory(VkDeviceMemory memory, VkDeviceSize size);
+    uint32_t get_order(VkDeviceSize size) const;
+    VkDeviceSize get_order_size(uint32_t order) const;
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    VkPhysicalDeviceMemoryProperties memory_properties_;
+    VkDeviceSize block_size_ = MEMORY_BLOCK_SIZE;
+    uint32_t max_order_ = 0;
+    std::array<Pool, VK_MAX_MEMORY_TYPES * 2> pools_;
+    MemoryStats stats_ = {};
+    mutable std::mutex mutex_;
+  };
+} // namespace core
+
+#include "core/memory-allocator.hxx"
@@ -0,0 +1,10 @@
+#include "core/memory-allocator.h"
+
+namespace core
+{
+  inline MemoryStats MemoryAllocator::get_stats() const
+  {
+    std::lock_guard lock(mutex_);
+    return stats_;
+  }
+} // namespace core
@@ -0,0 +1,390 @@
+#include "core/profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <imgui.h>
+
+#include "core/engine.h"
+#include "core/trace-recorder.h"
+#include "misc/thread-pool.h"
+
+namespace core
+{
+  void Profiler::init(const std::string& export_path)
+  {
+    auto& engine = Engine::get_singleton();
+    auto physical_device = engine.get_physical_device();
+
+    export_path_ = export_path;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+    uint32_t family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count, nullptr);
+
+    std::vector<VkQueueFamilyProperties> family_properties(family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &family_count,
+                                             family_properties.data());
+
+    uint32_t valid_bits = family_properties[engine.get_graphics_queue_family()].timestampValidBits;
+    timestamps_supported_ = valid_bits != 0;
+    timestamp_period_ = properties.limits.timestampPeriod;
+    timestamp_mask_ = valid_bits >= 64 ? UINT64_MAX : (uint64_t(1) << valid_bits) - 1;
+
+    if (!timestamps_supported_)
+      std::clog << "profiler: the graphics queue has no timestamps, only CPU times are shown\n";
+
+    const VkQueryPoolCreateInfo query_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = PROFILER_MAX_QUERIES,
+      .pipelineStatistics = 0,
+    };
+
+    frames_.resize(MAX_FRAMES_IN_FLIGHT);
+    for (auto& queries : frames_)
+    {
+      queries.query_pool = VK_NULL_HANDLE;
+      queries.dropped_count = 0;
+      queries.pending = false;
+
+      if (!timestamps_supported_)
+        continue;
+
+      VkResult result = vkCreateQueryPool(engine.get_device(), &query_pool_create_info, nullptr,
+                                          &queries.query_pool);
+      if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to create query pool");
+    }
+  }
+
+  void Profiler::free()
+  {
+    flush();
+
+    if (!export_path_.empty())
+      export_frames();
+
+    auto device = Engine::get_singleton().get_device();
+    for (auto& queries : frames_)
+      vkDestroyQueryPool(device, queries.query_pool, nullptr);
+
+    frames_.clear();
+    history_.clear();
+    exported_frames_.clear();
+  }
+
+  void Profiler::begin_frame(VkCommandBuffer command_buffer)
+  {
+    auto& queries = frames_[Engine::get_singleton().get_current_frame()];
+
+    if (queries.pending)
+      resolve(queries);
+
+    queries.names.clear();
+    queries.dropped_count = 0;
+
+    if (!timestamps_supported_)
+      return;
+
+    // Queries 0 and 1 bound the whole frame, the scopes follow in pairs.
+    vkCmdResetQueryPool(command_buffer, queries.query_pool, 0, PROFILER_MAX_QUERIES);
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queries.query_pool, 0);
+  }
+
+  void Profiler::end_frame(VkCommandBuffer command_buffer)
+  {
+    auto& engine = Engine::get_singleton();
+    auto& queries = frames_[engine.get_current_frame()];
+
+    if (timestamps_supported_)
+      vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                          queries.query_pool, 1);
+
+    auto now = clock::now();
+    std::chrono::duration<double, std::milli> frame_time = now - last_frame_end_;
+
+    queries.frame.frame_number = engine.get_frame_number();
+    queries.frame.frame_time = started_ ? frame_time.count() : 0.0;
+    queries.frame.gpu_time = 0.0;
+    queries.frame.gpu_scopes.clear();
+    queries.submit_time = now;
+    queries.pending = true;
+
+    {
+      std::lock_guard lock(cpu_mutex_);
+      queries.frame.cpu_scopes = std::move(cpu_scopes_);
+      cpu_scopes_.clear();
+    }
+
+    last_frame_end_ = now;
+    started_ = true;
+  }
+
+  void Profiler::flush()
+  {
+    std::vector<FrameQueries*> pending;
+    for (auto& queries : frames_)
+      if (queries.pending)
+        pending.push_back(&queries);
+
+    std::sort(pending.begin(), pending.end(), [](const auto* a, const auto* b) {
+      return a->frame.frame_number < b->frame.frame_number;
+    });
+
+    for (auto* queries : pending)
+      resolve(*queries);
+  }
+
+  uint32_t Profiler::begin_gpu(VkCommandBuffer command_buffer, const char* name)
+  {
+    if (!timestamps_supported_)
+      return PROFILER_NO_QUERY;
+
+    auto& queries = frames_[Engine::get_singleton().get_current_frame()];
+
+    uint32_t query = 2 + 2 * queries.names.size();
+    if (query + 1 >= PROFILER_MAX_QUERIES)
+    {
+      queries.dropped_count++;
+      return PROFILER_NO_QUERY;
+    }
+
+    queries.names.push_back(name);
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queries.query_pool,
+                        query);
+
+    return query;
+  }
+
+  void Profiler::end_gpu(VkCommandBuffer command_buffer, uint32_t query)
+  {
+    if (query == PROFILER_NO_QUERY)
+      return;
+
+    auto& queries = frames_[Engine::get_singleton().get_current_frame()];
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queries.query_pool,
+                        query + 1);
+  }
+
+  void Profiler::add_cpu_time(const char* name, double milliseconds)
+  {
+    std::lock_guard lock(cpu_mutex_);
+    add_time(cpu_scopes_, name, milliseconds);
+  }
+
+  void Profiler::draw_overlay()
+  {
+    if (history_.empty())
+      return;
+
+    std::vector<float> frame_times;
+    std::vector<float> gpu_times;
+    std::vector<ScopeTime> cpu_averages;
+    std::vector<ScopeTime> gpu_averages;
+
+    for (const auto& frame : history_)
+    {
+      frame_times.push_back(frame.frame_time);
+      gpu_times.push_back(frame.gpu_time);
+
+      for (const auto& scope : frame.cpu_scopes)
+        add_time(cpu_averages, scope.name, scope.milliseconds / history_.size());
+      for (const auto& scope : frame.gpu_scopes)
+        add_time(gpu_averages, scope.name, scope.milliseconds / history_.size());
+    }
+
+    const auto& last_frame = history_.back();
+
+    ImGui::Begin("Profiler");
+    ImGui::Text("frame %.3f ms, gpu %.3f ms", last_frame.frame_time, last_frame.gpu_time);
+    ImGui::PlotLines("Frame", frame_times.data(), frame_times.size(), 0, nullptr, 0.0f,
+                     3.4e38f, ImVec2(0, 60));
+    ImGui::PlotLines("GPU", gpu_times.data(), gpu_times.size(), 0, nullptr, 0.0f, 3.4e38f,
+                     ImVec2(0, 60));
+
+    ImGui::Separator();
+    ImGui::Text("average over %zu frames", history_.size());
+    for (const auto& scope : cpu_averages)
+      ImGui::Text("cpu %s: %.3f ms", scope.name, scope.milliseconds);
+    for (const auto& scope : gpu_averages)
+      ImGui::Text("gpu %s: %.3f ms", scope.name, scope.milliseconds);
+
+    uint32_t dropped_count = 0;
+    for (const auto& queries : frames_)
+      dropped_count = std::max(dropped_count, queries.dropped_count);
+
+    if (dropped_count != 0)
+      ImGui::Text("%u gpu scopes over the query budget", dropped_count);
+
+    ImGui::Separator();
+    auto& trace_recorder = TraceRecorder::get_singleton();
+    bool recording = trace_recorder.is_recording();
+    if (ImGui::Checkbox("Record trace", &recording))
+      trace_recorder.set_recording(recording);
+
+    ImGui::End();
+  }
+
+  void Profiler::resolve(FrameQueries& queries)
+  {
+    auto& frame = queries.frame;
+
+    if (timestamps_supported_)
+    {
+      uint32_t query_count = 2 + 2 * queries.names.size();
+      std::vector<uint64_t> timestamps(query_count);
+
+      VkResult result = vkGetQueryPoolResults(
+          Engine::get_singleton().get_device(), queries.query_pool, 0, query_count,
+          timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t),
+          VK_QUERY_RESULT_64_BIT);
+
+      // Ticks wrap around past the valid bits.
+      auto to_milliseconds = [&](uint32_t query) {
+        uint64_t ticks = (timestamps[query + 1] - timestamps[query]) & timestamp_mask_;
+        return ticks * timestamp_period_ / 1e6;
+      };
+
+      if (result == VK_SUCCESS)
+      {
+        frame.gpu_time = to_milliseconds(0);
+        for (size_t i = 0; i < queries.names.size(); i++)
+          add_time(frame.gpu_scopes, queries.names[i], to_milliseconds(2 + 2 * i));
+
+        if (TraceRecorder::get_singleton().is_recording())
+          trace(queries, timestamps);
+      }
+    }
+
+    if (history_.size() == PROFILER_HISTORY)
+      history_.pop_front();
+    history_.push_back(frame);
+
+    if (!export_path_.empty())
+      exported_frames_.push_back(frame);
+
+    queries.pending = false;
+  }
+
+  void Profiler::trace(const FrameQueries& queries, const std::vector<uint64_t>& timestamps)
+  {
+    auto& trace_recorder = TraceRecorder::get_singleton();
+
+    auto to_nanoseconds = [&](uint32_t query) {
+      return static_cast<int64_t>(timestamps[query] * timestamp_period_);
+    };
+
+    // The GPU clock has its own origin. Without calibrated timestamps it is anchored so that no
+    // frame starts before it was submitted, the frame that started soonest after its submission
+    // giving the tightest offset.
+    int64_t offset = trace_recorder.to_trace_time(queries.submit_time) - to_nanoseconds(0);
+    if (!gpu_clock_calibrated_ || offset > gpu_clock_offset_)
+    {
+      gpu_clock_offset_ = offset;
+      gpu_clock_calibrated_ = true;
+    }
+
+    auto record = [&](const char* name, uint32_t query) {
+      int64_t start = to_nanoseconds(query) + gpu_clock_offset_;
+      int64_t end = to_nanoseconds(query + 1) + gpu_clock_offset_;
+      trace_recorder.record(name, std::max<int64_t>(start, 0), std::max<int64_t>(end - start, 0),
+                            TRACE_GPU_THREAD);
+    };
+
+    record("gpu frame", 0);
+    for (size_t i = 0; i < queries.names.size(); i++)
+      record(queries.names[i], 2 + 2 * i);
+  }
+
+  void Profiler::add_time(std::vector<ScopeTime>& scopes, const char* name,
+                          double milliseconds) const
+  {
+    // Identical literals are not guaranteed to share an address across translation units.
+    auto scope = std::find_if(scopes.begin(), scopes.end(),
+                              [name](const auto& s) { return strcmp(s.name, name) == 0; });
+
+    if (scope == scopes.end())
+      scopes.push_back({ name, milliseconds });
+    else
+      scope->milliseconds += milliseconds;
+  }
+
+  void Profiler::export_frames() const
+  {
+    std::ofstream file(export_path_);
+    if (!file)
+      throw std::runtime_error("failed to open " + export_path_);
+
+    bool json = export_path_.ends_with(".json");
+
+    auto write_json_scopes = [&](const std::vector<ScopeTime>& scopes) {
+      file << "{";
+      for (size_t i = 0; i < scopes.size(); i++)
+        file << (i == 0 ? "" : ", ") << '"' << scopes[i].name << "\": " << scopes[i].milliseconds;
+      file << "}";
+    };
+
+    // CSV rows are one scope each, so frames with different scopes share the same columns.
+    if (json)
+      file << "[\n";
+    else
+      file << "frame,source,scope,milliseconds\n";
+
+    for (size_t i = 0; i < exported_frames_.size(); i++)
+    {
+      const auto& frame = exported_frames_[i];
+
+      if (json)
+      {
+        file << "  {\"frame\": " << frame.frame_number << ", \"frame_time\": " << frame.frame_time
+             << ", \"gpu_time\": " << frame.gpu_time << ", \"cpu\": ";
+        write_json_scopes(frame.cpu_scopes);
+        file << ", \"gpu\": ";
+        write_json_scopes(frame.gpu_scopes);
+        file << "}" << (i + 1 == exported_frames_.size() ? "\n" : ",\n");
+        continue;
+      }
+
+      file << frame.frame_number << ",frame,frame," << frame.frame_time << '\n';
+      file << frame.frame_number << ",gpu,frame," << frame.gpu_time << '\n';
+      for (const auto& scope : frame.cpu_scopes)
+        file << frame.frame_number << ",cpu," << scope.name << ',' << scope.milliseconds << '\n';
+      for (const auto& scope : frame.gpu_scopes)
+        file << frame.frame_number << ",gpu," << scope.name << ',' << scope.milliseconds << '\n';
+    }
+
+    if (json)
+      file << "]\n";
+
+    std::clog << "profile of " << exported_frames_.size() << " frames saved to " << export_path_
+              << "\n";
+  }
+
+  CpuScope::CpuScope(const char* name)
+    : name_(name)
+    , start_(std::chrono::steady_clock::now())
+  {}
+
+  CpuScope::~CpuScope()
+  {
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> elapsed = end - start_;
+    Profiler::get_singleton().add_cpu_time(name_, elapsed.count());
+
+    auto& trace_recorder = TraceRecorder::get_singleton();
+    if (trace_recorder.is_recording())
+    {
+      uint64_t start_ns = trace_recorder.to_trace_time(start_);
+      trace_recorder.record(name_, start_ns, trace_recorder.to_trace_time(end) - start_ns,
+                            misc::ThreadPool::get_thread_index());
+    }
+  }
+} // namespace core
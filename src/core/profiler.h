@@ -0,0 +1,130 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "misc/singleton.h"
+
+#define PROFILER_MAX_QUERIES 512
+#define PROFILER_HISTORY 240
+#define PROFILER_NO_QUERY UINT32_MAX
+
+namespace core
+{
+  /// Time spent in every scope with the same name during one frame, in milliseconds.
+  struct ScopeTime
+  {
+    const char* name;
+    double milliseconds;
+  };
+
+  struct ProfiledFrame
+  {
+    uint64_t frame_number;
+    /// Time since the previous frame was submitted.
+    double frame_time;
+    /// From the first to the last command of the frame on the GPU, 0 without timestamps.
+    double gpu_time;
+    std::vector<ScopeTime> cpu_scopes;
+    std::vector<ScopeTime> gpu_scopes;
+  };
+
+  /// CPU scoped timers and GPU timestamp ranges, gathered per frame. GPU results are read when
+  /// the frame context is reused, so a frame shows up frames in flight frames late.
+  class Profiler : public misc::Singleton<Profiler>
+  {
+    // Give Singleton<Profiler> access to Profiler’s private constructor
+    friend class Singleton<Profiler>;
+
+  private:
+    /// Construct a Profiler.
+    Profiler() = default;
+
+  public:
+    /// Every profiled frame is kept and written to export_path on free(), as JSON when it ends
+    /// with .json and CSV otherwise. An empty path only keeps the recent frames for the overlay.
+    void init(const std::string& export_path);
+    void free();
+
+    /// Collect the results of the last frame recorded with the current context and start the
+    /// timestamps of the new one. Called once the in flight fence was waited.
+    void begin_frame(VkCommandBuffer command_buffer);
+    void end_frame(VkCommandBuffer command_buffer);
+    /// Collect every frame still pending. The device must be idle.
+    void flush();
+
+    /// Returns PROFILER_NO_QUERY once the frame ran out of queries, end_gpu() then ignores it.
+    uint32_t begin_gpu(VkCommandBuffer command_buffer, const char* name);
+    void end_gpu(VkCommandBuffer command_buffer, uint32_t query);
+    /// Thread safe.
+    void add_cpu_time(const char* name, double milliseconds);
+
+    /// Frame time graph and the time of every scope averaged over the recent frames.
+    void draw_overlay();
+    const std::deque<ProfiledFrame>& get_history() const;
+
+  private:
+    /// What a frame context measured, read back once its fence signaled.
+    struct FrameQueries
+    {
+      VkQueryPool query_pool;
+      /// Name of each begin and end query pair, in query order.
+      std::vector<const char*> names;
+      uint32_t dropped_count;
+      ProfiledFrame frame;
+      std::chrono::steady_clock::time_point submit_time;
+      bool pending;
+    };
+
+    void resolve(FrameQueries& queries);
+    /// Place the GPU ranges of a frame on the trace timeline.
+    void trace(const FrameQueries& queries, const std::vector<uint64_t>& timestamps);
+    void add_time(std::vector<ScopeTime>& scopes, const char* name, double milliseconds) const;
+    void export_frames() const;
+
+    using clock = std::chrono::steady_clock;
+
+    std::vector<FrameQueries> frames_;
+    bool timestamps_supported_ = false;
+    /// Nanoseconds per timestamp tick.
+    double timestamp_period_ = 1.0;
+    uint64_t timestamp_mask_ = UINT64_MAX;
+    /// Trace time minus GPU time, in nanoseconds.
+    int64_t gpu_clock_offset_ = 0;
+    bool gpu_clock_calibrated_ = false;
+    clock::time_point last_frame_end_;
+    bool started_ = false;
+
+    std::mutex cpu_mutex_;
+    /// Scopes of the frame being prepared, moved into its context by end_frame().
+    std::vector<ScopeTime> cpu_scopes_;
+
+    std::deque<ProfiledFrame> history_;
+    std::string export_path_;
+    std::vector<ProfiledFrame> exported_frames_;
+  };
+
+  /// Adds the time until it goes out of scope to the CPU scope name of the current frame, and
+  /// to the trace when one is recorded.
+  class CpuScope
+  {
+  public:
+    CpuScope(const char* name);
+    ~CpuScope();
+
+    CpuScope(const CpuScope&) = delete;
+    CpuScope& operator=(const CpuScope&) = delete;
+
+  private:
+    const char* name_;
+    std::chrono::steady_clock::time_point start_;
+  };
+} // namespace core
+
+#include "core/profiler.hxx"
@@ -0,0 +1,6 @@
+#include "core/profiler.h"
+
+namespace core
+{
+  inline const std::deque<ProfiledFrame>& Profiler::get_history() const { return history_; }
+} // namespace core
@@ -0,0 +1,143 @@
+#include "core/staging-buffer.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "core/engine.h"
+
+namespace core
+{
+  void StagingBuffer::init()
+  {
+    auto& engine = Engine::get_singleton();
+    capacity_ = STAGING_BUFFER_SIZE;
+
+    const VkBufferCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .size = capacity_,
+      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+    };
+
+    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    engine.create_buffer(create_info, flags, buffer_, allocation_);
+    data_ = static_cast<char*>(allocation_.data);
+  }
+
+  void StagingBuffer::free()
+  {
+    std::clog << "staging ring high-water mark: " << high_water_mark_ << " / " << capacity_
+              << " bytes\n";
+
+    Engine::get_singleton().destroy_buffer(buffer_, allocation_);
+
+    regions_.clear();
+    head_ = 0;
+    used_size_ = 0;
+  }
+
+  StagingRegion StagingBuffer::allocate(VkDeviceSize size, VkDeviceSize alignment)
+  {
+    if (size > capacity_)
+      return allocate_dedicated(size);
+
+    reclaim();
+
+    VkDeviceSize offset;
+    while (!try_allocate(size, alignment, offset))
+    {
+      // The ring is full: block on the oldest pending upload.
+      TransferQueue::get_singleton().wait(regions_.front().ticket);
+      release_front();
+    }
+
+    auto ticket = TransferQueue::get_singleton().get_recording_ticket();
+    if (!regions_.empty() && regions_.back().ticket == ticket && regions_.back().end == offset)
+      regions_.back().end = offset + size;
+    else
+      regions_.push_back({ .begin = offset, .end = offset + size, .ticket = ticket });
+
+    head_ = offset + size;
+    used_size_ += size;
+    high_water_mark_ = std::max(high_water_mark_, used_size_);
+
+    return { .buffer = buffer_, .offset = offset, .data = data_ + offset };
+  }
+
+  void StagingBuffer::reclaim()
+  {
+    auto& transfer_queue = TransferQueue::get_singleton();
+
+    while (!regions_.empty() && transfer_queue.is_complete(regions_.front().ticket))
+      release_front();
+  }
+
+  bool StagingBuffer::try_allocate(VkDeviceSize size, VkDeviceSize alignment,
+                                   VkDeviceSize& offset) const
+  {
+    if (regions_.empty())
+    {
+      offset = 0;
+      return true;
+    }
+
+    VkDeviceSize tail = regions_.front().begin;
+    offset = (head_ + alignment - 1) / alignment * alignment;
+
+    // Regions are laid out in order: free space is either past the head and before the
+    // start of the ring, or, once wrapped, between the head and the oldest region.
+    if (head_ > tail)
+    {
+      if (offset + size <= capacity_)
+        return true;
+
+      offset = 0;
+      return size <= tail;
+    }
+
+    return offset + size <= tail;
+  }
+
+  void StagingBuffer::release_front()
+  {
+    used_size_ -= regions_.front().end - regions_.front().begin;
+    regions_.pop_front();
+
+    if (regions_.empty())
+      head_ = 0;
+  }
+
+  StagingRegion StagingBuffer::allocate_dedicated(VkDeviceSize size)
+  {
+    auto& engine = Engine::get_singleton();
+    auto& transfer_queue = TransferQueue::get_singleton();
+
+    VkBuffer buffer;
+    Allocation allocation;
+
+    const VkBufferCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .size = size,
+      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+    };
+
+    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    engine.create_buffer(create_info, flags, buffer, allocation, MemoryLifetime::transient);
+
+    high_water_mark_ = std::max(high_water_mark_, used_size_ + size);
+
+    transfer_queue.on_complete(transfer_queue.get_recording_ticket(),
+                               [=, &engine]() { engine.destroy_buffer(buffer, allocation); });
+
+    return { .buffer = buffer, .offset = 0, .data = allocation.data };
+  }
+} // namespace core
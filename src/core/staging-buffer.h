@@ -0,0 +1,67 @@
+#pragma once
+
+#include <deque>
+
+#include <vulkan/vulkan.h>
+
+#include "core/memory-allocator.h"
+#include "core/transfer-queue.h"
+#include "misc/singleton.h"
+
+#define STAGING_BUFFER_SIZE (64 * 1024 * 1024)
+
+namespace core
+{
+  struct StagingRegion
+  {
+    VkBuffer buffer;
+    VkDeviceSize offset;
+    void* data;
+  };
+
+  class StagingBuffer : public misc::Singleton<StagingBuffer>
+  {
+    // Give Singleton<StagingBuffer> access to StagingBuffer’s private constructor
+    friend class Singleton<StagingBuffer>;
+
+  private:
+    /// Construct a StagingBuffer.
+    StagingBuffer() = default;
+
+  public:
+    void init();
+    void free();
+
+    /// Reserve a mapped region, released once the recording transfer batch completes.
+    StagingRegion allocate(VkDeviceSize size, VkDeviceSize alignment = 16);
+    /// Release the regions of every completed transfer batch.
+    void reclaim();
+
+    VkDeviceSize get_capacity() const;
+    VkDeviceSize get_used_size() const;
+    VkDeviceSize get_high_water_mark() const;
+
+  private:
+    struct Region
+    {
+      VkDeviceSize begin;
+      VkDeviceSize end;
+      TransferTicket ticket;
+    };
+
+    bool try_allocate(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) const;
+    void release_front();
+    StagingRegion allocate_dedicated(VkDeviceSize size);
+
+    VkBuffer buffer_ = VK_NULL_HANDLE;
+    Allocation allocation_;
+    char* data_ = nullptr;
+    VkDeviceSize capacity_ = 0;
+    VkDeviceSize head_ = 0;
+    VkDeviceSize used_size_ = 0;
+    VkDeviceSize high_water_mark_ = 0;
+    std::deque<Region> regions_;
+  };
+} // namespace core
+
+#include "core/staging-buffer.hxx"
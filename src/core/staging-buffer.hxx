@@ -0,0 +1,8 @@
+#include "core/staging-buffer.h"
+
+namespace core
+{
+  inline VkDeviceSize StagingBuffer::get_capacity() const { return capacity_; }
+  inline VkDeviceSize StagingBuffer::get_used_size() const { return used_size_; }
+  inline VkDeviceSize StagingBuffer::get_high_water_mark() const { return high_water_mark_; }
+} // namespace core
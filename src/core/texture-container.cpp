@@ -0,0 +1,296 @@
+#include "core/texture-container.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <stdexcept>
+
+#include "core/engine.h"
+
+namespace core
+{
+  TextureContainer::TextureContainer(const std::string& source_path)
+  {
+    std::filesystem::path path = source_path;
+    if (path.extension() == ".ktx2" || path.extension() == ".dds")
+    {
+      path_ = source_path;
+      return;
+    }
+
+    std::error_code error;
+    for (auto extension : { ".ktx2", ".dds" })
+    {
+      path.replace_extension(extension);
+      if (std::filesystem::exists(path, error))
+      {
+        path_ = path.string();
+        return;
+      }
+    }
+  }
+
+  bool TextureContainer::load()
+  {
+    if (path_.empty())
+      return false;
+
+    file_ = std::make_unique<misc::MappedFile>(path_);
+
+    bool parsed = path_.ends_with(".ktx2") ? parse_ktx2() : parse_dds();
+    if (parsed && !is_format_supported())
+    {
+      std::clog << path_ << ": format " << format_ << " is not supported by the device\n";
+      parsed = false;
+    }
+
+    if (!parsed)
+    {
+      file_.reset();
+      levels_.clear();
+      return false;
+    }
+
+    for (const auto& level : levels_)
+      if (level.offset + level.size > file_->size())
+        throw std::runtime_error("truncated texture container " + path_);
+
+    return true;
+  }
+
+  std::vector<VkBufferImageCopy> TextureContainer::copy_regions(void* destination,
+                                                                VkDeviceSize buffer_offset,
+                                                                uint32_t layer) const
+  {
+    std::vector<VkBufferImageCopy> regions;
+    VkDeviceSize offset = 0;
+
+    for (uint32_t i = 0; i < levels_.size(); i++)
+    {
+      const auto& level = levels_[i];
+      std::memcpy(static_cast<char*>(destination) + offset, file_->data() + level.offset,
+                  level.size);
+
+      const VkImageSubresourceLayers image_subresource_layers = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .mipLevel = i,
+        .baseArrayLayer = layer,
+        .layerCount = 1,
+      };
+
+      regions.push_back({
+          .bufferOffset = buffer_offset + offset,
+          .bufferRowLength = 0,
+          .bufferImageHeight = 0,
+          .imageSubresource = image_subresource_layers,
+          .imageOffset = { 0, 0, 0 },
+          .imageExtent = level.extent,
+      });
+
+      // Buffer offsets have to stay a multiple of the texel block size.
+      offset = (offset + level.size + 15) / 16 * 16;
+    }
+
+    return regions;
+  }
+
+  VkDeviceSize TextureContainer::get_size() const
+  {
+    VkDeviceSize size = 0;
+    for (const auto& level : levels_)
+      size = (size + level.size + 15) / 16 * 16;
+
+    return size;
+  }
+
+  bool TextureContainer::parse_ktx2()
+  {
+    const uint8_t identifier[] = {
+      0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A,
+    };
+
+    Ktx2Header header;
+    if (file_->size() < sizeof(Ktx2Header))
+      throw std::runtime_error("truncated texture container " + path_);
+
+    std::memcpy(&header, file_->data(), sizeof(Ktx2Header));
+    if (std::memcmp(header.identifier, identifier, sizeof(identifier)) != 0)
+      throw std::runtime_error("invalid KTX2 identifier in " + path_);
+
+    // Basis Universal and zstd payloads would need a transcoder, those go through the
+    // fallback path.
+    if (header.vk_format == VK_FORMAT_UNDEFINED || header.supercompression_scheme != 0)
+    {
+      std::clog << path_ << ": supercompressed KTX2 files are not supported\n";
+      return false;
+    }
+
+    if (header.pixel_depth > 1 || header.layer_count > 1 || header.face_count != 1)
+    {
+      std::clog << path_ << ": only 2D textures are supported\n";
+      return false;
+    }
+
+    format_ = static_cast<VkFormat>(header.vk_format);
+    extent_ = { header.pixel_width, header.pixel_height, 1 };
+    level_count_ = std::max(header.level_count, 1u);
+
+    if (file_->size() < sizeof(Ktx2Header) + level_count_ * sizeof(Ktx2Level))
+      throw std::runtime_error("truncated texture container " + path_);
+
+    for (uint32_t i = 0; i < level_count_; i++)
+    {
+      Ktx2Level level;
+      std::memcpy(&level, file_->data() + sizeof(Ktx2Header) + i * sizeof(Ktx2Level),
+                  sizeof(Ktx2Level));
+
+      levels_.push_back({
+          .offset = level.byte_offset,
+          .size = level.byte_length,
+          .extent = { std::max(extent_.width >> i, 1u), std::max(extent_.height >> i, 1u), 1 },
+      });
+    }
+
+    return true;
+  }
+
+  bool TextureContainer::parse_dds()
+  {
+    DdsHeader header;
+    if (file_->size() < sizeof(DdsHeader))
+      throw std::runtime_error("truncated texture container " + path_);
+
+    std::memcpy(&header, file_->data(), sizeof(DdsHeader));
+    if (std::memcmp(header.magic, "DDS ", 4) != 0)
+      throw std::runtime_error("invalid DDS magic in " + path_);
+
+    VkDeviceSize offset = sizeof(DdsHeader);
+    DdsHeaderDx10 header_dx10;
+    bool dx10 = std::memcmp(header.four_cc, "DX10", 4) == 0;
+
+    if (dx10)
+    {
+      if (file_->size() < offset + sizeof(DdsHeaderDx10))
+        throw std::runtime_error("truncated texture container " + path_);
+
+      std::memcpy(&header_dx10, file_->data() + offset, sizeof(DdsHeaderDx10));
+      offset += sizeof(DdsHeaderDx10);
+    }
+
+    // DDSCAPS2_CUBEMAP, DDSCAPS2_VOLUME and D3D10_RESOURCE_MISC_TEXTURECUBE.
+    bool cube_or_volume = (header.caps2 & 0x200) || (header.caps2 & 0x200000)
+        || (dx10 && ((header_dx10.misc_flag & 0x4) || header_dx10.array_size > 1));
+    if (cube_or_volume)
+    {
+      std::clog << path_ << ": only 2D textures are supported\n";
+      return false;
+    }
+
+    format_ = get_dds_format(header, dx10 ? &header_dx10 : nullptr);
+    if (format_ == VK_FORMAT_UNDEFINED)
+    {
+      std::clog << path_ << ": only block compressed DDS files are supported\n";
+      return false;
+    }
+
+    extent_ = { header.width, header.height, 1 };
+    // DDSD_MIPMAPCOUNT
+    level_count_ = header.flags & 0x20000 ? std::max(header.mip_map_count, 1u) : 1;
+
+    // Unlike KTX2, levels are stored back to back from the largest one.
+    for (uint32_t i = 0; i < level_count_; i++)
+    {
+      VkExtent3D extent = { std::max(extent_.width >> i, 1u), std::max(extent_.height >> i, 1u),
+                            1 };
+      VkDeviceSize size = static_cast<VkDeviceSize>((extent.width + 3) / 4)
+          * ((extent.height + 3) / 4) * get_block_size();
+
+      levels_.push_back({ .offset = offset, .size = size, .extent = extent });
+      offset += size;
+    }
+
+    return true;
+  }
+
+  VkFormat TextureContainer::get_dds_format(const DdsHeader& header,
+                                            const DdsHeaderDx10* header_dx10) const
+  {
+    if (header_dx10)
+      switch (header_dx10->dxgi_format)
+      {
+      case 71:
+        return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+      case 72:
+        return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+      case 74:
+        return VK_FORMAT_BC2_UNORM_BLOCK;
+      case 75:
+        return VK_FORMAT_BC2_SRGB_BLOCK;
+      case 77:
+        return VK_FORMAT_BC3_UNORM_BLOCK;
+      case 78:
+        return VK_FORMAT_BC3_SRGB_BLOCK;
+      case 80:
+        return VK_FORMAT_BC4_UNORM_BLOCK;
+      case 81:
+        return VK_FORMAT_BC4_SNORM_BLOCK;
+      case 83:
+        return VK_FORMAT_BC5_UNORM_BLOCK;
+      case 84:
+        return VK_FORMAT_BC5_SNORM_BLOCK;
+      case 95:
+        return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+      case 96:
+        return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+      case 98:
+        return VK_FORMAT_BC7_UNORM_BLOCK;
+      case 99:
+        return VK_FORMAT_BC7_SRGB_BLOCK;
+      default:
+        return VK_FORMAT_UNDEFINED;
+      }
+
+    // Legacy files carry no colour space, they are treated as colour textures like the ones
+    // decoded by stb.
+    std::string four_cc(header.four_cc, 4);
+    if (four_cc == "DXT1")
+      return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+    if (four_cc == "DXT3")
+      return VK_FORMAT_BC2_SRGB_BLOCK;
+    if (four_cc == "DXT5")
+      return VK_FORMAT_BC3_SRGB_BLOCK;
+    if (four_cc == "ATI1" || four_cc == "BC4U")
+      return VK_FORMAT_BC4_UNORM_BLOCK;
+    if (four_cc == "ATI2" || four_cc == "BC5U")
+      return VK_FORMAT_BC5_UNORM_BLOCK;
+
+    return VK_FORMAT_UNDEFINED;
+  }
+
+  VkDeviceSize TextureContainer::get_block_size() const
+  {
+    switch (format_)
+    {
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC4_SNORM_BLOCK:
+      return 8;
+    default:
+      return 16;
+    }
+  }
+
+  bool TextureContainer::is_format_supported() const
+  {
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(Engine::get_singleton().get_physical_device(), format_,
+                                        &format_properties);
+
+    const VkFormatFeatureFlags required_features = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT
+        | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+
+    return (format_properties.optimalTilingFeatures & required_features) == required_features;
+  }
+} // namespace core
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "misc/mapped-file.h"
+
+namespace core
+{
+  /// Image data of one mip level inside the container.
+  struct TextureLevel
+  {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    VkExtent3D extent;
+  };
+
+  /// Pre-compressed 2D texture stored as KTX2 or DDS, uploaded as is instead of being decoded
+  /// to RGBA8. The mip chain, when the file has one, comes along with it.
+  class TextureContainer
+  {
+  public:
+    /// Use source_path itself when it is a container, otherwise look for a .ktx2 or a .dds
+    /// with the same stem next to it.
+    explicit TextureContainer(const std::string& source_path);
+
+    /// Map and parse the container, false when there is none or the device cannot sample its
+    /// format.
+    bool load();
+    /// Pack every level into destination and return the matching copy regions, starting at
+    /// buffer_offset and targeting array layer layer.
+    std::vector<VkBufferImageCopy> copy_regions(void* destination, VkDeviceSize buffer_offset,
+                                                uint32_t layer = 0) const;
+
+    const std::string& get_path() const;
+    VkFormat get_format() const;
+    VkExtent3D get_extent() const;
+    uint32_t get_level_count() const;
+    /// Size of all the image data, what copy_regions writes.
+    VkDeviceSize get_size() const;
+
+  private:
+    struct Ktx2Header
+    {
+      uint8_t identifier[12];
+      uint32_t vk_format;
+      uint32_t type_size;
+      uint32_t pixel_width;
+      uint32_t pixel_height;
+      uint32_t pixel_depth;
+      uint32_t layer_count;
+      uint32_t face_count;
+      uint32_t level_count;
+      uint32_t supercompression_scheme;
+      uint32_t dfd_byte_offset;
+      uint32_t dfd_byte_length;
+      uint32_t kvd_byte_offset;
+      uint32_t kvd_byte_length;
+      uint64_t sgd_byte_offset;
+      uint64_t sgd_byte_length;
+    };
+
+    struct Ktx2Level
+    {
+      uint64_t byte_offset;
+      uint64_t byte_length;
+      uint64_t uncompressed_byte_length;
+    };
+
+    struct DdsHeader
+    {
+      char magic[4];
+      uint32_t size;
+      uint32_t flags;
+      uint32_t height;
+      uint32_t width;
+      uint32_t pitch_or_linear_size;
+      uint32_t depth;
+      uint32_t mip_map_count;
+      uint32_t reserved1[11];
+      uint32_t pixel_format_size;
+      uint32_t pixel_format_flags;
+      char four_cc[4];
+      uint32_t rgb_bit_count;
+      uint32_t bit_masks[4];
+      uint32_t caps;
+      uint32_t caps2;
+      uint32_t caps3;
+      uint32_t caps4;
+      uint32_t reserved2;
+    };
+
+    struct DdsHeaderDx10
+    {
+      uint32_t dxgi_format;
+      uint32_t resource_dimension;
+      uint32_t misc_flag;
+      uint32_t array_size;
+      uint32_t misc_flags2;
+    };
+
+    bool parse_ktx2();
+    bool parse_dds();
+    VkFormat get_dds_format(const DdsHeader& header, const DdsHeaderDx10* header_dx10) const;
+    VkDeviceSize get_block_size() const;
+    bool is_format_supported() const;
+
+    std::string path_;
+    std::unique_ptr<misc::MappedFile> file_;
+    VkFormat format_ = VK_FORMAT_UNDEFINED;
+    VkExtent3D extent_ = {};
+    uint32_t level_count_ = 1;
+    std::vector<TextureLevel> levels_;
+  };
+} // namespace core
+
+#include "core/texture-container.hxx"
@@ -0,0 +1,9 @@
+#include "core/texture-container.h"
+
+namespace core
+{
+  inline const std::string& TextureContainer::get_path() const { return path_; }
+  inline VkFormat TextureContainer::get_format() const { return format_; }
+  inline VkExtent3D TextureContainer::get_extent() const { return extent_; }
+  inline uint32_t TextureContainer::get_level_count() const { return level_count_; }
+} // namespace core
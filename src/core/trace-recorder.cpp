@@ -0,0 +1,148 @@
+#include "core/trace-recorder.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include "misc/thread-pool.h"
+
+namespace core
+{
+  void TraceRecorder::init(const std::string& path)
+  {
+    epoch_ = std::chrono::steady_clock::now();
+    path_ = path.empty() ? DEFAULT_TRACE_PATH : path;
+
+    if (!path.empty())
+      set_recording(true);
+  }
+
+  void TraceRecorder::free()
+  {
+    set_recording(false);
+    events_.clear();
+    events_.shrink_to_fit();
+  }
+
+  void TraceRecorder::set_recording(bool recording)
+  {
+    if (recording == is_recording())
+      return;
+
+    if (recording)
+    {
+      // The buffer is only paid for once a trace is actually recorded.
+      events_.resize(TRACE_MAX_EVENTS);
+      reserved_count_.store(0, std::memory_order_relaxed);
+      written_count_.store(0, std::memory_order_relaxed);
+      recording_.store(true, std::memory_order_release);
+      std::clog << "trace: recording\n";
+    }
+    else
+    {
+      recording_.store(false, std::memory_order_release);
+      save();
+    }
+  }
+
+  void TraceRecorder::record(const char* name, uint64_t start_ns, uint64_t duration_ns,
+                             uint32_t thread)
+  {
+    if (!is_recording())
+      return;
+
+    uint32_t index = reserved_count_.fetch_add(1, std::memory_order_relaxed);
+    if (index >= TRACE_MAX_EVENTS)
+      return;
+
+    events_[index] = { name, start_ns, duration_ns, thread };
+    written_count_.fetch_add(1, std::memory_order_release);
+  }
+
+  uint64_t TraceRecorder::get_time() const
+  {
+    return to_trace_time(std::chrono::steady_clock::now());
+  }
+
+  uint64_t TraceRecorder::to_trace_time(std::chrono::steady_clock::time_point time) const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch_).count();
+  }
+
+  void TraceRecorder::save()
+  {
+    uint32_t reserved_count = reserved_count_.load(std::memory_order_relaxed);
+    uint32_t event_count = std::min<uint32_t>(reserved_count, TRACE_MAX_EVENTS);
+
+    // A thread that got its slot just before recording stopped may still be writing it.
+    while (written_count_.load(std::memory_order_acquire) < event_count)
+      std::this_thread::yield();
+
+    std::ofstream file(path_);
+    if (!file)
+      throw std::runtime_error("failed to open " + path_);
+
+    std::set<uint32_t> threads;
+    for (uint32_t i = 0; i < event_count; i++)
+      threads.insert(events_[i].thread);
+
+    file << std::fixed << std::setprecision(3);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+    for (auto thread : threads)
+    {
+      std::string name = "worker " + std::to_string(thread);
+      if (thread == TRACE_GPU_THREAD)
+        name = "gpu";
+      else if (thread == 0)
+        name = "main";
+
+      // Metadata events name the tracks and keep the GPU one below the threads.
+      file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+           << ", \"args\": {\"name\": \"" << name << "\"}},\n";
+      file << "{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+           << ", \"args\": {\"sort_index\": " << thread << "}},\n";
+    }
+
+    // Complete events, timestamps are in microseconds.
+    for (uint32_t i = 0; i < event_count; i++)
+    {
+      const auto& event = events_[i];
+      file << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+           << event.thread << ", \"ts\": " << event.start_ns / 1000.0
+           << ", \"dur\": " << event.duration_ns / 1000.0 << "},\n";
+    }
+
+    file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": "
+            "\"vulkan-engine\"}}\n]}\n";
+
+    if (!file)
+      throw std::runtime_error("failed to write " + path_);
+
+    std::clog << "trace: " << event_count << " events saved to " << path_;
+    if (reserved_count > event_count)
+      std::clog << ", " << reserved_count - event_count << " dropped";
+    std::clog << "\n";
+  }
+
+  TraceScope::TraceScope(const char* name)
+    : name_(name)
+    , active_(TraceRecorder::get_singleton().is_recording())
+    , start_ns_(active_ ? TraceRecorder::get_singleton().get_time() : 0)
+  {}
+
+  TraceScope::~TraceScope()
+  {
+    if (!active_)
+      return;
+
+    auto& trace_recorder = TraceRecorder::get_singleton();
+    uint64_t end_ns = trace_recorder.get_time();
+    trace_recorder.record(name_, start_ns_, end_ns - start_ns_,
+                          misc::ThreadPool::get_thread_index());
+  }
+} // namespace core
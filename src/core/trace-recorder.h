@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "misc/singleton.h"
+
+#define TRACE_MAX_EVENTS (1 << 20)
+/// Thread id of the GPU timeline in the trace, after every pool thread.
+#define TRACE_GPU_THREAD 1000
+#define DEFAULT_TRACE_PATH "trace.json"
+
+namespace core
+{
+  struct TraceEvent
+  {
+    const char* name;
+    /// Since the recorder was initialized.
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    /// ThreadPool::get_thread_index() of the recording thread, or TRACE_GPU_THREAD.
+    uint32_t thread;
+  };
+
+  /// Records CPU scopes from every thread and GPU ranges as Chrome trace JSON, which opens in
+  /// chrome://tracing or Perfetto. Events go to a fixed buffer through a single atomic
+  /// increment, so recording never takes a lock; events past TRACE_MAX_EVENTS are dropped.
+  class TraceRecorder : public misc::Singleton<TraceRecorder>
+  {
+    // Give Singleton<TraceRecorder> access to TraceRecorder’s private constructor
+    friend class Singleton<TraceRecorder>;
+
+  private:
+    /// Construct a TraceRecorder.
+    TraceRecorder() = default;
+
+  public:
+    /// Start recording right away when path is not empty. Later recordings are saved to path,
+    /// or DEFAULT_TRACE_PATH.
+    void init(const std::string& path);
+    /// Save the recording still running.
+    void free();
+
+    /// Stopping saves what was recorded since the start. Only the main thread toggles it.
+    void set_recording(bool recording);
+    bool is_recording() const;
+
+    /// Thread safe, ignored while not recording.
+    void record(const char* name, uint64_t start_ns, uint64_t duration_ns, uint32_t thread);
+    uint64_t get_time() const;
+    /// Convert a steady_clock time to the trace timeline.
+    uint64_t to_trace_time(std::chrono::steady_clock::time_point time) const;
+
+  private:
+    void save();
+
+    std::chrono::steady_clock::time_point epoch_;
+    std::string path_;
+    std::vector<TraceEvent> events_;
+    std::atomic<bool> recording_ = false;
+    /// Slots handed out, can run past TRACE_MAX_EVENTS.
+    std::atomic<uint32_t> reserved_count_ = 0;
+    /// Slots whose event is fully written.
+    std::atomic<uint32_t> written_count_ = 0;
+  };
+
+  /// Records the time until it goes out of scope as a trace event of the calling thread.
+  class TraceScope
+  {
+  public:
+    TraceScope(const char* name);
+    ~TraceScope();
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+  private:
+    const char* name_;
+    /// Whether the recorder was recording at construction.
+    bool active_;
+    uint64_t start_ns_;
+  };
+} // namespace core
+
+#include "core/trace-recorder.hxx"
@@ -0,0 +1,9 @@
+#include "core/trace-recorder.h"
+
+namespace core
+{
+  inline bool TraceRecorder::is_recording() const
+  {
+    return recording_.load(std::memory_order_relaxed);
+  }
+} // namespace core
@@ -0,0 +1,233 @@
+#include "core/transfer-queue.h"
+
+#include <stdexcept>
+
+#include "core/engine.h"
+#include "core/trace-recorder.h"
+
+namespace core
+{
+  void TransferQueue::init()
+  {
+    auto& engine = Engine::get_singleton();
+    device_ = engine.get_device();
+
+    vkGetDeviceQueue(device_, engine.get_transfer_queue_family(), 0, &queue_);
+
+    const VkCommandPoolCreateInfo command_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      .queueFamilyIndex = engine.get_transfer_queue_family(),
+    };
+
+    VkResult result =
+        vkCreateCommandPool(device_, &command_pool_create_info, nullptr, &command_pool_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create transfer command pool");
+
+    std::array<VkCommandBuffer, TRANSFER_BATCH_COUNT> command_buffers;
+
+    const VkCommandBufferAllocateInfo allocate_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .commandPool = command_pool_,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = TRANSFER_BATCH_COUNT,
+    };
+
+    result = vkAllocateCommandBuffers(device_, &allocate_info, command_buffers.data());
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate command buffers");
+
+    for (size_t i = 0; i < TRANSFER_BATCH_COUNT; i++)
+      batches_[i] = { .command_buffer = command_buffers[i], .ticket = 0 };
+
+    const VkSemaphoreTypeCreateInfo semaphore_type_create_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+      .pNext = nullptr,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+      .initialValue = 0,
+    };
+
+    const VkSemaphoreCreateInfo semaphore_create_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &semaphore_type_create_info,
+      .flags = 0,
+    };
+
+    result = vkCreateSemaphore(device_, &semaphore_create_info, nullptr, &timeline_semaphore_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create timeline semaphore");
+  }
+
+  void TransferQueue::free()
+  {
+    // Pending callbacks, such as dedicated staging buffer releases, may hold the recording
+    // ticket even when no upload follows them.
+    wait(callbacks_.empty() ? get_last_ticket() : get_recording_ticket());
+    poll();
+
+    for (auto& batch : batches_)
+      vkFreeCommandBuffers(device_, command_pool_, 1, &batch.command_buffer);
+
+    vkDestroyCommandPool(device_, command_pool_, nullptr);
+    vkDestroySemaphore(device_, timeline_semaphore_, nullptr);
+  }
+
+  VkCommandBuffer TransferQueue::get_command_buffer()
+  {
+    auto& batch = batches_[current_batch_];
+
+    if (recording_)
+      return batch.command_buffer;
+
+    // The ring wrapped around: the oldest batch must retire before being reused.
+    if (batch.ticket != 0 && !is_complete(batch.ticket))
+      wait(batch.ticket);
+
+    VkResult result = vkResetCommandBuffer(batch.command_buffer, 0);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to reset command buffer");
+
+    const VkCommandBufferBeginInfo command_buffer_begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .pNext = nullptr,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+      .pInheritanceInfo = nullptr,
+    };
+
+    result = vkBeginCommandBuffer(batch.command_buffer, &command_buffer_begin_info);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to begin command buffer");
+
+    recording_ = true;
+    return batch.command_buffer;
+  }
+
+  TransferTicket TransferQueue::submit()
+  {
+    if (!recording_)
+      return submitted_ticket_;
+
+    TraceScope scope("transfer submit");
+
+    auto& batch = batches_[current_batch_];
+
+    VkResult result = vkEndCommandBuffer(batch.command_buffer);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to end command buffer");
+
+    TransferTicket ticket = submitted_ticket_ + 1;
+
+    const VkTimelineSemaphoreSubmitInfo timeline_submit_info = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .pNext = nullptr,
+      .waitSemaphoreValueCount = 0,
+      .pWaitSemaphoreValues = nullptr,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues = &ticket,
+    };
+
+    const VkSubmitInfo submit_info = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = &timeline_submit_info,
+      .waitSemaphoreCount = 0,
+      .pWaitSemaphores = nullptr,
+      .pWaitDstStageMask = nullptr,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &batch.command_buffer,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &timeline_semaphore_,
+    };
+
+    result = vkQueueSubmit(queue_, 1, &submit_info, VK_NULL_HANDLE);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to submit to queue");
+
+    batch.ticket = ticket;
+    submitted_ticket_ = ticket;
+    current_batch_ = (current_batch_ + 1) % TRANSFER_BATCH_COUNT;
+    recording_ = false;
+
+    return ticket;
+  }
+
+  bool TransferQueue::is_complete(TransferTicket ticket) const
+  {
+    return ticket <= get_completed_value();
+  }
+
+  void TransferQueue::wait(TransferTicket ticket)
+  {
+    // Tickets are handed out before anything is recorded for them, e.g. to a staging region
+    // whose upload threw. An empty batch still signals the ticket, so the wait cannot hang.
+    if (ticket > submitted_ticket_)
+    {
+      get_command_buffer();
+      submit();
+    }
+
+    TraceScope scope("transfer wait");
+    const VkSemaphoreWaitInfo wait_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .semaphoreCount = 1,
+      .pSemaphores = &timeline_semaphore_,
+      .pValues = &ticket,
+    };
+
+    VkResult result = vkWaitSemaphores(device_, &wait_info, UINT64_MAX);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to wait for transfer completion");
+  }
+
+  void TransferQueue::on_complete(TransferTicket ticket, std::function<void()> callback)
+  {
+    if (is_complete(ticket))
+      callback();
+    else
+      callbacks_.emplace_back(ticket, std::move(callback));
+  }
+
+  void TransferQueue::poll()
+  {
+    if (callbacks_.empty())
+      return;
+
+    uint64_t completed = get_completed_value();
+
+    // Callbacks may register new ones, so run them from a detached list.
+    auto pending = std::move(callbacks_);
+    callbacks_.clear();
+
+    for (auto& [ticket, callback] : pending)
+    {
+      if (ticket <= completed)
+        callback();
+      else
+        callbacks_.emplace_back(ticket, std::move(callback));
+    }
+  }
+
+  TransferTicket TransferQueue::consume_graphics_wait()
+  {
+    if (submitted_ticket_ == graphics_waited_ticket_)
+      return 0;
+
+    graphics_waited_ticket_ = submitted_ticket_;
+    return submitted_ticket_;
+  }
+
+  uint64_t TransferQueue::get_completed_value() const
+  {
+    uint64_t value = 0;
+
+    VkResult result = vkGetSemaphoreCounterValue(device_, timeline_semaphore_, &value);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to query timeline semaphore");
+
+    return value;
+  }
+} // namespace core
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "misc/singleton.h"
+
+#define TRANSFER_BATCH_COUNT 4
+
+namespace core
+{
+  /// Handle on a transfer batch, complete once the timeline semaphore reaches it.
+  using TransferTicket = uint64_t;
+
+  class TransferQueue : public misc::Singleton<TransferQueue>
+  {
+    // Give Singleton<TransferQueue> access to TransferQueue’s private constructor
+    friend class Singleton<TransferQueue>;
+
+  private:
+    /// Construct a TransferQueue.
+    TransferQueue() = default;
+
+  public:
+    void init();
+    void free();
+
+    /// Command buffer of the batch being recorded, opened on first use.
+    VkCommandBuffer get_command_buffer();
+    /// Ticket the commands recorded right now will complete with.
+    TransferTicket get_recording_ticket() const;
+    /// Submit the recording batch, if any, and return the last submitted ticket.
+    TransferTicket submit();
+
+    bool is_complete(TransferTicket ticket) const;
+    /// Block until ticket is reached, submitting the batch it belongs to even if empty.
+    void wait(TransferTicket ticket);
+    void on_complete(TransferTicket ticket, std::function<void()> callback);
+    void poll();
+
+    /// Ticket the next graphics submission has to wait for, or 0 if already waited on.
+    TransferTicket consume_graphics_wait();
+
+    VkSemaphore get_timeline_semaphore() const;
+    TransferTicket get_submitted_ticket() const;
+    /// Ticket covering everything recorded so far, submitted or not.
+    TransferTicket get_last_ticket() const;
+
+  private:
+    struct Batch
+    {
+      VkCommandBuffer command_buffer = VK_NULL_HANDLE;
+      TransferTicket ticket = 0;
+    };
+
+    uint64_t get_completed_value() const;
+
+    VkDevice device_ = VK_NULL_HANDLE;
+    VkQueue queue_ = VK_NULL_HANDLE;
+    VkCommandPool command_pool_ = VK_NULL_HANDLE;
+    VkSemaphore timeline_semaphore_ = VK_NULL_HANDLE;
+    std::array<Batch, TRANSFER_BATCH_COUNT> batches_;
+    size_t current_batch_ = 0;
+    bool recording_ = false;
+    TransferTicket submitted_ticket_ = 0;
+    TransferTicket graphics_waited_ticket_ = 0;
+    std::vector<std::pair<TransferTicket, std::function<void()>>> callbacks_;
+  };
+} // namespace core
+
+#include "core/transfer-queue.hxx"
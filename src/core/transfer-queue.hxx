@@ -0,0 +1,15 @@
+#include "core/transfer-queue.h"
+
+namespace core
+{
+  inline TransferTicket TransferQueue::get_recording_ticket() const
+  {
+    return submitted_ticket_ + 1;
+  }
+  inline VkSemaphore TransferQueue::get_timeline_semaphore() const { return timeline_semaphore_; }
+  inline TransferTicket TransferQueue::get_submitted_ticket() const { return submitted_ticket_; }
+  inline TransferTicket TransferQueue::get_last_ticket() const
+  {
+    return recording_ ? submitted_ticket_ + 1 : submitted_ticket_;
+  }
+} // namespace core
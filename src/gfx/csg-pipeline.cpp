@@ -1,14 +1,25 @@
 #include "gfx/csg-pipeline.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <iostream>
+#include <limits>
 #include <string>
 
+#include "core/command-pools.h"
 #include "core/engine.h"
+#include "core/profiler.h"
+#include "core/trace-recorder.h"
 
 namespace gfx
 {
   void CSGPipeline::init()
   {
+    // Fragments are appended to the A-buffer from the fragment shader.
+    abuffer_supported_ =
+        core::Engine::get_singleton().get_enabled_features().fragmentStoresAndAtomics;
+
     create_pipeline_layout();
     create_descriptor_set();
     create_pipeline_cache();
@@ -18,148 +29,177 @@ namespace gfx
     create_shader_module("depth.frag.spv", &depth_shader_);
     create_shader_module("csg-diff-frontface.frag.spv", &frontface_shader_);
     create_shader_module("csg-diff.vert.spv", &vertex_frontface_shader_);
+    create_shader_module("csg-stencil.frag.spv", &stencil_shader_);
+    create_shader_module("csg-stencil-clear.vert.spv", &stencil_clear_shader_);
+    create_shader_module("csg-stencil-restore.frag.spv", &stencil_restore_shader_);
+
+    if (abuffer_supported_)
+    {
+      create_shader_module("csg-abuffer-append.frag.spv", &append_shader_);
+      create_shader_module("csg-abuffer-resolve.comp.spv", &resolve_shader_);
+      create_shader_module("csg-abuffer-composite.frag.spv", &composite_shader_);
+    }
 
     create_graphics_pipeline();
     create_uniform_buffer();
-    create_depth_image(ray_enter_image_, ray_enter_view_, ray_enter_sampler_, ray_enter_memory_);
-    create_depth_image(ray_leave_image_, ray_leave_view_, ray_leave_sampler_, ray_leave_memory_);
-    create_depth_image(back_depth_image_, back_depth_view_, back_depth_sampler_,
-                       back_depth_memory_);
+    create_targets();
+    bind_depth_images();
+
+    if (abuffer_supported_)
+    {
+      create_compute_pipeline();
+      create_abuffer_counters();
+      bind_abuffer();
+    }
+    else
+      std::clog << "csg: fragment stores are not supported, the A-buffer mode is disabled\n";
+  }
 
+  void CSGPipeline::update(const types::Matrix4& view, const types::Matrix4& projection,
+                           std::span<const CSGPair> pairs)
+  {
     auto& engine = core::Engine::get_singleton();
+    auto frame = engine.get_current_frame();
 
-    const VkExtent3D image_extent = {
-      .width = 800,
-      .height = 600,
-      .depth = 1,
-    };
+    std::memcpy(uniform_buffers_data_[engine.get_current_frame()], view.data(), 16 * sizeof(float));
+    std::memcpy(uniform_buffers_data_[engine.get_current_frame()] + 64, projection.data(),
+                16 * sizeof(float));
 
-    const VkImageCreateInfo mask_image_create_info = {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .imageType = VK_IMAGE_TYPE_2D,
-      .format = VK_FORMAT_R8_UNORM,
-      .extent = image_extent,
-      .mipLevels = 1,
-      .arrayLayers = 1,
-      .samples = VK_SAMPLE_COUNT_1_BIT,
-      .tiling = VK_IMAGE_TILING_OPTIMAL,
-      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT
-          | VK_IMAGE_USAGE_SAMPLED_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-      .queueFamilyIndexCount = 0,
-      .pQueueFamilyIndices = nullptr,
-      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-    };
+    // TODO: Update and bind textures descriptor sets
 
-    engine.create_image(mask_image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mask_image_,
-                        mask_memory_);
+    ImGui::Checkbox("Active", &active_);
 
-    const VkComponentMapping components = {
-      .r = VK_COMPONENT_SWIZZLE_R,
-      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
-      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
-      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
-    };
+    int mode = static_cast<int>(mode_);
+    if (ImGui::Combo("CSG mode", &mode, "Depth images\0Stencil\0A-buffer\0"))
+      mode_ = static_cast<CSGMode>(mode);
 
-    const VkImageSubresourceRange subresource_range = {
-      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-      .baseMipLevel = 0,
-      .levelCount = 1,
-      .baseArrayLayer = 0,
-      .layerCount = 1,
-    };
+    if (abuffer_supported_)
+    {
+      // The counters of this frame were last written frames in flight ago, the fence of the
+      // frame has been waited on since. Overflowing pairs were already drawn through the
+      // stencil passes by then, this only reports it.
+      auto counter = static_cast<uint32_t*>(counter_buffers_allocation_[frame].data);
+      bool overflowed = counter[1] != 0;
+      if (overflowed && !abuffer_overflowed_)
+      {
+        std::clog << "csg: a pair overflowed the " << node_capacity_
+                  << " fragments of the A-buffer, drawing it through the stencil passes\n";
+      }
 
-    const VkImageViewCreateInfo view_info = {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .image = mask_image_,
-      .viewType = VK_IMAGE_VIEW_TYPE_2D,
-      .format = VK_FORMAT_R8_UNORM,
-      .components = components,
-      .subresourceRange = subresource_range,
-    };
+      abuffer_overflowed_ = overflowed;
+      counter[1] = 0;
+    }
+    else if (mode_ == CSGMode::ABuffer)
+      mode_ = CSGMode::DepthImages;
 
-    VkResult result = vkCreateImageView(engine.get_device(), &view_info, nullptr, &mask_view_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create image view");
+    view_ = view;
+    projection_ = projection;
 
-    const VkSamplerCreateInfo sampler_info = {
-      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .magFilter = VK_FILTER_NEAREST,
-      .minFilter = VK_FILTER_NEAREST,
-      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
-      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .mipLodBias = 0.0f,
-      .anisotropyEnable = VK_FALSE,
-      .maxAnisotropy = 0.0f,
-      .compareEnable = VK_FALSE,
-      .compareOp = VK_COMPARE_OP_NEVER,
-      .minLod = 0.0f,
-      .maxLod = 0.0f,
-      .borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
-      .unnormalizedCoordinates = VK_FALSE,
-    };
+    pairs_.assign(pairs.begin(), pairs.end());
+    pair_areas_.resize(pairs_.size());
+    pair_commands_.resize(pairs_.size());
 
-    result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &mask_sampler_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create sampler");
+    auto intersect = [](const VkRect2D& a, const VkRect2D& b) -> VkRect2D {
+      int32_t left = std::max(a.offset.x, b.offset.x);
+      int32_t top = std::max(a.offset.y, b.offset.y);
+      int32_t right = std::min<int32_t>(a.offset.x + a.extent.width, b.offset.x + b.extent.width);
+      int32_t bottom =
+          std::min<int32_t>(a.offset.y + a.extent.height, b.offset.y + b.extent.height);
 
-    const core::TransitionLayout transition_layout = {
-      .src_access = 0,
-      .dst_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-      .dst_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
-      .aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT,
-      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .new_layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      if (right <= left || bottom <= top)
+        return {};
+
+      return { { left, top },
+               { static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) } };
     };
 
-    engine.transition_image_layout(mask_image_, VK_FORMAT_R8_UNORM, 1, transition_layout);
+    auto unite = [](const VkRect2D& a, const VkRect2D& b) -> VkRect2D {
+      if (a.extent.width == 0)
+        return b;
+      if (b.extent.width == 0)
+        return a;
 
-    bind_depth_images();
+      int32_t left = std::min(a.offset.x, b.offset.x);
+      int32_t top = std::min(a.offset.y, b.offset.y);
+      int32_t right = std::max<int32_t>(a.offset.x + a.extent.width, b.offset.x + b.extent.width);
+      int32_t bottom =
+          std::max<int32_t>(a.offset.y + a.extent.height, b.offset.y + b.extent.height);
+
+      return { { left, top },
+               { static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) } };
+    };
+
+    // The substractive mesh can only carve where both meshes cover the screen, elsewhere the
+    // mesh is drawn as is. The mask pass still clears the mask under every front face.
+    for (size_t i = 0; i < pairs_.size(); i++)
+    {
+      const auto& pair = pairs_[i];
+      auto mesh_area = project_bounds(*pair.mesh, pair.transform);
+      auto substractive_area =
+          project_bounds(*pair.substractive_mesh, pair.substractive_transform);
+
+      pair_areas_[i] = {
+        .overlap = active_ ? intersect(mesh_area, substractive_area) : VkRect2D{},
+        .frontface = active_ ? mesh_area : unite(mesh_area, substractive_area),
+      };
+    }
   }
 
-  void CSGPipeline::draw(VkImageView image_view, VkImageView depth_view,
-                         VkCommandBuffer command_buffer, const types::Matrix4& view,
-                         const types::Matrix4& projection, scene::Mesh& mesh,
-                         scene::Mesh& substractive_mesh)
+  void CSGPipeline::record(uint32_t index)
   {
-    auto& engine = core::Engine::get_singleton();
-    auto extent = engine.get_swapchain_extent();
+    core::TraceScope scope("csg record");
+    const auto& pair = pairs_[index];
+    const auto& areas = pair_areas_[index];
+    auto& commands = pair_commands_[index];
 
-    std::memcpy(uniform_buffers_data_[engine.get_current_frame()], view.data(), 16 * sizeof(float));
-    std::memcpy(uniform_buffers_data_[engine.get_current_frame()] + 64, projection.data(),
-                16 * sizeof(float));
+    // Passes culled by draw() are not recorded.
+    commands = {};
 
-    // TODO: Update and bind textures descriptor sets
+    if (mode_ == CSGMode::Stencil)
+    {
+      if (areas.frontface.extent.width != 0)
+        commands.stencil = record_stencil(pair, areas);
+      return;
+    }
 
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1,
-                            &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+    // The resolve pass evaluates the pair wherever the mesh is, overlapping or not.
+    if (mode_ == CSGMode::ABuffer)
+    {
+      if (areas.frontface.extent.width != 0)
+      {
+        commands.abuffer_append = record_abuffer_append(pair, areas.frontface);
+        commands.abuffer_composite = record_abuffer_composite(pair, areas);
+      }
+      return;
+    }
 
-    const VkViewport viewport{
-      .x = 0.0f,
-      .y = 0.0f,
-      .width = static_cast<float>(extent.width),
-      .height = static_cast<float>(extent.height),
-      .minDepth = 0.0f,
-      .maxDepth = 1.0f,
-    };
+    if (areas.overlap.extent.width != 0)
+    {
+      commands.ray_enter =
+          record_depth(*pair.mesh, pair.transform, VK_CULL_MODE_BACK_BIT, areas.overlap);
+      commands.ray_leave =
+          record_depth(*pair.mesh, pair.transform, VK_CULL_MODE_FRONT_BIT, areas.overlap);
+      commands.back_depth = record_depth(*pair.substractive_mesh, pair.substractive_transform,
+                                         VK_CULL_MODE_BACK_BIT, areas.overlap);
+    }
+
+    if (areas.frontface.extent.width != 0)
+    {
+      commands.mask = record_mask(pair, areas.overlap);
+      commands.frontface = record_frontface(pair, areas.frontface);
+    }
+  }
+
+  void CSGPipeline::draw(VkImageView image_view, VkImage depth_image, VkImageView depth_view,
+                         VkCommandBuffer command_buffer) const
+  {
+    auto extent = core::Engine::get_singleton().get_render_extent();
 
-    const VkRect2D scissor = {
+    const VkRect2D render_area = {
       .offset = { 0, 0 },
       .extent = extent,
     };
 
-    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
-    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
-
     const VkClearValue clear_value = {};
     const VkRenderingAttachmentInfo attachments[] = {
       {
@@ -188,6 +228,8 @@ namespace gfx
       },
     };
 
+    // The scene depth is cleared once a frame, so pairs drawn later are hidden by the ones in
+    // front of them.
     const VkClearValue depth_clear_value = { .depthStencil = { .depth = 1.0f, .stencil = 0 } };
     const VkRenderingAttachmentInfo depth_attachment = {
       .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
@@ -197,20 +239,15 @@ namespace gfx
       .resolveMode = VK_RESOLVE_MODE_NONE,
       .resolveImageView = VK_NULL_HANDLE,
       .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
       .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
       .clearValue = depth_clear_value,
     };
 
-    const VkRect2D render_area = {
-      .offset = { 0, 0 },
-      .extent = extent,
-    };
-
-    const VkRenderingInfo rendering_info = {
+    VkRenderingInfo rendering_info = {
       .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
       .pNext = nullptr,
-      .flags = 0,
+      .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
       .renderArea = render_area,
       .layerCount = 1,
       .viewMask = 0,
@@ -220,153 +257,223 @@ namespace gfx
       .pStencilAttachment = nullptr,
     };
 
-    vkCmdSetStencilWriteMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, 0xFF);
-    vkCmdSetStencilCompareMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, 0xFF);
+    const VkRenderingAttachmentInfo frontface_attachments[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+          .pNext = nullptr,
+          .imageView = image_view,
+          .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+          .resolveMode = VK_RESOLVE_MODE_NONE,
+          .resolveImageView = VK_NULL_HANDLE,
+          .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+          .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+          .clearValue = clear_value,
+      },
+    };
 
-    static bool active = false;
-    ImGui::Checkbox("Active", &active);
+    VkRenderingInfo frontface_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+      .renderArea = render_area,
+      .layerCount = 1,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachments = frontface_attachments,
+      .pDepthAttachment = &depth_attachment,
+      .pStencilAttachment = nullptr,
+    };
 
-    {
-      render_depth(command_buffer, mesh, substractive_mesh);
+    const VkRenderingAttachmentInfo depth_attachments[] = {
+      get_depth_attachment(ray_enter_view_),
+      get_depth_attachment(ray_leave_view_),
+      get_depth_attachment(back_depth_view_),
+    };
 
-      const VkImageSubresourceRange subresource_range = {
-        .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
-        .baseMipLevel = 0,
-        .levelCount = 1,
-        .baseArrayLayer = 0,
+    VkRenderingInfo depth_rendering_infos[3];
+    for (size_t i = 0; i < 3; i++)
+    {
+      depth_rendering_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .pNext = nullptr,
+        .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+        .renderArea = render_area,
         .layerCount = 1,
+        .viewMask = 0,
+        .colorAttachmentCount = 0,
+        .pColorAttachments = nullptr,
+        .pDepthAttachment = &depth_attachments[i],
+        .pStencilAttachment = nullptr,
       };
+    }
 
-      const VkImageMemoryBarrier ray_enter_memory_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = ray_enter_image_,
-        .subresourceRange = subresource_range,
-      };
+    const VkImageMemoryBarrier depth_read_barriers[] = {
+      get_depth_barrier(ray_enter_image_, true),
+      get_depth_barrier(ray_leave_image_, true),
+      get_depth_barrier(back_depth_image_, true),
+    };
 
-      const VkImageMemoryBarrier ray_leave_memory_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = ray_leave_image_,
-        .subresourceRange = subresource_range,
-      };
+    const VkImageMemoryBarrier depth_write_barriers[] = {
+      get_depth_barrier(ray_enter_image_, false),
+      get_depth_barrier(ray_leave_image_, false),
+      get_depth_barrier(back_depth_image_, false),
+    };
 
-      const VkImageMemoryBarrier back_depth_memory_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = back_depth_image_,
-        .subresourceRange = subresource_range,
-      };
+    const VkImageSubresourceRange mask_subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
 
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &ray_enter_memory_barrier);
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &ray_leave_memory_barrier);
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &back_depth_memory_barrier);
+    const VkImageMemoryBarrier mask_memory_barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = mask_image_,
+      .subresourceRange = mask_subresource_range,
+    };
 
-      VkDeviceSize offset = 0;
-      VkBuffer vertex_buffer;
+    const VkImageMemoryBarrier mask_memory_barrier2 = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+      .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = mask_image_,
+      .subresourceRange = mask_subresource_range,
+    };
 
-      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_);
-      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 1,
-                              1, &textures_descriptor_sets_[engine.get_current_frame()], 0,
-                              nullptr);
+    // Only the stencil aspect is cleared, the surfaces of each pair are counted from zero.
+    const VkRenderingAttachmentInfo stencil_attachment = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = depth_view,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+      .clearValue = depth_clear_value,
+    };
 
-      vkCmdBeginRendering(command_buffer, &rendering_info);
+    VkRenderingInfo stencil_rendering_info = frontface_rendering_info;
+    stencil_rendering_info.pStencilAttachment = &stencil_attachment;
 
-      if (active)
-      {
-        vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
-                           substractive_mesh.cframe.to_matrix().data());
+    // Every pair loads the color and depth the pair before stored.
+    const VkMemoryBarrier stencil_barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask =
+          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    };
 
-        int minus_one = -1;
-        vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64, 4,
-                           &minus_one);
+    auto& profiler = core::Profiler::get_singleton();
 
-        vkCmdSetCullMode(command_buffer, VK_CULL_MODE_FRONT_BIT);
+    // Times of the same pass add up over the pairs.
+    auto execute_profiled = [&](const char* name, const VkRenderingInfo& info,
+                                VkCommandBuffer secondary_command_buffer) {
+      uint32_t query = profiler.begin_gpu(command_buffer, name);
+      execute_rendering(command_buffer, info, secondary_command_buffer);
+      profiler.end_gpu(command_buffer, query);
+    };
 
-        vertex_buffer = substractive_mesh.get_vertex_buffer();
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
-        vkCmdBindIndexBuffer(command_buffer, substractive_mesh.get_index_buffer(), offset,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(command_buffer, substractive_mesh.get_index_count(), 1, 0, 0, 0);
+    // A single rendering pass per pair, preceded by a copy of the scene depth it carves through.
+    if (mode_ == CSGMode::Stencil)
+    {
+      for (size_t i = 0; i < pair_commands_.size(); i++)
+      {
+        const auto& areas = pair_areas_[i];
+        if (areas.frontface.extent.width == 0)
+          continue;
+
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                             0, 1, &stencil_barrier, 0, nullptr, 0, nullptr);
+
+        if (areas.overlap.extent.width != 0)
+          save_depth(command_buffer, depth_image, areas.overlap);
+
+        stencil_rendering_info.renderArea = areas.frontface;
+        execute_profiled("csg stencil", stencil_rendering_info, pair_commands_[i].stencil);
       }
 
-      vkCmdEndRendering(command_buffer);
+      return;
+    }
+
+    if (mode_ == CSGMode::ABuffer)
+    {
+      auto frame = core::Engine::get_singleton().get_current_frame();
 
-      const VkImageMemoryBarrier ray_enter_memory_barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      VkRenderingInfo append_rendering_info = {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
         .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = ray_enter_image_,
-        .subresourceRange = subresource_range,
+        .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+        .renderArea = render_area,
+        .layerCount = 1,
+        .viewMask = 0,
+        .colorAttachmentCount = 0,
+        .pColorAttachments = nullptr,
+        .pDepthAttachment = nullptr,
+        .pStencilAttachment = nullptr,
       };
 
-      const VkImageMemoryBarrier ray_leave_memory_barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      // The stencil is only used by the fallback of a pair that overflowed.
+      VkRenderingInfo composite_rendering_info = frontface_rendering_info;
+      composite_rendering_info.pStencilAttachment = &stencil_attachment;
+
+      const VkMemoryBarrier transfer_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
         .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = ray_leave_image_,
-        .subresourceRange = subresource_range,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
       };
 
-      const VkImageMemoryBarrier back_depth_memory_barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      const VkMemoryBarrier append_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
         .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = back_depth_image_,
-        .subresourceRange = subresource_range,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
       };
 
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &ray_enter_memory_barrier2);
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &ray_leave_memory_barrier2);
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-                           VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &back_depth_memory_barrier2);
+      const VkMemoryBarrier resolve_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .pNext = nullptr,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      };
 
-      // Render front
-      const VkImageSubresourceRange mask_subresource_range = {
+      const VkMemoryBarrier indirect_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .pNext = nullptr,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+      };
+
+      const VkMemoryBarrier composite_barriers[] = {
+        resolve_barrier,
+        indirect_barrier,
+        stencil_barrier,
+      };
+
+      const VkImageSubresourceRange heads_subresource_range = {
         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .baseMipLevel = 0,
         .levelCount = 1,
@@ -374,97 +481,143 @@ namespace gfx
         .layerCount = 1,
       };
 
-      const VkImageMemoryBarrier mask_memory_barrier = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = mask_image_,
-        .subresourceRange = mask_subresource_range,
-      };
+      const VkClearColorValue heads_clear_value = { .uint32 = { CSG_ABUFFER_END, 0, 0, 0 } };
+      bool heads_cleared = false;
 
-      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
-                           &mask_memory_barrier);
+      // Pairs share the A-buffer and the resolved images, so they run one after the other. The
+      // lists are cleared once a frame, then emptied by the resolve pass as it reads them.
+      for (size_t i = 0; i < pair_commands_.size(); i++)
+      {
+        const auto& commands = pair_commands_[i];
+        const auto& areas = pair_areas_[i];
+
+        if (areas.frontface.extent.width == 0)
+          continue;
 
-      const VkRenderingAttachmentInfo frontface_attachments[] = {
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                                 | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &transfer_barrier, 0, nullptr,
+                             0, nullptr);
+
+        if (!heads_cleared)
         {
-            .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-            .pNext = nullptr,
-            .imageView = image_view,
-            .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-            .resolveMode = VK_RESOLVE_MODE_NONE,
-            .resolveImageView = VK_NULL_HANDLE,
-            .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-            .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
-            .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-            .clearValue = clear_value,
-        },
-      };
+          vkCmdClearColorImage(command_buffer, heads_image_, VK_IMAGE_LAYOUT_GENERAL,
+                               &heads_clear_value, 1, &heads_subresource_range);
+          heads_cleared = true;
+        }
+
+        vkCmdFillBuffer(command_buffer, counter_buffers_[frame], 0, sizeof(uint32_t), 0);
+
+        vkCmdPipelineBarrier(
+            command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &append_barrier, 0, nullptr, 0, nullptr);
+
+        append_rendering_info.renderArea = areas.frontface;
+        execute_profiled("csg a-buffer append", append_rendering_info, commands.abuffer_append);
+
+        // The composite of the pair before has read the resolved images and the indirect
+        // draws by then.
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                                 | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &resolve_barrier, 0,
+                             nullptr, 0, nullptr);
+
+        const auto& pair = pairs_[i];
+        const struct
+        {
+          VkOffset2D origin;
+          VkExtent2D size;
+          uint32_t carve;
+          uint32_t index_counts[2];
+        } resolve_constants = {
+          .origin = areas.frontface.offset,
+          .size = areas.frontface.extent,
+          .carve = active_,
+          .index_counts = { pair.mesh->get_index_count(),
+                            pair.substractive_mesh->get_index_count() },
+        };
+
+        uint32_t query = profiler.begin_gpu(command_buffer, "csg a-buffer resolve");
+        vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, resolve_pipeline_);
+        vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                resolve_pipeline_layout_, 0, 1, &abuffer_descriptor_sets_[frame],
+                                0, nullptr);
+        vkCmdPushConstants(command_buffer, resolve_pipeline_layout_, VK_SHADER_STAGE_COMPUTE_BIT,
+                           0, sizeof(resolve_constants), &resolve_constants);
+        vkCmdDispatch(command_buffer, (areas.frontface.extent.width + 7) / 8,
+                      (areas.frontface.extent.height + 7) / 8, 1);
+        profiler.end_gpu(command_buffer, query);
+
+        // The fallback carves through to the scene depth, whether it runs is only known on
+        // the device.
+        if (areas.overlap.extent.width != 0)
+          save_depth(command_buffer, depth_image, areas.overlap);
+
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT
+                                 | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                             VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+                                 | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT
+                                 | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                             0, 3, composite_barriers, 0, nullptr, 0, nullptr);
+
+        composite_rendering_info.renderArea = areas.frontface;
+        execute_profiled("csg a-buffer composite", composite_rendering_info,
+                         commands.abuffer_composite);
+      }
 
-      const VkRenderingInfo frontface_rendering_info = {
-        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
-        .pNext = nullptr,
-        .flags = 0,
-        .renderArea = render_area,
-        .layerCount = 1,
-        .viewMask = 0,
-        .colorAttachmentCount = 1,
-        .pColorAttachments = frontface_attachments,
-        .pDepthAttachment = &depth_attachment,
-        .pStencilAttachment = nullptr,
-      };
-
-      vkCmdBeginRendering(command_buffer, &frontface_rendering_info);
+      return;
+    }
 
-      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, frontface_pipeline_);
+    // Pairs share the intermediate images, so their passes run one pair after the other. Only
+    // the barriers and the rendering scopes are recorded here, the draws were recorded by
+    // record() on the thread pool. Each pass only covers the screen area of its pair.
+    for (size_t i = 0; i < pair_commands_.size(); i++)
+    {
+      const auto& commands = pair_commands_[i];
+      const auto& areas = pair_areas_[i];
 
-      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              frontface_pipeline_layout_, 0, 1,
-                              &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+      if (areas.frontface.extent.width == 0)
+        continue;
 
-      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              frontface_pipeline_layout_, 1, 1,
-                              &frontface_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
-      vkCmdSetCullMode(command_buffer, VK_CULL_MODE_BACK_BIT);
+      // Without overlap the mask pass only clears the mask, the depth images are never read.
+      bool carved = areas.overlap.extent.width != 0;
 
-      if (!active)
+      if (carved)
       {
-        vkCmdPushConstants(command_buffer, frontface_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT,
-                           0, 64, substractive_mesh.cframe.to_matrix().data());
-
-        vertex_buffer = substractive_mesh.get_vertex_buffer();
-        vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
-        vkCmdBindIndexBuffer(command_buffer, substractive_mesh.get_index_buffer(), offset,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdDrawIndexed(command_buffer, substractive_mesh.get_index_count(), 1, 0, 0, 0);
+        for (auto& depth_rendering_info : depth_rendering_infos)
+          depth_rendering_info.renderArea = areas.overlap;
+
+        execute_profiled("csg ray enter", depth_rendering_infos[0], commands.ray_enter);
+        execute_profiled("csg ray leave", depth_rendering_infos[1], commands.ray_leave);
+        execute_profiled("csg back depth", depth_rendering_infos[2], commands.back_depth);
+
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 3,
+                             depth_read_barriers);
       }
 
-      vkCmdPushConstants(command_buffer, frontface_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
-                         64, mesh.cframe.to_matrix().data());
+      rendering_info.renderArea = areas.frontface;
+      execute_profiled("csg mask", rendering_info, commands.mask);
 
-      vertex_buffer = mesh.get_vertex_buffer();
-      vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
-      vkCmdBindIndexBuffer(command_buffer, mesh.get_index_buffer(), offset, VK_INDEX_TYPE_UINT32);
-      vkCmdDrawIndexed(command_buffer, mesh.get_index_count(), 1, 0, 0, 0);
-      vkCmdEndRendering(command_buffer);
+      if (carved)
+      {
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr,
+                             3, depth_write_barriers);
+      }
 
-      const VkImageMemoryBarrier mask_memory_barrier2 = {
-        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .pNext = nullptr,
-        .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
-        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
-        .oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .image = mask_image_,
-        .subresourceRange = mask_subresource_range,
-      };
+      // Render front
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                           VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1,
+                           &mask_memory_barrier);
+
+      frontface_rendering_info.renderArea = areas.frontface;
+      execute_profiled("csg frontface", frontface_rendering_info, commands.frontface);
 
       vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr,
@@ -472,6 +625,17 @@ namespace gfx
     }
   }
 
+  void CSGPipeline::resize()
+  {
+    // Only called with the device idle.
+    destroy_targets();
+    create_targets();
+    bind_depth_images();
+
+    if (abuffer_supported_)
+      bind_abuffer();
+  }
+
   void CSGPipeline::free()
   {
     auto& engine = core::Engine::get_singleton();
@@ -479,53 +643,51 @@ namespace gfx
     vkDestroyPipeline(engine.get_device(), pipeline_, nullptr);
     vkDestroyPipeline(engine.get_device(), depth_pipeline_, nullptr);
     vkDestroyPipeline(engine.get_device(), frontface_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), stencil_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), stencil_color_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), stencil_restore_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), append_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), resolve_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), composite_pipeline_, nullptr);
 
     vkDestroyShaderModule(engine.get_device(), fragment_shader_, nullptr);
     vkDestroyShaderModule(engine.get_device(), vertex_shader_, nullptr);
     vkDestroyShaderModule(engine.get_device(), depth_shader_, nullptr);
     vkDestroyShaderModule(engine.get_device(), frontface_shader_, nullptr);
     vkDestroyShaderModule(engine.get_device(), vertex_frontface_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), stencil_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), stencil_clear_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), stencil_restore_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), append_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), resolve_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), composite_shader_, nullptr);
 
     vkDestroyPipelineCache(engine.get_device(), pipeline_cache_, nullptr);
 
     for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-    {
-      vkUnmapMemory(engine.get_device(), uniform_buffers_memory_[i]);
-      vkDestroyBuffer(engine.get_device(), uniform_buffers_[i], nullptr);
-      vkFreeMemory(engine.get_device(), uniform_buffers_memory_[i], nullptr);
-    }
+      engine.destroy_buffer(uniform_buffers_[i], uniform_buffers_allocation_[i]);
+
+    for (size_t i = 0; i < counter_buffers_.size(); i++)
+      engine.destroy_buffer(counter_buffers_[i], counter_buffers_allocation_[i]);
 
     vkFreeDescriptorSets(engine.get_device(), descriptor_pool_, 1, ubo_descriptor_sets_.data());
     vkFreeDescriptorSets(engine.get_device(), descriptor_pool_, 1,
                          textures_descriptor_sets_.data());
     vkFreeDescriptorSets(engine.get_device(), descriptor_pool_, 1,
                          frontface_descriptor_sets_.data());
+    vkFreeDescriptorSets(engine.get_device(), descriptor_pool_, 1,
+                         abuffer_descriptor_sets_.data());
     vkDestroyDescriptorPool(engine.get_device(), descriptor_pool_, nullptr);
     vkDestroyPipelineLayout(engine.get_device(), pipeline_layout_, nullptr);
     vkDestroyPipelineLayout(engine.get_device(), frontface_pipeline_layout_, nullptr);
+    vkDestroyPipelineLayout(engine.get_device(), abuffer_pipeline_layout_, nullptr);
+    vkDestroyPipelineLayout(engine.get_device(), resolve_pipeline_layout_, nullptr);
     vkDestroyDescriptorSetLayout(engine.get_device(), ubo_descriptor_set_layout_, nullptr);
     vkDestroyDescriptorSetLayout(engine.get_device(), textures_descriptor_set_layout_, nullptr);
     vkDestroyDescriptorSetLayout(engine.get_device(), frontface_descriptor_set_layout_, nullptr);
+    vkDestroyDescriptorSetLayout(engine.get_device(), abuffer_descriptor_set_layout_, nullptr);
 
-    vkDestroySampler(engine.get_device(), ray_enter_sampler_, nullptr);
-    vkDestroyImageView(engine.get_device(), ray_enter_view_, nullptr);
-    vkDestroyImage(engine.get_device(), ray_enter_image_, nullptr);
-    vkFreeMemory(engine.get_device(), ray_enter_memory_, nullptr);
-
-    vkDestroySampler(engine.get_device(), ray_leave_sampler_, nullptr);
-    vkDestroyImageView(engine.get_device(), ray_leave_view_, nullptr);
-    vkDestroyImage(engine.get_device(), ray_leave_image_, nullptr);
-    vkFreeMemory(engine.get_device(), ray_leave_memory_, nullptr);
-
-    vkDestroySampler(engine.get_device(), back_depth_sampler_, nullptr);
-    vkDestroyImageView(engine.get_device(), back_depth_view_, nullptr);
-    vkDestroyImage(engine.get_device(), back_depth_image_, nullptr);
-    vkFreeMemory(engine.get_device(), back_depth_memory_, nullptr);
-
-    vkDestroySampler(engine.get_device(), mask_sampler_, nullptr);
-    vkDestroyImageView(engine.get_device(), mask_view_, nullptr);
-    vkDestroyImage(engine.get_device(), mask_image_, nullptr);
-    vkFreeMemory(engine.get_device(), mask_memory_, nullptr);
+    destroy_targets();
   }
 
   void CSGPipeline::create_pipeline_layout()
@@ -570,13 +732,21 @@ namespace gfx
           .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
           .pImmutableSamplers = nullptr,
       },
+      // Scene depth saved before a pair, restored by the stencil passes.
+      {
+          .binding = 3,
+          .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .pImmutableSamplers = nullptr,
+      },
     };
 
     const VkDescriptorSetLayoutCreateInfo textures_descriptor_set_layout_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .bindingCount = 3,
+      .bindingCount = 4,
       .pBindings = texture_layout_bindings,
     };
 
@@ -613,6 +783,38 @@ namespace gfx
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create descriptor set layout");
 
+    // Heads, nodes, counters, then the resolved color and depth.
+    const VkDescriptorType abuffer_types[] = {
+      VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+      VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+    };
+
+    VkDescriptorSetLayoutBinding abuffer_bindings[5];
+    for (uint32_t i = 0; i < 5; i++)
+    {
+      abuffer_bindings[i] = {
+        .binding = i,
+        .descriptorType = abuffer_types[i],
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT,
+        .pImmutableSamplers = nullptr,
+      };
+    }
+
+    const VkDescriptorSetLayoutCreateInfo abuffer_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .bindingCount = 5,
+      .pBindings = abuffer_bindings,
+    };
+
+    result = vkCreateDescriptorSetLayout(engine.get_device(), &abuffer_layout_info, nullptr,
+                                         &abuffer_descriptor_set_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create descriptor set layout");
+
     const VkPushConstantRange push_constant_ranges[] = {
       {
           .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
@@ -668,6 +870,63 @@ namespace gfx
                                     nullptr, &frontface_pipeline_layout_);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create pipeline layout");
+
+    // The append pass pushes the operand of the mesh after the constants of csg.vert.
+    const VkPushConstantRange abuffer_push_constant_ranges[] = {
+      {
+          .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+          .offset = 0,
+          .size = 68,
+      },
+      {
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .offset = 68,
+          .size = 4,
+      },
+    };
+
+    std::vector<VkDescriptorSetLayout> abuffer_descriptor_layouts = {
+      ubo_descriptor_set_layout_,
+      abuffer_descriptor_set_layout_,
+    };
+
+    const VkPipelineLayoutCreateInfo abuffer_pipeline_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .setLayoutCount = 2,
+      .pSetLayouts = abuffer_descriptor_layouts.data(),
+      .pushConstantRangeCount = 2,
+      .pPushConstantRanges = abuffer_push_constant_ranges,
+    };
+
+    result = vkCreatePipelineLayout(engine.get_device(), &abuffer_pipeline_layout_create_info,
+                                    nullptr, &abuffer_pipeline_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create pipeline layout");
+
+    // Origin, size and carving of the area resolved, then the index counts of the meshes for
+    // the indirect draws of the stencil passes.
+    const VkPushConstantRange resolve_push_constant_range = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = 28,
+    };
+
+    const VkPipelineLayoutCreateInfo resolve_pipeline_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .setLayoutCount = 1,
+      .pSetLayouts = &abuffer_descriptor_set_layout_,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &resolve_push_constant_range,
+    };
+
+    result = vkCreatePipelineLayout(engine.get_device(), &resolve_pipeline_layout_create_info,
+                                    nullptr, &resolve_pipeline_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create pipeline layout");
   }
 
   void CSGPipeline::create_descriptor_set()
@@ -681,7 +940,15 @@ namespace gfx
       },
       {
           .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-          .descriptorCount = MAX_FRAMES_IN_FLIGHT * 4,
+          .descriptorCount = MAX_FRAMES_IN_FLIGHT * 5,
+      },
+      {
+          .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+          .descriptorCount = MAX_FRAMES_IN_FLIGHT * 3,
+      },
+      {
+          .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .descriptorCount = MAX_FRAMES_IN_FLIGHT * 2,
       },
     };
 
@@ -689,8 +956,8 @@ namespace gfx
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
       .pNext = nullptr,
       .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
-      .maxSets = MAX_FRAMES_IN_FLIGHT * 3,
-      .poolSizeCount = 2,
+      .maxSets = MAX_FRAMES_IN_FLIGHT * 4,
+      .poolSizeCount = 4,
       .pPoolSizes = pool_sizes,
     };
 
@@ -705,6 +972,8 @@ namespace gfx
                                                         textures_descriptor_set_layout_);
     std::vector<VkDescriptorSetLayout> frontface_layouts(MAX_FRAMES_IN_FLIGHT,
                                                          frontface_descriptor_set_layout_);
+    std::vector<VkDescriptorSetLayout> abuffer_layouts(MAX_FRAMES_IN_FLIGHT,
+                                                       abuffer_descriptor_set_layout_);
 
     const VkDescriptorSetAllocateInfo ubo_descriptor_set_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
@@ -730,6 +999,14 @@ namespace gfx
       .pSetLayouts = frontface_layouts.data(),
     };
 
+    const VkDescriptorSetAllocateInfo abuffer_descriptor_set_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .descriptorPool = descriptor_pool_,
+      .descriptorSetCount = MAX_FRAMES_IN_FLIGHT,
+      .pSetLayouts = abuffer_layouts.data(),
+    };
+
     ubo_descriptor_sets_.resize(MAX_FRAMES_IN_FLIGHT);
     result = vkAllocateDescriptorSets(engine.get_device(), &ubo_descriptor_set_info,
                                       ubo_descriptor_sets_.data());
@@ -747,6 +1024,12 @@ namespace gfx
                                       frontface_descriptor_sets_.data());
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to allocate descriptor set");
+
+    abuffer_descriptor_sets_.resize(MAX_FRAMES_IN_FLIGHT);
+    result = vkAllocateDescriptorSets(engine.get_device(), &abuffer_descriptor_set_info,
+                                      abuffer_descriptor_sets_.data());
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate descriptor set");
   }
 
   void CSGPipeline::create_pipeline_cache()
@@ -1133,112 +1416,881 @@ namespace gfx
                                        &frontface_pipeline_);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create graphics pipeline");
-  }
 
-  void CSGPipeline::create_uniform_buffer()
-  {
-    auto& engine = core::Engine::get_singleton();
-    VkDeviceSize buffer_size = 128;
-
-    uniform_buffers_.resize(MAX_FRAMES_IN_FLIGHT);
-    uniform_buffers_memory_.resize(MAX_FRAMES_IN_FLIGHT);
-    uniform_buffers_data_.resize(MAX_FRAMES_IN_FLIGHT);
+    // The stencil mode renders to the scene color with the stencil of its depth buffer.
+    const VkPipelineRenderingCreateInfo stencil_rendering_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &frontface_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+    };
 
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
-    {
-      const VkBufferCreateInfo buffer_create_info = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .pNext = nullptr,
-        .flags = 0,
-        .size = buffer_size,
-        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-        .queueFamilyIndexCount = 0,
-        .pQueueFamilyIndices = nullptr,
-      };
+    const VkPipelineColorBlendAttachmentState stencil_color_blend_attachment = {
+      .blendEnable = VK_FALSE,
+      .srcColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .colorBlendOp = VK_BLEND_OP_ADD,
+      .srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .alphaBlendOp = VK_BLEND_OP_ADD,
+      .colorWriteMask = 0,
+    };
 
-      engine.create_buffer(buffer_create_info,
-                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                           uniform_buffers_[i], uniform_buffers_memory_[i]);
+    const VkPipelineColorBlendStateCreateInfo stencil_color_blend_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .logicOpEnable = VK_FALSE,
+      .logicOp = VK_LOGIC_OP_COPY,
+      .attachmentCount = 1,
+      .pAttachments = &stencil_color_blend_attachment,
+      .blendConstants = { 0.0f, 0.0f, 0.0f, 0.0f },
+    };
 
-      VkDeviceSize offset = 0;
-      vkMapMemory(engine.get_device(), uniform_buffers_memory_[i], offset, buffer_size, 0,
-                  &uniform_buffers_data_[i]);
+    const VkPipelineShaderStageCreateInfo stencil_shader_stage_infos[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_VERTEX_BIT,
+          .module = vertex_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = stencil_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
 
-      const VkDescriptorBufferInfo descriptor_buffer_info = {
-        .buffer = uniform_buffers_[i],
-        .offset = 0,
-        .range = buffer_size,
-      };
+    // Without a fragment shader, only depth and stencil are written.
+    const VkGraphicsPipelineCreateInfo stencil_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .pNext = &stencil_rendering_create_info,
+      .flags = 0,
+      .stageCount = 1,
+      .pStages = stencil_shader_stage_infos,
+      .pVertexInputState = &vertex_input_state,
+      .pInputAssemblyState = &input_assembly_state,
+      .pTessellationState = nullptr,
+      .pViewportState = &viewport_state,
+      .pRasterizationState = &rasterization_state,
+      .pMultisampleState = &multisample_state,
+      .pDepthStencilState = &depth_stencil_state,
+      .pColorBlendState = &stencil_color_blend_state,
+      .pDynamicState = &dynamic_state,
+      .layout = pipeline_layout_,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
 
-      const VkWriteDescriptorSet write_descriptor_set = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = nullptr,
-        .dstSet = ubo_descriptor_sets_[i],
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-        .pImageInfo = nullptr,
-        .pBufferInfo = &descriptor_buffer_info,
-        .pTexelBufferView = nullptr,
-      };
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &stencil_create_info, nullptr,
+                                       &stencil_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
 
-      vkUpdateDescriptorSets(engine.get_device(), 1, &write_descriptor_set, 0, nullptr);
-    }
-  }
+    VkGraphicsPipelineCreateInfo stencil_color_create_info = stencil_create_info;
+    stencil_color_create_info.stageCount = 2;
+    stencil_color_create_info.pColorBlendState = &frontface_color_blend_state;
 
-  void CSGPipeline::create_depth_image(VkImage& image, VkImageView& image_view, VkSampler& sampler,
-                                       VkDeviceMemory& memory)
-  {
-    auto& engine = core::Engine::get_singleton();
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &stencil_color_create_info,
+                                       nullptr, &stencil_color_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
 
-    const VkExtent3D image_extent = {
-      .width = 800,
-      .height = 600,
-      .depth = 1,
+    const VkPipelineShaderStageCreateInfo stencil_clear_shader_stage_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .stage = VK_SHADER_STAGE_VERTEX_BIT,
+      .module = stencil_clear_shader_,
+      .pName = "main",
+      .pSpecializationInfo = nullptr,
     };
 
-    const VkImageCreateInfo depth_image_create_info = {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+    const VkPipelineVertexInputStateCreateInfo stencil_clear_vertex_input_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .imageType = VK_IMAGE_TYPE_2D,
-      .format = VK_FORMAT_D32_SFLOAT,
-      .extent = image_extent,
-      .mipLevels = 1,
-      .arrayLayers = 1,
-      .samples = VK_SAMPLE_COUNT_1_BIT,
-      .tiling = VK_IMAGE_TILING_OPTIMAL,
-      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT
-          | VK_IMAGE_USAGE_SAMPLED_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-      .queueFamilyIndexCount = 0,
-      .pQueueFamilyIndices = nullptr,
-      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .vertexBindingDescriptionCount = 0,
+      .pVertexBindingDescriptions = nullptr,
+      .vertexAttributeDescriptionCount = 0,
+      .pVertexAttributeDescriptions = nullptr,
     };
 
-    engine.create_image(depth_image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image,
-                        memory);
-
-    const VkComponentMapping depth_components = {
-      .r = VK_COMPONENT_SWIZZLE_IDENTITY,
-      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
-      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
-      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
+    const VkPipelineShaderStageCreateInfo stencil_restore_shader_stage_infos[] = {
+      stencil_clear_shader_stage_info,
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = stencil_restore_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
     };
 
-    const VkImageSubresourceRange depth_subresource_range = {
-      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
-      .baseMipLevel = 0,
-      .levelCount = 1,
-      .baseArrayLayer = 0,
-      .layerCount = 1,
-    };
+    VkGraphicsPipelineCreateInfo stencil_restore_create_info = stencil_create_info;
+    stencil_restore_create_info.stageCount = 2;
+    stencil_restore_create_info.pStages = stencil_restore_shader_stage_infos;
+    stencil_restore_create_info.pVertexInputState = &stencil_clear_vertex_input_state;
 
-    const VkImageViewCreateInfo depth_view_info = {
-      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &stencil_restore_create_info,
+                                       nullptr, &stencil_restore_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+
+    if (!abuffer_supported_)
+      return;
+
+    // The append pass has no attachment, its fragment shader writes to the A-buffer only.
+    const VkPipelineRenderingCreateInfo append_rendering_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .viewMask = 0,
+      .colorAttachmentCount = 0,
+      .pColorAttachmentFormats = nullptr,
+      .depthAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+    };
+
+    const VkPipelineColorBlendStateCreateInfo append_color_blend_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .logicOpEnable = VK_FALSE,
+      .logicOp = VK_LOGIC_OP_COPY,
+      .attachmentCount = 0,
+      .pAttachments = nullptr,
+      .blendConstants = { 0.0f, 0.0f, 0.0f, 0.0f },
+    };
+
+    const VkPipelineShaderStageCreateInfo append_shader_stage_infos[] = {
+      stencil_shader_stage_infos[0],
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = append_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
+
+    const VkGraphicsPipelineCreateInfo append_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .pNext = &append_rendering_create_info,
+      .flags = 0,
+      .stageCount = 2,
+      .pStages = append_shader_stage_infos,
+      .pVertexInputState = &vertex_input_state,
+      .pInputAssemblyState = &input_assembly_state,
+      .pTessellationState = nullptr,
+      .pViewportState = &viewport_state,
+      .pRasterizationState = &rasterization_state,
+      .pMultisampleState = &multisample_state,
+      .pDepthStencilState = &depth_stencil_state,
+      .pColorBlendState = &append_color_blend_state,
+      .pDynamicState = &dynamic_state,
+      .layout = abuffer_pipeline_layout_,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
+
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &append_create_info, nullptr,
+                                       &append_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+
+    // The composite covers the area with one triangle and writes the resolved depth.
+    const VkPipelineShaderStageCreateInfo composite_shader_stage_infos[] = {
+      stencil_clear_shader_stage_info,
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = composite_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
+
+    VkGraphicsPipelineCreateInfo composite_create_info = frontface_create_info;
+    composite_create_info.pNext = &stencil_rendering_create_info;
+    composite_create_info.flags = 0;
+    composite_create_info.pStages = composite_shader_stage_infos;
+    composite_create_info.pVertexInputState = &stencil_clear_vertex_input_state;
+    composite_create_info.layout = abuffer_pipeline_layout_;
+
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &composite_create_info, nullptr,
+                                       &composite_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+  }
+
+  void CSGPipeline::create_compute_pipeline()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkComputePipelineCreateInfo resolve_create_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .stage = {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+          .module = resolve_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+      .layout = resolve_pipeline_layout_,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
+
+    VkResult result = vkCreateComputePipelines(engine.get_device(), pipeline_cache_, 1,
+                                               &resolve_create_info, nullptr, &resolve_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create compute pipeline");
+  }
+
+  void CSGPipeline::create_uniform_buffer()
+  {
+    auto& engine = core::Engine::get_singleton();
+    VkDeviceSize buffer_size = 128;
+
+    uniform_buffers_.resize(MAX_FRAMES_IN_FLIGHT);
+    uniform_buffers_allocation_.resize(MAX_FRAMES_IN_FLIGHT);
+    uniform_buffers_data_.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      const VkBufferCreateInfo buffer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .size = buffer_size,
+        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = 0,
+        .pQueueFamilyIndices = nullptr,
+      };
+
+      engine.create_buffer(buffer_create_info,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           uniform_buffers_[i], uniform_buffers_allocation_[i]);
+
+      uniform_buffers_data_[i] = uniform_buffers_allocation_[i].data;
+
+      const VkDescriptorBufferInfo descriptor_buffer_info = {
+        .buffer = uniform_buffers_[i],
+        .offset = 0,
+        .range = buffer_size,
+      };
+
+      const VkWriteDescriptorSet write_descriptor_set = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = ubo_descriptor_sets_[i],
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+        .pImageInfo = nullptr,
+        .pBufferInfo = &descriptor_buffer_info,
+        .pTexelBufferView = nullptr,
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 1, &write_descriptor_set, 0, nullptr);
+    }
+  }
+
+  void CSGPipeline::create_targets()
+  {
+    create_depth_image(ray_enter_image_, ray_enter_view_, ray_enter_sampler_,
+                       ray_enter_allocation_);
+    create_depth_image(ray_leave_image_, ray_leave_view_, ray_leave_sampler_,
+                       ray_leave_allocation_);
+    create_depth_image(back_depth_image_, back_depth_view_, back_depth_sampler_,
+                       back_depth_allocation_);
+    create_mask_image();
+    create_saved_depth_image();
+
+    if (!abuffer_supported_)
+      return;
+
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    create_storage_image(VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT, heads_image_,
+                         heads_view_, heads_allocation_);
+    create_storage_image(VK_FORMAT_R8G8B8A8_UNORM, 0, resolved_color_image_,
+                         resolved_color_view_, resolved_color_allocation_);
+    create_storage_image(VK_FORMAT_R32_SFLOAT, 0, resolved_depth_image_, resolved_depth_view_,
+                         resolved_depth_allocation_);
+
+    // A node is its depth, its shaded color and the link to the next node of the pixel. Links
+    // keep two bits for the facing and the operand.
+    node_capacity_ = std::min<VkDeviceSize>(static_cast<VkDeviceSize>(extent.width)
+                                                * extent.height * CSG_ABUFFER_FRAGMENTS_PER_PIXEL,
+                                            CSG_ABUFFER_END);
+
+    // The whole pool is bound as one storage buffer, many drivers cap those at 128 MiB.
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(engine.get_physical_device(), &properties);
+
+    VkDeviceSize max_capacity = properties.limits.maxStorageBufferRange / CSG_ABUFFER_NODE_SIZE;
+    if (node_capacity_ > max_capacity)
+    {
+      std::clog << "csg: the A-buffer is clamped to " << max_capacity << " of its "
+                << node_capacity_ << " fragments by the storage buffer range\n";
+      node_capacity_ = max_capacity;
+    }
+
+    const VkBufferCreateInfo nodes_buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .size = node_capacity_ * CSG_ABUFFER_NODE_SIZE,
+      .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+    };
+
+    engine.create_buffer(nodes_buffer_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nodes_buffer_,
+                         nodes_allocation_);
+  }
+
+  void CSGPipeline::destroy_targets()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    vkDestroySampler(engine.get_device(), ray_enter_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), ray_enter_view_, nullptr);
+    engine.destroy_image(ray_enter_image_, ray_enter_allocation_);
+
+    vkDestroySampler(engine.get_device(), ray_leave_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), ray_leave_view_, nullptr);
+    engine.destroy_image(ray_leave_image_, ray_leave_allocation_);
+
+    vkDestroySampler(engine.get_device(), back_depth_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), back_depth_view_, nullptr);
+    engine.destroy_image(back_depth_image_, back_depth_allocation_);
+
+    vkDestroySampler(engine.get_device(), mask_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), mask_view_, nullptr);
+    engine.destroy_image(mask_image_, mask_allocation_);
+
+    vkDestroySampler(engine.get_device(), saved_depth_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), saved_depth_view_, nullptr);
+    engine.destroy_image(saved_depth_image_, saved_depth_allocation_);
+
+    if (!abuffer_supported_)
+      return;
+
+    vkDestroyImageView(engine.get_device(), heads_view_, nullptr);
+    engine.destroy_image(heads_image_, heads_allocation_);
+
+    vkDestroyImageView(engine.get_device(), resolved_color_view_, nullptr);
+    engine.destroy_image(resolved_color_image_, resolved_color_allocation_);
+
+    vkDestroyImageView(engine.get_device(), resolved_depth_view_, nullptr);
+    engine.destroy_image(resolved_depth_image_, resolved_depth_allocation_);
+
+    engine.destroy_buffer(nodes_buffer_, nodes_allocation_);
+  }
+
+  void CSGPipeline::create_abuffer_counters()
+  {
+    auto& engine = core::Engine::get_singleton();
+    // Two counters, two indexed and one plain indirect draw.
+    VkDeviceSize buffer_size = CSG_ABUFFER_CLEAR_DRAW + 4 * sizeof(uint32_t);
+
+    counter_buffers_.resize(MAX_FRAMES_IN_FLIGHT);
+    counter_buffers_allocation_.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      const VkBufferCreateInfo buffer_create_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .size = buffer_size,
+        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+            | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = 0,
+        .pQueueFamilyIndices = nullptr,
+      };
+
+      // Host visible so that update() reads back whether the fragments overflowed.
+      engine.create_buffer(buffer_create_info,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           counter_buffers_[i], counter_buffers_allocation_[i]);
+
+      std::memset(counter_buffers_allocation_[i].data, 0, buffer_size);
+
+      const VkDescriptorBufferInfo descriptor_buffer_info = {
+        .buffer = counter_buffers_[i],
+        .offset = 0,
+        .range = buffer_size,
+      };
+
+      const VkWriteDescriptorSet write_descriptor_set = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = abuffer_descriptor_sets_[i],
+        .dstBinding = 2,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pImageInfo = nullptr,
+        .pBufferInfo = &descriptor_buffer_info,
+        .pTexelBufferView = nullptr,
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 1, &write_descriptor_set, 0, nullptr);
+    }
+  }
+
+  void CSGPipeline::create_storage_image(VkFormat format, VkImageUsageFlags usage,
+                                         VkImage& image, VkImageView& image_view,
+                                         core::Allocation& allocation)
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    const VkExtent3D image_extent = {
+      .width = extent.width,
+      .height = extent.height,
+      .depth = 1,
+    };
+
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = image_extent,
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_STORAGE_BIT | usage,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image,
+                        allocation);
+
+    const VkComponentMapping components = {
+      .r = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
+    };
+
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageViewCreateInfo view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .image = image,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = format,
+      .components = components,
+      .subresourceRange = subresource_range,
+    };
+
+    VkResult result = vkCreateImageView(engine.get_device(), &view_info, nullptr, &image_view);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create image view");
+
+    // Storage images stay in the general layout, written and read by shaders alike.
+    const core::TransitionLayout transition_layout = {
+      .src_access = 0,
+      .dst_access = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      .dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      .aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .new_layout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    engine.transition_image_layout(image, format, 1, transition_layout);
+  }
+
+  void CSGPipeline::bind_abuffer()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkDescriptorImageInfo heads_image_info = {
+      .sampler = VK_NULL_HANDLE,
+      .imageView = heads_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    const VkDescriptorBufferInfo nodes_buffer_info = {
+      .buffer = nodes_buffer_,
+      .offset = 0,
+      .range = node_capacity_ * CSG_ABUFFER_NODE_SIZE,
+    };
+
+    const VkDescriptorImageInfo resolved_color_image_info = {
+      .sampler = VK_NULL_HANDLE,
+      .imageView = resolved_color_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    const VkDescriptorImageInfo resolved_depth_image_info = {
+      .sampler = VK_NULL_HANDLE,
+      .imageView = resolved_depth_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      const VkWriteDescriptorSet write_descriptor_sets[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = abuffer_descriptor_sets_[i],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .pImageInfo = &heads_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = abuffer_descriptor_sets_[i],
+            .dstBinding = 1,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImageInfo = nullptr,
+            .pBufferInfo = &nodes_buffer_info,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = abuffer_descriptor_sets_[i],
+            .dstBinding = 3,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .pImageInfo = &resolved_color_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = abuffer_descriptor_sets_[i],
+            .dstBinding = 4,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .pImageInfo = &resolved_depth_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 4, write_descriptor_sets, 0, nullptr);
+    }
+  }
+
+  void CSGPipeline::create_mask_image()
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    const VkExtent3D image_extent = {
+      .width = extent.width,
+      .height = extent.height,
+      .depth = 1,
+    };
+
+    const VkImageCreateInfo mask_image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = VK_FORMAT_R8_UNORM,
+      .extent = image_extent,
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+          | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(mask_image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mask_image_,
+                        mask_allocation_);
+
+    const VkComponentMapping components = {
+      .r = VK_COMPONENT_SWIZZLE_R,
+      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
+    };
+
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageViewCreateInfo view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .image = mask_image_,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = VK_FORMAT_R8_UNORM,
+      .components = components,
+      .subresourceRange = subresource_range,
+    };
+
+    VkResult result = vkCreateImageView(engine.get_device(), &view_info, nullptr, &mask_view_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create image view");
+
+    const VkSamplerCreateInfo sampler_info = {
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .magFilter = VK_FILTER_NEAREST,
+      .minFilter = VK_FILTER_NEAREST,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .mipLodBias = 0.0f,
+      .anisotropyEnable = VK_FALSE,
+      .maxAnisotropy = 0.0f,
+      .compareEnable = VK_FALSE,
+      .compareOp = VK_COMPARE_OP_NEVER,
+      .minLod = 0.0f,
+      .maxLod = 0.0f,
+      .borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
+      .unnormalizedCoordinates = VK_FALSE,
+    };
+
+    result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &mask_sampler_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create sampler");
+
+    const core::TransitionLayout transition_layout = {
+      .src_access = 0,
+      .dst_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      .dst_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+      .aspect_mask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .new_layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+
+    engine.transition_image_layout(mask_image_, VK_FORMAT_R8_UNORM, 1, transition_layout);
+  }
+
+  void CSGPipeline::create_saved_depth_image()
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    const VkExtent3D image_extent = {
+      .width = extent.width,
+      .height = extent.height,
+      .depth = 1,
+    };
+
+    // Depth formats can only be copied to the same format, so it matches the scene depth.
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .extent = image_extent,
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, saved_depth_image_,
+                        saved_depth_allocation_);
+
+    const VkComponentMapping components = {
+      .r = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
+    };
+
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageViewCreateInfo view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .image = saved_depth_image_,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .components = components,
+      .subresourceRange = subresource_range,
+    };
+
+    VkResult result =
+        vkCreateImageView(engine.get_device(), &view_info, nullptr, &saved_depth_view_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create image view");
+
+    const VkSamplerCreateInfo sampler_info = {
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .magFilter = VK_FILTER_NEAREST,
+      .minFilter = VK_FILTER_NEAREST,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .mipLodBias = 0.0f,
+      .anisotropyEnable = VK_FALSE,
+      .maxAnisotropy = 0.0f,
+      .compareEnable = VK_FALSE,
+      .compareOp = VK_COMPARE_OP_NEVER,
+      .minLod = 0.0f,
+      .maxLod = 0.0f,
+      .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+      .unnormalizedCoordinates = VK_FALSE,
+    };
+
+    result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &saved_depth_sampler_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create sampler");
+
+    const core::TransitionLayout transition_layout = {
+      .src_access = 0,
+      .dst_access = VK_ACCESS_SHADER_READ_BIT,
+      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      .dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      .aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT,
+      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .new_layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+
+    engine.transition_image_layout(saved_depth_image_, VK_FORMAT_D32_SFLOAT_S8_UINT, 1,
+                                   transition_layout);
+  }
+
+  void CSGPipeline::create_depth_image(VkImage& image, VkImageView& image_view, VkSampler& sampler,
+                                       core::Allocation& allocation)
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    const VkExtent3D image_extent = {
+      .width = extent.width,
+      .height = extent.height,
+      .depth = 1,
+    };
+
+    const VkImageCreateInfo depth_image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = VK_FORMAT_D32_SFLOAT,
+      .extent = image_extent,
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT
+          | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(depth_image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image,
+                        allocation);
+
+    const VkComponentMapping depth_components = {
+      .r = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .g = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .b = VK_COMPONENT_SWIZZLE_IDENTITY,
+      .a = VK_COMPONENT_SWIZZLE_IDENTITY,
+    };
+
+    const VkImageSubresourceRange depth_subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageViewCreateInfo depth_view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
       .image = image,
@@ -1253,268 +2305,758 @@ namespace gfx
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create image view");
 
-    const VkSamplerCreateInfo sampler_info = {
-      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    const VkSamplerCreateInfo sampler_info = {
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .magFilter = VK_FILTER_NEAREST,
+      .minFilter = VK_FILTER_NEAREST,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .mipLodBias = 0.0f,
+      .anisotropyEnable = VK_FALSE,
+      .maxAnisotropy = 0.0f,
+      .compareEnable = VK_FALSE,
+      .compareOp = VK_COMPARE_OP_NEVER,
+      .minLod = 0.0f,
+      .maxLod = 0.0f,
+      .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+      .unnormalizedCoordinates = VK_FALSE,
+    };
+
+    result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &sampler);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create sampler");
+
+    const core::TransitionLayout transition_layout = {
+      .src_access = 0,
+      .dst_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      .dst_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+      .aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT,
+      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .new_layout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+    };
+
+    engine.transition_image_layout(image, VK_FORMAT_D32_SFLOAT, 1, transition_layout);
+  }
+
+  void CSGPipeline::bind_depth_images()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkDescriptorImageInfo ray_enter_image_info = {
+      .sampler = ray_enter_sampler_,
+      .imageView = ray_enter_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+
+    const VkDescriptorImageInfo ray_leave_image_info = {
+      .sampler = ray_leave_sampler_,
+      .imageView = ray_leave_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+
+    const VkDescriptorImageInfo back_depth_image_info = {
+      .sampler = back_depth_sampler_,
+      .imageView = back_depth_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+
+    const VkDescriptorImageInfo saved_depth_image_info = {
+      .sampler = saved_depth_sampler_,
+      .imageView = saved_depth_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    };
+
+    const VkDescriptorImageInfo mask_image_info = {
+      .sampler = mask_sampler_,
+      .imageView = mask_view_,
+      .imageLayout = VK_IMAGE_LAYOUT_READ_ONLY_OPTIMAL,
+    };
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      VkWriteDescriptorSet write_descriptor[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = textures_descriptor_sets_[i],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &ray_enter_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = textures_descriptor_sets_[i],
+            .dstBinding = 1,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &ray_leave_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = textures_descriptor_sets_[i],
+            .dstBinding = 2,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &back_depth_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = textures_descriptor_sets_[i],
+            .dstBinding = 3,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &saved_depth_image_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 4, write_descriptor, 0, nullptr);
+
+      VkWriteDescriptorSet mask_write_descriptor = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .pNext = nullptr,
+        .dstSet = frontface_descriptor_sets_[i],
+        .dstBinding = 0,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = &mask_image_info,
+        .pBufferInfo = nullptr,
+        .pTexelBufferView = nullptr,
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 1, &mask_write_descriptor, 0, nullptr);
+    }
+  }
+
+  VkRect2D CSGPipeline::project_bounds(const scene::Mesh& mesh,
+                                       const types::Matrix4& transform) const
+  {
+    auto extent = core::Engine::get_singleton().get_render_extent();
+    const auto& bounds_min = mesh.get_bounds_min();
+    const auto& bounds_max = mesh.get_bounds_max();
+
+    float min_x = std::numeric_limits<float>::max();
+    float min_y = std::numeric_limits<float>::max();
+    float max_x = std::numeric_limits<float>::lowest();
+    float max_y = std::numeric_limits<float>::lowest();
+
+    for (int corner = 0; corner < 8; corner++)
+    {
+      float position[4] = {
+        corner & 1 ? bounds_max.x : bounds_min.x,
+        corner & 2 ? bounds_max.y : bounds_min.y,
+        corner & 4 ? bounds_max.z : bounds_min.z,
+        1.0f,
+      };
+
+      // Same transforms as the vertex shader, the matrices are column major.
+      for (auto matrix : { &transform, &view_, &projection_ })
+      {
+        float result[4] = {};
+        for (int row = 0; row < 4; row++)
+          for (int column = 0; column < 4; column++)
+            result[row] += matrix->data()[column * 4 + row] * position[column];
+
+        std::memcpy(position, result, sizeof(result));
+      }
+
+      // A corner behind the eye projects anywhere on screen.
+      if (position[3] <= 0.0f)
+        return { { 0, 0 }, extent };
+
+      min_x = std::min(min_x, position[0] / position[3]);
+      min_y = std::min(min_y, position[1] / position[3]);
+      max_x = std::max(max_x, position[0] / position[3]);
+      max_y = std::max(max_y, position[1] / position[3]);
+    }
+
+    // The viewport maps normalized device coordinates to the whole render extent.
+    auto left = static_cast<int32_t>(std::floor((std::max(min_x, -1.0f) + 1.0f) * 0.5f
+                                                * extent.width));
+    auto top = static_cast<int32_t>(std::floor((std::max(min_y, -1.0f) + 1.0f) * 0.5f
+                                               * extent.height));
+    auto right = static_cast<int32_t>(std::ceil((std::min(max_x, 1.0f) + 1.0f) * 0.5f
+                                                * extent.width));
+    auto bottom = static_cast<int32_t>(std::ceil((std::min(max_y, 1.0f) + 1.0f) * 0.5f
+                                                 * extent.height));
+
+    if (right <= left || bottom <= top)
+      return {};
+
+    return { { left, top },
+             { static_cast<uint32_t>(right - left), static_cast<uint32_t>(bottom - top) } };
+  }
+
+  VkRenderingAttachmentInfo CSGPipeline::get_depth_attachment(VkImageView image_view) const
+  {
+    const VkClearValue depth_clear_value = { .depthStencil = { .depth = 1.0f, .stencil = 0 } };
+
+    return {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = image_view,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = depth_clear_value,
+    };
+  }
+
+  VkImageMemoryBarrier CSGPipeline::get_depth_barrier(VkImage image, bool read) const
+  {
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    VkAccessFlags write_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    VkAccessFlags read_access = VK_ACCESS_SHADER_READ_BIT;
+    VkImageLayout write_layout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL;
+    VkImageLayout read_layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+    return {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = read ? write_access : read_access,
+      .dstAccessMask = read ? read_access : write_access,
+      .oldLayout = read ? write_layout : read_layout,
+      .newLayout = read ? read_layout : write_layout,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = subresource_range,
+    };
+  }
+
+  void CSGPipeline::save_depth(VkCommandBuffer command_buffer, VkImage depth_image,
+                               const VkRect2D& area) const
+  {
+    // Layouts of depth stencil images cover both aspects, only the depth is copied.
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageMemoryBarrier copy_barriers[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+          .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+          .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = depth_image,
+          .subresourceRange = subresource_range,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = VK_ACCESS_SHADER_READ_BIT,
+          .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+          .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = saved_depth_image_,
+          .subresourceRange = subresource_range,
+      },
+    };
+
+    vkCmdPipelineBarrier(command_buffer,
+                         VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                             | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2,
+                         copy_barriers);
+
+    const VkImageSubresourceLayers depth_layers = {
+      .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+      .mipLevel = 0,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageCopy region = {
+      .srcSubresource = depth_layers,
+      .srcOffset = { area.offset.x, area.offset.y, 0 },
+      .dstSubresource = depth_layers,
+      .dstOffset = { area.offset.x, area.offset.y, 0 },
+      .extent = { area.extent.width, area.extent.height, 1 },
+    };
+
+    vkCmdCopyImage(command_buffer, depth_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                   saved_depth_image_, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    const VkImageMemoryBarrier render_barriers[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+          .dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+              | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = depth_image,
+          .subresourceRange = subresource_range,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          .newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = saved_depth_image_,
+          .subresourceRange = subresource_range,
+      },
+    };
+
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                             | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                             | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, 2, render_barriers);
+  }
+
+  void CSGPipeline::set_dynamic_state(VkCommandBuffer command_buffer,
+                                      const VkRect2D& scissor) const
+  {
+    auto extent = core::Engine::get_singleton().get_render_extent();
+
+    const VkViewport viewport{
+      .x = 0.0f,
+      .y = 0.0f,
+      .width = static_cast<float>(extent.width),
+      .height = static_cast<float>(extent.height),
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f,
+    };
+
+    // Secondary command buffers inherit no state from the primary one.
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+    vkCmdSetDepthTestEnable(command_buffer, VK_TRUE);
+    vkCmdSetDepthWriteEnable(command_buffer, VK_TRUE);
+    vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_LESS);
+    vkCmdSetStencilTestEnable(command_buffer, VK_FALSE);
+    vkCmdSetStencilWriteMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, 0xFF);
+    vkCmdSetStencilCompareMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, 0xFF);
+  }
+
+  void CSGPipeline::draw_mesh(VkCommandBuffer command_buffer, const scene::Mesh& mesh) const
+  {
+    VkDeviceSize offset = 0;
+    VkBuffer vertex_buffer = mesh.get_vertex_buffer();
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, mesh.get_index_buffer(), offset, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexed(command_buffer, mesh.get_index_count(), 1, 0, 0, 0);
+  }
+
+  VkCommandBuffer CSGPipeline::record_depth(const scene::Mesh& mesh,
+                                            const types::Matrix4& transform,
+                                            VkCullModeFlags cull_mode,
+                                            const VkRect2D& scissor) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .magFilter = VK_FILTER_NEAREST,
-      .minFilter = VK_FILTER_NEAREST,
-      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
-      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
-      .mipLodBias = 0.0f,
-      .anisotropyEnable = VK_FALSE,
-      .maxAnisotropy = 0.0f,
-      .compareEnable = VK_FALSE,
-      .compareOp = VK_COMPARE_OP_NEVER,
-      .minLod = 0.0f,
-      .maxLod = 0.0f,
-      .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
-      .unnormalizedCoordinates = VK_FALSE,
+      .viewMask = 0,
+      .colorAttachmentCount = 0,
+      .pColorAttachmentFormats = nullptr,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &sampler);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create sampler");
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, scissor);
 
-    const core::TransitionLayout transition_layout = {
-      .src_access = 0,
-      .dst_access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
-      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
-      .dst_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
-      .aspect_mask = VK_IMAGE_ASPECT_DEPTH_BIT,
-      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .new_layout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
-    };
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, depth_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1,
+                            &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
 
-    engine.transition_image_layout(image, VK_FORMAT_D32_SFLOAT, 1, transition_layout);
+    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
+                       transform.data());
+
+    int one = 1;
+    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64, 4, &one);
+
+    vkCmdSetCullMode(command_buffer, cull_mode);
+    draw_mesh(command_buffer, mesh);
+
+    command_pools.end(command_buffer);
+    return command_buffer;
   }
 
-  void CSGPipeline::bind_depth_images()
+  VkCommandBuffer CSGPipeline::record_mask(const CSGPair& pair, const VkRect2D& scissor) const
   {
     auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
 
-    const VkDescriptorImageInfo ray_enter_image_info = {
-      .sampler = ray_enter_sampler_,
-      .imageView = ray_enter_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    const VkFormat color_formats[] = {
+      engine.get_surface_format().format,
+      VK_FORMAT_R8_UNORM,
     };
 
-    const VkDescriptorImageInfo ray_leave_image_info = {
-      .sampler = ray_leave_sampler_,
-      .imageView = ray_leave_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 2,
+      .pColorAttachmentFormats = color_formats,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    const VkDescriptorImageInfo back_depth_image_info = {
-      .sampler = back_depth_sampler_,
-      .imageView = back_depth_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
-    };
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, scissor);
 
-    const VkDescriptorImageInfo mask_image_info = {
-      .sampler = mask_sampler_,
-      .imageView = mask_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_READ_ONLY_OPTIMAL,
-    };
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1,
+                            &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 1, 1,
+                            &textures_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
 
-    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    if (active_ && scissor.extent.width != 0)
     {
-      VkWriteDescriptorSet write_descriptor[] = {
-        {
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .pNext = nullptr,
-            .dstSet = textures_descriptor_sets_[i],
-            .dstBinding = 0,
-            .dstArrayElement = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .pImageInfo = &ray_enter_image_info,
-            .pBufferInfo = nullptr,
-            .pTexelBufferView = nullptr,
-        },
-        {
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .pNext = nullptr,
-            .dstSet = textures_descriptor_sets_[i],
-            .dstBinding = 1,
-            .dstArrayElement = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .pImageInfo = &ray_leave_image_info,
-            .pBufferInfo = nullptr,
-            .pTexelBufferView = nullptr,
-        },
-        {
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .pNext = nullptr,
-            .dstSet = textures_descriptor_sets_[i],
-            .dstBinding = 2,
-            .dstArrayElement = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-            .pImageInfo = &back_depth_image_info,
-            .pBufferInfo = nullptr,
-            .pTexelBufferView = nullptr,
-        },
-      };
+      vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
+                         pair.substractive_transform.data());
 
-      vkUpdateDescriptorSets(engine.get_device(), 3, write_descriptor, 0, nullptr);
-
-      VkWriteDescriptorSet mask_write_descriptor = {
-        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-        .pNext = nullptr,
-        .dstSet = frontface_descriptor_sets_[i],
-        .dstBinding = 0,
-        .dstArrayElement = 0,
-        .descriptorCount = 1,
-        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-        .pImageInfo = &mask_image_info,
-        .pBufferInfo = nullptr,
-        .pTexelBufferView = nullptr,
-      };
+      int minus_one = -1;
+      vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64, 4,
+                         &minus_one);
 
-      vkUpdateDescriptorSets(engine.get_device(), 1, &mask_write_descriptor, 0, nullptr);
+      vkCmdSetCullMode(command_buffer, VK_CULL_MODE_FRONT_BIT);
+      draw_mesh(command_buffer, *pair.substractive_mesh);
     }
+
+    command_pools.end(command_buffer);
+    return command_buffer;
   }
 
-  void CSGPipeline::render_depth(VkCommandBuffer& command_buffer, scene::Mesh& mesh,
-                                 scene::Mesh& substractive_mesh)
+  VkCommandBuffer CSGPipeline::record_frontface(const CSGPair& pair,
+                                                const VkRect2D& scissor) const
   {
     auto& engine = core::Engine::get_singleton();
-    auto extent = engine.get_swapchain_extent();
+    auto& command_pools = core::CommandPools::get_singleton();
 
-    const VkRect2D render_area = {
-      .offset = { 0, 0 },
-      .extent = extent,
+    const VkFormat color_format = engine.get_surface_format().format;
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    const VkClearValue depth_clear_value = { .depthStencil = { .depth = 1.0f, .stencil = 0 } };
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, scissor);
 
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, depth_pipeline_);
-    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
-                       mesh.cframe.to_matrix().data());
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, frontface_pipeline_);
 
-    int one = 1;
-    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64, 4, &one);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            frontface_pipeline_layout_, 0, 1,
+                            &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
 
-    vkCmdSetDepthTestEnable(command_buffer, VK_TRUE);
-    vkCmdSetDepthWriteEnable(command_buffer, VK_TRUE);
-    vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_LESS);
-    vkCmdSetStencilTestEnable(command_buffer, VK_FALSE);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            frontface_pipeline_layout_, 1, 1,
+                            &frontface_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_BACK_BIT);
 
-    VkDeviceSize offset = 0;
-    VkBuffer vertex_buffer = mesh.get_vertex_buffer();
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
-    vkCmdBindIndexBuffer(command_buffer, mesh.get_index_buffer(), offset, VK_INDEX_TYPE_UINT32);
+    if (!active_)
+    {
+      vkCmdPushConstants(command_buffer, frontface_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT,
+                         0, 64, pair.substractive_transform.data());
+      draw_mesh(command_buffer, *pair.substractive_mesh);
+    }
 
-    const VkRenderingAttachmentInfo ray_enter_attachment = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-      .pNext = nullptr,
-      .imageView = ray_enter_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-      .resolveMode = VK_RESOLVE_MODE_NONE,
-      .resolveImageView = VK_NULL_HANDLE,
-      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-      .clearValue = depth_clear_value,
-    };
+    vkCmdPushConstants(command_buffer, frontface_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       64, pair.transform.data());
+    draw_mesh(command_buffer, *pair.mesh);
 
-    const VkRenderingInfo ray_enter_rendering_info = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
+
+  void CSGPipeline::set_stencil_state(VkCommandBuffer command_buffer, VkCompareOp compare_op,
+                                      uint32_t reference, uint32_t compare_mask,
+                                      uint32_t write_mask) const
+  {
+    // Surfaces are counted by parity, so every write inverts the bits of the write mask.
+    vkCmdSetStencilTestEnable(command_buffer, VK_TRUE);
+    vkCmdSetStencilOp(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, VK_STENCIL_OP_KEEP,
+                      write_mask != 0 ? VK_STENCIL_OP_INVERT : VK_STENCIL_OP_KEEP,
+                      VK_STENCIL_OP_KEEP, compare_op);
+    vkCmdSetStencilReference(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, reference);
+    vkCmdSetStencilCompareMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, compare_mask);
+    vkCmdSetStencilWriteMask(command_buffer, VK_STENCIL_FACE_FRONT_AND_BACK, write_mask);
+  }
+
+  VkCommandBuffer CSGPipeline::record_stencil(const CSGPair& pair, const PairAreas& areas) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    const VkFormat color_format = engine.get_surface_format().format;
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .renderArea = render_area,
-      .layerCount = 1,
       .viewMask = 0,
-      .colorAttachmentCount = 0,
-      .pColorAttachments = nullptr,
-      .pDepthAttachment = &ray_enter_attachment,
-      .pStencilAttachment = nullptr,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    vkCmdBeginRendering(command_buffer, &ray_enter_rendering_info);
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, areas.frontface);
+    record_stencil_draws(command_buffer, pair, areas, false);
 
-    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_BACK_BIT);
-    vkCmdDrawIndexed(command_buffer, mesh.get_index_count(), 1, 0, 0, 0);
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
+
+  void CSGPipeline::record_stencil_draws(VkCommandBuffer command_buffer, const CSGPair& pair,
+                                         const PairAreas& areas, bool indirect) const
+  {
+    auto frame = core::Engine::get_singleton().get_current_frame();
+
+    // Every stencil pipeline shares the layout, the frame sets stay bound across them.
+    const VkDescriptorSet descriptor_sets[] = {
+      ubo_descriptor_sets_[frame],
+      textures_descriptor_sets_[frame],
+    };
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 2,
+                            descriptor_sets, 0, nullptr);
+
+    auto draw = [&](VkPipeline pipeline, const scene::Mesh& mesh, const types::Matrix4& transform,
+                    int direction, VkCullModeFlags cull_mode) {
+      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+      vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
+                         transform.data());
+      vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64, 4,
+                         &direction);
+      vkCmdSetCullMode(command_buffer, cull_mode);
+
+      if (!indirect)
+      {
+        draw_mesh(command_buffer, mesh);
+        return;
+      }
 
-    vkCmdEndRendering(command_buffer);
+      VkDeviceSize offset = 0;
+      VkBuffer vertex_buffer = mesh.get_vertex_buffer();
+      vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
+      vkCmdBindIndexBuffer(command_buffer, mesh.get_index_buffer(), offset, VK_INDEX_TYPE_UINT32);
+      vkCmdDrawIndexedIndirect(command_buffer, counter_buffers_[frame],
+                               &mesh == pair.mesh ? CSG_ABUFFER_MESH_DRAW
+                                                  : CSG_ABUFFER_SUBSTRACTIVE_DRAW,
+                               1, 0);
+    };
 
-    const VkRenderingAttachmentInfo ray_leave_attachment = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-      .pNext = nullptr,
-      .imageView = ray_leave_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-      .resolveMode = VK_RESOLVE_MODE_NONE,
-      .resolveImageView = VK_NULL_HANDLE,
-      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-      .clearValue = depth_clear_value,
+    // The scene depth of the pairs drawn before, saved by draw(), is put back.
+    auto restore_depth = [&]() {
+      vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                        stencil_restore_pipeline_);
+      vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_ALWAYS);
+      vkCmdSetDepthWriteEnable(command_buffer, VK_TRUE);
+      vkCmdSetCullMode(command_buffer, VK_CULL_MODE_NONE);
+
+      if (indirect)
+        vkCmdDrawIndirect(command_buffer, counter_buffers_[frame], CSG_ABUFFER_CLEAR_DRAW, 1, 0);
+      else
+        vkCmdDraw(command_buffer, 3, 1, 0, 0);
     };
 
-    const VkRenderingInfo ray_leave_rendering_info = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+    const auto& mesh = *pair.mesh;
+    const auto& substractive_mesh = *pair.substractive_mesh;
+
+    if (areas.overlap.extent.width == 0)
+    {
+      // Nothing is carved, the substractive mesh is only drawn as is when inactive.
+      if (!active_)
+        draw(stencil_color_pipeline_, substractive_mesh, pair.substractive_transform, 1,
+             VK_CULL_MODE_BACK_BIT);
+      draw(stencil_color_pipeline_, mesh, pair.transform, 1, VK_CULL_MODE_BACK_BIT);
+      return;
+    }
+
+    // Nearest front faces of the mesh.
+    draw(stencil_pipeline_, mesh, pair.transform, 1, VK_CULL_MODE_BACK_BIT);
+
+    // Bit 0 is set where an odd number of substractive surfaces lie in front of them, inside
+    // the substractive mesh.
+    vkCmdSetScissor(command_buffer, 0, 1, &areas.overlap);
+    vkCmdSetDepthWriteEnable(command_buffer, VK_FALSE);
+    set_stencil_state(command_buffer, VK_COMPARE_OP_ALWAYS, 0, 0, 1);
+    draw(stencil_pipeline_, substractive_mesh, pair.substractive_transform, 1,
+         VK_CULL_MODE_NONE);
+
+    // Shade the front faces left outside it.
+    vkCmdSetScissor(command_buffer, 0, 1, &areas.frontface);
+    vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_EQUAL);
+    set_stencil_state(command_buffer, VK_COMPARE_OP_EQUAL, 0, 1, 0);
+    draw(stencil_color_pipeline_, mesh, pair.transform, 1, VK_CULL_MODE_BACK_BIT);
+
+    // Where they were carved, find the nearest back faces of the substractive mesh in front of
+    // the scene instead.
+    vkCmdSetScissor(command_buffer, 0, 1, &areas.overlap);
+    set_stencil_state(command_buffer, VK_COMPARE_OP_EQUAL, 1, 1, 0);
+    restore_depth();
+
+    vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_LESS);
+    draw(stencil_pipeline_, substractive_mesh, pair.substractive_transform, -1,
+         VK_CULL_MODE_FRONT_BIT);
+
+    // Bit 1 is set where those back faces lie inside the mesh.
+    vkCmdSetDepthWriteEnable(command_buffer, VK_FALSE);
+    set_stencil_state(command_buffer, VK_COMPARE_OP_EQUAL, 1, 1, 2);
+    draw(stencil_pipeline_, mesh, pair.transform, 1, VK_CULL_MODE_NONE);
+
+    // They are the walls of the carved hole.
+    vkCmdSetDepthCompareOp(command_buffer, VK_COMPARE_OP_EQUAL);
+    set_stencil_state(command_buffer, VK_COMPARE_OP_EQUAL, 3, 3, 0);
+    draw(stencil_color_pipeline_, substractive_mesh, pair.substractive_transform, -1,
+         VK_CULL_MODE_FRONT_BIT);
+
+    // Where the hole goes through the mesh, the scene behind it is left as it was.
+    set_stencil_state(command_buffer, VK_COMPARE_OP_EQUAL, 1, 3, 0);
+    restore_depth();
+  }
+
+  VkCommandBuffer CSGPipeline::record_abuffer_append(const CSGPair& pair,
+                                                     const VkRect2D& scissor) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .renderArea = render_area,
-      .layerCount = 1,
       .viewMask = 0,
       .colorAttachmentCount = 0,
-      .pColorAttachments = nullptr,
-      .pDepthAttachment = &ray_leave_attachment,
-      .pStencilAttachment = nullptr,
+      .pColorAttachmentFormats = nullptr,
+      .depthAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    vkCmdBeginRendering(command_buffer, &ray_leave_rendering_info);
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, scissor);
 
-    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_FRONT_BIT);
-    vkCmdDrawIndexed(command_buffer, mesh.get_index_count(), 1, 0, 0, 0);
+    // Every surface is appended, whatever its facing or depth, in one draw per mesh.
+    vkCmdSetDepthTestEnable(command_buffer, VK_FALSE);
+    vkCmdSetDepthWriteEnable(command_buffer, VK_FALSE);
+    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_NONE);
 
-    vkCmdEndRendering(command_buffer);
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, append_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            abuffer_pipeline_layout_, 0, 1,
+                            &ubo_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            abuffer_pipeline_layout_, 1, 1,
+                            &abuffer_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+
+    auto draw = [&](const scene::Mesh& mesh, const types::Matrix4& transform, uint32_t operand) {
+      int one = 1;
+      vkCmdPushConstants(command_buffer, abuffer_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                         64, transform.data());
+      vkCmdPushConstants(command_buffer, abuffer_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 64,
+                         4, &one);
+      vkCmdPushConstants(command_buffer, abuffer_pipeline_layout_, VK_SHADER_STAGE_FRAGMENT_BIT,
+                         68, 4, &operand);
+      draw_mesh(command_buffer, mesh);
+    };
+
+    draw(*pair.mesh, pair.transform, 0);
+    draw(*pair.substractive_mesh, pair.substractive_transform, 1);
+
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
 
-    const VkRenderingAttachmentInfo back_depth_attachment = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-      .pNext = nullptr,
-      .imageView = back_depth_view_,
-      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
-      .resolveMode = VK_RESOLVE_MODE_NONE,
-      .resolveImageView = VK_NULL_HANDLE,
-      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
-      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-      .clearValue = depth_clear_value,
-    };
+  VkCommandBuffer CSGPipeline::record_abuffer_composite(const CSGPair& pair,
+                                                        const PairAreas& areas) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
 
-    const VkRenderingInfo back_depth_rendering_info = {
-      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+    const VkFormat color_format = engine.get_surface_format().format;
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .renderArea = render_area,
-      .layerCount = 1,
       .viewMask = 0,
-      .colorAttachmentCount = 0,
-      .pColorAttachments = nullptr,
-      .pDepthAttachment = &back_depth_attachment,
-      .pStencilAttachment = nullptr,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
     };
 
-    vkCmdBeginRendering(command_buffer, &back_depth_rendering_info);
-
-    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0, 64,
-                       substractive_mesh.cframe.to_matrix().data());
-
-    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_BACK_BIT);
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer, areas.frontface);
+    vkCmdSetCullMode(command_buffer, VK_CULL_MODE_NONE);
 
-    vertex_buffer = substractive_mesh.get_vertex_buffer();
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
-    vkCmdBindIndexBuffer(command_buffer, substractive_mesh.get_index_buffer(), offset,
-                         VK_INDEX_TYPE_UINT32);
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, composite_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            abuffer_pipeline_layout_, 1, 1,
+                            &abuffer_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+    vkCmdDraw(command_buffer, 3, 1, 0, 0);
 
-    vkCmdDrawIndexed(command_buffer, substractive_mesh.get_index_count(), 1, 0, 0, 0);
+    // A pair that overflowed was left transparent by the resolve pass, which instanced these
+    // draws instead. Otherwise they draw nothing, at no cost of another pass or barrier.
+    record_stencil_draws(command_buffer, pair, areas, true);
 
-    vkCmdEndRendering(command_buffer);
+    command_pools.end(command_buffer);
+    return command_buffer;
   }
 } // namespace gfx
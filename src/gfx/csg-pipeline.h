@@ -1,14 +1,50 @@
 #pragma once
 
+#include <span>
 #include <vector>
 
+#include "core/memory-allocator.h"
 #include "gfx/pipeline.h"
 #include "misc/singleton.h"
 #include "scene/mesh.h"
 #include "types/matrix4.h"
 
+/// Fragments the A-buffer holds per pixel of the render extent, on average over a pair.
+#define CSG_ABUFFER_FRAGMENTS_PER_PIXEL 4
+/// Nearest surfaces of a pixel sorted by the resolve pass, deeper ones are dropped.
+#define CSG_ABUFFER_MAX_LAYERS 32
+/// Bytes of an A-buffer node: its depth, its shaded color and its link.
+#define CSG_ABUFFER_NODE_SIZE 12
+/// End of a pixel list, the two high bits of a link hold the facing and the operand.
+#define CSG_ABUFFER_END 0x3FFFFFFFu
+/// Offsets in the counter buffer of the indirect draws of the stencil passes, which only draw
+/// a pair that overflowed the A-buffer.
+#define CSG_ABUFFER_MESH_DRAW 8
+#define CSG_ABUFFER_SUBSTRACTIVE_DRAW 28
+#define CSG_ABUFFER_CLEAR_DRAW 48
+
 namespace gfx
 {
+  /// A mesh with substractive_mesh carved out of it, each placed by its own transform.
+  struct CSGPair
+  {
+    const scene::Mesh* mesh;
+    const scene::Mesh* substractive_mesh;
+    types::Matrix4 transform;
+    types::Matrix4 substractive_transform;
+  };
+
+  enum class CSGMode
+  {
+    /// Depth images of the ray enter, ray leave and back depth sampled by the mask pass.
+    DepthImages,
+    /// Surfaces counted in the stencil of the scene depth buffer, within one rendering pass.
+    Stencil,
+    /// Every surface of both meshes appended to per pixel lists, sorted and evaluated by a
+    /// compute pass. Needs the fragmentStoresAndAtomics device feature.
+    ABuffer,
+  };
+
   class CSGPipeline
     : public misc::Singleton<CSGPipeline>
     , public Pipeline
@@ -21,64 +57,190 @@ namespace gfx
 
   public:
     void init();
-    void draw(VkImageView image_view, VkImageView depth_view, VkCommandBuffer command_buffer,
-              const types::Matrix4& view, const types::Matrix4& projection, scene::Mesh& mesh,
-              scene::Mesh& substractive_mesh);
+    /// Set up the frame on the main thread, before any call to record().
+    void update(const types::Matrix4& view, const types::Matrix4& projection,
+                std::span<const CSGPair> pairs);
+    /// Record the passes of pair index into secondary command buffers. Pairs can be recorded
+    /// concurrently from the thread pool.
+    void record(uint32_t index);
+    /// Execute the recorded passes on the primary command buffer, with the barriers between
+    /// them. The scene depth is cleared once a frame by the caller, pairs occlude each other.
+    void draw(VkImageView image_view, VkImage depth_image, VkImageView depth_view,
+              VkCommandBuffer command_buffer) const;
     void free();
+    /// Recreate the intermediate targets at the current render extent. The device must be idle.
+    void resize();
+
+    uint32_t get_pair_count() const;
+    CSGMode get_mode() const;
+    void set_mode(CSGMode mode);
+    /// Inactive pairs draw both meshes without carving.
+    bool is_active() const;
+    void set_active(bool active);
 
   private:
+    struct PairCommands
+    {
+      VkCommandBuffer ray_enter;
+      VkCommandBuffer ray_leave;
+      VkCommandBuffer back_depth;
+      VkCommandBuffer mask;
+      VkCommandBuffer frontface;
+      VkCommandBuffer stencil;
+      VkCommandBuffer abuffer_append;
+      VkCommandBuffer abuffer_composite;
+    };
+
+    /// Screen rectangles of a pair, an empty one skips its passes.
+    struct PairAreas
+    {
+      /// Where both meshes overlap, the only place the depth and mask passes can carve.
+      VkRect2D overlap;
+      /// Where the front faces are drawn, which the mask must cover.
+      VkRect2D frontface;
+    };
+
     void create_pipeline_layout();
     void create_descriptor_set();
     void create_pipeline_cache();
     void create_graphics_pipeline();
     void create_uniform_buffer();
     void create_depth_image(VkImage& image, VkImageView& image_view, VkSampler& sampler,
-                            VkDeviceMemory& memory);
+                            core::Allocation& allocation);
     void bind_depth_images();
+    void create_targets();
+    void destroy_targets();
+    void create_mask_image();
+    void create_saved_depth_image();
+    void create_compute_pipeline();
+    void create_abuffer_counters();
+    void create_storage_image(VkFormat format, VkImageUsageFlags usage, VkImage& image,
+                              VkImageView& image_view, core::Allocation& allocation);
+    void bind_abuffer();
+
+    /// Conservative rectangle covered by the bounding box of mesh, the whole render extent when
+    /// the box crosses the eye plane.
+    VkRect2D project_bounds(const scene::Mesh& mesh, const types::Matrix4& transform) const;
 
-    void render_depth(VkCommandBuffer& command_buffer, scene::Mesh& mesh,
-                      scene::Mesh& substractive_mesh);
+    VkRenderingAttachmentInfo get_depth_attachment(VkImageView image_view) const;
+    /// Barrier moving a depth image between attachment and shader read, in either direction.
+    VkImageMemoryBarrier get_depth_barrier(VkImage image, bool read) const;
+    /// Copy the scene depth under area to the saved depth the stencil passes restore it from.
+    void save_depth(VkCommandBuffer command_buffer, VkImage depth_image, const VkRect2D& area) const;
+    void set_dynamic_state(VkCommandBuffer command_buffer, const VkRect2D& scissor) const;
+    void draw_mesh(VkCommandBuffer command_buffer, const scene::Mesh& mesh) const;
+    VkCommandBuffer record_depth(const scene::Mesh& mesh, const types::Matrix4& transform,
+                                 VkCullModeFlags cull_mode, const VkRect2D& scissor) const;
+    VkCommandBuffer record_mask(const CSGPair& pair, const VkRect2D& scissor) const;
+    VkCommandBuffer record_frontface(const CSGPair& pair, const VkRect2D& scissor) const;
+    void set_stencil_state(VkCommandBuffer command_buffer, VkCompareOp compare_op,
+                           uint32_t reference, uint32_t compare_mask, uint32_t write_mask) const;
+    VkCommandBuffer record_stencil(const CSGPair& pair, const PairAreas& areas) const;
+    /// Indirect draws take their instance count from the counter buffer of the frame.
+    void record_stencil_draws(VkCommandBuffer command_buffer, const CSGPair& pair,
+                              const PairAreas& areas, bool indirect) const;
+    VkCommandBuffer record_abuffer_append(const CSGPair& pair, const VkRect2D& scissor) const;
+    VkCommandBuffer record_abuffer_composite(const CSGPair& pair, const PairAreas& areas) const;
 
     VkDescriptorSetLayout ubo_descriptor_set_layout_ = VK_NULL_HANDLE;
     VkDescriptorSetLayout textures_descriptor_set_layout_ = VK_NULL_HANDLE;
     VkDescriptorSetLayout frontface_descriptor_set_layout_ = VK_NULL_HANDLE;
+    VkDescriptorSetLayout abuffer_descriptor_set_layout_ = VK_NULL_HANDLE;
     VkPipelineLayout pipeline_layout_ = VK_NULL_HANDLE;
     VkPipelineLayout frontface_pipeline_layout_ = VK_NULL_HANDLE;
+    VkPipelineLayout abuffer_pipeline_layout_ = VK_NULL_HANDLE;
+    VkPipelineLayout resolve_pipeline_layout_ = VK_NULL_HANDLE;
     VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
     std::vector<VkDescriptorSet> ubo_descriptor_sets_;
     std::vector<VkDescriptorSet> textures_descriptor_sets_;
     std::vector<VkDescriptorSet> frontface_descriptor_sets_;
+    std::vector<VkDescriptorSet> abuffer_descriptor_sets_;
     VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
     VkShaderModule vertex_shader_ = VK_NULL_HANDLE;
     VkShaderModule fragment_shader_ = VK_NULL_HANDLE;
     VkShaderModule depth_shader_ = VK_NULL_HANDLE;
     VkShaderModule frontface_shader_ = VK_NULL_HANDLE;
     VkShaderModule vertex_frontface_shader_ = VK_NULL_HANDLE;
+    VkShaderModule stencil_shader_ = VK_NULL_HANDLE;
+    VkShaderModule stencil_clear_shader_ = VK_NULL_HANDLE;
+    VkShaderModule stencil_restore_shader_ = VK_NULL_HANDLE;
+    VkShaderModule append_shader_ = VK_NULL_HANDLE;
+    VkShaderModule resolve_shader_ = VK_NULL_HANDLE;
+    VkShaderModule composite_shader_ = VK_NULL_HANDLE;
     VkPipeline pipeline_ = VK_NULL_HANDLE;
     VkPipeline depth_pipeline_ = VK_NULL_HANDLE;
     VkPipeline frontface_pipeline_ = VK_NULL_HANDLE;
+    /// Depth and stencil only.
+    VkPipeline stencil_pipeline_ = VK_NULL_HANDLE;
+    VkPipeline stencil_color_pipeline_ = VK_NULL_HANDLE;
+    /// Puts the saved scene depth back where the stencil test passes.
+    VkPipeline stencil_restore_pipeline_ = VK_NULL_HANDLE;
+    /// Without attachments, fragments are only appended to the A-buffer.
+    VkPipeline append_pipeline_ = VK_NULL_HANDLE;
+    VkPipeline resolve_pipeline_ = VK_NULL_HANDLE;
+    VkPipeline composite_pipeline_ = VK_NULL_HANDLE;
     std::vector<VkBuffer> uniform_buffers_;
-    std::vector<VkDeviceMemory> uniform_buffers_memory_;
+    std::vector<core::Allocation> uniform_buffers_allocation_;
     std::vector<void*> uniform_buffers_data_;
 
     VkImage ray_enter_image_ = VK_NULL_HANDLE;
-    VkDeviceMemory ray_enter_memory_ = VK_NULL_HANDLE;
+    core::Allocation ray_enter_allocation_;
     VkImageView ray_enter_view_ = VK_NULL_HANDLE;
     VkSampler ray_enter_sampler_ = VK_NULL_HANDLE;
 
     VkImage ray_leave_image_ = VK_NULL_HANDLE;
-    VkDeviceMemory ray_leave_memory_ = VK_NULL_HANDLE;
+    core::Allocation ray_leave_allocation_;
     VkImageView ray_leave_view_ = VK_NULL_HANDLE;
     VkSampler ray_leave_sampler_ = VK_NULL_HANDLE;
 
     VkImage back_depth_image_ = VK_NULL_HANDLE;
-    VkDeviceMemory back_depth_memory_ = VK_NULL_HANDLE;
+    core::Allocation back_depth_allocation_;
     VkImageView back_depth_view_ = VK_NULL_HANDLE;
     VkSampler back_depth_sampler_ = VK_NULL_HANDLE;
 
     VkImage mask_image_ = VK_NULL_HANDLE;
-    VkDeviceMemory mask_memory_ = VK_NULL_HANDLE;
+    core::Allocation mask_allocation_;
     VkImageView mask_view_ = VK_NULL_HANDLE;
     VkSampler mask_sampler_ = VK_NULL_HANDLE;
+
+    /// Scene depth before the current pair, the stencil passes carve through to it.
+    VkImage saved_depth_image_ = VK_NULL_HANDLE;
+    core::Allocation saved_depth_allocation_;
+    VkImageView saved_depth_view_ = VK_NULL_HANDLE;
+    VkSampler saved_depth_sampler_ = VK_NULL_HANDLE;
+
+    /// Head of the fragment list of each pixel.
+    VkImage heads_image_ = VK_NULL_HANDLE;
+    core::Allocation heads_allocation_;
+    VkImageView heads_view_ = VK_NULL_HANDLE;
+
+    VkBuffer nodes_buffer_ = VK_NULL_HANDLE;
+    core::Allocation nodes_allocation_;
+    VkDeviceSize node_capacity_ = 0;
+    /// Fragments appended by the current pair, whether any was lost, read back by update(), and
+    /// the indirect draws of the stencil passes written by the resolve pass.
+    std::vector<VkBuffer> counter_buffers_;
+    std::vector<core::Allocation> counter_buffers_allocation_;
+
+    VkImage resolved_color_image_ = VK_NULL_HANDLE;
+    core::Allocation resolved_color_allocation_;
+    VkImageView resolved_color_view_ = VK_NULL_HANDLE;
+
+    VkImage resolved_depth_image_ = VK_NULL_HANDLE;
+    core::Allocation resolved_depth_allocation_;
+    VkImageView resolved_depth_view_ = VK_NULL_HANDLE;
+
+    types::Matrix4 view_;
+    types::Matrix4 projection_;
+    std::vector<CSGPair> pairs_;
+    std::vector<PairAreas> pair_areas_;
+    std::vector<PairCommands> pair_commands_;
+    bool active_ = false;
+    CSGMode mode_ = CSGMode::DepthImages;
+    bool abuffer_supported_ = false;
+    /// Whether a pair overflowed the last time the frame was drawn, to log it only once.
+    bool abuffer_overflowed_ = false;
   };
 } // namespace gfx
+
+#include "gfx/csg-pipeline.hxx"
@@ -0,0 +1,10 @@
+#include "gfx/csg-pipeline.h"
+
+namespace gfx
+{
+  inline uint32_t CSGPipeline::get_pair_count() const { return pairs_.size(); }
+  inline CSGMode CSGPipeline::get_mode() const { return mode_; }
+  inline void CSGPipeline::set_mode(CSGMode mode) { mode_ = mode; }
+  inline bool CSGPipeline::is_active() const { return active_; }
+  inline void CSGPipeline::set_active(bool active) { active_ = active; }
+} // namespace gfx
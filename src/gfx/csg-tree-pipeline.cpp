@@ -0,0 +1,1501 @@
+#include "gfx/csg-tree-pipeline.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <imgui.h>
+
+#include "core/command-pools.h"
+#include "core/engine.h"
+#include "core/profiler.h"
+#include "core/trace-recorder.h"
+#include "scene/mesh.h"
+
+namespace gfx
+{
+  void CSGTreePipeline::init()
+  {
+    // The inside mask is built by XORing one bit per operand.
+    supported_ = core::Engine::get_singleton().get_enabled_features().logicOp;
+    if (!supported_)
+    {
+      std::clog << "csg: logic operations are not supported, CSG trees are not drawn\n";
+      return;
+    }
+
+    create_pipeline_layout();
+    create_descriptor_set();
+    create_pipeline_cache();
+
+    create_shader_module("csg-tree.vert.spv", &vertex_shader_);
+    create_shader_module("csg-tree-peel.frag.spv", &peel_shader_);
+    create_shader_module("csg-tree-count.frag.spv", &count_shader_);
+    create_shader_module("csg-tree-resolve.vert.spv", &resolve_vertex_shader_);
+    create_shader_module("csg-tree-resolve.frag.spv", &resolve_shader_);
+
+    create_graphics_pipeline();
+    create_buffers();
+    create_targets();
+    bind_targets();
+  }
+
+  void CSGTreePipeline::update(const types::Matrix4& view, const types::Matrix4& projection,
+                               std::span<scene::CSGNode* const> nodes)
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto frame = engine.get_current_frame();
+
+    int layer_count = layer_count_;
+    if (ImGui::SliderInt("CSG layers", &layer_count, 1, CSG_TREE_MAX_LAYERS))
+      set_layer_count(layer_count);
+
+    trees_.clear();
+    tree_commands_.clear();
+
+    if (!supported_)
+      return;
+
+    auto uniform_data = static_cast<char*>(uniform_buffers_allocation_[frame].data);
+    std::memcpy(uniform_data, view.data(), 16 * sizeof(float));
+    std::memcpy(uniform_data + 64, projection.data(), 16 * sizeof(float));
+
+    auto programs = static_cast<uint32_t*>(program_buffers_allocation_[frame].data);
+    uint32_t program_size = 0;
+
+    for (auto node : nodes)
+    {
+      CSGTree tree = {
+        .operands = {},
+        .program = {},
+        .program_offset = program_size,
+      };
+
+      bool flattened = flatten(*node, types::CFrame(), tree);
+      if (flattened && tree.program.empty())
+        continue;
+
+      if (!flattened || program_size + tree.program.size() > CSG_TREE_MAX_PROGRAM)
+      {
+        if (!warned_)
+          std::clog << "csg: skipping a tree over " << CSG_TREE_MAX_OPERANDS
+                    << " operands or past the program budget\n";
+        warned_ = true;
+        continue;
+      }
+
+      std::memcpy(programs + program_size, tree.program.data(),
+                  tree.program.size() * sizeof(uint32_t));
+      program_size += tree.program.size();
+      trees_.push_back(std::move(tree));
+    }
+
+    tree_commands_.resize(trees_.size());
+  }
+
+  void CSGTreePipeline::record(uint32_t index)
+  {
+    core::TraceScope scope("csg tree record");
+    const auto& tree = trees_[index];
+    auto& commands = tree_commands_[index];
+
+    // Secondary command buffers are one time submit, so every layer records its own.
+    commands.resize(layer_count_);
+    for (uint32_t layer = 0; layer < layer_count_; layer++)
+    {
+      commands[layer] = {
+        .peel = record_peel(tree, layer),
+        .count = record_count(tree),
+        .resolve = record_resolve(tree, layer),
+      };
+    }
+  }
+
+  void CSGTreePipeline::draw(VkImageView image_view, VkImageView depth_view,
+                             VkCommandBuffer command_buffer) const
+  {
+    if (trees_.empty())
+      return;
+
+    auto extent = core::Engine::get_singleton().get_render_extent();
+
+    const VkRect2D render_area = {
+      .offset = { 0, 0 },
+      .extent = extent,
+    };
+
+    const VkClearValue clear_value = {};
+    const VkClearValue depth_clear_value = { .depthStencil = { .depth = 1.0f, .stencil = 0 } };
+
+    const VkRenderingAttachmentInfo layer_color_attachment = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = layer_color_.view,
+      .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = clear_value,
+    };
+
+    const VkRenderingAttachmentInfo inside_mask_attachment = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = inside_mask_.view,
+      .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = clear_value,
+    };
+
+    VkRenderingAttachmentInfo peel_depth_attachments[2];
+    VkRenderingAttachmentInfo count_depth_attachments[2];
+    for (uint32_t i = 0; i < 2; i++)
+    {
+      peel_depth_attachments[i] = {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+        .pNext = nullptr,
+        .imageView = peel_depth_[i].view,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+        .resolveMode = VK_RESOLVE_MODE_NONE,
+        .resolveImageView = VK_NULL_HANDLE,
+        .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+        .clearValue = depth_clear_value,
+      };
+
+      // The count pass only tests against the layer.
+      count_depth_attachments[i] = peel_depth_attachments[i];
+      count_depth_attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    }
+
+    const VkRenderingAttachmentInfo color_attachment = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = image_view,
+      .imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = clear_value,
+    };
+
+    const VkRenderingAttachmentInfo depth_attachment = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+      .pNext = nullptr,
+      .imageView = depth_view,
+      .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+      .resolveMode = VK_RESOLVE_MODE_NONE,
+      .resolveImageView = VK_NULL_HANDLE,
+      .resolveImageLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+      .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+      .clearValue = depth_clear_value,
+    };
+
+    VkRenderingInfo peel_rendering_infos[2];
+    VkRenderingInfo count_rendering_infos[2];
+    for (uint32_t i = 0; i < 2; i++)
+    {
+      peel_rendering_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+        .pNext = nullptr,
+        .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+        .renderArea = render_area,
+        .layerCount = 1,
+        .viewMask = 0,
+        .colorAttachmentCount = 1,
+        .pColorAttachments = &layer_color_attachment,
+        .pDepthAttachment = &peel_depth_attachments[i],
+        .pStencilAttachment = nullptr,
+      };
+
+      count_rendering_infos[i] = peel_rendering_infos[i];
+      count_rendering_infos[i].pColorAttachments = &inside_mask_attachment;
+      count_rendering_infos[i].pDepthAttachment = &count_depth_attachments[i];
+    }
+
+    const VkRenderingInfo resolve_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
+      .renderArea = render_area,
+      .layerCount = 1,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachments = &color_attachment,
+      .pDepthAttachment = &depth_attachment,
+      .pStencilAttachment = nullptr,
+    };
+
+    // The resolve passes of every layer and tree load what the passes before them wrote.
+    const VkMemoryBarrier resolve_barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask =
+          VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    };
+
+    auto& profiler = core::Profiler::get_singleton();
+
+    auto execute_profiled = [&](const char* name, const VkRenderingInfo& info,
+                                VkCommandBuffer secondary_command_buffer) {
+      uint32_t query = profiler.begin_gpu(command_buffer, name);
+      execute_rendering(command_buffer, info, secondary_command_buffer);
+      profiler.end_gpu(command_buffer, query);
+    };
+
+    constexpr VkImageAspectFlags depth_aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+    constexpr VkImageAspectFlags color_aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+
+    // Between layers every target rests in a shader read layout, the previous layer depth
+    // being sampled by the next peel.
+    for (const auto& commands : tree_commands_)
+    {
+      for (uint32_t layer = 0; layer < commands.size(); layer++)
+      {
+        const auto& peel_depth = peel_depth_[layer % 2];
+
+        const VkImageMemoryBarrier peel_barriers[] = {
+          get_barrier(peel_depth, depth_aspect, VK_ACCESS_SHADER_READ_BIT,
+                      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+                          | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                      VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL),
+          get_barrier(layer_color_, color_aspect, 0, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL),
+          get_barrier(inside_mask_, color_aspect, 0, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                      VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL),
+        };
+
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                             0, 0, nullptr, 0, nullptr, 3, peel_barriers);
+
+        execute_profiled("csg tree peel", peel_rendering_infos[layer % 2], commands[layer].peel);
+
+        const VkImageMemoryBarrier count_barriers[] = {
+          get_barrier(peel_depth, depth_aspect, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT,
+                      VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                      VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL),
+          get_barrier(layer_color_, color_aspect, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                      VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+        };
+
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                             0, 0, nullptr, 0, nullptr, 2, count_barriers);
+
+        execute_profiled("csg tree count", count_rendering_infos[layer % 2],
+                         commands[layer].count);
+
+        const VkImageMemoryBarrier resolve_barriers[] = {
+          get_barrier(peel_depth, depth_aspect, 0, VK_ACCESS_SHADER_READ_BIT,
+                      VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+                      VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL),
+          get_barrier(inside_mask_, color_aspect, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                      VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                      VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL),
+        };
+
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+                                 | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                             VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 2,
+                             resolve_barriers);
+
+        vkCmdPipelineBarrier(command_buffer,
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+                             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+                                 | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                             0, 1, &resolve_barrier, 0, nullptr, 0, nullptr);
+
+        execute_profiled("csg tree resolve", resolve_rendering_info, commands[layer].resolve);
+      }
+    }
+  }
+
+  void CSGTreePipeline::free()
+  {
+    if (!supported_)
+      return;
+
+    auto& engine = core::Engine::get_singleton();
+
+    vkDestroyPipeline(engine.get_device(), peel_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), count_pipeline_, nullptr);
+    vkDestroyPipeline(engine.get_device(), resolve_pipeline_, nullptr);
+
+    vkDestroyShaderModule(engine.get_device(), vertex_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), peel_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), count_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), resolve_vertex_shader_, nullptr);
+    vkDestroyShaderModule(engine.get_device(), resolve_shader_, nullptr);
+
+    vkDestroyPipelineCache(engine.get_device(), pipeline_cache_, nullptr);
+    vkDestroySampler(engine.get_device(), sampler_, nullptr);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      engine.destroy_buffer(uniform_buffers_[i], uniform_buffers_allocation_[i]);
+      engine.destroy_buffer(program_buffers_[i], program_buffers_allocation_[i]);
+    }
+
+    vkDestroyDescriptorPool(engine.get_device(), descriptor_pool_, nullptr);
+    vkDestroyPipelineLayout(engine.get_device(), geometry_pipeline_layout_, nullptr);
+    vkDestroyPipelineLayout(engine.get_device(), resolve_pipeline_layout_, nullptr);
+    vkDestroyDescriptorSetLayout(engine.get_device(), frame_descriptor_set_layout_, nullptr);
+    vkDestroyDescriptorSetLayout(engine.get_device(), peel_descriptor_set_layout_, nullptr);
+    vkDestroyDescriptorSetLayout(engine.get_device(), resolve_descriptor_set_layout_, nullptr);
+
+    destroy_targets();
+  }
+
+  void CSGTreePipeline::resize()
+  {
+    if (!supported_)
+      return;
+
+    destroy_targets();
+    create_targets();
+    bind_targets();
+  }
+
+  void CSGTreePipeline::set_layer_count(uint32_t layer_count)
+  {
+    layer_count_ = std::clamp<uint32_t>(layer_count, 1, CSG_TREE_MAX_LAYERS);
+  }
+
+  bool CSGTreePipeline::flatten(const scene::CSGNode& node, const types::CFrame& parent_cframe,
+                                CSGTree& tree) const
+  {
+    auto cframe = parent_cframe * node.cframe;
+    size_t operand_start = tree.operands.size();
+    size_t program_start = tree.program.size();
+
+    uint32_t operation = CSG_OP_UNION;
+    if (node.operation == scene::CSGOperation::Subtract)
+      operation = CSG_OP_SUBTRACT;
+    else if (node.operation == scene::CSGOperation::Intersect)
+      operation = CSG_OP_INTERSECT;
+
+    bool first = true;
+    for (auto operand : node.get_operands())
+    {
+      size_t program_size = tree.program.size();
+
+      if (auto child = dynamic_cast<const scene::CSGNode*>(operand))
+      {
+        if (!flatten(*child, cframe, tree))
+          return false;
+      }
+      else if (auto mesh = dynamic_cast<const scene::Mesh*>(operand))
+      {
+        if (tree.operands.size() == CSG_TREE_MAX_OPERANDS)
+          return false;
+
+        tree.program.push_back(CSG_OP_OPERAND << 16 | tree.operands.size());
+        tree.operands.push_back({ mesh, (cframe * mesh->cframe).to_matrix() });
+      }
+
+      if (tree.program.size() != program_size)
+      {
+        if (!first)
+          tree.program.push_back(operation << 16);
+        first = false;
+      }
+      else if (operation == CSG_OP_INTERSECT || (operation == CSG_OP_SUBTRACT && first))
+      {
+        // An empty operand empties the whole node.
+        tree.operands.resize(operand_start);
+        tree.program.resize(program_start);
+        return true;
+      }
+    }
+
+    return true;
+  }
+
+  void CSGTreePipeline::create_pipeline_layout()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkDescriptorSetLayoutBinding frame_bindings[] = {
+      {
+          .binding = 0,
+          .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+          .pImmutableSamplers = nullptr,
+      },
+      {
+          .binding = 1,
+          .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .pImmutableSamplers = nullptr,
+      },
+    };
+
+    const VkDescriptorSetLayoutBinding peel_bindings[] = {
+      {
+          .binding = 0,
+          .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .descriptorCount = 1,
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .pImmutableSamplers = nullptr,
+      },
+    };
+
+    VkDescriptorSetLayoutBinding resolve_bindings[3];
+    for (uint32_t i = 0; i < 3; i++)
+    {
+      resolve_bindings[i] = {
+        .binding = i,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .pImmutableSamplers = nullptr,
+      };
+    }
+
+    const VkDescriptorSetLayoutCreateInfo frame_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .bindingCount = 2,
+      .pBindings = frame_bindings,
+    };
+
+    const VkDescriptorSetLayoutCreateInfo peel_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .bindingCount = 1,
+      .pBindings = peel_bindings,
+    };
+
+    const VkDescriptorSetLayoutCreateInfo resolve_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .bindingCount = 3,
+      .pBindings = resolve_bindings,
+    };
+
+    VkResult result = vkCreateDescriptorSetLayout(engine.get_device(), &frame_layout_info,
+                                                  nullptr, &frame_descriptor_set_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create descriptor set layout");
+
+    result = vkCreateDescriptorSetLayout(engine.get_device(), &peel_layout_info, nullptr,
+                                         &peel_descriptor_set_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create descriptor set layout");
+
+    result = vkCreateDescriptorSetLayout(engine.get_device(), &resolve_layout_info, nullptr,
+                                         &resolve_descriptor_set_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create descriptor set layout");
+
+    // The model matrix, then the first layer flag of the peel or the operand bit of the count.
+    const VkPushConstantRange geometry_push_constant_ranges[] = {
+      {
+          .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+          .offset = 0,
+          .size = 64,
+      },
+      {
+          .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .offset = 64,
+          .size = 8,
+      },
+    };
+
+    const VkDescriptorSetLayout geometry_descriptor_layouts[] = {
+      frame_descriptor_set_layout_,
+      peel_descriptor_set_layout_,
+    };
+
+    const VkPipelineLayoutCreateInfo geometry_layout_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .setLayoutCount = 2,
+      .pSetLayouts = geometry_descriptor_layouts,
+      .pushConstantRangeCount = 2,
+      .pPushConstantRanges = geometry_push_constant_ranges,
+    };
+
+    result = vkCreatePipelineLayout(engine.get_device(), &geometry_layout_info, nullptr,
+                                    &geometry_pipeline_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create pipeline layout");
+
+    // Offset and length of the tree program.
+    const VkPushConstantRange resolve_push_constant_range = {
+      .stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
+      .offset = 0,
+      .size = 8,
+    };
+
+    const VkDescriptorSetLayout resolve_descriptor_layouts[] = {
+      frame_descriptor_set_layout_,
+      resolve_descriptor_set_layout_,
+    };
+
+    const VkPipelineLayoutCreateInfo resolve_layout_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .setLayoutCount = 2,
+      .pSetLayouts = resolve_descriptor_layouts,
+      .pushConstantRangeCount = 1,
+      .pPushConstantRanges = &resolve_push_constant_range,
+    };
+
+    result = vkCreatePipelineLayout(engine.get_device(), &resolve_layout_create_info, nullptr,
+                                    &resolve_pipeline_layout_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create pipeline layout");
+  }
+
+  void CSGTreePipeline::create_descriptor_set()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkDescriptorPoolSize pool_sizes[] = {
+      {
+          .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+          .descriptorCount = MAX_FRAMES_IN_FLIGHT,
+      },
+      {
+          .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+          .descriptorCount = MAX_FRAMES_IN_FLIGHT,
+      },
+      {
+          .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+          .descriptorCount = 2 * 4,
+      },
+    };
+
+    const VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .maxSets = MAX_FRAMES_IN_FLIGHT + 4,
+      .poolSizeCount = 3,
+      .pPoolSizes = pool_sizes,
+    };
+
+    VkResult result = vkCreateDescriptorPool(engine.get_device(), &descriptor_pool_create_info,
+                                             nullptr, &descriptor_pool_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create descriptor pool");
+
+    std::vector<VkDescriptorSetLayout> frame_layouts(MAX_FRAMES_IN_FLIGHT,
+                                                     frame_descriptor_set_layout_);
+
+    const VkDescriptorSetAllocateInfo frame_descriptor_set_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .descriptorPool = descriptor_pool_,
+      .descriptorSetCount = MAX_FRAMES_IN_FLIGHT,
+      .pSetLayouts = frame_layouts.data(),
+    };
+
+    frame_descriptor_sets_.resize(MAX_FRAMES_IN_FLIGHT);
+    result = vkAllocateDescriptorSets(engine.get_device(), &frame_descriptor_set_info,
+                                      frame_descriptor_sets_.data());
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate descriptor set");
+
+    const VkDescriptorSetLayout peel_layouts[] = {
+      peel_descriptor_set_layout_,
+      peel_descriptor_set_layout_,
+    };
+
+    const VkDescriptorSetAllocateInfo peel_descriptor_set_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .descriptorPool = descriptor_pool_,
+      .descriptorSetCount = 2,
+      .pSetLayouts = peel_layouts,
+    };
+
+    result = vkAllocateDescriptorSets(engine.get_device(), &peel_descriptor_set_info,
+                                      peel_descriptor_sets_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate descriptor set");
+
+    const VkDescriptorSetLayout resolve_layouts[] = {
+      resolve_descriptor_set_layout_,
+      resolve_descriptor_set_layout_,
+    };
+
+    const VkDescriptorSetAllocateInfo resolve_descriptor_set_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .pNext = nullptr,
+      .descriptorPool = descriptor_pool_,
+      .descriptorSetCount = 2,
+      .pSetLayouts = resolve_layouts,
+    };
+
+    result = vkAllocateDescriptorSets(engine.get_device(), &resolve_descriptor_set_info,
+                                      resolve_descriptor_sets_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to allocate descriptor set");
+  }
+
+  void CSGTreePipeline::create_pipeline_cache()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    const VkPipelineCacheCreateInfo create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .initialDataSize = 0,
+      .pInitialData = nullptr,
+    };
+
+    VkResult result =
+        vkCreatePipelineCache(engine.get_device(), &create_info, nullptr, &pipeline_cache_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create pipeline cache");
+  }
+
+  void CSGTreePipeline::create_graphics_pipeline()
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto device = engine.get_device();
+
+    const VkVertexInputBindingDescription vertex_binding_description = {
+      .binding = 0,
+      .stride = 32,
+      .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    };
+
+    const VkVertexInputAttributeDescription vertex_attribute_descriptions[] = {
+      {
+          .location = 0,
+          .binding = 0,
+          .format = VK_FORMAT_R32G32B32_SFLOAT,
+          .offset = 0,
+      },
+      {
+          .location = 1,
+          .binding = 0,
+          .format = VK_FORMAT_R32G32B32_SFLOAT,
+          .offset = 12,
+      },
+      {
+          .location = 2,
+          .binding = 0,
+          .format = VK_FORMAT_R32G32_SFLOAT,
+          .offset = 24,
+      },
+    };
+
+    const VkPipelineVertexInputStateCreateInfo vertex_input_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .vertexBindingDescriptionCount = 1,
+      .pVertexBindingDescriptions = &vertex_binding_description,
+      .vertexAttributeDescriptionCount = 3,
+      .pVertexAttributeDescriptions = vertex_attribute_descriptions,
+    };
+
+    // The resolve triangle is generated from the vertex index.
+    const VkPipelineVertexInputStateCreateInfo resolve_vertex_input_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .vertexBindingDescriptionCount = 0,
+      .pVertexBindingDescriptions = nullptr,
+      .vertexAttributeDescriptionCount = 0,
+      .pVertexAttributeDescriptions = nullptr,
+    };
+
+    const VkPipelineInputAssemblyStateCreateInfo input_assembly_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+      .primitiveRestartEnable = VK_FALSE,
+    };
+
+    // Front and back faces both bound the operands.
+    const VkPipelineRasterizationStateCreateInfo rasterization_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .depthClampEnable = VK_FALSE,
+      .rasterizerDiscardEnable = VK_FALSE,
+      .polygonMode = VK_POLYGON_MODE_FILL,
+      .cullMode = VK_CULL_MODE_NONE,
+      .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
+      .depthBiasEnable = VK_FALSE,
+      .depthBiasConstantFactor = 0.0f,
+      .depthBiasClamp = 0.0f,
+      .depthBiasSlopeFactor = 0.0f,
+      .lineWidth = 1.0f,
+    };
+
+    const VkPipelineMultisampleStateCreateInfo multisample_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+      .sampleShadingEnable = VK_FALSE,
+      .minSampleShading = 0.0f,
+      .pSampleMask = nullptr,
+      .alphaToCoverageEnable = VK_FALSE,
+      .alphaToOneEnable = VK_FALSE,
+    };
+
+    const VkPipelineColorBlendAttachmentState color_blend_attachment = {
+      .blendEnable = VK_FALSE,
+      .srcColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .colorBlendOp = VK_BLEND_OP_ADD,
+      .srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+      .alphaBlendOp = VK_BLEND_OP_ADD,
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+          | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+
+    const VkPipelineColorBlendStateCreateInfo color_blend_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .logicOpEnable = VK_FALSE,
+      .logicOp = VK_LOGIC_OP_COPY,
+      .attachmentCount = 1,
+      .pAttachments = &color_blend_attachment,
+      .blendConstants = { 0.0f, 0.0f, 0.0f, 0.0f },
+    };
+
+    // Every operand flips its bit for each of its surfaces up to the layer.
+    const VkPipelineColorBlendStateCreateInfo count_color_blend_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .logicOpEnable = VK_TRUE,
+      .logicOp = VK_LOGIC_OP_XOR,
+      .attachmentCount = 1,
+      .pAttachments = &color_blend_attachment,
+      .blendConstants = { 0.0f, 0.0f, 0.0f, 0.0f },
+    };
+
+    const VkDynamicState dynamic_states[] = {
+      VK_DYNAMIC_STATE_VIEWPORT,
+      VK_DYNAMIC_STATE_SCISSOR,
+    };
+
+    const VkPipelineDynamicStateCreateInfo dynamic_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .dynamicStateCount = sizeof(dynamic_states) / sizeof(dynamic_states[0]),
+      .pDynamicStates = dynamic_states,
+    };
+
+    const VkPipelineViewportStateCreateInfo viewport_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewportCount = 1,
+      .pViewports = nullptr,
+      .scissorCount = 1,
+      .pScissors = nullptr,
+    };
+
+    const VkPipelineDepthStencilStateCreateInfo depth_stencil_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .depthTestEnable = VK_TRUE,
+      .depthWriteEnable = VK_TRUE,
+      .depthCompareOp = VK_COMPARE_OP_LESS,
+      .depthBoundsTestEnable = VK_FALSE,
+      .stencilTestEnable = VK_FALSE,
+      .front = {},
+      .back = {},
+      .minDepthBounds = 0.0f,
+      .maxDepthBounds = 1.0f,
+    };
+
+    // Surfaces on the layer count too, so the mask tells what lies just behind it.
+    const VkPipelineDepthStencilStateCreateInfo count_depth_stencil_state = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .depthTestEnable = VK_TRUE,
+      .depthWriteEnable = VK_FALSE,
+      .depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL,
+      .depthBoundsTestEnable = VK_FALSE,
+      .stencilTestEnable = VK_FALSE,
+      .front = {},
+      .back = {},
+      .minDepthBounds = 0.0f,
+      .maxDepthBounds = 1.0f,
+    };
+
+    const VkPipelineShaderStageCreateInfo peel_shader_stage_infos[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_VERTEX_BIT,
+          .module = vertex_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = peel_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
+
+    const VkFormat peel_color_format = VK_FORMAT_R8G8B8A8_UNORM;
+
+    const VkPipelineRenderingCreateInfo peel_rendering_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &peel_color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+    };
+
+    const VkGraphicsPipelineCreateInfo peel_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .pNext = &peel_rendering_create_info,
+      .flags = 0,
+      .stageCount = 2,
+      .pStages = peel_shader_stage_infos,
+      .pVertexInputState = &vertex_input_state,
+      .pInputAssemblyState = &input_assembly_state,
+      .pTessellationState = nullptr,
+      .pViewportState = &viewport_state,
+      .pRasterizationState = &rasterization_state,
+      .pMultisampleState = &multisample_state,
+      .pDepthStencilState = &depth_stencil_state,
+      .pColorBlendState = &color_blend_state,
+      .pDynamicState = &dynamic_state,
+      .layout = geometry_pipeline_layout_,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
+
+    VkResult result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &peel_create_info,
+                                                nullptr, &peel_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+
+    const VkPipelineShaderStageCreateInfo count_shader_stage_infos[] = {
+      peel_shader_stage_infos[0],
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = count_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
+
+    const VkFormat count_color_format = VK_FORMAT_R32G32_UINT;
+
+    const VkPipelineRenderingCreateInfo count_rendering_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &count_color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+    };
+
+    const VkGraphicsPipelineCreateInfo count_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .pNext = &count_rendering_create_info,
+      .flags = 0,
+      .stageCount = 2,
+      .pStages = count_shader_stage_infos,
+      .pVertexInputState = &vertex_input_state,
+      .pInputAssemblyState = &input_assembly_state,
+      .pTessellationState = nullptr,
+      .pViewportState = &viewport_state,
+      .pRasterizationState = &rasterization_state,
+      .pMultisampleState = &multisample_state,
+      .pDepthStencilState = &count_depth_stencil_state,
+      .pColorBlendState = &count_color_blend_state,
+      .pDynamicState = &dynamic_state,
+      .layout = geometry_pipeline_layout_,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
+
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &count_create_info, nullptr,
+                                       &count_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+
+    const VkPipelineShaderStageCreateInfo resolve_shader_stage_infos[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_VERTEX_BIT,
+          .module = resolve_vertex_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+          .pNext = nullptr,
+          .flags = 0,
+          .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+          .module = resolve_shader_,
+          .pName = "main",
+          .pSpecializationInfo = nullptr,
+      },
+    };
+
+    VkFormat resolve_color_format = engine.get_surface_format().format;
+
+    const VkPipelineRenderingCreateInfo resolve_rendering_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &resolve_color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+    };
+
+    const VkGraphicsPipelineCreateInfo resolve_create_info = {
+      .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+      .pNext = &resolve_rendering_create_info,
+      .flags = 0,
+      .stageCount = 2,
+      .pStages = resolve_shader_stage_infos,
+      .pVertexInputState = &resolve_vertex_input_state,
+      .pInputAssemblyState = &input_assembly_state,
+      .pTessellationState = nullptr,
+      .pViewportState = &viewport_state,
+      .pRasterizationState = &rasterization_state,
+      .pMultisampleState = &multisample_state,
+      .pDepthStencilState = &depth_stencil_state,
+      .pColorBlendState = &color_blend_state,
+      .pDynamicState = &dynamic_state,
+      .layout = resolve_pipeline_layout_,
+      .renderPass = VK_NULL_HANDLE,
+      .subpass = 0,
+      .basePipelineHandle = VK_NULL_HANDLE,
+      .basePipelineIndex = 0,
+    };
+
+    result = vkCreateGraphicsPipelines(device, pipeline_cache_, 1, &resolve_create_info, nullptr,
+                                       &resolve_pipeline_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create graphics pipeline");
+  }
+
+  void CSGTreePipeline::create_buffers()
+  {
+    auto& engine = core::Engine::get_singleton();
+    VkDeviceSize uniform_buffer_size = 128;
+    VkDeviceSize program_buffer_size = CSG_TREE_MAX_PROGRAM * sizeof(uint32_t);
+
+    uniform_buffers_.resize(MAX_FRAMES_IN_FLIGHT);
+    uniform_buffers_allocation_.resize(MAX_FRAMES_IN_FLIGHT);
+    program_buffers_.resize(MAX_FRAMES_IN_FLIGHT);
+    program_buffers_allocation_.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+      const VkBufferCreateInfo uniform_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .size = uniform_buffer_size,
+        .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = 0,
+        .pQueueFamilyIndices = nullptr,
+      };
+
+      engine.create_buffer(uniform_buffer_info,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           uniform_buffers_[i], uniform_buffers_allocation_[i]);
+
+      const VkBufferCreateInfo program_buffer_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .size = program_buffer_size,
+        .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = 0,
+        .pQueueFamilyIndices = nullptr,
+      };
+
+      engine.create_buffer(program_buffer_info,
+                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                               | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                           program_buffers_[i], program_buffers_allocation_[i]);
+
+      const VkDescriptorBufferInfo uniform_buffer_descriptor = {
+        .buffer = uniform_buffers_[i],
+        .offset = 0,
+        .range = uniform_buffer_size,
+      };
+
+      const VkDescriptorBufferInfo program_buffer_descriptor = {
+        .buffer = program_buffers_[i],
+        .offset = 0,
+        .range = program_buffer_size,
+      };
+
+      const VkWriteDescriptorSet write_descriptor_sets[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = frame_descriptor_sets_[i],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .pImageInfo = nullptr,
+            .pBufferInfo = &uniform_buffer_descriptor,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = frame_descriptor_sets_[i],
+            .dstBinding = 1,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .pImageInfo = nullptr,
+            .pBufferInfo = &program_buffer_descriptor,
+            .pTexelBufferView = nullptr,
+        },
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 2, write_descriptor_sets, 0, nullptr);
+    }
+
+    const VkSamplerCreateInfo sampler_info = {
+      .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .magFilter = VK_FILTER_NEAREST,
+      .minFilter = VK_FILTER_NEAREST,
+      .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+      .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+      .mipLodBias = 0.0f,
+      .anisotropyEnable = VK_FALSE,
+      .maxAnisotropy = 0.0f,
+      .compareEnable = VK_FALSE,
+      .compareOp = VK_COMPARE_OP_NEVER,
+      .minLod = 0.0f,
+      .maxLod = 0.0f,
+      .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE,
+      .unnormalizedCoordinates = VK_FALSE,
+    };
+
+    VkResult result = vkCreateSampler(engine.get_device(), &sampler_info, nullptr, &sampler_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create sampler");
+  }
+
+  void CSGTreePipeline::create_targets()
+  {
+    for (auto& peel_depth : peel_depth_)
+      create_target(VK_FORMAT_D32_SFLOAT, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                    VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+                    peel_depth);
+
+    create_target(VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                  VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                  layer_color_);
+    create_target(VK_FORMAT_R32G32_UINT, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+                  VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                  inside_mask_);
+  }
+
+  void CSGTreePipeline::destroy_targets()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    for (auto target : { &peel_depth_[0], &peel_depth_[1], &layer_color_, &inside_mask_ })
+    {
+      vkDestroyImageView(engine.get_device(), target->view, nullptr);
+      engine.destroy_image(target->image, target->allocation);
+      *target = {};
+    }
+  }
+
+  void CSGTreePipeline::create_target(VkFormat format, VkImageUsageFlags usage,
+                                      VkImageAspectFlags aspect_mask, VkImageLayout layout,
+                                      Target& target) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = { extent.width, extent.height, 1 },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = usage | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, target.image,
+                        target.allocation);
+
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = aspect_mask,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageViewCreateInfo view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .image = target.image,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = format,
+      .components = {},
+      .subresourceRange = subresource_range,
+    };
+
+    VkResult result = vkCreateImageView(engine.get_device(), &view_info, nullptr, &target.view);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create image view");
+
+    const core::TransitionLayout transition_layout = {
+      .src_access = 0,
+      .dst_access = VK_ACCESS_SHADER_READ_BIT,
+      .src_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      .dst_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+      .aspect_mask = aspect_mask,
+      .old_layout = VK_IMAGE_LAYOUT_UNDEFINED,
+      .new_layout = layout,
+    };
+
+    engine.transition_image_layout(target.image, format, 1, transition_layout);
+  }
+
+  void CSGTreePipeline::bind_targets()
+  {
+    auto& engine = core::Engine::get_singleton();
+
+    for (uint32_t i = 0; i < 2; i++)
+    {
+      // The peel writing to one depth target reads the layer from the other one.
+      const VkDescriptorImageInfo previous_layer_info = {
+        .sampler = sampler_,
+        .imageView = peel_depth_[1 - i].view,
+        .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+      };
+
+      const VkDescriptorImageInfo resolve_image_infos[] = {
+        {
+            .sampler = sampler_,
+            .imageView = inside_mask_.view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        },
+        {
+            .sampler = sampler_,
+            .imageView = peel_depth_[i].view,
+            .imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+        },
+        {
+            .sampler = sampler_,
+            .imageView = layer_color_.view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        },
+      };
+
+      const VkWriteDescriptorSet write_descriptor_sets[] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = peel_descriptor_sets_[i],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &previous_layer_info,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .pNext = nullptr,
+            .dstSet = resolve_descriptor_sets_[i],
+            .dstBinding = 0,
+            .dstArrayElement = 0,
+            .descriptorCount = 3,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = resolve_image_infos,
+            .pBufferInfo = nullptr,
+            .pTexelBufferView = nullptr,
+        },
+      };
+
+      vkUpdateDescriptorSets(engine.get_device(), 2, write_descriptor_sets, 0, nullptr);
+    }
+  }
+
+  VkImageMemoryBarrier CSGTreePipeline::get_barrier(const Target& target,
+                                                    VkImageAspectFlags aspect_mask,
+                                                    VkAccessFlags src_access,
+                                                    VkAccessFlags dst_access,
+                                                    VkImageLayout old_layout,
+                                                    VkImageLayout new_layout) const
+  {
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = aspect_mask,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    return {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = src_access,
+      .dstAccessMask = dst_access,
+      .oldLayout = old_layout,
+      .newLayout = new_layout,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = target.image,
+      .subresourceRange = subresource_range,
+    };
+  }
+
+  void CSGTreePipeline::set_dynamic_state(VkCommandBuffer command_buffer) const
+  {
+    auto extent = core::Engine::get_singleton().get_render_extent();
+
+    const VkViewport viewport{
+      .x = 0.0f,
+      .y = 0.0f,
+      .width = static_cast<float>(extent.width),
+      .height = static_cast<float>(extent.height),
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f,
+    };
+
+    const VkRect2D scissor = {
+      .offset = { 0, 0 },
+      .extent = extent,
+    };
+
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+  }
+
+  void CSGTreePipeline::draw_mesh(VkCommandBuffer command_buffer, const scene::Mesh& mesh) const
+  {
+    VkDeviceSize offset = 0;
+    VkBuffer vertex_buffer = mesh.get_vertex_buffer();
+    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer, &offset);
+    vkCmdBindIndexBuffer(command_buffer, mesh.get_index_buffer(), offset, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexed(command_buffer, mesh.get_index_count(), 1, 0, 0, 0);
+  }
+
+  VkCommandBuffer CSGTreePipeline::record_peel(const CSGTree& tree, uint32_t layer) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    const VkFormat color_format = VK_FORMAT_R8G8B8A8_UNORM;
+
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer);
+
+    const VkDescriptorSet descriptor_sets[] = {
+      frame_descriptor_sets_[engine.get_current_frame()],
+      peel_descriptor_sets_[layer % 2],
+    };
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, peel_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            geometry_pipeline_layout_, 0, 2, descriptor_sets, 0, nullptr);
+
+    uint32_t first_layer = layer == 0;
+    vkCmdPushConstants(command_buffer, geometry_pipeline_layout_, VK_SHADER_STAGE_FRAGMENT_BIT, 64,
+                       sizeof(first_layer), &first_layer);
+
+    for (const auto& operand : tree.operands)
+    {
+      vkCmdPushConstants(command_buffer, geometry_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                         64, operand.transform.data());
+      draw_mesh(command_buffer, *operand.mesh);
+    }
+
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
+
+  VkCommandBuffer CSGTreePipeline::record_count(const CSGTree& tree) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    const VkFormat color_format = VK_FORMAT_R32G32_UINT;
+
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer);
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, count_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            geometry_pipeline_layout_, 0, 1,
+                            &frame_descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+
+    for (uint32_t i = 0; i < tree.operands.size(); i++)
+    {
+      const uint32_t operand_bit[] = {
+        i < 32 ? 1u << i : 0u,
+        i < 32 ? 0u : 1u << (i - 32),
+      };
+
+      vkCmdPushConstants(command_buffer, geometry_pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                         64, tree.operands[i].transform.data());
+      vkCmdPushConstants(command_buffer, geometry_pipeline_layout_, VK_SHADER_STAGE_FRAGMENT_BIT, 64,
+                         sizeof(operand_bit), operand_bit);
+      draw_mesh(command_buffer, *tree.operands[i].mesh);
+    }
+
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
+
+  VkCommandBuffer CSGTreePipeline::record_resolve(const CSGTree& tree, uint32_t layer) const
+  {
+    auto& engine = core::Engine::get_singleton();
+    auto& command_pools = core::CommandPools::get_singleton();
+
+    VkFormat color_format = engine.get_surface_format().format;
+
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_D32_SFLOAT_S8_UINT,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    auto command_buffer = command_pools.begin(inheritance_rendering_info);
+    set_dynamic_state(command_buffer);
+
+    const VkDescriptorSet descriptor_sets[] = {
+      frame_descriptor_sets_[engine.get_current_frame()],
+      resolve_descriptor_sets_[layer % 2],
+    };
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, resolve_pipeline_);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            resolve_pipeline_layout_, 0, 2, descriptor_sets, 0, nullptr);
+
+    const uint32_t program[] = {
+      tree.program_offset,
+      static_cast<uint32_t>(tree.program.size()),
+    };
+
+    vkCmdPushConstants(command_buffer, resolve_pipeline_layout_, VK_SHADER_STAGE_FRAGMENT_BIT, 0,
+                       sizeof(program), program);
+    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+
+    command_pools.end(command_buffer);
+    return command_buffer;
+  }
+} // namespace gfx
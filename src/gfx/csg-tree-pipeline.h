@@ -0,0 +1,160 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "core/memory-allocator.h"
+#include "gfx/pipeline.h"
+#include "misc/singleton.h"
+#include "scene/csg-node.h"
+#include "types/cframe.h"
+#include "types/matrix4.h"
+
+/// One bit per operand in the R32G32_UINT inside mask.
+#define CSG_TREE_MAX_OPERANDS 64
+#define CSG_TREE_MAX_LAYERS 16
+#define CSG_TREE_DEFAULT_LAYERS 8
+/// Program words of every tree drawn in a frame.
+#define CSG_TREE_MAX_PROGRAM 4096
+
+#define CSG_OP_OPERAND 0u
+#define CSG_OP_UNION 1u
+#define CSG_OP_SUBTRACT 2u
+#define CSG_OP_INTERSECT 3u
+
+namespace gfx
+{
+  struct CSGOperand
+  {
+    const scene::Mesh* mesh;
+    types::Matrix4 transform;
+  };
+
+  /// A CSG node flattened into the meshes it combines and a postfix program over them.
+  struct CSGTree
+  {
+    std::vector<CSGOperand> operands;
+    /// Operation in the high half of each word, operand index in the low half.
+    std::vector<uint32_t> program;
+    uint32_t program_offset;
+  };
+
+  /// Evaluates CSG trees of any shape in image space by depth peeling. Every layer peels the
+  /// next surface of all the operands, counts for each operand the surfaces in front of it to
+  /// know which operands it lies in, then keeps it where the tree expression holds. A tree
+  /// costs three passes per layer whatever its operand count, and surfaces deeper than the
+  /// last layer are lost.
+  class CSGTreePipeline
+    : public misc::Singleton<CSGTreePipeline>
+    , public Pipeline
+  {
+    // Give Singleton<CSGTreePipeline> access to class’s private constructor
+    friend class Singleton<CSGTreePipeline>;
+
+  private:
+    /// Construct a CSGTreePipeline.
+    CSGTreePipeline() = default;
+
+  public:
+    void init();
+    /// Flatten the trees of the frame on the main thread, before any call to record(). Trees
+    /// with more than CSG_TREE_MAX_OPERANDS meshes are skipped.
+    void update(const types::Matrix4& view, const types::Matrix4& projection,
+                std::span<scene::CSGNode* const> nodes);
+    /// Record the passes of tree index into secondary command buffers, safe to call from a
+    /// worker thread.
+    void record(uint32_t index);
+    /// Execute the recorded passes, resolving each tree into image_view and depth_view.
+    void draw(VkImageView image_view, VkImageView depth_view,
+              VkCommandBuffer command_buffer) const;
+    void free();
+    /// Recreate the layer targets at the current render extent. The device must be idle.
+    void resize();
+
+    uint32_t get_tree_count() const;
+    uint32_t get_layer_count() const;
+    void set_layer_count(uint32_t layer_count);
+    /// Rendering passes drawn by the last draw().
+    uint32_t get_pass_count() const;
+
+  private:
+    struct Target
+    {
+      VkImage image = VK_NULL_HANDLE;
+      VkImageView view = VK_NULL_HANDLE;
+      core::Allocation allocation;
+    };
+
+    struct LayerCommands
+    {
+      VkCommandBuffer peel;
+      VkCommandBuffer count;
+      VkCommandBuffer resolve;
+    };
+
+    /// Append the operands and program of node, false once the tree has too many operands.
+    bool flatten(const scene::CSGNode& node, const types::CFrame& parent_cframe,
+                 CSGTree& tree) const;
+
+    void create_pipeline_layout();
+    void create_descriptor_set();
+    void create_pipeline_cache();
+    void create_graphics_pipeline();
+    void create_buffers();
+    void create_targets();
+    void destroy_targets();
+    void create_target(VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect_mask,
+                       VkImageLayout layout, Target& target) const;
+    void bind_targets();
+    VkImageMemoryBarrier get_barrier(const Target& target, VkImageAspectFlags aspect_mask,
+                                     VkAccessFlags src_access, VkAccessFlags dst_access,
+                                     VkImageLayout old_layout, VkImageLayout new_layout) const;
+
+    void set_dynamic_state(VkCommandBuffer command_buffer) const;
+    void draw_mesh(VkCommandBuffer command_buffer, const scene::Mesh& mesh) const;
+    VkCommandBuffer record_peel(const CSGTree& tree, uint32_t layer) const;
+    VkCommandBuffer record_count(const CSGTree& tree) const;
+    VkCommandBuffer record_resolve(const CSGTree& tree, uint32_t layer) const;
+
+    VkDescriptorSetLayout frame_descriptor_set_layout_ = VK_NULL_HANDLE;
+    VkDescriptorSetLayout peel_descriptor_set_layout_ = VK_NULL_HANDLE;
+    VkDescriptorSetLayout resolve_descriptor_set_layout_ = VK_NULL_HANDLE;
+    VkPipelineLayout geometry_pipeline_layout_ = VK_NULL_HANDLE;
+    VkPipelineLayout resolve_pipeline_layout_ = VK_NULL_HANDLE;
+    VkDescriptorPool descriptor_pool_ = VK_NULL_HANDLE;
+    /// Indexed by frame in flight.
+    std::vector<VkDescriptorSet> frame_descriptor_sets_;
+    /// Indexed by which of the two peel depth targets the layer renders to.
+    VkDescriptorSet peel_descriptor_sets_[2] = {};
+    VkDescriptorSet resolve_descriptor_sets_[2] = {};
+    VkPipelineCache pipeline_cache_ = VK_NULL_HANDLE;
+    VkShaderModule vertex_shader_ = VK_NULL_HANDLE;
+    VkShaderModule peel_shader_ = VK_NULL_HANDLE;
+    VkShaderModule count_shader_ = VK_NULL_HANDLE;
+    VkShaderModule resolve_vertex_shader_ = VK_NULL_HANDLE;
+    VkShaderModule resolve_shader_ = VK_NULL_HANDLE;
+    VkPipeline peel_pipeline_ = VK_NULL_HANDLE;
+    VkPipeline count_pipeline_ = VK_NULL_HANDLE;
+    VkPipeline resolve_pipeline_ = VK_NULL_HANDLE;
+    VkSampler sampler_ = VK_NULL_HANDLE;
+
+    std::vector<VkBuffer> uniform_buffers_;
+    std::vector<core::Allocation> uniform_buffers_allocation_;
+    std::vector<VkBuffer> program_buffers_;
+    std::vector<core::Allocation> program_buffers_allocation_;
+
+    /// Layers alternate between the two, the other one holding the layer peeled before.
+    Target peel_depth_[2];
+    Target layer_color_;
+    Target inside_mask_;
+
+    std::vector<CSGTree> trees_;
+    /// Indexed by tree, then by layer.
+    std::vector<std::vector<LayerCommands>> tree_commands_;
+    uint32_t layer_count_ = CSG_TREE_DEFAULT_LAYERS;
+    bool supported_ = false;
+    bool warned_ = false;
+  };
+} // namespace gfx
+
+#include "gfx/csg-tree-pipeline.hxx"
@@ -0,0 +1,11 @@
+#include "gfx/csg-tree-pipeline.h"
+
+namespace gfx
+{
+  inline uint32_t CSGTreePipeline::get_tree_count() const { return trees_.size(); }
+  inline uint32_t CSGTreePipeline::get_layer_count() const { return layer_count_; }
+  inline uint32_t CSGTreePipeline::get_pass_count() const
+  {
+    return trees_.size() * layer_count_ * 3;
+  }
+} // namespace gfx
@@ -41,4 +41,13 @@ namespace gfx
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create shader module");
   }
+
+  void Pipeline::execute_rendering(VkCommandBuffer command_buffer,
+                                   const VkRenderingInfo& rendering_info,
+                                   VkCommandBuffer secondary_command_buffer) const
+  {
+    vkCmdBeginRendering(command_buffer, &rendering_info);
+    vkCmdExecuteCommands(command_buffer, 1, &secondary_command_buffer);
+    vkCmdEndRendering(command_buffer);
+  }
 } // namespace gfx
@@ -8,5 +8,9 @@ namespace gfx
   {
   protected:
     virtual void create_shader_module(const char* filename, VkShaderModule* shader_module);
+    /// Run a secondary command buffer inside a rendering pass of the primary command buffer,
+    /// rendering_info must have VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT set.
+    void execute_rendering(VkCommandBuffer command_buffer, const VkRenderingInfo& rendering_info,
+                           VkCommandBuffer secondary_command_buffer) const;
   };
 } // namespace gfx
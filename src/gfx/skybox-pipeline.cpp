@@ -2,7 +2,10 @@
 
 #include <cstring>
 
+#include "core/command-pools.h"
 #include "core/engine.h"
+#include "core/profiler.h"
+#include "core/trace-recorder.h"
 
 namespace gfx
 {
@@ -20,12 +23,12 @@ namespace gfx
     create_vertex_buffer();
   }
 
-  void SkyboxPipeline::draw(VkImageView image_view, VkCommandBuffer command_buffer,
-                            const types::Matrix4& view, const types::Matrix4& projection,
-                            const SkyboxData& skybox_data)
+  void SkyboxPipeline::record(const types::Matrix4& view, const types::Matrix4& projection,
+                              const SkyboxData& skybox_data)
   {
+    core::TraceScope scope("skybox record");
     auto& engine = core::Engine::get_singleton();
-    auto extent = engine.get_swapchain_extent();
+    auto extent = engine.get_render_extent();
 
     const VkDescriptorImageInfo descriptor_image_info = {
       .sampler = skybox_data.sampler,
@@ -48,6 +51,62 @@ namespace gfx
 
     vkUpdateDescriptorSets(engine.get_device(), 1, &write_descriptor_set, 0, nullptr);
 
+    const VkFormat color_format = engine.get_surface_format().format;
+    const VkCommandBufferInheritanceRenderingInfo inheritance_rendering_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .viewMask = 0,
+      .colorAttachmentCount = 1,
+      .pColorAttachmentFormats = &color_format,
+      .depthAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .stencilAttachmentFormat = VK_FORMAT_UNDEFINED,
+      .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    auto& command_pools = core::CommandPools::get_singleton();
+    command_buffer_ = command_pools.begin(inheritance_rendering_info);
+
+    vkCmdBindPipeline(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_);
+
+    vkCmdBindDescriptorSets(command_buffer_, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0,
+                            1, &descriptor_sets_[engine.get_current_frame()], 0, nullptr);
+
+    const VkViewport viewport{
+      .x = 0.0f,
+      .y = 0.0f,
+      .width = static_cast<float>(extent.width),
+      .height = static_cast<float>(extent.height),
+      .minDepth = 0.0f,
+      .maxDepth = 1.0f,
+    };
+
+    const VkRect2D scissor = {
+      .offset = { 0, 0 },
+      .extent = extent,
+    };
+
+    vkCmdSetViewport(command_buffer_, 0, 1, &viewport);
+    vkCmdSetScissor(command_buffer_, 0, 1, &scissor);
+
+    VkDeviceSize offset = 0;
+    vkCmdBindVertexBuffers(command_buffer_, 0, 1, &vertex_buffer_, &offset);
+
+    float data[32];
+    std::memcpy(data, view.data(), 16 * sizeof(float));
+    std::memcpy(data + 16, projection.data(), 16 * sizeof(float));
+
+    vkCmdPushConstants(command_buffer_, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
+                       sizeof(data), data);
+    vkCmdDraw(command_buffer_, 36, 1, 0, 0);
+
+    command_pools.end(command_buffer_);
+  }
+
+  void SkyboxPipeline::draw(VkImageView image_view, VkCommandBuffer command_buffer) const
+  {
+    auto extent = core::Engine::get_singleton().get_render_extent();
+
     const VkClearValue clear_value = { { { 0.0f, 0.0f, 0.0f, 1.0f } } };
 
     const VkRenderingAttachmentInfo color_attachment = {
@@ -71,7 +130,7 @@ namespace gfx
     const VkRenderingInfo rendering_info = {
       .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
       .pNext = nullptr,
-      .flags = 0,
+      .flags = VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT,
       .renderArea = render_area,
       .layerCount = 1,
       .viewMask = 0,
@@ -81,40 +140,10 @@ namespace gfx
       .pStencilAttachment = nullptr,
     };
 
-    vkCmdBeginRendering(command_buffer, &rendering_info);
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_);
-
-    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout_, 0, 1,
-                            &descriptor_sets_[engine.get_current_frame()], 0, nullptr);
-
-    const VkViewport viewport{
-      .x = 0.0f,
-      .y = 0.0f,
-      .width = static_cast<float>(extent.width),
-      .height = static_cast<float>(extent.height),
-      .minDepth = 0.0f,
-      .maxDepth = 1.0f,
-    };
-
-    const VkRect2D scissor = {
-      .offset = { 0, 0 },
-      .extent = extent,
-    };
-
-    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
-    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
-
-    VkDeviceSize offset = 0;
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, &vertex_buffer_, &offset);
-
-    float data[32];
-    std::memcpy(data, view.data(), 16 * sizeof(float));
-    std::memcpy(data + 16, projection.data(), 16 * sizeof(float));
-
-    vkCmdPushConstants(command_buffer, pipeline_layout_, VK_SHADER_STAGE_VERTEX_BIT, 0,
-                       sizeof(data), data);
-    vkCmdDraw(command_buffer, 36, 1, 0, 0);
-    vkCmdEndRendering(command_buffer);
+    auto& profiler = core::Profiler::get_singleton();
+    uint32_t query = profiler.begin_gpu(command_buffer, "skybox");
+    execute_rendering(command_buffer, rendering_info, command_buffer_);
+    profiler.end_gpu(command_buffer, query);
   }
 
   void SkyboxPipeline::free()
@@ -122,8 +151,7 @@ namespace gfx
     auto& engine = core::Engine::get_singleton();
     auto device = engine.get_device();
 
-    vkFreeMemory(device, vertex_buffer_memory_, nullptr);
-    vkDestroyBuffer(device, vertex_buffer_, nullptr);
+    engine.destroy_buffer(vertex_buffer_, vertex_buffer_allocation_);
 
     vkDestroyPipeline(device, pipeline_, nullptr);
 
@@ -416,7 +444,6 @@ namespace gfx
   void SkyboxPipeline::create_vertex_buffer()
   {
     auto& engine = core::Engine::get_singleton();
-    auto device = engine.get_device();
 
     // clang-format off
     const float cube_vertices[] = {
@@ -470,35 +497,9 @@ namespace gfx
       .pQueueFamilyIndices = nullptr,
     };
 
-    VkResult result = vkCreateBuffer(device, &create_info, nullptr, &vertex_buffer_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create buffer");
-
-    VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(device, vertex_buffer_, &memory_requirements);
-
     auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    const VkMemoryAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = engine.find_memory_type(memory_requirements.memoryTypeBits, flags),
-    };
-
-    result = vkAllocateMemory(device, &allocate_info, nullptr, &vertex_buffer_memory_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
-
-    result = vkBindBufferMemory(device, vertex_buffer_, vertex_buffer_memory_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to bind buffer memory");
-
-    void* data;
-    result = vkMapMemory(device, vertex_buffer_memory_, 0, sizeof(cube_vertices), 0, &data);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to map buffer memory");
+    engine.create_buffer(create_info, flags, vertex_buffer_, vertex_buffer_allocation_);
 
-    std::memcpy(data, cube_vertices, sizeof(cube_vertices));
-    vkUnmapMemory(engine.get_device(), vertex_buffer_memory_);
+    std::memcpy(vertex_buffer_allocation_.data, cube_vertices, sizeof(cube_vertices));
   }
 } // namespace gfx
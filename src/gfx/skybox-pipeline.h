@@ -2,6 +2,7 @@
 
 #include <vector>
 
+#include "core/memory-allocator.h"
 #include "gfx/pipeline.h"
 #include "misc/singleton.h"
 #include "types/matrix4.h"
@@ -27,8 +28,11 @@ namespace gfx
 
   public:
     void init();
-    void draw(VkImageView image_view, VkCommandBuffer command_buffer, const types::Matrix4& view,
-              const types::Matrix4& projection, const SkyboxData& skybox_data);
+    /// Record the pass into a secondary command buffer, safe to call from a worker thread.
+    void record(const types::Matrix4& view, const types::Matrix4& projection,
+                const SkyboxData& skybox_data);
+    /// Execute the recorded pass on the primary command buffer.
+    void draw(VkImageView image_view, VkCommandBuffer command_buffer) const;
     void free();
 
   private:
@@ -47,7 +51,8 @@ namespace gfx
     VkShaderModule fragment_shader_ = VK_NULL_HANDLE;
     VkPipeline pipeline_ = VK_NULL_HANDLE;
     VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
-    VkDeviceMemory vertex_buffer_memory_ = VK_NULL_HANDLE;
+    core::Allocation vertex_buffer_allocation_;
+    VkCommandBuffer command_buffer_ = VK_NULL_HANDLE;
   };
 } // namespace gfx
 
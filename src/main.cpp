@@ -1,11 +1,16 @@
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
 
 #include "core/asset-manager.h"
 #include "core/engine.h"
 #include "core/scene-manager.h"
+#include "gfx/csg-pipeline.h"
+#include "gfx/csg-tree-pipeline.h"
 #include "gfx/skybox-pipeline.h"
+#include "misc/thread-pool.h"
+#include "scene/csg-node.h"
 #include "scene/cube.h"
 
 using namespace core;
@@ -36,6 +41,147 @@ void init(Scene& scene)
   scene.substractive_mesh = substractive_mesh;
 }
 
+/// Compare device local and dynamic (host visible) geometry on the heavier models, then time
+/// scenes with hundreds of CSG pairs and CSG trees with dozens of operands.
+void benchmark(Scene& scene, uint32_t frame_count)
+{
+  auto& engine = Engine::get_singleton();
+
+  // The skybox is sampled every frame, run once more with --no-mipmaps to compare the texture
+  // bandwidth of the full mip chain against the base level alone.
+  std::cout << "mipmaps " << (engine.is_mipmapping() ? "enabled" : "disabled") << '\n';
+  std::cout << engine.get_frames_in_flight() << " frames in flight\n";
+
+  for (std::string model : { "suzanne", "metaballs" })
+  {
+    for (bool dynamic : { false, true })
+    {
+      delete scene.mesh;
+      delete scene.substractive_mesh;
+
+      scene.mesh = new Mesh(dynamic);
+      scene.mesh->load_mesh_from_file("assets/geometry/" + model + ".obj");
+
+      scene.substractive_mesh = new Mesh(dynamic);
+      scene.substractive_mesh->load_mesh_from_file("assets/geometry/cylinder.obj");
+
+      double frame_time = engine.benchmark(frame_count);
+      std::cout << model << (dynamic ? " dynamic: " : " device local: ") << frame_time
+                << " ms/frame over " << frame_count << " frames\n";
+    }
+  }
+
+  // Every pair records its own passes, so with hundreds of them the frame time mostly depends
+  // on how many threads share the recording.
+  delete scene.mesh;
+  delete scene.substractive_mesh;
+
+  scene.mesh = new Mesh();
+  scene.mesh->load_mesh_from_file("assets/geometry/cube.obj");
+
+  scene.substractive_mesh = new Mesh();
+  scene.substractive_mesh->load_mesh_from_file("assets/geometry/cylinder.obj");
+
+  auto thread_count = misc::ThreadPool::get_singleton().get_thread_count() + 1;
+  auto& csg_pipeline = CSGPipeline::get_singleton();
+  auto csg_mode = csg_pipeline.get_mode();
+  auto csg_active = csg_pipeline.is_active();
+
+  // Carving is what the modes do differently.
+  csg_pipeline.set_active(true);
+
+  const CSGMode modes[] = { CSGMode::DepthImages, CSGMode::Stencil, CSGMode::ABuffer };
+
+  // The mode actually drawn, the A-buffer falls back to the depth images when unsupported.
+  auto mode_name = [&csg_pipeline]() {
+    switch (csg_pipeline.get_mode())
+    {
+    case CSGMode::Stencil:
+      return " (stencil)";
+    case CSGMode::ABuffer:
+      return " (a-buffer)";
+    default:
+      return " (depth images)";
+    }
+  };
+
+  // Metaballs are not convex, only the A-buffer carves the surfaces behind their nearest one.
+  delete scene.substractive_mesh;
+  scene.substractive_mesh = new Mesh();
+  scene.substractive_mesh->load_mesh_from_file("assets/geometry/metaballs.obj");
+
+  for (auto mode : modes)
+  {
+    csg_pipeline.set_mode(mode);
+
+    double frame_time = engine.benchmark(frame_count);
+    std::cout << "cube minus metaballs" << mode_name() << ": " << frame_time
+              << " ms/frame over " << frame_count << " frames\n";
+  }
+
+  delete scene.substractive_mesh;
+  scene.substractive_mesh = new Mesh();
+  scene.substractive_mesh->load_mesh_from_file("assets/geometry/cylinder.obj");
+
+  for (uint32_t pair_count : { 1u, 100u, 500u })
+  {
+    scene.csg_placements.clear();
+    for (uint32_t i = 1; i < pair_count; i++)
+    {
+      Vector3 position((i % 20) * 3.0f, 0, (i / 20) * 3.0f);
+      scene.csg_placements.push_back({ .cframe = CFrame(position),
+                                       .substractive_cframe = CFrame(position) });
+    }
+
+    // The same pairs through the depth images, the stencil and the A-buffer.
+    for (auto mode : modes)
+    {
+      csg_pipeline.set_mode(mode);
+
+      double frame_time = engine.benchmark(frame_count);
+      std::cout << pair_count << " CSG pairs" << mode_name() << " on " << thread_count
+                << " threads: " << frame_time << " ms/frame over " << frame_count << " frames\n";
+    }
+  }
+
+  csg_pipeline.set_mode(csg_mode);
+  csg_pipeline.set_active(csg_active);
+  scene.csg_placements.clear();
+
+  // A tree costs the same number of passes whatever its operand count, only the geometry drawn
+  // by each pass grows with it.
+  auto& csg_tree_pipeline = CSGTreePipeline::get_singleton();
+
+  for (uint32_t operand_count : { 2u, 8u, 32u, 64u })
+  {
+    auto node = new CSGNode(CSGOperation::Subtract);
+    node->cframe = CFrame(Vector3(0, 0, 8));
+
+    auto mesh = new Mesh();
+    mesh->load_mesh_from_file("assets/geometry/cube.obj");
+    mesh->cframe = CFrame(Vector3(0, 0, 0));
+    node->add_operand(mesh);
+
+    for (uint32_t i = 1; i < operand_count; i++)
+    {
+      auto substractive_mesh = new Mesh();
+      substractive_mesh->load_mesh_from_file("assets/geometry/cylinder.obj");
+      substractive_mesh->cframe =
+          CFrame(Vector3((i % 8) * 0.25f - 0.875f, 0, (i / 8) * 0.25f - 0.875f));
+      node->add_operand(substractive_mesh);
+    }
+
+    node->set_parent(&scene);
+
+    double frame_time = engine.benchmark(frame_count);
+    std::cout << operand_count << " CSG tree operands in " << csg_tree_pipeline.get_pass_count()
+              << " passes: " << frame_time << " ms/frame over " << frame_count << " frames\n";
+
+    node->set_parent(nullptr);
+    delete node;
+  }
+}
+
 int main(int argc, char* argv[])
 {
   try
@@ -47,7 +193,12 @@ int main(int argc, char* argv[])
     engine.init(argc, argv);
     init(*scene);
     scene_manager.set_current_scene(scene);
-    engine.loop();
+
+    if (engine.get_benchmark_frames() != 0)
+      benchmark(*scene, engine.get_benchmark_frames());
+    else
+      engine.loop();
+
     delete scene;
     engine.quit();
 
@@ -0,0 +1,50 @@
+#include "misc/mapped-file.h"
+
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace misc
+{
+  MappedFile::MappedFile(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      throw std::runtime_error("failed to open " + path);
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1)
+    {
+      close(fd);
+      throw std::runtime_error("failed to stat " + path);
+    }
+
+    size_ = file_stat.st_size;
+
+    // mmap rejects empty mappings, an empty file simply has no data.
+    if (size_ != 0)
+    {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+      {
+        close(fd);
+        throw std::runtime_error("failed to map " + path);
+      }
+
+      madvise(data, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(data);
+    }
+
+    // The mapping stays valid once the descriptor is closed.
+    close(fd);
+  }
+
+  MappedFile::~MappedFile()
+  {
+    if (data_)
+      munmap(const_cast<char*>(data_), size_);
+  }
+} // namespace misc
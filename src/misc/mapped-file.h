@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace misc
+{
+  /// Read-only memory mapping of a whole file.
+  class MappedFile
+  {
+    // Make it non-copyable.
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+  public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    const char* data() const;
+    size_t size() const;
+
+  private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+  };
+} // namespace misc
+
+#include "misc/mapped-file.hxx"
@@ -0,0 +1,7 @@
+#include "misc/mapped-file.h"
+
+namespace misc
+{
+  inline const char* MappedFile::data() const { return data_; }
+  inline size_t MappedFile::size() const { return size_; }
+} // namespace misc
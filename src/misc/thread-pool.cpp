@@ -0,0 +1,129 @@
+#include "misc/thread-pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace misc
+{
+  thread_local uint32_t ThreadPool::thread_index_ = 0;
+
+  void ThreadPool::init(uint32_t thread_count)
+  {
+    if (thread_count == 0)
+      thread_count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+    stopping_ = false;
+    for (uint32_t i = 0; i < thread_count; i++)
+      threads_.emplace_back(&ThreadPool::work, this, i + 1);
+  }
+
+  void ThreadPool::free()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      stopping_ = true;
+    }
+
+    condition_.notify_all();
+
+    for (auto& thread : threads_)
+      thread.join();
+
+    threads_.clear();
+  }
+
+  void ThreadPool::submit(std::function<void()> task)
+  {
+    if (threads_.empty())
+    {
+      task();
+      return;
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+
+    condition_.notify_one();
+  }
+
+  void ThreadPool::parallel_for(uint32_t count, const std::function<void(uint32_t)>& function)
+  {
+    if (count == 0)
+      return;
+
+    struct State
+    {
+      std::atomic<uint32_t> next = 0;
+      std::atomic<uint32_t> done = 0;
+      std::mutex mutex;
+      std::condition_variable condition;
+      std::exception_ptr exception;
+    };
+
+    auto state = std::make_shared<State>();
+
+    // Helpers that start after every index was claimed return without touching function, so it
+    // is safe to reference it past the end of this call.
+    auto run = [state, count, &function]() {
+      for (uint32_t i = state->next++; i < count; i = state->next++)
+      {
+        try
+        {
+          function(i);
+        }
+        catch (...)
+        {
+          std::lock_guard lock(state->mutex);
+          if (!state->exception)
+            state->exception = std::current_exception();
+        }
+
+        if (++state->done == count)
+        {
+          std::lock_guard lock(state->mutex);
+          state->condition.notify_all();
+        }
+      }
+    };
+
+    auto helper_count = std::min<size_t>(count - 1, threads_.size());
+    for (size_t i = 0; i < helper_count; i++)
+      submit(run);
+
+    // Working on the caller's thread as well keeps nested parallel_for calls from deadlocking.
+    run();
+
+    std::unique_lock lock(state->mutex);
+    state->condition.wait(lock, [&]() { return state->done == count; });
+
+    if (state->exception)
+      std::rethrow_exception(state->exception);
+  }
+
+  void ThreadPool::work(uint32_t thread_index)
+  {
+    thread_index_ = thread_index;
+
+    while (true)
+    {
+      std::function<void()> task;
+
+      {
+        std::unique_lock lock(mutex_);
+        condition_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+
+        if (tasks_.empty())
+          return;
+
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+
+      task();
+    }
+  }
+} // namespace misc
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "misc/singleton.h"
+
+namespace misc
+{
+  class ThreadPool : public Singleton<ThreadPool>
+  {
+    // Give Singleton<ThreadPool> access to ThreadPool’s private constructor
+    friend class Singleton<ThreadPool>;
+
+  private:
+    /// Construct a ThreadPool.
+    ThreadPool() = default;
+
+  public:
+    /// Start thread_count workers, 0 picks one per hardware thread besides the caller's.
+    void init(uint32_t thread_count = 0);
+    void free();
+
+    /// Queue a task, it runs inline when the pool has no worker.
+    void submit(std::function<void()> task);
+    /// Call function for every index in [0, count), the calling thread takes part in the work.
+    void parallel_for(uint32_t count, const std::function<void(uint32_t)>& function);
+
+    uint32_t get_thread_count() const;
+    /// Index of the calling thread, 0 for any thread outside the pool and 1 to
+    /// get_thread_count() for the workers. Lets callers keep per thread resources in an array.
+    static uint32_t get_thread_index();
+
+  private:
+    void work(uint32_t thread_index);
+
+    static thread_local uint32_t thread_index_;
+
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stopping_ = false;
+  };
+} // namespace misc
+
+#include "misc/thread-pool.hxx"
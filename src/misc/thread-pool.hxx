@@ -0,0 +1,7 @@
+#include "misc/thread-pool.h"
+
+namespace misc
+{
+  inline uint32_t ThreadPool::get_thread_count() const { return threads_.size(); }
+  inline uint32_t ThreadPool::get_thread_index() { return thread_index_; }
+} // namespace misc
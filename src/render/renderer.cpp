@@ -2,13 +2,15 @@
 
 #include <cmath>
 
-#include <SDL3/SDL.h>
 #include <imgui.h>
 
 #include "core/engine.h"
+#include "core/profiler.h"
 #include "core/scene-manager.h"
 #include "gfx/csg-pipeline.h"
+#include "gfx/csg-tree-pipeline.h"
 #include "gfx/skybox-pipeline.h"
+#include "misc/thread-pool.h"
 #include "scene/mesh.h"
 
 using namespace core;
@@ -16,12 +18,26 @@ using namespace core;
 namespace render
 {
   void Renderer::init()
+  {
+    create_targets();
+  }
+
+  void Renderer::resize()
+  {
+    destroy_targets();
+    create_targets();
+    gfx::CSGPipeline::get_singleton().resize();
+    gfx::CSGTreePipeline::get_singleton().resize();
+  }
+
+  void Renderer::create_targets()
   {
     auto& engine = Engine::get_singleton();
+    auto extent = engine.get_render_extent();
 
     const VkExtent3D image_extent = {
-      .width = 800,
-      .height = 600,
+      .width = extent.width,
+      .height = extent.height,
       .depth = 1,
     };
 
@@ -36,7 +52,8 @@ namespace render
       .arrayLayers = 1,
       .samples = VK_SAMPLE_COUNT_1_BIT,
       .tiling = VK_IMAGE_TILING_OPTIMAL,
-      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+      .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+          | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
@@ -44,7 +61,7 @@ namespace render
     };
 
     engine.create_image(depth_image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image_,
-                        depth_image_memory_);
+                        depth_image_allocation_);
 
     const VkComponentMapping depth_components = {
       .r = VK_COMPONENT_SWIZZLE_IDENTITY,
@@ -89,9 +106,73 @@ namespace render
 
     engine.transition_image_layout(depth_image_, VK_FORMAT_D32_SFLOAT_S8_UINT, 1,
                                    transition_layout);
+
+    if (engine.get_render_scale() != 1.0f)
+      create_scene_image();
+  }
+
+  void Renderer::destroy_targets()
+  {
+    auto& engine = Engine::get_singleton();
+
+    vkDestroySampler(engine.get_device(), depth_sampler_, nullptr);
+    vkDestroyImageView(engine.get_device(), depth_image_view_, nullptr);
+    engine.destroy_image(depth_image_, depth_image_allocation_);
+
+    if (scene_image_ != VK_NULL_HANDLE)
+    {
+      vkDestroyImageView(engine.get_device(), scene_image_view_, nullptr);
+      engine.destroy_image(scene_image_, scene_image_allocation_);
+      scene_image_ = VK_NULL_HANDLE;
+      scene_image_view_ = VK_NULL_HANDLE;
+    }
+  }
+
+  void Renderer::create_scene_image()
+  {
+    auto& engine = Engine::get_singleton();
+    auto extent = engine.get_render_extent();
+    auto format = engine.get_surface_format().format;
+
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = { extent.width, extent.height, 1 },
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .queueFamilyIndexCount = 0,
+      .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scene_image_,
+                        scene_image_allocation_);
+
+    const VkImageViewCreateInfo view_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+      .pNext = nullptr,
+      .flags = 0,
+      .image = scene_image_,
+      .viewType = VK_IMAGE_VIEW_TYPE_2D,
+      .format = format,
+      .components = {},
+      .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+    };
+
+    VkResult result =
+        vkCreateImageView(engine.get_device(), &view_info, nullptr, &scene_image_view_);
+    if (result != VK_SUCCESS)
+      throw std::runtime_error("failed to create image view");
   }
 
-  void Renderer::draw(VkImageView image_view, VkCommandBuffer command_buffer)
+  void Renderer::draw(VkImage image, VkImageView image_view, VkCommandBuffer command_buffer)
   {
     auto& engine = core::Engine::get_singleton();
     auto& scene_manager = core::SceneManager::get_singleton();
@@ -100,11 +181,8 @@ namespace render
     if (!scene || !scene->current_camera)
       return;
 
-    int width, height;
-    if (!SDL_GetWindowSize(engine.get_window(), &width, &height))
-      throw std::runtime_error(SDL_GetError());
-
-    float ratio = static_cast<float>(width) / static_cast<float>(height);
+    auto extent = engine.get_swapchain_extent();
+    float ratio = static_cast<float>(extent.width) / static_cast<float>(extent.height);
     auto& camera = *scene->current_camera;
 
     auto dt = ImGui::GetIO().DeltaTime;
@@ -139,29 +217,25 @@ namespace render
     auto view = camera.cframe.invert().to_matrix();
     auto projection = types::Matrix4::perspective(camera.field_of_view, ratio, 0.1f, 100.0f);
 
-    // if (scene->get_skybox_image())
-    {
-      auto& skybox_renderer = gfx::SkyboxPipeline::get_singleton();
-
-      const gfx::SkyboxData skybox_data = {
-        .image = scene->get_skybox_image(),
-        .image_view = scene->get_skybox_image_view(),
-        .sampler = scene->get_skybox_sampler(),
-      };
+    auto& skybox_pipeline = gfx::SkyboxPipeline::get_singleton();
 
-      skybox_renderer.draw(image_view, command_buffer, view, projection, skybox_data);
-    }
+    const gfx::SkyboxData skybox_data = {
+      .image = scene->get_skybox_image(),
+      .image_view = scene->get_skybox_image_view(),
+      .sampler = scene->get_skybox_sampler(),
+    };
 
-    image_view_ = image_view;
+    // The scene goes to the swapchain image directly at native scale.
+    image_view_ = scene_image_ != VK_NULL_HANDLE ? scene_image_view_ : image_view;
     command_buffer_ = command_buffer;
     view_ = view;
     projection_ = projection;
 
-    // Visitor::operator()(*scene);
+    csg_nodes_.clear();
+    Visitor::operator()(*scene);
 
     auto& csg_pipeline = gfx::CSGPipeline::get_singleton();
-
-    clear_depth();
+    auto& csg_tree_pipeline = gfx::CSGTreePipeline::get_singleton();
 
     static float x = 0.0f;
     static float y = 0.0f;
@@ -180,26 +254,90 @@ namespace render
     ImGui::DragFloat("RY", &ry, 0.1f, -180.0f, 180.0f);
     ImGui::DragFloat("RZ", &rz, 0.1f, -180.0f, 180.0f);
 
+    int frames_in_flight = engine.get_frames_in_flight();
+    if (ImGui::SliderInt("Frames in flight", &frames_in_flight, 1, MAX_FRAMES_IN_FLIGHT))
+      engine.set_frames_in_flight(frames_in_flight);
+
     scene->substractive_mesh->cframe = types::CFrame(
         types::Vector3(x, y, z),
         types::Vector3(x, y, z)
             + types::Vector3(std::cos(rx * M_PI / 180.0f), std::sin(rx * M_PI / 180.0f), 0));
 
+    csg_pairs_.clear();
     if (scene->mesh && scene->substractive_mesh)
-      csg_pipeline.draw(image_view_, depth_image_view_, command_buffer_, view_, projection_,
-                        *scene->mesh, *scene->substractive_mesh);
+    {
+      csg_pairs_.push_back({
+          .mesh = scene->mesh,
+          .substractive_mesh = scene->substractive_mesh,
+          .transform = scene->mesh->cframe.to_matrix(),
+          .substractive_transform = scene->substractive_mesh->cframe.to_matrix(),
+      });
+
+      for (const auto& placement : scene->csg_placements)
+      {
+        csg_pairs_.push_back({
+            .mesh = scene->mesh,
+            .substractive_mesh = scene->substractive_mesh,
+            .transform = placement.cframe.to_matrix(),
+            .substractive_transform = placement.substractive_cframe.to_matrix(),
+        });
+      }
+    }
+
+    csg_pipeline.update(view, projection, csg_pairs_);
+    csg_tree_pipeline.update(view, projection, csg_nodes_);
 
     ImGui::End();
+
+    // Every pass is recorded into secondary command buffers on the thread pool, index 0 being
+    // the skybox, then one CSG pair or CSG tree each. The primary only executes them in order.
+    {
+      core::CpuScope scope("record");
+      uint32_t pair_count = csg_pipeline.get_pair_count();
+      misc::ThreadPool::get_singleton().parallel_for(
+          pair_count + csg_tree_pipeline.get_tree_count() + 1, [&](uint32_t i) {
+            if (i == 0)
+              skybox_pipeline.record(view, projection, skybox_data);
+            else if (i <= pair_count)
+              csg_pipeline.record(i - 1);
+            else
+              csg_tree_pipeline.record(i - 1 - pair_count);
+          });
+    }
+
+    if (scene_image_ != VK_NULL_HANDLE)
+    {
+      // Its previous content is discarded, only the blit of the last frame must be done.
+      const VkImageMemoryBarrier scene_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .pNext = nullptr,
+        .srcAccessMask = 0,
+        .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = scene_image_,
+        .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+      };
+
+      vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0,
+                           nullptr, 1, &scene_barrier);
+    }
+
+    skybox_pipeline.draw(image_view_, command_buffer);
+    clear_depth();
+    csg_pipeline.draw(image_view_, depth_image_, depth_image_view_, command_buffer_);
+    csg_tree_pipeline.draw(image_view_, depth_image_view_, command_buffer_);
+
+    if (scene_image_ != VK_NULL_HANDLE)
+      blit_scene(image);
   }
 
   void Renderer::free()
   {
-    auto& engine = Engine::get_singleton();
-
-    vkDestroySampler(engine.get_device(), depth_sampler_, nullptr);
-    vkDestroyImageView(engine.get_device(), depth_image_view_, nullptr);
-    vkDestroyImage(engine.get_device(), depth_image_, nullptr);
-    vkFreeMemory(engine.get_device(), depth_image_memory_, nullptr);
+    destroy_targets();
   }
 
   void Renderer::operator()(scene::Mesh& mesh)
@@ -209,6 +347,11 @@ namespace render
     // csg_pipeline.draw(image_view_, depth_image_view_, command_buffer_, view_, projection_, mesh);
   }
 
+  void Renderer::operator()(scene::CSGNode& node)
+  {
+    csg_nodes_.push_back(&node);
+  }
+
   void Renderer::clear_depth() const
   {
     const VkImageSubresourceRange subresource_range = {
@@ -258,4 +401,81 @@ namespace render
                          VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 0, 0, nullptr, 0, nullptr, 1,
                          &back_image_memory_barrier);
   }
+
+  void Renderer::blit_scene(VkImage image) const
+  {
+    auto& engine = Engine::get_singleton();
+    auto render_extent = engine.get_render_extent();
+    auto swapchain_extent = engine.get_swapchain_extent();
+
+    const VkImageSubresourceRange subresource_range = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .baseMipLevel = 0,
+      .levelCount = 1,
+      .baseArrayLayer = 0,
+      .layerCount = 1,
+    };
+
+    const VkImageMemoryBarrier barriers[] = {
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+          .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+          .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = scene_image_,
+          .subresourceRange = subresource_range,
+      },
+      {
+          .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+          .pNext = nullptr,
+          .srcAccessMask = 0,
+          .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+          .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+          .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+          .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+          .image = image,
+          .subresourceRange = subresource_range,
+      },
+    };
+
+    vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+    const VkImageBlit blit = {
+      .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+      .srcOffsets = { { 0, 0, 0 },
+                      { static_cast<int32_t>(render_extent.width),
+                        static_cast<int32_t>(render_extent.height), 1 } },
+      .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+      .dstOffsets = { { 0, 0, 0 },
+                      { static_cast<int32_t>(swapchain_extent.width),
+                        static_cast<int32_t>(swapchain_extent.height), 1 } },
+    };
+
+    vkCmdBlitImage(command_buffer_, scene_image_, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image,
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+    // ImGui is drawn over the scaled scene.
+    const VkImageMemoryBarrier image_barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .pNext = nullptr,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = image,
+      .subresourceRange = subresource_range,
+    };
+
+    vkCmdPipelineBarrier(command_buffer_, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 0, nullptr, 0, nullptr,
+                         1, &image_barrier);
+  }
 } // namespace render
@@ -5,6 +5,8 @@
 #include <vulkan/vulkan.h>
 
 #include "core/engine.h"
+#include "gfx/csg-pipeline.h"
+#include "gfx/csg-tree-pipeline.h"
 #include "misc/singleton.h"
 #include "scene/visitor.h"
 #include "types/matrix4.h"
@@ -25,26 +27,44 @@ namespace render
     using Visitor::operator();
 
     void init();
-    void draw(VkImageView image_view, VkCommandBuffer command_buffer);
+    /// Render the scene into the swapchain image, through the scene image when the render
+    /// scale is not 1.
+    void draw(VkImage image, VkImageView image_view, VkCommandBuffer command_buffer);
     void free();
+    /// Recreate the render targets at the current render extent. The device must be idle.
+    void resize();
 
     void operator()(scene::Mesh& mesh) override;
+    /// Collect the node as one tree, its operands are drawn through it.
+    void operator()(scene::CSGNode& node) override;
 
   private:
+    void create_targets();
+    void destroy_targets();
+    void create_scene_image();
     void clear_depth() const;
+    /// Scale the scene image to the swapchain image, left as a color attachment.
+    void blit_scene(VkImage image) const;
 
     VkImage depth_image_ = VK_NULL_HANDLE;
     VkImageView depth_image_view_ = VK_NULL_HANDLE;
     VkSampler depth_sampler_ = VK_NULL_HANDLE;
-    VkDeviceMemory depth_image_memory_ = VK_NULL_HANDLE;
+    core::Allocation depth_image_allocation_;
+
+    /// Only used when the render scale is not 1.
+    VkImage scene_image_ = VK_NULL_HANDLE;
+    VkImageView scene_image_view_ = VK_NULL_HANDLE;
+    core::Allocation scene_image_allocation_;
 
     VkImageView image_view_ = VK_NULL_HANDLE;
     VkCommandBuffer command_buffer_ = VK_NULL_HANDLE;
     types::Matrix4 view_;
     types::Matrix4 projection_;
+    std::vector<gfx::CSGPair> csg_pairs_;
+    std::vector<scene::CSGNode*> csg_nodes_;
 
     std::vector<VkBuffer> uniform_buffers_;
-    std::vector<VkDeviceMemory> uniform_buffers_memory_;
+    std::vector<core::Allocation> uniform_buffers_allocation_;
     std::vector<void*> uniform_buffers_data_;
   };
 } // namespace render
@@ -0,0 +1,24 @@
+#include "scene/csg-node.h"
+
+namespace scene
+{
+  CSGNode::CSGNode(CSGOperation operation)
+    : operation(operation)
+  {}
+
+  void CSGNode::add_operand(Object* operand)
+  {
+    operand->set_parent(this);
+    operands_.push_back(operand);
+  }
+
+  std::vector<Object*> CSGNode::get_operands() const
+  {
+    std::vector<Object*> operands;
+    for (auto operand : operands_)
+      if (operand->get_parent() == this)
+        operands.push_back(operand);
+
+    return operands;
+  }
+} // namespace scene
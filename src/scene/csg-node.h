@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "scene/object.h"
+#include "scene/visitor.h"
+
+namespace scene
+{
+  enum class CSGOperation
+  {
+    Union,
+    Subtract,
+    Intersect,
+  };
+
+  /// Combines its operands, meshes or other CSG nodes, with one boolean operation. Subtract
+  /// carves every operand after the first out of the first one. The node cframe places the
+  /// whole tree, operands are placed relative to it.
+  class CSGNode : public Object
+  {
+  public:
+    explicit CSGNode(CSGOperation operation = CSGOperation::Union);
+
+    void accept(Visitor& visitor) override;
+
+    /// Parent operand to the node and append it to the operands, which keep their order unlike
+    /// children.
+    void add_operand(Object* operand);
+    /// The operands still parented to the node, in the order they were added.
+    std::vector<Object*> get_operands() const;
+
+    CSGOperation operation;
+
+  private:
+    std::vector<Object*> operands_;
+  };
+} // namespace scene
+
+#include "scene/csg-node.hxx"
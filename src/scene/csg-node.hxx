@@ -0,0 +1,6 @@
+#include "scene/csg-node.h"
+
+namespace scene
+{
+  inline void CSGNode::accept(Visitor& visitor) { visitor(*this); }
+} // namespace scene
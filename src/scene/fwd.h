@@ -1,6 +1,7 @@
 namespace scene
 {
   class Camera;
+  class CSGNode;
   class Instance;
   class Mesh;
   class Object;
@@ -0,0 +1,98 @@
+#include "scene/mesh-cache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+namespace scene
+{
+  MeshCache::MeshCache(const std::string& source_path)
+  {
+    auto absolute_path = std::filesystem::absolute(source_path);
+
+    std::ostringstream cache_path;
+    cache_path << MESH_CACHE_DIR << absolute_path.stem().string() << '-' << std::hex
+               << std::hash<std::string>()(absolute_path.string()) << ".mesh";
+    cache_path_ = cache_path.str();
+
+    source_size_ = std::filesystem::file_size(absolute_path);
+    source_mtime_ =
+        std::filesystem::last_write_time(absolute_path).time_since_epoch().count();
+  }
+
+  bool MeshCache::load()
+  {
+    std::error_code error;
+    if (!std::filesystem::exists(cache_path_, error))
+      return false;
+
+    file_ = std::make_unique<misc::MappedFile>(cache_path_);
+    if (file_->size() < sizeof(Header))
+      return false;
+
+    Header header;
+    std::memcpy(&header, file_->data(), sizeof(Header));
+
+    bool valid = std::memcmp(header.magic, "MESH", 4) == 0
+        && header.version == MESH_CACHE_VERSION && header.vertex_size == sizeof(Vertex)
+        && header.source_size == source_size_ && header.source_mtime == source_mtime_
+        && file_->size()
+            == sizeof(Header) + header.vertex_count * sizeof(Vertex)
+                + header.index_count * sizeof(uint32_t);
+
+    if (!valid)
+    {
+      file_.reset();
+      return false;
+    }
+
+    // The mapping is page aligned and the header keeps the arrays 8 byte aligned, so the data
+    // can be used in place.
+    auto vertices = reinterpret_cast<const Vertex*>(file_->data() + sizeof(Header));
+    auto indices = reinterpret_cast<const uint32_t*>(vertices + header.vertex_count);
+
+    vertices_ = { vertices, header.vertex_count };
+    indices_ = { indices, header.index_count };
+
+    return true;
+  }
+
+  void MeshCache::write(std::span<const Vertex> vertices, std::span<const uint32_t> indices) const
+  {
+    Header header = {
+      .magic = { 'M', 'E', 'S', 'H' },
+      .version = MESH_CACHE_VERSION,
+      .vertex_size = sizeof(Vertex),
+      .padding = 0,
+      .source_size = source_size_,
+      .source_mtime = source_mtime_,
+      .vertex_count = vertices.size(),
+      .index_count = indices.size(),
+    };
+
+    std::error_code error;
+    std::filesystem::create_directories(MESH_CACHE_DIR, error);
+
+    // Write to a temporary file first so that an interrupted write never leaves a cache that
+    // passes validation.
+    auto temporary_path = cache_path_ + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(vertices.data()), vertices.size_bytes());
+    file.write(reinterpret_cast<const char*>(indices.data()), indices.size_bytes());
+    file.close();
+
+    if (!file)
+    {
+      std::clog << "failed to write mesh cache " << cache_path_ << '\n';
+      std::filesystem::remove(temporary_path, error);
+      return;
+    }
+
+    std::filesystem::rename(temporary_path, cache_path_, error);
+  }
+} // namespace scene
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+
+#include "misc/mapped-file.h"
+#include "scene/mesh.h"
+
+#define MESH_CACHE_DIR ".cache/meshes/"
+#define MESH_CACHE_VERSION 1
+
+namespace scene
+{
+  /// Binary copy of a parsed and optimised mesh, stored next to the working directory and
+  /// invalidated when the source file size or modification time changes.
+  class MeshCache
+  {
+  public:
+    explicit MeshCache(const std::string& source_path);
+
+    /// Map the cache file, false when it is missing or stale.
+    bool load();
+    void write(std::span<const Vertex> vertices, std::span<const uint32_t> indices) const;
+
+    std::span<const Vertex> get_vertices() const;
+    std::span<const uint32_t> get_indices() const;
+
+  private:
+    struct Header
+    {
+      char magic[4];
+      uint32_t version;
+      uint32_t vertex_size;
+      uint32_t padding;
+      uint64_t source_size;
+      int64_t source_mtime;
+      uint64_t vertex_count;
+      uint64_t index_count;
+    };
+
+    std::string cache_path_;
+    uint64_t source_size_ = 0;
+    int64_t source_mtime_ = 0;
+    std::unique_ptr<misc::MappedFile> file_;
+    std::span<const Vertex> vertices_;
+    std::span<const uint32_t> indices_;
+  };
+} // namespace scene
+
+#include "scene/mesh-cache.hxx"
@@ -0,0 +1,7 @@
+#include "scene/mesh-cache.h"
+
+namespace scene
+{
+  inline std::span<const Vertex> MeshCache::get_vertices() const { return vertices_; }
+  inline std::span<const uint32_t> MeshCache::get_indices() const { return indices_; }
+} // namespace scene
@@ -0,0 +1,217 @@
+#include "scene/mesh-optimizer.h"
+
+#include <array>
+#include <cstring>
+#include <unordered_map>
+
+namespace scene
+{
+  MeshOptimizer::MeshOptimizer(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+    : vertices_(vertices)
+    , indices_(indices)
+  {}
+
+  void MeshOptimizer::weld()
+  {
+    using Key = std::array<uint32_t, 8>;
+
+    struct KeyHash
+    {
+      size_t operator()(const Key& key) const
+      {
+        uint64_t hash = 14695981039346656037ull;
+        for (auto value : key)
+          hash = (hash ^ value) * 1099511628211ull;
+
+        return hash;
+      }
+    };
+
+    std::unordered_map<Key, uint32_t, KeyHash> unique_vertices;
+    unique_vertices.reserve(vertices_.size());
+
+    std::vector<uint32_t> remap(vertices_.size());
+    std::vector<Vertex> welded_vertices;
+    welded_vertices.reserve(vertices_.size());
+
+    for (size_t i = 0; i < vertices_.size(); i++)
+    {
+      const auto& vertex = vertices_[i];
+
+      // Adding 0 turns -0 into +0 so that both hash the same.
+      const float values[] = {
+        vertex.position.x + 0.0f, vertex.position.y + 0.0f, vertex.position.z + 0.0f,
+        vertex.normal.x + 0.0f,   vertex.normal.y + 0.0f,   vertex.normal.z + 0.0f,
+        vertex.uv.x + 0.0f,       vertex.uv.y + 0.0f,
+      };
+
+      Key key;
+      std::memcpy(key.data(), values, sizeof(values));
+
+      auto [it, inserted] = unique_vertices.try_emplace(key, welded_vertices.size());
+      if (inserted)
+        welded_vertices.push_back(vertex);
+
+      remap[i] = it->second;
+    }
+
+    for (auto& index : indices_)
+      index = remap[index];
+
+    vertices_ = std::move(welded_vertices);
+  }
+
+  void MeshOptimizer::optimize_vertex_cache(uint32_t cache_size)
+  {
+    auto vertex_count = static_cast<uint32_t>(vertices_.size());
+    auto triangle_count = static_cast<uint32_t>(indices_.size() / 3);
+
+    // Vertex to triangle adjacency, stored as offsets into a flat list.
+    std::vector<uint32_t> live_triangles(vertex_count, 0);
+    for (auto index : indices_)
+      live_triangles[index]++;
+
+    std::vector<uint32_t> offsets(vertex_count + 1, 0);
+    for (uint32_t v = 0; v < vertex_count; v++)
+      offsets[v + 1] = offsets[v] + live_triangles[v];
+
+    std::vector<uint32_t> adjacency(indices_.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (uint32_t t = 0; t < triangle_count; t++)
+      for (uint32_t k = 0; k < 3; k++)
+        adjacency[fill[indices_[t * 3 + k]]++] = t;
+
+    std::vector<uint32_t> cache_times(vertex_count, 0);
+    std::vector<bool> emitted(triangle_count, false);
+    std::vector<uint32_t> dead_ends;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> output;
+    output.reserve(indices_.size());
+
+    uint32_t time_stamp = cache_size + 1;
+    uint32_t cursor = 0;
+    int64_t fanning_vertex = vertex_count ? 0 : -1;
+
+    while (fanning_vertex >= 0)
+    {
+      candidates.clear();
+
+      for (uint32_t a = offsets[fanning_vertex]; a < offsets[fanning_vertex + 1]; a++)
+      {
+        uint32_t t = adjacency[a];
+        if (emitted[t])
+          continue;
+
+        for (uint32_t k = 0; k < 3; k++)
+        {
+          uint32_t v = indices_[t * 3 + k];
+          output.push_back(v);
+          dead_ends.push_back(v);
+          candidates.push_back(v);
+          live_triangles[v]--;
+
+          if (time_stamp - cache_times[v] > cache_size)
+            cache_times[v] = time_stamp++;
+        }
+
+        emitted[t] = true;
+      }
+
+      fanning_vertex = get_next_vertex(candidates, live_triangles, cache_times, time_stamp,
+                                       cache_size, dead_ends, cursor);
+    }
+
+    indices_ = std::move(output);
+  }
+
+  void MeshOptimizer::optimize_vertex_fetch()
+  {
+    constexpr uint32_t unused = UINT32_MAX;
+
+    std::vector<uint32_t> remap(vertices_.size(), unused);
+    std::vector<Vertex> fetch_ordered_vertices;
+    fetch_ordered_vertices.reserve(vertices_.size());
+
+    for (auto& index : indices_)
+    {
+      if (remap[index] == unused)
+      {
+        remap[index] = fetch_ordered_vertices.size();
+        fetch_ordered_vertices.push_back(vertices_[index]);
+      }
+
+      index = remap[index];
+    }
+
+    // Vertices no face refers to are dropped.
+    vertices_ = std::move(fetch_ordered_vertices);
+  }
+
+  float MeshOptimizer::compute_acmr(uint32_t cache_size) const
+  {
+    if (indices_.empty())
+      return 0.0f;
+
+    // A vertex is still in the FIFO as long as fewer than cache_size misses followed its own.
+    std::vector<int64_t> miss_times(vertices_.size(), -static_cast<int64_t>(cache_size) - 1);
+    int64_t miss_count = 0;
+
+    for (auto index : indices_)
+    {
+      if (miss_count - miss_times[index] > cache_size)
+        miss_times[index] = miss_count++;
+    }
+
+    return static_cast<float>(miss_count) / (indices_.size() / 3);
+  }
+
+  int64_t MeshOptimizer::get_next_vertex(const std::vector<uint32_t>& candidates,
+                                         const std::vector<uint32_t>& live_triangles,
+                                         const std::vector<uint32_t>& cache_times,
+                                         uint32_t time_stamp, uint32_t cache_size,
+                                         std::vector<uint32_t>& dead_ends,
+                                         uint32_t& cursor) const
+  {
+    int64_t next_vertex = -1;
+    int64_t best_priority = -1;
+
+    // Prefer the candidate that will still be in the cache once all its triangles are emitted,
+    // and among those the oldest one.
+    for (auto v : candidates)
+    {
+      if (live_triangles[v] == 0)
+        continue;
+
+      int64_t priority = 0;
+      if (time_stamp - cache_times[v] + 2 * live_triangles[v] <= cache_size)
+        priority = time_stamp - cache_times[v];
+
+      if (priority > best_priority)
+      {
+        best_priority = priority;
+        next_vertex = v;
+      }
+    }
+
+    if (next_vertex != -1)
+      return next_vertex;
+
+    // Dead end: fall back to recently used vertices, then to the next vertex in input order.
+    while (!dead_ends.empty())
+    {
+      uint32_t v = dead_ends.back();
+      dead_ends.pop_back();
+
+      if (live_triangles[v] > 0)
+        return v;
+    }
+
+    for (; cursor < live_triangles.size(); cursor++)
+    {
+      if (live_triangles[cursor] > 0)
+        return cursor;
+    }
+
+    return -1;
+  }
+} // namespace scene
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "scene/mesh.h"
+
+#define VERTEX_CACHE_SIZE 16
+
+namespace scene
+{
+  /// In-place index/vertex buffer optimisations run on freshly loaded meshes.
+  class MeshOptimizer
+  {
+  public:
+    MeshOptimizer(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+    /// Merge vertices with identical position, normal and uv.
+    void weld();
+    /// Reorder triangles for the post-transform cache (Tipsify, Sander et al. 2007).
+    void optimize_vertex_cache(uint32_t cache_size = VERTEX_CACHE_SIZE);
+    /// Reorder vertices in first-use order so that fetches are mostly sequential.
+    void optimize_vertex_fetch();
+
+    /// Average cache miss ratio: transformed vertices per triangle with a FIFO cache.
+    float compute_acmr(uint32_t cache_size = VERTEX_CACHE_SIZE) const;
+
+  private:
+    int64_t get_next_vertex(const std::vector<uint32_t>& candidates,
+                            const std::vector<uint32_t>& live_triangles,
+                            const std::vector<uint32_t>& cache_times, uint32_t time_stamp,
+                            uint32_t cache_size, std::vector<uint32_t>& dead_ends,
+                            uint32_t& cursor) const;
+
+    std::vector<Vertex>& vertices_;
+    std::vector<uint32_t>& indices_;
+  };
+} // namespace scene
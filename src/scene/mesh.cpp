@@ -1,251 +1,154 @@
 #include "scene/mesh.h"
 
+#include <algorithm>
 #include <cstring>
-#include <fstream>
-#include <sstream>
+#include <iostream>
+#include <stdexcept>
 
+#include "core/deletion-queue.h"
 #include "core/engine.h"
+#include "core/staging-buffer.h"
+#include "scene/mesh-cache.h"
+#include "scene/mesh-optimizer.h"
+#include "scene/obj-loader.h"
 
 using namespace core;
 
 namespace scene
 {
-  Mesh::~Mesh()
-  {
-    auto& engine = Engine::get_singleton();
-
-    if (vertex_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), vertex_buffer_, nullptr);
+  Mesh::Mesh(bool dynamic)
+    : dynamic_(dynamic)
+  {}
 
-    if (index_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), index_buffer_, nullptr);
-
-    if (vertex_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), vertex_buffer_memory_, nullptr);
+  Mesh::~Mesh() { reset(); }
 
-    if (index_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), index_buffer_memory_, nullptr);
-
-    vkDeviceWaitIdle(engine.get_device());
-  }
-
-  void Mesh::load_mesh_data(const std::vector<Vertex>& vertices,
-                            const std::vector<uint32_t>& indices)
+  void Mesh::load_mesh_data(std::span<const Vertex> vertices, std::span<const uint32_t> indices)
   {
+    // Vulkan buffers cannot be empty, the current geometry is kept.
+    if (vertices.empty() || indices.empty())
+      throw std::runtime_error("cannot load empty mesh data");
+
     create_vertex_buffer(vertices);
     create_index_vertex(indices);
+
+    bounds_min_ = vertices.empty() ? types::Vector3() : vertices[0].position;
+    bounds_max_ = bounds_min_;
+    for (const auto& vertex : vertices)
+    {
+      bounds_min_ = types::Vector3(std::min(bounds_min_.x, vertex.position.x),
+                                   std::min(bounds_min_.y, vertex.position.y),
+                                   std::min(bounds_min_.z, vertex.position.z));
+      bounds_max_ = types::Vector3(std::max(bounds_max_.x, vertex.position.x),
+                                   std::max(bounds_max_.y, vertex.position.y),
+                                   std::max(bounds_max_.z, vertex.position.z));
+    }
   }
 
   void Mesh::reset()
   {
-    auto& engine = Engine::get_singleton();
+    // Frames in flight may still draw the buffers.
+    auto& deletion_queue = DeletionQueue::get_singleton();
 
     if (vertex_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), vertex_buffer_, nullptr);
+      deletion_queue.destroy_buffer(vertex_buffer_, vertex_buffer_allocation_);
 
     if (index_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), index_buffer_, nullptr);
-
-    if (vertex_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), vertex_buffer_memory_, nullptr);
-
-    if (index_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), index_buffer_memory_, nullptr);
+      deletion_queue.destroy_buffer(index_buffer_, index_buffer_allocation_);
 
     vertex_buffer_ = VK_NULL_HANDLE;
     index_buffer_ = VK_NULL_HANDLE;
-    vertex_buffer_memory_ = VK_NULL_HANDLE;
-    index_buffer_memory_ = VK_NULL_HANDLE;
+    vertex_buffer_allocation_ = {};
+    index_buffer_allocation_ = {};
   }
 
-  void Mesh::create_vertex_buffer(const std::vector<Vertex>& vertices)
+  void Mesh::create_vertex_buffer(std::span<const Vertex> vertices)
   {
-    auto& engine = Engine::get_singleton();
-    auto buffer_size = vertices.size() * sizeof(Vertex);
-
-    const VkBufferCreateInfo create_info = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-      .pNext = nullptr,
-      .flags = 0,
-      .size = buffer_size,
-      .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-      .queueFamilyIndexCount = 0,
-      .pQueueFamilyIndices = nullptr,
-    };
-
-    if (vertex_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), vertex_buffer_, nullptr);
-
-    if (vertex_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), vertex_buffer_memory_, nullptr);
+    upload_buffer(vertices.data(), vertices.size() * sizeof(Vertex),
+                  VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertex_buffer_, vertex_buffer_allocation_);
 
-    VkResult result = vkCreateBuffer(engine.get_device(), &create_info, nullptr, &vertex_buffer_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create buffer");
+    vertex_count_ = vertices.size();
+  }
 
-    VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(engine.get_device(), vertex_buffer_, &memory_requirements);
+  void Mesh::load_mesh_from_file(const std::string& path)
+  {
+    // Skip parsing and optimisation entirely when an up to date binary copy exists, the
+    // mapped data goes straight to the staging buffer.
+    MeshCache cache(path);
+    if (cache.load())
+    {
+      load_mesh_data(cache.get_vertices(), cache.get_indices());
+      return;
+    }
 
-    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    const VkMemoryAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = engine.find_memory_type(memory_requirements.memoryTypeBits, flags),
-    };
+    ObjLoader loader(path);
+    loader.load();
 
-    result = vkAllocateMemory(engine.get_device(), &allocate_info, nullptr, &vertex_buffer_memory_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
+    auto& vertices = loader.get_vertices();
+    auto& indices = loader.get_indices();
+    auto corner_count = vertices.size();
 
-    result = vkBindBufferMemory(engine.get_device(), vertex_buffer_, vertex_buffer_memory_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to bind buffer memory");
+    MeshOptimizer optimizer(vertices, indices);
+    optimizer.weld();
+    auto welded_acmr = optimizer.compute_acmr();
 
-    void* data;
-    result = vkMapMemory(engine.get_device(), vertex_buffer_memory_, 0, buffer_size, 0, &data);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to map buffer memory");
+    optimizer.optimize_vertex_cache();
+    optimizer.optimize_vertex_fetch();
 
-    std::memcpy(data, vertices.data(), buffer_size);
-    vkUnmapMemory(engine.get_device(), vertex_buffer_memory_);
+    std::clog << path << ": " << corner_count << " -> " << vertices.size() << " vertices, ACMR "
+              << welded_acmr << " -> " << optimizer.compute_acmr() << '\n';
 
-    vertex_count_ = vertices.size();
+    load_mesh_data(vertices, indices);
+    cache.write(vertices, indices);
   }
 
-  void Mesh::load_mesh_from_file(const std::string& path)
+  void Mesh::create_index_vertex(std::span<const uint32_t> indices)
   {
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indicies;
+    upload_buffer(indices.data(), indices.size() * sizeof(uint32_t),
+                  VK_BUFFER_USAGE_INDEX_BUFFER_BIT, index_buffer_, index_buffer_allocation_);
 
-    std::ifstream file(path);
-    if (file.is_open())
-    {
-      int start = 0;
-
-      std::vector<types::Vector3> positions;
-      std::vector<types::Vector3> normals;
-
-      std::string line;
-      while (std::getline(file, line))
-      {
-        std::istringstream iss(line);
-        std::string prefix;
-        iss >> prefix;
-
-        if (prefix == "v")
-        {
-          types::Vector3 pos;
-          iss >> pos.x >> pos.y >> pos.z;
-          positions.push_back(pos);
-        }
-        else if (prefix == "vn")
-        {
-          types::Vector3 normal;
-          iss >> normal.x >> normal.y >> normal.z;
-          normals.push_back(normal);
-        }
-        else if (prefix == "f")
-        {
-          std::string v1, v2, v3, v4;
-          iss >> v1 >> v2 >> v3 >> v4;
-
-          auto faceData = v4.empty() ? std::vector<std::string>{ v1, v2, v3 }
-                                     : std::vector<std::string>{ v1, v2, v3, v4 };
-
-          for (const std::string& vert : faceData)
-          {
-            std::istringstream vstream(vert);
-            std::string p, t, n;
-            std::getline(vstream, p, '/');
-            std::getline(vstream, t, '/');
-            std::getline(vstream, n, '/');
-
-            Vertex vertex = { positions[std::stoi(p) - 1], normals[std::stoi(n) - 1] };
-
-            vertices.push_back(vertex);
-          }
-
-          if (v4.empty())
-          {
-            indicies.push_back(start);
-            indicies.push_back(start + 1);
-            indicies.push_back(start + 2);
-
-            start += 3;
-          }
-          else
-          {
-            indicies.push_back(start);
-            indicies.push_back(start + 1);
-            indicies.push_back(start + 2);
-            indicies.push_back(start + 2);
-            indicies.push_back(start + 3);
-            indicies.push_back(start);
-
-            start += 4;
-          }
-        }
-      }
-    }
-
-    load_mesh_data(vertices, indicies);
+    index_count_ = indices.size();
   }
 
-  void Mesh::create_index_vertex(const std::vector<uint32_t>& indices)
+  void Mesh::upload_buffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+                           VkBuffer& buffer, Allocation& allocation)
   {
     auto& engine = Engine::get_singleton();
-    auto buffer_size = indices.size() * sizeof(uint32_t);
+
+    // Frames in flight may still read the previous buffer, even a dynamic one is never rewritten
+    // in place. It is retired once those frames are done and the new data gets a fresh buffer.
+    if (buffer != VK_NULL_HANDLE)
+      DeletionQueue::get_singleton().destroy_buffer(buffer, allocation);
+
+    // Static geometry is read several times per frame by the CSG passes, so it is uploaded once
+    // to device local memory instead of being fetched over the bus every time.
+    VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    if (dynamic_)
+      flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    else
+      usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
 
     const VkBufferCreateInfo create_info = {
       .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
       .pNext = nullptr,
       .flags = 0,
-      .size = buffer_size,
-      .usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+      .size = size,
+      .usage = usage,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
     };
 
-    if (index_buffer_ != VK_NULL_HANDLE)
-      vkDestroyBuffer(engine.get_device(), index_buffer_, nullptr);
-
-    if (index_buffer_memory_ != VK_NULL_HANDLE)
-      vkFreeMemory(engine.get_device(), index_buffer_memory_, nullptr);
-
-    VkResult result = vkCreateBuffer(engine.get_device(), &create_info, nullptr, &index_buffer_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to create buffer");
-
-    VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(engine.get_device(), index_buffer_, &memory_requirements);
-
-    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    const VkMemoryAllocateInfo allocate_info = {
-      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-      .pNext = nullptr,
-      .allocationSize = memory_requirements.size,
-      .memoryTypeIndex = engine.find_memory_type(memory_requirements.memoryTypeBits, flags),
-    };
-
-    result = vkAllocateMemory(engine.get_device(), &allocate_info, nullptr, &index_buffer_memory_);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to allocate device memory");
-
-    result = vkBindBufferMemory(engine.get_device(), index_buffer_, index_buffer_memory_, 0);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to bind buffer memory");
+    engine.create_buffer(create_info, flags, buffer, allocation);
 
-    void* data;
-    result = vkMapMemory(engine.get_device(), index_buffer_memory_, 0, buffer_size, 0, &data);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to map buffer memory");
+    if (dynamic_)
+    {
+      std::memcpy(allocation.data, data, size);
+      return;
+    }
 
-    std::memcpy(data, indices.data(), buffer_size);
-    vkUnmapMemory(engine.get_device(), index_buffer_memory_);
+    auto staging_region = StagingBuffer::get_singleton().allocate(size);
+    std::memcpy(staging_region.data, data, size);
 
-    index_count_ = indices.size();
+    engine.copy_buffer(staging_region.buffer, staging_region.offset, buffer, 0, size);
   }
 } // namespace scene
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <span>
 #include <vector>
 
 #include <vulkan/vulkan.h>
 
+#include "core/memory-allocator.h"
 #include "scene/object.h"
 #include "scene/visitor.h"
 #include "types/vector2.h"
@@ -21,12 +23,13 @@ namespace scene
   class Mesh : public Object
   {
   public:
-    Mesh() = default;
+    /// Construct a Mesh, dynamic meshes keep their geometry in host visible memory.
+    explicit Mesh(bool dynamic = false);
 
     virtual ~Mesh();
 
-    virtual void load_mesh_data(const std::vector<Vertex>& vertices,
-                                const std::vector<uint32_t>& indices);
+    virtual void load_mesh_data(std::span<const Vertex> vertices,
+                                std::span<const uint32_t> indices);
     virtual void load_mesh_from_file(const std::string& path);
     virtual void reset();
 
@@ -36,17 +39,26 @@ namespace scene
     VkBuffer get_index_buffer() const;
     uint32_t get_vertex_count() const;
     uint32_t get_index_count() const;
+    bool is_dynamic() const;
+    /// Corners of the object space bounding box of the vertices.
+    const types::Vector3& get_bounds_min() const;
+    const types::Vector3& get_bounds_max() const;
 
   private:
-    void create_vertex_buffer(const std::vector<Vertex>& vertices);
-    void create_index_vertex(const std::vector<uint32_t>& indices);
+    void create_vertex_buffer(std::span<const Vertex> vertices);
+    void create_index_vertex(std::span<const uint32_t> indices);
+    void upload_buffer(const void* data, VkDeviceSize size, VkBufferUsageFlags usage,
+                       VkBuffer& buffer, core::Allocation& allocation);
 
     VkBuffer vertex_buffer_ = VK_NULL_HANDLE;
     VkBuffer index_buffer_ = VK_NULL_HANDLE;
-    VkDeviceMemory vertex_buffer_memory_ = VK_NULL_HANDLE;
-    VkDeviceMemory index_buffer_memory_ = VK_NULL_HANDLE;
+    core::Allocation vertex_buffer_allocation_;
+    core::Allocation index_buffer_allocation_;
     uint32_t vertex_count_ = 0;
     uint32_t index_count_ = 0;
+    types::Vector3 bounds_min_;
+    types::Vector3 bounds_max_;
+    bool dynamic_ = false;
   };
 } // namespace scene
 
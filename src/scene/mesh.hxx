@@ -7,4 +7,7 @@ namespace scene
   inline VkBuffer Mesh::get_index_buffer() const { return index_buffer_; }
   inline uint32_t Mesh::get_vertex_count() const { return vertex_count_; }
   inline uint32_t Mesh::get_index_count() const { return index_count_; }
+  inline bool Mesh::is_dynamic() const { return dynamic_; }
+  inline const types::Vector3& Mesh::get_bounds_min() const { return bounds_min_; }
+  inline const types::Vector3& Mesh::get_bounds_max() const { return bounds_max_; }
 } // namespace scene
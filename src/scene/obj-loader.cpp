@@ -0,0 +1,276 @@
+#include "scene/obj-loader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include "misc/thread-pool.h"
+
+namespace scene
+{
+  ObjLoader::ObjLoader(const std::string& path)
+    : file_(path)
+  {}
+
+  void ObjLoader::load(uint32_t thread_count)
+  {
+    auto& thread_pool = misc::ThreadPool::get_singleton();
+    if (thread_count == 0)
+      thread_count = thread_pool.get_thread_count() + 1;
+
+    const char* data = file_.data();
+    const char* end = data + file_.size();
+
+    // Split on line boundaries, small files are not worth waking the pool for.
+    size_t chunk_count = std::min<size_t>(thread_count, file_.size() / OBJ_MIN_CHUNK_SIZE + 1);
+    std::vector<Chunk> chunks(chunk_count);
+
+    const char* begin = data;
+    for (size_t i = 0; i < chunk_count; i++)
+    {
+      const char* chunk_end = data + file_.size() * (i + 1) / chunk_count;
+      chunk_end = std::max(chunk_end, begin);
+
+      auto line_end = static_cast<const char*>(std::memchr(chunk_end, '\n', end - chunk_end));
+      chunk_end = line_end ? line_end + 1 : end;
+
+      chunks[i].begin = begin;
+      chunks[i].end = chunk_end;
+      begin = chunk_end;
+    }
+
+    thread_pool.parallel_for(chunk_count, [&](uint32_t i) { parse_chunk(chunks[i]); });
+
+    // Prefix sums give each chunk its place in the stitched arrays.
+    size_t position_count = 0;
+    size_t uv_count = 0;
+    size_t normal_count = 0;
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+
+    for (auto& chunk : chunks)
+    {
+      chunk.position_base = position_count;
+      chunk.uv_base = uv_count;
+      chunk.normal_base = normal_count;
+      chunk.vertex_base = vertex_count;
+      chunk.index_base = index_count;
+
+      position_count += chunk.positions.size();
+      uv_count += chunk.uvs.size();
+      normal_count += chunk.normals.size();
+      vertex_count += chunk.corners.size();
+      index_count += chunk.triangle_count * 3;
+    }
+
+    positions_.resize(position_count);
+    uvs_.resize(uv_count);
+    normals_.resize(normal_count);
+    vertices_.resize(vertex_count);
+    indices_.resize(index_count);
+
+    thread_pool.parallel_for(chunk_count, [&](uint32_t i) {
+      auto& chunk = chunks[i];
+      std::copy(chunk.positions.begin(), chunk.positions.end(),
+                positions_.begin() + chunk.position_base);
+      std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs_.begin() + chunk.uv_base);
+      std::copy(chunk.normals.begin(), chunk.normals.end(),
+                normals_.begin() + chunk.normal_base);
+    });
+
+    thread_pool.parallel_for(chunk_count, [&](uint32_t i) { build_chunk(chunks[i]); });
+  }
+
+  void ObjLoader::parse_chunk(Chunk& chunk) const
+  {
+    const char* it = chunk.begin;
+
+    while (it < chunk.end)
+    {
+      auto line_end = static_cast<const char*>(std::memchr(it, '\n', chunk.end - it));
+      if (!line_end)
+        line_end = chunk.end;
+
+      parse_line(chunk, it, line_end);
+      it = line_end + 1;
+    }
+  }
+
+  void ObjLoader::parse_line(Chunk& chunk, const char* it, const char* end) const
+  {
+    it = skip_spaces(it, end);
+    if (end - it < 2)
+      return;
+
+    if (it[0] == 'v' && it[1] == ' ')
+    {
+      types::Vector3 position;
+      it = parse_float(it + 2, end, position.x);
+      it = parse_float(it, end, position.y);
+      parse_float(it, end, position.z);
+      chunk.positions.push_back(position);
+    }
+    else if (it[0] == 'v' && it[1] == 'n')
+    {
+      types::Vector3 normal;
+      it = parse_float(it + 2, end, normal.x);
+      it = parse_float(it, end, normal.y);
+      parse_float(it, end, normal.z);
+      chunk.normals.push_back(normal);
+    }
+    else if (it[0] == 'v' && it[1] == 't')
+    {
+      types::Vector2 uv;
+      it = parse_float(it + 2, end, uv.x);
+      parse_float(it, end, uv.y);
+      chunk.uvs.push_back(uv);
+    }
+    else if (it[0] == 'f' && it[1] == ' ')
+      parse_face(chunk, it + 2, end);
+
+    // Comments, objects, groups, smoothing groups and materials are ignored.
+  }
+
+  void ObjLoader::parse_face(Chunk& chunk, const char* it, const char* end) const
+  {
+    Face face = {
+      .first_corner = static_cast<uint32_t>(chunk.corners.size()),
+      .corner_count = 0,
+      .position_count = static_cast<uint32_t>(chunk.positions.size()),
+      .uv_count = static_cast<uint32_t>(chunk.uvs.size()),
+      .normal_count = static_cast<uint32_t>(chunk.normals.size()),
+    };
+
+    for (it = skip_spaces(it, end); it < end && *it != '\r'; it = skip_spaces(it, end))
+    {
+      Corner corner;
+      it = parse_corner(it, end, corner);
+      chunk.corners.push_back(corner);
+      face.corner_count++;
+    }
+
+    if (face.corner_count < 3)
+      throw std::runtime_error("obj face with less than 3 vertices");
+
+    chunk.faces.push_back(face);
+    chunk.triangle_count += face.corner_count - 2;
+  }
+
+  void ObjLoader::build_chunk(const Chunk& chunk)
+  {
+    auto vertex = vertices_.begin() + chunk.vertex_base;
+    auto index = indices_.begin() + chunk.index_base;
+
+    for (const auto& face : chunk.faces)
+    {
+      auto base = static_cast<uint32_t>(vertex - vertices_.begin());
+
+      for (uint32_t i = 0; i < face.corner_count; i++)
+      {
+        const auto& corner = chunk.corners[face.first_corner + i];
+        auto position = resolve_index(corner.position, chunk.position_base + face.position_count);
+
+        vertex[i].position = positions_[position];
+        vertex[i].normal = types::Vector3();
+        vertex[i].uv = types::Vector2(0.0f, 0.0f);
+
+        if (corner.uv)
+          vertex[i].uv = uvs_[resolve_index(corner.uv, chunk.uv_base + face.uv_count)];
+
+        if (corner.normal)
+          vertex[i].normal =
+              normals_[resolve_index(corner.normal, chunk.normal_base + face.normal_count)];
+      }
+
+      // Faces without normals get a flat one, Newell's method also handles non-planar n-gons.
+      types::Vector3 face_normal;
+      for (uint32_t i = 0; i < face.corner_count; i++)
+      {
+        const auto& current = vertex[i].position;
+        const auto& next = vertex[(i + 1) % face.corner_count].position;
+
+        face_normal.x += (current.y - next.y) * (current.z + next.z);
+        face_normal.y += (current.z - next.z) * (current.x + next.x);
+        face_normal.z += (current.x - next.x) * (current.y + next.y);
+      }
+
+      if (face_normal.magnitude() > 0.0f)
+        face_normal = face_normal.unit();
+
+      for (uint32_t i = 0; i < face.corner_count; i++)
+      {
+        if (!chunk.corners[face.first_corner + i].normal)
+          vertex[i].normal = face_normal;
+      }
+
+      for (uint32_t i = 1; i + 1 < face.corner_count; i++)
+      {
+        *index++ = base;
+        *index++ = base + i;
+        *index++ = base + i + 1;
+      }
+
+      vertex += face.corner_count;
+    }
+  }
+
+  const char* ObjLoader::parse_corner(const char* it, const char* end, Corner& corner) const
+  {
+    corner = { .position = 0, .uv = 0, .normal = 0 };
+
+    // v, v/vt, v//vn or v/vt/vn
+    it = parse_index(it, end, corner.position);
+    if (it == end || *it != '/')
+      return it;
+
+    it++;
+    if (it != end && *it != '/')
+      it = parse_index(it, end, corner.uv);
+
+    if (it == end || *it != '/')
+      return it;
+
+    return parse_index(it + 1, end, corner.normal);
+  }
+
+  const char* ObjLoader::parse_float(const char* it, const char* end, float& value) const
+  {
+    it = skip_spaces(it, end);
+    if (it != end && *it == '+')
+      it++;
+
+    auto [ptr, error] = std::from_chars(it, end, value);
+    if (error != std::errc())
+      throw std::runtime_error("invalid number in obj file");
+
+    return ptr;
+  }
+
+  const char* ObjLoader::parse_index(const char* it, const char* end, int64_t& value) const
+  {
+    auto [ptr, error] = std::from_chars(it, end, value);
+    if (error != std::errc() || value == 0)
+      throw std::runtime_error("invalid index in obj file");
+
+    return ptr;
+  }
+
+  const char* ObjLoader::skip_spaces(const char* it, const char* end) const
+  {
+    while (it != end && (*it == ' ' || *it == '\t'))
+      it++;
+
+    return it;
+  }
+
+  uint32_t ObjLoader::resolve_index(int64_t value, size_t count) const
+  {
+    // Indices are 1-based, negative ones count back from the last element read so far.
+    int64_t resolved = value < 0 ? static_cast<int64_t>(count) + value : value - 1;
+    if (resolved < 0 || resolved >= static_cast<int64_t>(count))
+      throw std::runtime_error("obj index out of range");
+
+    return resolved;
+  }
+} // namespace scene
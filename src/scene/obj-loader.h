@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "misc/mapped-file.h"
+#include "scene/mesh.h"
+#include "types/vector2.h"
+#include "types/vector3.h"
+
+#define OBJ_MIN_CHUNK_SIZE (1024 * 1024)
+
+namespace scene
+{
+  /// Wavefront OBJ parser scanning a memory-mapped file in place.
+  class ObjLoader
+  {
+  public:
+    explicit ObjLoader(const std::string& path);
+
+    /// Parse the file into one vertex per face corner, n-gons are triangulated as fans.
+    /// The file is split in line-aligned chunks parsed by up to thread_count threads (0 uses
+    /// the whole thread pool), the result does not depend on the thread count.
+    void load(uint32_t thread_count = 0);
+
+    const std::vector<Vertex>& get_vertices() const;
+    std::vector<Vertex>& get_vertices();
+    const std::vector<uint32_t>& get_indices() const;
+    std::vector<uint32_t>& get_indices();
+
+  private:
+    /// Raw OBJ indices, 1-based or negative, 0 when the attribute is missing.
+    struct Corner
+    {
+      int64_t position;
+      int64_t uv;
+      int64_t normal;
+    };
+
+    /// Attribute counts are local to the chunk and taken when the face is read, which is what
+    /// negative indices are relative to.
+    struct Face
+    {
+      uint32_t first_corner;
+      uint32_t corner_count;
+      uint32_t position_count;
+      uint32_t uv_count;
+      uint32_t normal_count;
+    };
+
+    struct Chunk
+    {
+      const char* begin;
+      const char* end;
+      std::vector<types::Vector3> positions;
+      std::vector<types::Vector3> normals;
+      std::vector<types::Vector2> uvs;
+      std::vector<Corner> corners;
+      std::vector<Face> faces;
+      size_t triangle_count = 0;
+      size_t position_base = 0;
+      size_t uv_base = 0;
+      size_t normal_base = 0;
+      size_t vertex_base = 0;
+      size_t index_base = 0;
+    };
+
+    void parse_chunk(Chunk& chunk) const;
+    void parse_line(Chunk& chunk, const char* it, const char* end) const;
+    void parse_face(Chunk& chunk, const char* it, const char* end) const;
+    void build_chunk(const Chunk& chunk);
+    const char* parse_corner(const char* it, const char* end, Corner& corner) const;
+    const char* parse_float(const char* it, const char* end, float& value) const;
+    const char* parse_index(const char* it, const char* end, int64_t& value) const;
+    const char* skip_spaces(const char* it, const char* end) const;
+    uint32_t resolve_index(int64_t value, size_t count) const;
+
+    misc::MappedFile file_;
+    std::vector<types::Vector3> positions_;
+    std::vector<types::Vector3> normals_;
+    std::vector<types::Vector2> uvs_;
+    std::vector<Vertex> vertices_;
+    std::vector<uint32_t> indices_;
+  };
+} // namespace scene
+
+#include "scene/obj-loader.hxx"
@@ -0,0 +1,9 @@
+#include "scene/obj-loader.h"
+
+namespace scene
+{
+  inline const std::vector<Vertex>& ObjLoader::get_vertices() const { return vertices_; }
+  inline std::vector<Vertex>& ObjLoader::get_vertices() { return vertices_; }
+  inline const std::vector<uint32_t>& ObjLoader::get_indices() const { return indices_; }
+  inline std::vector<uint32_t>& ObjLoader::get_indices() { return indices_; }
+} // namespace scene
@@ -1,28 +1,27 @@
 #include "scene/scene.h"
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstring>
+#include <iostream>
 #include <stdexcept>
+#include <vector>
 
 #include <stb/stb_image.h>
 
+#include "core/deletion-queue.h"
 #include "core/engine.h"
+#include "core/staging-buffer.h"
+#include "core/texture-container.h"
+#include "misc/thread-pool.h"
 
 namespace scene
 {
   Scene::~Scene()
   {
     if (skybox_image_)
-    {
-      auto& engine = core::Engine::get_singleton();
-
-      vkDeviceWaitIdle(engine.get_device());
-
-      vkDestroySampler(engine.get_device(), skybox_sampler_, nullptr);
-      vkDestroyImageView(engine.get_device(), skybox_image_view_, nullptr);
-      vkDestroyImage(engine.get_device(), skybox_image_, nullptr);
-      vkFreeMemory(engine.get_device(), skybox_image_memory_, nullptr);
-    }
+      destroy_skybox();
 
     if (mesh)
       delete mesh;
@@ -41,61 +40,160 @@ namespace scene
                           const std::string& back)
   {
     std::array<std::string, 6> faces = { right, left, top, bottom, front, back };
-    std::array<stbi_uc*, 6> image_data;
-    int width = 0;
-    int height = 0;
-    int channels = 0;
 
-    for (int i = 0; i < 6; i++)
+    if (skybox_image_)
+      destroy_skybox();
+
+    VkFormat format;
+    uint32_t mip_levels;
+    if (!upload_compressed_skybox(faces, format, mip_levels))
     {
-      int w, h, c;
-      image_data[i] = stbi_load(faces[i].c_str(), &w, &h, &c, STBI_rgb_alpha);
-      if (!image_data[i])
-        throw std::runtime_error("failed to load image");
+      format = VK_FORMAT_R8G8B8A8_SRGB;
+      mip_levels = upload_skybox(faces);
+    }
 
-      if (i == 0)
-      {
-        width = w;
-        height = h;
-        channels = 4;
+    create_skybox_view(format, mip_levels);
+  }
+
+  void Scene::destroy_skybox()
+  {
+    auto& deletion_queue = core::DeletionQueue::get_singleton();
+    auto device = core::Engine::get_singleton().get_device();
+
+    // The skybox pass of the frames in flight may still sample it.
+    deletion_queue.push([device, sampler = skybox_sampler_, image_view = skybox_image_view_]() {
+      vkDestroySampler(device, sampler, nullptr);
+      vkDestroyImageView(device, image_view, nullptr);
+    });
+    deletion_queue.destroy_image(skybox_image_, skybox_image_allocation_);
+
+    skybox_image_ = VK_NULL_HANDLE;
+    skybox_image_view_ = VK_NULL_HANDLE;
+    skybox_sampler_ = VK_NULL_HANDLE;
+  }
 
-        if (width != height)
-          throw std::runtime_error("skybox images must have the same dimensions");
+  bool Scene::upload_compressed_skybox(const std::array<std::string, 6>& faces,
+                                       VkFormat& format, uint32_t& mip_levels)
+  {
+    std::vector<core::TextureContainer> containers;
+    containers.reserve(6);
+
+    for (const auto& face : faces)
+    {
+      auto& container = containers.emplace_back(face);
+      if (!container.load())
+        return false;
+
+      const auto& first = containers.front();
+      bool matching = container.get_format() == first.get_format()
+          && container.get_extent().width == first.get_extent().width
+          && container.get_extent().height == first.get_extent().height
+          && container.get_level_count() == first.get_level_count();
+      if (!matching)
+      {
+        std::clog << container.get_path() << ": skybox faces do not match, decoding instead\n";
+        return false;
       }
-      else if (w != width || h != height)
-        throw std::runtime_error("skybox images must have the same dimensions");
     }
 
     auto& engine = core::Engine::get_singleton();
-    VkDeviceSize image_size = width * height * 4;
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_memory;
+    const auto& first = containers.front();
+    format = first.get_format();
+    mip_levels = first.get_level_count();
+
+    if (first.get_extent().width != first.get_extent().height)
+      throw std::runtime_error("skybox images must have the same dimensions");
+
+    // Every face holds its own mip chain, they are packed one after the other.
+    VkDeviceSize face_size = first.get_size();
+    auto staging_region = core::StagingBuffer::get_singleton().allocate(face_size * 6);
+    std::vector<VkBufferImageCopy> regions;
 
-    const VkBufferCreateInfo buffer_create_info = {
-      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    for (uint32_t i = 0; i < 6; i++)
+    {
+      auto face_regions = containers[i].copy_regions(
+          static_cast<char*>(staging_region.data) + i * face_size,
+          staging_region.offset + i * face_size, i);
+      regions.insert(regions.end(), face_regions.begin(), face_regions.end());
+    }
+
+    const VkImageCreateInfo image_create_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
       .pNext = nullptr,
-      .flags = 0,
-      .size = image_size * 6,
-      .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+      .flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = format,
+      .extent = first.get_extent(),
+      .mipLevels = mip_levels,
+      .arrayLayers = 6,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    auto flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    engine.create_buffer(buffer_create_info, flags, staging_buffer, staging_memory);
+    engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, skybox_image_,
+                        skybox_image_allocation_);
+    engine.transfer_image_levels(skybox_image_, staging_region.buffer, regions, 6, mip_levels);
 
-    void* data;
-    VkResult result = vkMapMemory(engine.get_device(), staging_memory, 0, image_size * 6, 0, &data);
-    if (result != VK_SUCCESS)
-      throw std::runtime_error("failed to map buffer memory");
+    std::clog << "skybox " << first.get_extent().width << "x" << first.get_extent().height
+              << " (" << mip_levels << " mip levels): " << face_size * 6
+              << " bytes of compressed data uploaded\n";
+
+    return true;
+  }
+
+  uint32_t Scene::upload_skybox(const std::array<std::string, 6>& faces)
+  {
+    using clock = std::chrono::steady_clock;
+
+    auto start = clock::now();
+
+    // Only the headers are read here, so that the staging slices can be handed out before
+    // decoding.
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    if (!stbi_info(faces[0].c_str(), &width, &height, &channels))
+      throw std::runtime_error("failed to load image");
+
+    if (width != height)
+      throw std::runtime_error("skybox images must have the same dimensions");
+
+    auto& engine = core::Engine::get_singleton();
+    VkDeviceSize image_size = width * height * 4;
+    auto staging_region = core::StagingBuffer::get_singleton().allocate(image_size * 6);
+
+    // Each face is decoded and copied into its own slice of the staging region concurrently.
+    std::array<clock::duration, 6> decode_times;
+    std::array<clock::duration, 6> copy_times;
+
+    misc::ThreadPool::get_singleton().parallel_for(6, [&](uint32_t i) {
+      auto decode_start = clock::now();
+
+      int w, h, c;
+      stbi_uc* pixels = stbi_load(faces[i].c_str(), &w, &h, &c, STBI_rgb_alpha);
+      if (!pixels)
+        throw std::runtime_error("failed to load image");
 
-    for (int i = 0; i < 6; i++)
-      std::memcpy(static_cast<char*>(data) + (i * image_size), image_data[i], image_size);
-    vkUnmapMemory(engine.get_device(), staging_memory);
+      if (w != width || h != height)
+      {
+        stbi_image_free(pixels);
+        throw std::runtime_error("skybox images must have the same dimensions");
+      }
+
+      auto copy_start = clock::now();
+      std::memcpy(static_cast<char*>(staging_region.data) + i * image_size, pixels, image_size);
+      stbi_image_free(pixels);
+
+      decode_times[i] = copy_start - decode_start;
+      copy_times[i] = clock::now() - copy_start;
+    });
 
-    for (int i = 0; i < 6; i++)
-      stbi_image_free(image_data[i]);
+    auto upload_start = clock::now();
 
     const VkExtent3D image_extent = {
       .width = static_cast<uint32_t>(width),
@@ -103,6 +201,13 @@ namespace scene
       .depth = 1,
     };
 
+    // Distant parts of the cube map are minified heavily, the mip chain keeps those fetches
+    // cheap and free of shimmering.
+    uint32_t mip_levels = engine.get_mip_levels(VK_FORMAT_R8G8B8A8_SRGB, image_extent);
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (mip_levels > 1)
+      usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
     const VkImageCreateInfo image_create_info = {
       .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
       .pNext = nullptr,
@@ -110,27 +215,19 @@ namespace scene
       .imageType = VK_IMAGE_TYPE_2D,
       .format = VK_FORMAT_R8G8B8A8_SRGB,
       .extent = image_extent,
-      .mipLevels = 1,
+      .mipLevels = mip_levels,
       .arrayLayers = 6,
       .samples = VK_SAMPLE_COUNT_1_BIT,
       .tiling = VK_IMAGE_TILING_OPTIMAL,
-      .usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+      .usage = usage,
       .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
       .queueFamilyIndexCount = 0,
       .pQueueFamilyIndices = nullptr,
       .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    if (skybox_image_)
-    {
-      vkDestroySampler(engine.get_device(), skybox_sampler_, nullptr);
-      vkDestroyImageView(engine.get_device(), skybox_image_view_, nullptr);
-      vkDestroyImage(engine.get_device(), skybox_image_, nullptr);
-      vkFreeMemory(engine.get_device(), skybox_image_memory_, nullptr);
-    }
-
     engine.create_image(image_create_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, skybox_image_,
-                        skybox_image_memory_);
+                        skybox_image_allocation_);
 
     const VkOffset3D offset = {
       .x = 0,
@@ -138,10 +235,33 @@ namespace scene
       .z = 0,
     };
 
-    engine.transfer_image(skybox_image_, offset, image_extent, 6, staging_buffer);
+    auto ticket = engine.transfer_image(skybox_image_, offset, image_extent, 6,
+                                        staging_region.buffer, staging_region.offset, mip_levels);
+
+    using milliseconds = std::chrono::duration<double, std::milli>;
+    auto end = clock::now();
+
+    std::clog << "skybox " << width << "x" << height << " (" << mip_levels
+              << " mip levels): decode "
+              << milliseconds(*std::max_element(decode_times.begin(), decode_times.end())).count()
+              << " ms, copy "
+              << milliseconds(*std::max_element(copy_times.begin(), copy_times.end())).count()
+              << " ms (slowest face), upload recorded in "
+              << milliseconds(end - upload_start).count() << " ms, total "
+              << milliseconds(end - start).count() << " ms\n";
 
-    vkDestroyBuffer(engine.get_device(), staging_buffer, nullptr);
-    vkFreeMemory(engine.get_device(), staging_memory, nullptr);
+    // The transfer itself runs asynchronously, report when the GPU is done with it.
+    core::TransferQueue::get_singleton().on_complete(ticket, [start]() {
+      std::clog << "skybox upload complete after "
+                << milliseconds(clock::now() - start).count() << " ms\n";
+    });
+
+    return mip_levels;
+  }
+
+  void Scene::create_skybox_view(VkFormat format, uint32_t mip_levels)
+  {
+    auto& engine = core::Engine::get_singleton();
 
     const VkComponentMapping components = {
       .r = VK_COMPONENT_SWIZZLE_R,
@@ -153,7 +273,7 @@ namespace scene
     const VkImageSubresourceRange subresource_range = {
       .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
       .baseMipLevel = 0,
-      .levelCount = 1,
+      .levelCount = mip_levels,
       .baseArrayLayer = 0,
       .layerCount = 6,
     };
@@ -164,12 +284,12 @@ namespace scene
       .flags = 0,
       .image = skybox_image_,
       .viewType = VK_IMAGE_VIEW_TYPE_CUBE,
-      .format = VK_FORMAT_R8G8B8A8_SRGB,
+      .format = format,
       .components = components,
       .subresourceRange = subresource_range,
     };
 
-    result = vkCreateImageView(engine.get_device(), &image_view_create_info, nullptr,
+    VkResult result = vkCreateImageView(engine.get_device(), &image_view_create_info, nullptr,
                                &skybox_image_view_);
     if (result != VK_SUCCESS)
       throw std::runtime_error("failed to create image view");
@@ -190,7 +310,7 @@ namespace scene
       .compareEnable = VK_FALSE,
       .compareOp = VK_COMPARE_OP_ALWAYS,
       .minLod = 0.0f,
-      .maxLod = 1.0f,
+      .maxLod = static_cast<float>(mip_levels),
       .borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
       .unnormalizedCoordinates = VK_FALSE,
     };
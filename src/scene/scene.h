@@ -1,16 +1,27 @@
 #pragma once
 
+#include <array>
 #include <string>
+#include <vector>
 
 #include <vulkan/vulkan.h>
 
+#include "core/memory-allocator.h"
 #include "scene/camera.h"
 #include "scene/instance.h"
 #include "scene/mesh.h"
 #include "scene/visitor.h"
+#include "types/cframe.h"
 
 namespace scene
 {
+  /// Another copy of the mesh and substractive_mesh pair, drawn with the same geometry.
+  struct CSGPlacement
+  {
+    types::CFrame cframe;
+    types::CFrame substractive_cframe;
+  };
+
   class Scene : public Instance
   {
   public:
@@ -31,12 +42,21 @@ namespace scene
     Camera* current_camera = nullptr;
     Mesh* mesh = nullptr;
     Mesh* substractive_mesh = nullptr;
+    std::vector<CSGPlacement> csg_placements;
 
   private:
+    void destroy_skybox();
+    /// Upload six compressed face containers as is, false unless they all exist and match.
+    bool upload_compressed_skybox(const std::array<std::string, 6>& faces, VkFormat& format,
+                                  uint32_t& mip_levels);
+    /// Decode the faces to RGBA8 and upload them, returning the mip level count.
+    uint32_t upload_skybox(const std::array<std::string, 6>& faces);
+    void create_skybox_view(VkFormat format, uint32_t mip_levels);
+
     VkImage skybox_image_ = VK_NULL_HANDLE;
     VkImageView skybox_image_view_ = VK_NULL_HANDLE;
     VkSampler skybox_sampler_ = VK_NULL_HANDLE;
-    VkDeviceMemory skybox_image_memory_ = VK_NULL_HANDLE;
+    core::Allocation skybox_image_allocation_;
   };
 } // namespace scene
 
@@ -1,6 +1,7 @@
 #include "scene/visitor.h"
 
 #include "scene/camera.h"
+#include "scene/csg-node.h"
 #include "scene/mesh.h"
 #include "scene/scene.h"
 
@@ -18,6 +19,12 @@ namespace scene
       child->accept(*this);
   }
 
+  void Visitor::operator()(CSGNode& node)
+  {
+    for (auto child : node.get_children())
+      child->accept(*this);
+  }
+
   void Visitor::operator()(Mesh& mesh)
   {
     for (auto child : mesh.get_children())
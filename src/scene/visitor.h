@@ -9,6 +9,7 @@ namespace scene
   public:
     virtual void operator()(Scene& scene);
     virtual void operator()(Camera& camera);
+    virtual void operator()(CSGNode& node);
     virtual void operator()(Mesh& mesh);
   };
 } // namespace scene